@@ -407,6 +407,16 @@ static ssize_t _ccfx_get_line (connchain_b *bb, ssize_t i, char *str, size_t sz)
   return (x + d);
 }
 
+static int _mc_buffers = 0;
+
+static void _ccfx_free (struct connchain_buffer **b)
+{
+  if (*b)
+    MEM_COUNT (_mc_buffers, "connchain buffers",
+	       -(ssize_t)sizeof(struct connchain_buffer));
+  FREE (b);
+}
+
 /* trying to get line and return it when CR+LF occured, skipping CR+LF */
 static ssize_t _ccfilter_x_recv (connchain_i **ch, idx_t id, char *str,
 				 size_t sz, struct connchain_buffer **b)
@@ -418,7 +428,7 @@ static ssize_t _ccfilter_x_recv (connchain_i **ch, idx_t id, char *str,
     return E_NOSOCKET;
   if (str == NULL)			/* termination requested */
   {
-    FREE (b);				/* free the buffer struct */
+    _ccfx_free (b);			/* free the buffer struct */
     return E_NOSOCKET;
   }
   bb = &(*b)->in;
@@ -475,7 +485,7 @@ static ssize_t _ccfilter_x_recv (connchain_i **ch, idx_t id, char *str,
 	return i + 1;
       }
       i = (*b)->out.inbuf;
-      FREE (b);				/* terminating */
+      _ccfx_free (b);			/* terminating */
       return i;
     }
     if (i == 0)				/* no data received yet */
@@ -515,7 +525,7 @@ static ssize_t _ccfilter_x_recv (connchain_i **ch, idx_t id, char *str,
       return i + 1;
     }
     i = (*b)->out.inbuf;
-    FREE (b);				/* terminating */
+    _ccfx_free (b);			/* terminating */
     return i;
   }
   DBG("connchain.c:_ccfilter_x_recv: got +%zd", i);
@@ -536,6 +546,7 @@ static int _ccfilter_x_init (struct peer_t *peer,
   if (b == NULL)
     return 1;
   *b = safe_malloc (sizeof(struct connchain_buffer));
+  MEM_COUNT (_mc_buffers, "connchain buffers", sizeof(struct connchain_buffer));
   (*b)->in.inbuf = (*b)->in.bufpos = (*b)->out.inbuf = (*b)->out.bufpos = 0;
   (*b)->peer = peer;
   return 1;
@@ -545,7 +556,7 @@ static int _ccfilter_x_init (struct peer_t *peer,
 void Status_Connchains (INTERFACE *iface)
 {
   New_Request (iface, F_REPORT, "Connchains: %u in use (max was %u), %zu bytes.",
-	       _CC_num, _CC_max, _CC_asize);
+	       _CC_num, _CC_max, _pool_(connchain_i)->asize);
 }
 
 /* init all this stuff */
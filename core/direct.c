@@ -743,16 +743,6 @@ static void _login_wait_cleanup(void *data)
   pthread_mutex_unlock(&ListenMutex);
 }
 
-static void _listen_wait_socket(size_t *ptr)
-{
-  pthread_cleanup_push(&_listen_mutex_cleanup, NULL);
-  pthread_mutex_lock(&ListenMutex);
-  if (*ptr == 0)
-    pthread_cond_wait(&ListenCond, &ListenMutex);
-  *ptr = 0;
-  pthread_cleanup_pop(1);
-}
-
 static int _login_wait_socket(time_t t, size_t *ptr)
 {
   struct timespec abstime;
@@ -917,6 +907,16 @@ static size_t _do_rfc854_input (char *str, size_t sz, char *tosend, size_t *s)
   return done;
 }
 
+static int _mc_buffers = 0;
+
+static void _ccfy_free (struct connchain_buffer **b)
+{
+  if (*b)
+    MEM_COUNT (_mc_buffers, "connchain buffers",
+	       -(ssize_t)sizeof(struct connchain_buffer));
+  FREE (b);
+}
+
 static ssize_t _ccfilter_y_recv (struct connchain_i **ch, idx_t id, char *str,
 				 size_t sz, struct connchain_buffer **b)
 {
@@ -924,7 +924,7 @@ static ssize_t _ccfilter_y_recv (struct connchain_i **ch, idx_t id, char *str,
 
   if (str == NULL)			/* they killed me */
   {
-    FREE (b);
+    _ccfy_free (b);
     return E_NOSOCKET;
   }
   if (*b == NULL)
@@ -933,7 +933,7 @@ static ssize_t _ccfilter_y_recv (struct connchain_i **ch, idx_t id, char *str,
   if (id < 0)				/* pulling buffers */
     return (sr);
   if (sr < 0)				/* got an error */
-    FREE (b);
+    _ccfy_free (b);
   if (sr <= 0)				/* error or no data */
     return sr;
   sw = sizeof((*b)->data) - (*b)->tosend; /* free space in buffer */
@@ -954,6 +954,7 @@ static int _ccfilter_y_init (peer_t *peer,
     return 1;
   /* we will use buffer as marker, yes */
   *b = safe_malloc (sizeof(struct connchain_buffer));
+  MEM_COUNT (_mc_buffers, "connchain buffers", sizeof(struct connchain_buffer));
   (*b)->tosend = 0;
   return 1;
 }
@@ -1292,7 +1293,27 @@ static char *session_handler_main (char *ident, const char *host, peer_t *dcc,
 }
 
 
+/*
+ * Accepted connections are limited by number of threads doing ident/domain
+ *  stage: accept-threads in total and accept-per-listener for each listener.
+ *  If there is no free slot then connection waits in listener's queue (up
+ *  to accept-queue of them) and if queue is full then it's rejected.
+ *  Listener's data may be freed before its children so these counters are
+ *  kept in separate structure which both listener and children refer to.
+ */
+struct accept_t;
+
 typedef struct
+{
+  unsigned int refs;		/* listener and children in slots */
+  unsigned int active;		/* children in slots */
+  unsigned int queued;
+  struct accept_t *queue, *qlast;
+  unsigned long int started, rejected;
+  unsigned long int waited, maxwait; /* time in queue, ms */
+} accept_pool;
+
+typedef struct accept_t
 {
   char *client;			/* it must be allocated by caller */
   char *confline;		/* the same */
@@ -1306,8 +1327,22 @@ typedef struct
   idx_t socket, id;
   pthread_t th;
   volatile unsigned int tst;
+  accept_pool *pool;		/* NULL for child if slot is released */
+  struct accept_t *qnext;	/* for child in listener's queue */
+  struct timespec since;	/* when child was queued */
+  size_t mark;			/* set by poller on ident socket event */
 } accept_t;
 
+static unsigned int _accept_active = 0;	/* children in slots, total */
+static unsigned int _accept_freed = 0;	/* counter of released slots */
+
+/* drops reference to pool, called with ListenMutex locked */
+static void _accept_unref (accept_pool *pool)
+{
+  if (--pool->refs == 0)
+    FREE (&pool);
+}
+
 #define static
 typedef BINDING_TYPE_got_listener ((*_got_listener_func_t));
 #undef static
@@ -1316,14 +1351,25 @@ static iftype_t port_signal (INTERFACE *iface, ifsig_t signal)
 {
   accept_t *acptr = (accept_t *)iface->data;
   INTERFACE *tmp;
-  char msg[48];
+  char msg[SHORT_STRING];
   char buf[STRING];
 
   switch (signal)
   {
     case S_REPORT:
       /* %@ - hostname, %L - name, %P - idx, %* - state */
-      snprintf (msg, sizeof(msg), _("listening on port %hu"), acptr->lport);
+      pthread_mutex_lock(&ListenMutex);
+      if (acptr->pool && acptr->pool->started + acptr->pool->rejected)
+	snprintf (msg, sizeof(msg),
+		  _("listening on port %hu, %u active, %u queued, %lu rejected, waited %lu ms avg %lu ms max"),
+		  acptr->lport, acptr->pool->active, acptr->pool->queued,
+		  acptr->pool->rejected,
+		  acptr->pool->started ?
+			acptr->pool->waited / acptr->pool->started : 0,
+		  acptr->pool->maxwait);
+      else
+	snprintf (msg, sizeof(msg), _("listening on port %hu"), acptr->lport);
+      pthread_mutex_unlock(&ListenMutex);
       printl (buf, sizeof(buf), ReportFormat, 0,
 	      NULL, SocketDomain (acptr->socket, NULL), iface->name, NULL,
 	      (uint32_t)0, acptr->socket + 1, 0, msg);
@@ -1359,6 +1405,11 @@ static iftype_t port_signal (INTERFACE *iface, ifsig_t signal)
       FREE (&acptr->confline);
       FREE (&acptr->data);
       FREE (&acptr->host);
+      pthread_mutex_lock(&ListenMutex);
+      if (acptr->pool)			/* children may still refer to it */
+	_accept_unref (acptr->pool);
+      acptr->pool = NULL;
+      pthread_mutex_unlock(&ListenMutex);
       LOG_CONN (_("Listening socket on port %hu terminated."), acptr->lport);
       /* we don't need to free acptr since dispatcher will do it for us */
       iface->ift |= I_DIED;
@@ -1372,42 +1423,183 @@ static iftype_t port_signal (INTERFACE *iface, ifsig_t signal)
 
 /* internal thread functions for Listen_Port */
 #define acptr ((accept_t *)input_data)
-static void _ident_cleanup (void *input_data)
+/*
+ * Hosts which didn't answer ident query (refused, timed out or closed
+ *  connection without answer) are remembered for ident-negative-ttl
+ *  seconds so we don't delay every connection from them. Entries are
+ *  kept in order of insertion so purge has to check head only.
+ */
+typedef struct ident_neg_t
 {
-  acptr->tst = 0;
+  struct ident_neg_t *next;
+  time_t expire;
+  char ip[1];
+} ident_neg_t;
+
+static pthread_mutex_t IdentLock = PTHREAD_MUTEX_INITIALIZER;
+static NODE *_ident_neg_tree = NULL;
+static ident_neg_t *_ident_neg = NULL, *_ident_neg_last = NULL;
+
+/* called with IdentLock locked */
+static void _ident_neg_purge (time_t now)
+{
+  ident_neg_t *n;
+
+  while ((n = _ident_neg) && n->expire <= now)
+  {
+    if ((_ident_neg = n->next) == NULL)
+      _ident_neg_last = NULL;
+    Delete_Key (_ident_neg_tree, n->ip, n);
+    FREE (&n);
+  }
 }
 
-static void *_ask_ident (void *input_data)
+static int _ident_is_negative (const char *ip)
 {
-  const char *domain, *myip;
-  size_t sz, sp;
-  register ssize_t st;
+  ident_neg_t *n;
+  time_t now = time(NULL);
+  int res;
+
+  pthread_mutex_lock (&IdentLock);
+  _ident_neg_purge (now);
+  /* list may be unsorted after change of ttl so check expiration too */
+  res = ((n = Find_Key (_ident_neg_tree, ip)) != NULL && n->expire > now);
+  pthread_mutex_unlock (&IdentLock);
+  return res;
+}
+
+static void _ident_set_negative (const char *ip)
+{
+  ident_neg_t *n;
+  time_t now = time(NULL);
+
+  if (ident_negative_ttl <= 0)
+    return;
+  pthread_mutex_lock (&IdentLock);
+  _ident_neg_purge (now);
+  if ((n = Find_Key (_ident_neg_tree, ip)) != NULL)
+    n->expire = now + ident_negative_ttl;
+  else
+  {
+    n = safe_malloc (sizeof(ident_neg_t) + strlen(ip));
+    strcpy (n->ip, ip);
+    n->expire = now + ident_negative_ttl;
+    n->next = NULL;
+    if (Insert_Key (&_ident_neg_tree, n->ip, n, 1))
+      FREE (&n);
+    else
+    {
+      if (_ident_neg_last)
+	_ident_neg_last->next = n;
+      else
+	_ident_neg = n;
+      _ident_neg_last = n;
+    }
+  }
+  pthread_mutex_unlock (&IdentLock);
+}
+
+/*
+ * Asks identd on remote side using non-blocking socket acptr->id, poller
+ *  wakes us on every event on it so there is no sleeping at all.
+ * Returns length of answer line in buf or 0 if there was no answer.
+ */
+static size_t _ask_ident (void *input_data, char *buf, size_t bs)
+{
+  const char *ip, *myip;
+  char query[24];
+  char mybuf[SHORT_STRING];
+  size_t sz, sp, bp;
+  ssize_t st, sw;
   unsigned short p;
-  char buf[SHORT_STRING];
+  time_t t;
 
-  pthread_cleanup_push (&_ident_cleanup, input_data);
   SocketDomain (acptr->socket, &p);
-  domain = SocketIP(acptr->socket);
-  myip = SocketMyIP(acptr->socket, buf, sizeof(buf));
+  ip = SocketIP (acptr->socket);
+  if (ip == NULL)
+    return 0;
+  if (_ident_is_negative (ip))
+  {
+    dprint (5, "ident: %s is known to not answer, skipping query", ip);
+    return 0;
+  }
+  myip = SocketMyIP (acptr->socket, mybuf, sizeof(mybuf));
   dprint (5, "input connection was to %s/%hu, trying identd for it",
 	  NONULLP(myip), acptr->lport);
-  if ((st = SetupSocket (acptr->id, domain, myip, 113, NULL, NULL)) == 0)
+  if ((acptr->id = GetSocket (M_NBLK)) < 0)
+    return 0;
+  acptr->mark = 0;
+  AssociateSocket (acptr->id, &_listen_send_signal, &acptr->mark);
+  t = time(NULL) + ident_timeout;
+  if ((st = SetupSocket (acptr->id, ip, myip, 113, NULL, NULL)) != 0)
   {
-    snprintf (buf, sizeof(buf), "%hu, %hu\n", p, acptr->lport);
-    dprint (5, "ask host %s for ident: %s", domain, buf);
-    sz = strlen (buf);
-    sp = 0;
-    while ((st = WriteSocket (acptr->id, buf, &sp, (size_t *)&sz)) == 0);
-    dprint(5, "WriteSocket on ident connection returned %zd", st);
-  } else
     dprint (5, "SetupSocket on ident connection returned %zd", st);
-  pthread_cleanup_pop(1);
-  pthread_exit(NULL);
+    _ident_set_negative (ip);
+    return 0;
+  }
+  snprintf (query, sizeof(query), "%hu, %hu\r\n", p, acptr->lport);
+  dprint (5, "ask host %s for ident: %s", ip, query);
+  sz = strlen (query);
+  sp = bp = 0;
+  FOREVER
+  {
+    st = ReadSocket (&buf[bp], acptr->id, bs - bp - 1);
+    if (st == E_AGAIN)			/* still connecting */
+      st = 0;
+    else if (st < 0)			/* refused or closed */
+      break;
+    else if (sz && (sw = WriteSocket (acptr->id, query, &sp, &sz)) < 0)
+    {
+      st = sw;
+      break;
+    }
+    while (st > 0)			/* check for end of line */
+    {
+      if (buf[bp] == '\r' || buf[bp] == '\n')
+      {
+	buf[bp] = 0;
+	return bp;
+      }
+      bp++;
+      st--;
+    }
+    if (bp >= bs - 1)			/* too long line */
+      break;
+    if (time(NULL) >= t)
+    {
+      dprint (5, "ident: no answer from %s in %ld seconds", ip,
+	      (long)ident_timeout);
+      break;
+    }
+    _login_wait_socket (t, &acptr->mark);
+  }
+  dprint (5, "ident: query to %s ended with %zd", ip, st);
+  buf[bp] = 0;
+  if (bp == 0)
+    _ident_set_negative (ip);
+  return bp;
+}
+
+/* frees slot of child */
+static void _accept_release (accept_t *child)
+{
+  pthread_mutex_lock(&ListenMutex);
+  if (child->pool)
+  {
+    child->pool->active--;
+    _accept_active--;
+    _accept_unref (child->pool);
+    child->pool = NULL;
+    _accept_freed++;			/* listeners will see it on wait */
+    pthread_cond_broadcast(&ListenCond); /* let listeners check queues */
+  }
+  pthread_mutex_unlock(&ListenMutex);
 }
 
 static void _accept_port_cleanup (void *input_data)
 {
   DBG("_accept_port_cleanup for socket %hd", acptr->id);
+  _accept_release (acptr);
   KillSocket (&acptr->id);
   FREE (&acptr->client);
   safe_free (&input_data); /* FREE (&acptr) */
@@ -1419,21 +1611,17 @@ static void *_accept_port (void *input_data)
   const char *domain;
   char ident[64];
   char buf[512];		/* see RFC1413 */
-  ssize_t sz;
-  size_t sp;
   unsigned short p;
-  time_t t;
-  struct timespec ts1, ts2;
-  pthread_t ith;
 
   /* set cleanup for the thread before any cancellation point */
   acptr->id = -1;
   pthread_cleanup_push (&_accept_port_cleanup, input_data);
   dprint(5, "_accept_port: retrieving data for socket %hd", acptr->socket);
-  ts1.tv_sec = 0;
-  ts1.tv_nsec = 50000000; /* sleep 50 ms */
+  pthread_cleanup_push (&_listen_mutex_cleanup, NULL);
+  pthread_mutex_lock (&ListenMutex);
   while (acptr->tst == 0)
-    nanosleep (&ts1, &ts2);		/* wait for prehandler */
+    pthread_cond_wait (&ListenCond, &ListenMutex); /* wait for prehandler */
+  pthread_cleanup_pop (1);
   domain = SocketDomain (acptr->socket, &p);
   /* SocketDomain() does not return NULL, let's don't wait! */
   if (!*domain)
@@ -1442,84 +1630,50 @@ static void *_accept_port (void *input_data)
   dprint(5, "_accept_port: socket %hd: got domain '%s'", acptr->socket,
 	 NONULL(domain));
   *ident = 0;
-  acptr->id = GetSocket (M_RAW);
-  if (acptr->id >= 0 && pthread_create(&ith, NULL, &_ask_ident, input_data) == 0)
+  if (_ask_ident (input_data, buf, sizeof(buf)) > 0)
   {
-    DBG("_accept_port: got thread %p for ident", (void *)ith);
-    Set_Iface (NULL);
-    t = Time + ident_timeout;
-    Unset_Iface();
-    while (acptr->tst != 0) {
-      nanosleep (&ts1, &ts2);		/* wait for prehandler */
-      if (time(NULL) > t)
-	pthread_cancel(ith);
-    }
-    pthread_join(ith, NULL);
-    dprint(5, "ident thread %p for %hd terminated, timer left: %d", (void *)ith,
-	   acptr->socket, (int)(t - time(NULL)));
-    sp = 0;
-    sz = 0;
-    while (time(NULL) < t)
+    dprint (3, "%s ident answer: %s", NONULL(domain), buf);
+    /* overflow is impossible: part of buf isn't greater than buf */
+    if (sscanf(buf, "%*[^:]: USERID : %[^: ] : %63[^ \r\n]", buf, ident) == 2)
     {
-      sz = ReadSocket (&buf[sp], acptr->id, sizeof(buf) - sp);
-      if (sz < 0)
-	break;
-      while (sz)
-	if (buf[sp] == '\r' || buf[sp] == '\n')
-	{
-	  buf[sp] = 0;
-	  break;
-	}
-	else
-	{
-	  sp++;
-	  sz--;
-	}
-      if (sz)
-	break;
-    }
-    dprint(5, "ident: ReadSocket returned %zd", sz);
-    if (sz > 0)
-    {
-      dprint (3, "%s ident answer: %s", domain, buf);
-      /* overflow is impossible: part of buf isn't greater than buf */
-      if (sscanf(buf, "%*[^:]: USERID : %[^: ] : %63[^ \r\n]", buf, ident) == 2)
-      {
-	char *charset;
+      char *charset;
 //	conversion_t *conv = NULL;
-	register unsigned char *tstch;
+      register unsigned char *tstch;
 
-	charset = strchr(buf, ',');
-	if (charset)
-	  *charset++ = '\0';
+      charset = strchr(buf, ',');
+      if (charset)
+	*charset++ = '\0';
 //	else
 //	  charset = "US-ASCII";
 //	conv = Get_Conversion(charset);
-	if (!strcmp(buf, "OTHER") || !isalnum(ident[0])) {
+      if (!strcmp(buf, "OTHER") || !isalnum(ident[0])) {
 //	  buf[0] = '=';
 //	  Do_Conversion();
-	  memmove(&ident[1], ident, 62);
-	  ident[0] = '=';
-	  ident[63] = '\0';
-	}
+	memmove(&ident[1], ident, 62);
+	ident[0] = '=';
+	ident[63] = '\0';
+      }
 //	} else
 //	  Do_Conv....
 //	Free_Conversion(conv);
 //	strfcpy(ident, buf, sizeof(ident));
-	for (tstch = (unsigned char *)ident; *tstch; tstch++)
+      for (tstch = (unsigned char *)ident; *tstch; tstch++)
 //	  if (*tstch < 0x20 || *tstch == text_replace_char[0])
-	  if (*tstch < 0x20 || *tstch >= 0x80 || *tstch == ':')
-	    break;
-	if (*tstch) {
-	  dprint (4, "ident answer contains invalid chars, ignoring it");
-	  ident[0] = '\0';
-	}
-      } else
-	*ident = 0;
-    } /* ident is checked */
-    DBG ("_accept_port: killing ident socket");
-    KillSocket (&acptr->id);
-  }
+	if (*tstch < 0x20 || *tstch >= 0x80 || *tstch == ':')
+	  break;
+      if (*tstch) {
+	dprint (4, "ident answer contains invalid chars, ignoring it");
+	ident[0] = '\0';
+      }
+    } else
+      *ident = 0;
+  } /* ident is checked */
+  DBG ("_accept_port: killing ident socket");
+  KillSocket (&acptr->id);
+  /* resolver worked while we waited for ident so it may know domain now */
+  domain = SocketDomain (acptr->socket, NULL);
+  if (!*domain)
+    domain = NULL;
   /* %* - ident, %@ - hostname, %L - Lname, %P - port */
   Set_Iface (NULL);
   printl (buf, sizeof(buf), format_dcc_input_connection, 0, NULL, domain,
@@ -1527,6 +1681,7 @@ static void *_accept_port (void *input_data)
   Unset_Iface();
   LOG_CONN ("%s", buf);
   /* we have ident now so call handler and exit */
+  _accept_release (acptr);		/* handler may run for long time */
   if (acptr->data == NULL)
     acptr->data = &acptr->socket;
   acptr->handler (acptr->client, ident, domain, acptr->data);
@@ -1563,6 +1718,7 @@ static int _direct_listener_callback(const struct sockaddr *sa, void *input_data
 static void _listen_port_cleanup (void *input_data)
 {
   void *data = acptr->data;
+  accept_t *child, *queue;
 
   if (acptr->prehandler && acptr->id < 0)	/* notify caller */
     acptr->prehandler ((pthread_t)0, &data, &acptr->id);
@@ -1571,7 +1727,16 @@ static void _listen_port_cleanup (void *input_data)
   acptr->iface->ift = I_LISTEN | I_FINWAIT;
   pthread_mutex_lock(&ListenMutex);
   AssociateSocket(acptr->socket, NULL, NULL);
+  queue = acptr->pool->queue;		/* drop connections still waiting */
+  acptr->pool->queue = acptr->pool->qlast = NULL;
+  acptr->pool->queued = 0;
   pthread_mutex_unlock(&ListenMutex);
+  while ((child = queue))
+  {
+    queue = child->qnext;
+    KillSocket (&child->socket);
+    FREE (&child);
+  }
   /* everything will be done by dispatcher */
 }
 
@@ -1587,6 +1752,105 @@ static inline unsigned short _random_port(unsigned short start,
   return (start + ps);
 }
 
+/* returns milliseconds passed since *t */
+static unsigned long int _accept_waited (struct timespec *t)
+{
+  struct timespec now;
+  long int ms;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  ms = (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+  return (ms > 0) ? ms : 0;
+}
+
+/* tries to get slot for new connection, called with ListenMutex locked */
+static int _accept_slot (accept_pool *pool)
+{
+  if ((accept_threads > 0 && _accept_active >= (unsigned int)accept_threads) ||
+      (accept_per_listener > 0 &&
+       pool->active >= (unsigned int)accept_per_listener))
+    return 0;
+  pool->active++;
+  _accept_active++;
+  pool->refs++;
+  return 1;
+}
+
+/* starts thread for child, it should have slot already
+   returns 1 if listener should terminate now */
+static int _accept_start (accept_t *lptr, accept_t *child)
+{
+  if (pthread_create (&child->th, NULL, &_accept_port, child))
+  {
+    _accept_release (child);
+    KillSocket (&child->socket);
+    FREE (&child);
+    return 0;
+  }
+  DBG("_listen_port: got thread %p for new socket %hd (detach=%d)",
+      (void *)child->th, child->socket, (lptr->prehandler == NULL));
+  if (lptr->prehandler)
+    lptr->prehandler (child->th, &child->data, &child->socket);
+  else
+    pthread_detach (child->th);	/* since it's not joinable */
+  pthread_mutex_lock(&ListenMutex);
+  child->tst = 1;			/* let new thread continue */
+  pthread_cond_broadcast(&ListenCond);
+  pthread_mutex_unlock(&ListenMutex);
+  if (lptr->client)			/* it's client connection so die now */
+  {
+    lptr->id = 0;			/* do not call prehandler again */
+    lptr->client = NULL;		/* it's inherited by child */
+    return 1;
+  }
+  return 0;
+}
+
+/* waits for event on listening socket or for released slot if there is
+   queue, slot may be released while we aren't waiting so check counter */
+static void _listen_wait_socket (accept_t *lptr, size_t *ptr,
+				 unsigned int *freed)
+{
+  pthread_cleanup_push(&_listen_mutex_cleanup, NULL);
+  pthread_mutex_lock(&ListenMutex);
+  while (*ptr == 0 && (lptr->pool->queue == NULL || *freed == _accept_freed))
+    pthread_cond_wait(&ListenCond, &ListenMutex);
+  *freed = _accept_freed;
+  *ptr = 0;
+  pthread_cleanup_pop(1);
+}
+
+/* starts queued connections while there are free slots */
+static void _accept_dequeue (accept_t *lptr)
+{
+  accept_pool *pool = lptr->pool;
+  accept_t *child;
+  unsigned long int ms;
+  int cancelstate, i;
+
+  pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancelstate);
+  pthread_mutex_lock(&ListenMutex);
+  while ((child = pool->queue) && _accept_slot (pool))
+  {
+    if ((pool->queue = child->qnext) == NULL)
+      pool->qlast = NULL;
+    pool->queued--;
+    child->pool = pool;
+    ms = _accept_waited (&child->since);
+    pool->started++;
+    pool->waited += ms;
+    if (ms > pool->maxwait)
+      pool->maxwait = ms;
+    pthread_mutex_unlock(&ListenMutex);
+    dprint (5, "direct:_listen_port: starting socket %d after %lu ms in queue",
+	    (int)child->socket, ms);
+    _accept_start (lptr, child);
+    pthread_mutex_lock(&ListenMutex);
+  }
+  pthread_mutex_unlock(&ListenMutex);
+  pthread_setcancelstate (cancelstate, &i);
+}
+
 static void *_listen_port (void *input_data)
 {
   idx_t new_idx;
@@ -1596,6 +1860,7 @@ static void *_listen_port (void *input_data)
   int n, i, cancelstate;
   unsigned short port;
   size_t mark = 0;
+  unsigned int freed = 0;
 
   /* set cleanup for the thread before any cancellation point */
   pthread_cleanup_push (&_listen_port_cleanup, input_data);
@@ -1637,7 +1902,9 @@ static void *_listen_port (void *input_data)
   acptr->id = -1;
   while (acptr->socket >= 0)		/* ends by cancellation */
   {
-    _listen_wait_socket(&mark);
+    _listen_wait_socket (acptr, &mark, &freed);
+    if (acptr->pool->queue)		/* some slot may be freed */
+      _accept_dequeue (acptr);
     if ((new_idx = AnswerSocket (acptr->socket)) == E_AGAIN)
       continue;
     else if (new_idx < 0) /* listening socket died */
@@ -1652,29 +1919,44 @@ static void *_listen_port (void *input_data)
     child->handler = acptr->handler;
     child->data = acptr->data;
     child->tst = 0;			/* use it to wait for prehandler */
+    child->pool = NULL;
+    child->qnext = NULL;
     dprint (5, "direct:_listen_port: socket %d answered, %s: new socket %d",
 	    (int)acptr->socket, acptr->client ? "terminated" : "continue",
 	    (int)new_idx);
-    if (pthread_create (&child->th, NULL, &_accept_port, child))
+    pthread_mutex_lock(&ListenMutex);
+    if (acptr->client || _accept_slot (acptr->pool))
     {
-      KillSocket (&child->socket);
-      FREE (&child);
+      if (!acptr->client)		/* outgoing one isn't limited */
+      {
+	child->pool = acptr->pool;
+	acptr->pool->started++;
+      }
+      pthread_mutex_unlock(&ListenMutex);
+      if (_accept_start (acptr, child))
+	break;
     }
-    else
+    else if (acptr->pool->queued < (unsigned int)accept_queue)
     {
-      DBG("_listen_port: got thread %p for new socket %hd (detach=%d)",
-	  (void *)child->th, child->socket, (acptr->prehandler == NULL));
-      if (acptr->prehandler)
-	acptr->prehandler (child->th, &child->data, &child->socket);
+      clock_gettime (CLOCK_MONOTONIC, &child->since);
+      if (acptr->pool->qlast)
+	acptr->pool->qlast->qnext = child;
       else
-	pthread_detach (child->th);	/* since it's not joinable */
-      child->tst = 1;			/* let new thread continue */
-      if (acptr->client)		/* it's client connection so die now */
-      {
-	acptr->id = 0;			/* do not call prehandler again */
-	acptr->client = NULL;		/* it's inherited by child */
-	break;
-      }
+	acptr->pool->queue = child;
+      acptr->pool->qlast = child;
+      acptr->pool->queued++;
+      pthread_mutex_unlock(&ListenMutex);
+      dprint (4, "direct:_listen_port: no free slot, socket %d queued",
+	      (int)new_idx);
+    }
+    else				/* queue is full: drop newest one */
+    {
+      acptr->pool->rejected++;
+      pthread_mutex_unlock(&ListenMutex);
+      LOG_CONN (_("Rejected connection on port %hu: too many pending."),
+		acptr->lport);
+      KillSocket (&child->socket);
+      FREE (&child);
     }
     pthread_setcancelstate (cancelstate, &i);
   }
@@ -1728,6 +2010,8 @@ int Listen_Port (char *client, const char *host, unsigned short sport,
     _assign_port_range (&acptr->lport, &acptr->eport);
   acptr->socket = idx;
   acptr->tst = 0;
+  acptr->pool = safe_calloc (1, sizeof(accept_pool));
+  acptr->pool->refs = 1;		/* listener's one */
   /* create interface now */
   if (!acptr->confline)
     snprintf (buf, sizeof(buf), "%hu", sport);
@@ -60,6 +60,7 @@ typedef struct queue_i
 {
   request_t *request;
   struct queue_i *next;
+  long long since;		/* Metric_Clock() when queued */
 } queue_i;
 
 typedef struct ifi_t
@@ -214,15 +215,52 @@ void bot_shutdown (char *message, int e)
  *            .
  */
 
+#ifdef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+/* it's initialized in dispatcher() but let tools use it without dispatcher */
+static pthread_mutex_t LockIface = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#else
 static pthread_mutex_t LockIface;
+#endif
 static pthread_cond_t CondIface = PTHREAD_COND_INITIALIZER;
 
 ALLOCATABLE_TYPE (queue_i, _Q, next) /* alloc_queue_i(), free_queue_i() */
 
+/* metrics of requests by interface type, first matched type is used */
+static struct
+{
+  iftype_t ift;
+  const char *labels;
+  int queued, delivered;
+  int waited, handled;			/* latency metrics */
+} _if_metrics[] = {
+  { I_LOG, "type=\"log\"", 0, 0, 0, 0 },
+  { I_FILE, "type=\"file\"", 0, 0, 0, 0 },
+  { I_DCCALIAS, "type=\"dccalias\"", 0, 0, 0, 0 },
+  { I_QUERY, "type=\"query\"", 0, 0, 0, 0 },
+  { I_CLIENT, "type=\"client\"", 0, 0, 0, 0 },
+  { I_SERVICE, "type=\"service\"", 0, 0, 0, 0 },
+  { I_DIRECT, "type=\"direct\"", 0, 0, 0, 0 },
+  { I_SCRIPT, "type=\"script\"", 0, 0, 0, 0 },
+  { I_CONSOLE, "type=\"console\"", 0, 0, 0, 0 },
+  { I_MODULE, "type=\"module\"", 0, 0, 0, 0 },
+  { 0, "type=\"other\"", 0, 0, 0, 0 }
+};
+
+static inline unsigned int _if_metric (iftype_t ift)
+{
+  register unsigned int i;
+
+  for (i = 0; _if_metrics[i].ift; i++)
+    if (ift & _if_metrics[i].ift)
+      break;
+  return i;
+}
+
 /* locks on input: LockIface */
 static int add2queue (ifi_t *to, request_t *req)
 {
   queue_i *newq;
+  register unsigned int i;
 
   if (!req->a.mask_if || (to->a.ift & (I_LOCKED | I_DIED)))
     return 0;			/* request to nobody? */
@@ -232,6 +270,7 @@ static int add2queue (ifi_t *to, request_t *req)
   /* we get our valid target so get free queue element and setup it */
   newq = alloc_queue_i();	/* newq->next is undefined now */
   newq->request = req;
+  newq->since = Metric_Clock ();
   req->x.used++;
   to->pq = newq;
   if (req->a.flag & F_QUICK)
@@ -269,6 +308,9 @@ static int add2queue (ifi_t *to, request_t *req)
     to->tail = newq;
   }
   to->a.qsize++;
+  i = _if_metric (to->a.ift);
+  METRIC_COUNT (_if_metrics[i].queued, "foxeye_requests_queued_total",
+		_if_metrics[i].labels, "Requests queued to interfaces", 1);
   if (lastdebuglog)
   {
     fprintf (lastdebuglog, "::dispatcher:add2queue: req %p: added %p to %p: new head=%p tail=%p qsize=%d\n",
@@ -306,6 +348,7 @@ typedef struct reqbl_t
 } reqbl_t;
 
 static reqbl_t *_Rbl = NULL;
+static int _mc_requests = 0;
 
 /* locks on input: LockIface */
 /* we don't use standard macro here to have all requests in one thread */
@@ -319,6 +362,7 @@ static request_t *alloc_request_t (void)
     register reqbl_t *rbl;
 
     rbl = safe_calloc (1, sizeof(reqbl_t));
+    MEM_COUNT (_mc_requests, "requests", sizeof(reqbl_t));
     rbl->prev = _Rbl;
     _Rbl = rbl;
     _Ralloc++;
@@ -606,6 +650,7 @@ static int _get_current (void)
 {
   int out;
   queue_i *curq = Current->head;
+  long long t = 0;
 
   /* interface may be unused so lock semaphore */
   if (!Current->a.ift || (Current->a.ift & I_DIED))
@@ -620,6 +665,7 @@ static int _get_current (void)
     if (Current->tail == curq)
       Current->tail = NULL;
     Current->a.qsize--;
+    t = Metric_Clock ();
     out = Current->a.IFRequest (&Current->a, &curq->request->a);
     curq->next = Current->head;			/* restore status-quo */
     if (Current->tail == NULL)
@@ -648,6 +694,24 @@ static int _get_current (void)
   if (Current->a.ift & I_FINWAIT)
     Current->a.marked = TRUE;			/* suicide performed, do kill */
 
+  if (curq)
+  {
+    register unsigned int i = _if_metric (Current->a.ift);
+    long long t2 = Metric_Clock ();
+
+    METRIC_TIME (_if_metrics[i].handled, "foxeye_request_handler_latency_us",
+		 _if_metrics[i].labels,
+		 "Time of request handling by interfaces", t2 - t);
+    Metric_Slow (t2 - t, "request to", Current->a.name);
+    if (out == REQ_OK)
+    {
+      METRIC_COUNT (_if_metrics[i].delivered, "foxeye_requests_delivered_total",
+		    _if_metrics[i].labels, "Requests delivered to interfaces", 1);
+      METRIC_TIME (_if_metrics[i].waited, "foxeye_request_queue_latency_us",
+		   _if_metrics[i].labels,
+		   "Time of request waiting in interface queue", t - curq->since);
+    }
+  }
   if (out == REQ_OK)
     return delete_request (Current, curq);	/* else it was rejected */
 
@@ -1226,11 +1290,11 @@ void Status_Interfaces (INTERFACE *iface)
     ERROR ("dispatcher: _Inum vs. _IFInum: %u != %u", _Inum, _IFInum);
   New_Request (iface, 0,
 	       "Total (current/max): %u/%u interfaces (%zu bytes), %u/%u requests (%zu bytes)",
-	       _Inum, _Imax, _Ialloc * sizeof(ifi_t *) + _IFIasize +
+	       _Inum, _Imax, _Ialloc * sizeof(ifi_t *) + _pool_(ifi_t)->asize +
 			     StNum * sizeof(ifst_t) + _Inamessize,
 	       _Rnum, _Rmax, _Ralloc * sizeof(reqbl_t));
   New_Request (iface, 0, "                     %u/%u queue slots (%zu bytes)",
-	       _Qnum, _Qmax, _Qasize);
+	       _Qnum, _Qmax, _pool_(queue_i)->asize);
   pthread_mutex_unlock (&LockIface);
 }
 
@@ -42,6 +42,8 @@ struct bindtable_t
   struct binding_t *lr;			/* last resort - for B_UNIQ unly */
   struct bindtable_t *next;
   bttype_t type;
+  int metric;				/* calls counter, 0 if not known yet */
+  int latency;				/* RunBinding() latency metric */
 };
 
 /* ----------------------------------------------------------------------------
@@ -163,6 +165,8 @@ struct binding_t *Add_Binding (const char *table, const char *mask, userflag gf,
   struct binding_t *bind = safe_malloc (sizeof(struct binding_t));
   struct binding_t *b;
 
+  bind->table = bt;
+
   if (bt->type == B_UNIQ || bt->type == B_KEYWORD)
   {
     if (!mask || !*mask)
@@ -379,6 +383,21 @@ void Delete_Binding (const char *table, Function func, const char *name)
   }
 }
 
+/* counts found bindings per bindtable */
+static void _bt_count_call (struct bindtable_t *bt)
+{
+  char labels[SHORT_STRING];
+
+  if (bt->metric == 0)
+  {
+    snprintf (labels, sizeof(labels), "table=\"%s\"", NONULL(bt->name));
+    bt->metric = Metric_Register ("foxeye_bindtable_calls_total", labels,
+				  "Bindings found in bindtables",
+				  METRIC_COUNTER, NULL, 0);
+  }
+  Metric_Add (bt->metric, 1);
+}
+
 struct binding_t *Check_Bindtable (struct bindtable_t *bt, const char *str,
 				   userflag gf, userflag scf,
 				   struct binding_t *bind)
@@ -577,12 +596,14 @@ struct binding_t *Check_Bindtable (struct bindtable_t *bt, const char *str,
     dprint (4, "binds: bindtable \"%s\" string \"%s\", flags %#x/%#x, found mask \"%s\"",
 	    NONULL(bt->name), NONULL(str), gf, cf, NONULL(b->key));
     b->hits++;
+    _bt_count_call (bt);
   }
   else if (bt->type == B_UNIQ && bt->lr)
   {
     dprint (4, "binds: bindtable \"%s\" string \"%s\", using last resort",
 	    NONULL(bt->name), NONULL(str));
     bt->lr->hits++;
+    _bt_count_call (bt);
     return bt->lr;
   }
   return b;
@@ -607,6 +628,7 @@ int RunBinding (struct binding_t *bind, const uchar *uh, const char *fst,
   char n[16];
   const char *a[8];
   register int i = 0;
+  long long t;
 
   if (!bind || !bind->name || !bind->func)	/* checking... */
     return 0;
@@ -646,7 +668,24 @@ int RunBinding (struct binding_t *bind, const uchar *uh, const char *fst,
   }
   if (last/* && *last*/)				/* NONULL */
     a[i++] = last;
+  t = Metric_Clock ();
   i = bind->func (bind->name, i, a);		/* int func(char *,int,char **) */
+  t = Metric_Clock () - t;
+  if (bind->table)
+  {
+    if (bind->table->latency == 0)
+    {
+      char labels[SHORT_STRING];
+
+      snprintf (labels, sizeof(labels), "table=\"%s\"",
+		NONULL(bind->table->name));
+      bind->table->latency = Metric_Register ("foxeye_binding_latency_us",
+					      labels, "Time of script bindings",
+					      METRIC_LATENCY, NULL, 0);
+    }
+    Metric_Observe (bind->table->latency, t);
+  }
+  Metric_Slow (t, "binding", bind->name);
   if (i)					/* return 0 or 1 only */
     i = 1;
   if (tt0)
@@ -1709,6 +1748,8 @@ Started %* on %s at host %@."),
     Status_Encodings (dcc->iface);
 #endif
     Status_Connchains (dcc->iface);
+    Status_Resolver (dcc->iface);
+    Status_Memory (dcc->iface, NULL, 0);
     ReportFormat = "%L @%@: %*";
     Send_Signal (I_LISTEN, "*", S_REPORT);
   }
@@ -1720,6 +1761,31 @@ Started %* on %s at host %@."),
   return 1;
 }
 
+		/* .memory [-h] [<module name>|-a] */
+BINDING_TYPE_dcc (dc_memory);
+static int dc_memory (struct peer_t *dcc, char *args)
+{
+  int history = 0;
+
+  if (args && !strncmp (args, "-h", 2) && (args[2] == 0 || args[2] == ' '))
+  {
+    history = 1;
+    args = NextWord (args);
+  }
+  if (!args || !*args || !strcmp (args, "-a"))
+    args = "*";
+  Status_Memory (dcc->iface, args, history);
+  return 1;
+}
+
+		/* .latency [<mask>] */
+BINDING_TYPE_dcc (dc_latency);
+static int dc_latency (struct peer_t *dcc, char *args)
+{
+  Status_Latency (dcc->iface, (args && *args) ? args : NULL);
+  return 1;
+}
+
 		/* .binds [-l|<name>|-a [<name>]] */
 BINDING_TYPE_dcc (dc_binds);
 static int dc_binds (struct peer_t *dcc, char *args)
@@ -2254,6 +2320,8 @@ INTERFACE *init (void)
   Add_Binding ("dcc", "binds", U_MASTER, U_MASTER, (Function)&dc_binds, NULL);
   Add_Binding ("dcc", "module", U_OWNER, U_NONE, (Function)&dc_module, NULL);
   Add_Binding ("dcc", "status", U_MASTER, U_NONE, (Function)&dc_status, NULL);
+  Add_Binding ("dcc", "memory", U_MASTER, U_NONE, (Function)&dc_memory, NULL);
+  Add_Binding ("dcc", "latency", U_MASTER, U_NONE, (Function)&dc_latency, NULL);
   Add_Binding ("dcc", "fset", U_OWNER, U_NONE, (Function)&dc_fset, NULL);
   Add_Binding ("dcc", "rehash", U_MASTER, U_NONE, &dc_rehash, NULL);
   Add_Binding ("dcc", "restart", U_MASTER, U_NONE, &dc_restart, NULL);
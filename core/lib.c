@@ -106,6 +106,479 @@ void safe_free (void **p)
   }
 }
 
+/*
+ * Memory accounting. Each thread has own set of counters so no lock is
+ * needed to account, only to register the set. When thread exits its
+ * counters are added to retired ones. Totals are sampled each minute by
+ * sheduler to get high-watermarks, for each class the peak is remembered
+ * and also peaks of last MEM_HISTORY hours.
+ */
+typedef struct mem_thread
+{
+  struct mem_thread *prev, *next;
+  ssize_t bytes[MEM_CLASSES];
+  long int count[MEM_CLASSES];
+} mem_thread;
+
+typedef struct
+{
+  char *module, *name;
+  ssize_t peak;
+  time_t peak_time;
+  ssize_t hist[MEM_HISTORY];		/* [0] is the current hour */
+} mem_class;
+
+static pthread_mutex_t MemLock = PTHREAD_MUTEX_INITIALIZER;
+static mem_class MemClasses[MEM_CLASSES] = { { "core", "other", 0, 0, { 0 } } };
+static unsigned int MemClassNum = 1;
+static mem_thread *MemThreads = NULL;
+static ssize_t MemRetiredBytes[MEM_CLASSES];
+static long int MemRetiredCount[MEM_CLASSES];
+static pthread_key_t MemKey;
+static pthread_once_t MemOnce = PTHREAD_ONCE_INIT;
+
+static void _mem_thread_done (void *data)
+{
+  mem_thread *mt = data;
+  register unsigned int i;
+
+  pthread_mutex_lock (&MemLock);
+  for (i = 0; i < MEM_CLASSES; i++)
+  {
+    MemRetiredBytes[i] += mt->bytes[i];
+    MemRetiredCount[i] += mt->count[i];
+  }
+  if (mt->prev)
+    mt->prev->next = mt->next;
+  else
+    MemThreads = mt->next;
+  if (mt->next)
+    mt->next->prev = mt->prev;
+  pthread_mutex_unlock (&MemLock);
+  safe_pfree (mt);
+}
+
+static void _mem_init_key (void)
+{
+  pthread_key_create (&MemKey, &_mem_thread_done);
+}
+
+int Mem_Class (const char *module, const char *name)
+{
+  register unsigned int i;
+
+  pthread_mutex_lock (&MemLock);
+  for (i = 1; i < MemClassNum; i++)
+    if (!strcmp (MemClasses[i].name, name) &&
+	!strcmp (MemClasses[i].module, module))
+      break;
+  if (i == MemClassNum)
+  {
+    if (i < MEM_CLASSES)
+    {
+      MemClasses[i].module = safe_strdup (module);
+      MemClasses[i].name = safe_strdup (name);
+      MemClassNum++;
+    }
+    else
+      i = 0;				/* no space, account it as other */
+  }
+  pthread_mutex_unlock (&MemLock);
+  return i;
+}
+
+void Mem_Account (int mclass, ssize_t bytes)
+{
+  mem_thread *mt;
+
+  if (mclass < 0 || mclass >= MEM_CLASSES)
+    mclass = 0;
+  pthread_once (&MemOnce, &_mem_init_key);
+  if ((mt = pthread_getspecific (MemKey)) == NULL)
+  {
+    mt = safe_calloc (1, sizeof(mem_thread));
+    pthread_setspecific (MemKey, mt);
+    pthread_mutex_lock (&MemLock);
+    if ((mt->next = MemThreads) != NULL)
+      mt->next->prev = mt;
+    MemThreads = mt;
+    pthread_mutex_unlock (&MemLock);
+  }
+  mt->bytes[mclass] += bytes;
+  if (bytes < 0)
+    mt->count[mclass]--;
+  else
+    mt->count[mclass]++;
+}
+
+/* sums counters of all threads, called with MemLock locked */
+static void _mem_totals (ssize_t *bytes, long int *count)
+{
+  mem_thread *mt;
+  register unsigned int i;
+
+  memcpy (bytes, MemRetiredBytes, sizeof(MemRetiredBytes));
+  memcpy (count, MemRetiredCount, sizeof(MemRetiredCount));
+  for (mt = MemThreads; mt; mt = mt->next)
+    for (i = 0; i < MemClassNum; i++)
+    {
+      bytes[i] += mt->bytes[i];
+      count[i] += mt->count[i];
+    }
+}
+
+/* called by sheduler each minute */
+void _fe_memory_sample (int newhour)
+{
+  ssize_t bytes[MEM_CLASSES];
+  long int count[MEM_CLASSES];
+  register unsigned int i;
+
+  pthread_mutex_lock (&MemLock);
+  _mem_totals (bytes, count);
+  for (i = 0; i < MemClassNum; i++)
+  {
+    if (newhour)
+    {
+      memmove (&MemClasses[i].hist[1], MemClasses[i].hist,
+	       (MEM_HISTORY - 1) * sizeof(ssize_t));
+      MemClasses[i].hist[0] = 0;
+    }
+    if (bytes[i] > MemClasses[i].hist[0])
+      MemClasses[i].hist[0] = bytes[i];
+    if (bytes[i] > MemClasses[i].peak)
+    {
+      MemClasses[i].peak = bytes[i];
+      MemClasses[i].peak_time = Time;
+    }
+  }
+  pthread_mutex_unlock (&MemLock);
+}
+
+/* module is NULL for summary per module, "*" for every class */
+void Status_Memory (INTERFACE *iface, const char *module, int history)
+{
+  ssize_t bytes[MEM_CLASSES], mbytes[MEM_CLASSES], mpeak[MEM_CLASSES];
+  long int count[MEM_CLASSES];
+  char *mods[MEM_CLASSES];
+  char buf[STRING];
+  struct tm tm;
+  register unsigned int i, j, n;
+  size_t s;
+  ssize_t total = 0;
+
+  pthread_mutex_lock (&MemLock);
+  _mem_totals (bytes, count);
+  if (module == NULL)			/* sum by modules */
+  {
+    for (i = 0, n = 0; i < MemClassNum; i++)
+    {
+      for (j = 0; j < n; j++)
+	if (!strcmp (mods[j], MemClasses[i].module))
+	  break;
+      if (j == n)
+      {
+	mods[n] = MemClasses[i].module;
+	mbytes[n] = mpeak[n] = 0;
+	n++;
+      }
+      mbytes[j] += bytes[i];
+      mpeak[j] += MemClasses[i].peak;
+      total += bytes[i];
+    }
+    for (j = 0; j < n; j++)
+      New_Request (iface, 0, "Memory of %s: %zd bytes (sum of peaks %zd).",
+		   mods[j], mbytes[j], mpeak[j]);
+    New_Request (iface, 0, "Memory accounted total: %zd bytes.", total);
+    pthread_mutex_unlock (&MemLock);
+    return;
+  }
+  for (i = 0; i < MemClassNum; i++)
+  {
+    if (strcmp (module, "*") && strcmp (module, MemClasses[i].module))
+      continue;
+    total += bytes[i];
+    if (MemClasses[i].peak_time)
+    {
+      localtime_r (&MemClasses[i].peak_time, &tm);
+      strftime (buf, sizeof(buf), "%H:%M %e %b", &tm);
+    }
+    else
+      strfcpy (buf, "-", sizeof(buf));
+    New_Request (iface, 0, "%s/%s: %zd bytes in %ld allocations, peak %zd at %s.",
+		 MemClasses[i].module, MemClasses[i].name, bytes[i], count[i],
+		 MemClasses[i].peak, buf);
+    if (!history)
+      continue;
+    for (j = 0, s = 0; j < MEM_HISTORY && s < sizeof(buf) - 16; j++)
+      s += snprintf (&buf[s], sizeof(buf) - s, " %zd", MemClasses[i].hist[j]);
+    New_Request (iface, 0, "  hourly peaks (latest first):%s", buf);
+  }
+  New_Request (iface, 0, "Total: %zd bytes.", total);
+  pthread_mutex_unlock (&MemLock);
+}
+
+/*
+ * Object pools. Each object has header which points to its block so freed
+ * object may be returned into block it was taken from and block may be
+ * returned to system as soon as all its objects are free. Free objects are
+ * chained by their first bytes. Each thread keeps magazine of few free
+ * objects per pool so alloc/free touch the pool lock once per half of
+ * magazine only. Magazines of exited thread are returned into pools.
+ */
+struct pool_block
+{
+  struct pool_block *prev, *next;	/* in list of all blocks */
+  struct pool_block *pprev, *pnext;	/* in list of partial blocks */
+  void *free;				/* chain of free objects */
+  unsigned int nfree;
+};
+
+typedef union				/* header of each object */
+{
+  struct pool_block *b;
+  long double align;			/* keep objects aligned */
+} pool_hdr;
+
+typedef struct
+{
+  unsigned int gen;			/* see PoolGen[] */
+  unsigned int n;
+  void *obj[POOL_MAGAZINE];
+} pool_mag;
+
+#define POOL_ROUND(s) (((s) + sizeof(pool_hdr) - 1) / sizeof(pool_hdr) * \
+		       sizeof(pool_hdr))
+#define POOL_SLOT(pool) (sizeof(pool_hdr) + POOL_ROUND((pool)->size))
+#define POOL_BSIZE(pool) (POOL_ROUND(sizeof(struct pool_block)) + \
+			  (pool)->per_block * POOL_SLOT(pool))
+#define POOL_CAP(pool) ((pool)->per_block < POOL_MAGAZINE ? \
+			(pool)->per_block : POOL_MAGAZINE)
+
+static pthread_mutex_t PoolsLock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *Pools[POOL_MAX];		/* [0] isn't used */
+static unsigned int PoolGen[POOL_MAX];	/* changed when pool is forgotten */
+static pthread_key_t PoolKey;
+static pthread_once_t PoolOnce = PTHREAD_ONCE_INIT;
+
+/* takes one object from blocks, called with pool->lock locked */
+static void *_pool_get (pool_t *pool)
+{
+  struct pool_block *b;
+  char *o;
+  unsigned int i;
+
+  if ((b = pool->partial) == NULL)	/* no free objects, add block */
+  {
+    if (pool->per_block == 0)
+      pool->per_block = 1;
+    pool->size = POOL_ROUND(pool->size);
+    b = safe_malloc (POOL_BSIZE(pool));
+    o = (char *)b + POOL_ROUND(sizeof(struct pool_block));
+    b->free = NULL;
+    for (i = 0; i < pool->per_block; i++, o += POOL_SLOT(pool))
+    {
+      ((pool_hdr *)o)->b = b;
+      *(void **)&o[sizeof(pool_hdr)] = b->free;
+      b->free = &o[sizeof(pool_hdr)];
+    }
+    b->nfree = pool->per_block;
+    b->prev = NULL;
+    if ((b->next = pool->blocks) != NULL)
+      b->next->prev = b;
+    pool->blocks = b;
+    b->pprev = b->pnext = NULL;
+    pool->partial = b;
+    pool->nfree += pool->per_block;
+    pool->asize += POOL_BSIZE(pool);
+    if (pool->mclass == 0)
+      pool->mclass = Mem_Class (pool->module, pool->name);
+    Mem_Account (pool->mclass, POOL_BSIZE(pool));
+    if (++pool->nblocks > pool->maxblocks)
+      pool->maxblocks = pool->nblocks;
+  }
+  o = b->free;
+  b->free = *(void **)o;
+  pool->nfree--;
+  if (--b->nfree == 0)			/* block is full now */
+  {
+    if ((pool->partial = b->pnext) != NULL)
+      pool->partial->pprev = NULL;
+    b->pnext = NULL;
+  }
+  return o;
+}
+
+/* returns object into its block, called with pool->lock locked */
+static void _pool_put (pool_t *pool, void *o)
+{
+  struct pool_block *b = ((pool_hdr *)o)[-1].b;
+
+  *(void **)o = b->free;
+  b->free = o;
+  pool->nfree++;
+  if (++b->nfree == 1)			/* it was full */
+  {
+    b->pprev = NULL;
+    if ((b->pnext = pool->partial) != NULL)
+      b->pnext->pprev = b;
+    pool->partial = b;
+  }
+  else if (b->nfree == pool->per_block &&
+	   pool->nfree >= 2 * pool->per_block) /* keep one free block */
+  {
+    if (b->pprev)
+      b->pprev->pnext = b->pnext;
+    else
+      pool->partial = b->pnext;
+    if (b->pnext)
+      b->pnext->pprev = b->pprev;
+    if (b->prev)
+      b->prev->next = b->next;
+    else
+      pool->blocks = b->next;
+    if (b->next)
+      b->next->prev = b->prev;
+    pool->nfree -= pool->per_block;
+    pool->asize -= POOL_BSIZE(pool);
+    Mem_Account (pool->mclass, -(ssize_t)POOL_BSIZE(pool));
+    pool->nblocks--;
+    pool->trimmed++;
+    FREE (&b);
+  }
+}
+
+/* thread is exiting, return its magazines into pools */
+static void _pool_thread_done (void *data)
+{
+  pool_mag **mags = data;
+  pool_t *pool;
+  unsigned int i;
+
+  pthread_mutex_lock (&PoolsLock);
+  for (i = 1; i < POOL_MAX; i++)
+  {
+    if (mags[i] == NULL)
+      continue;
+    if ((pool = Pools[i]) != NULL && mags[i]->gen == PoolGen[i] &&
+	mags[i]->n > 0)
+    {
+      pthread_mutex_lock (&pool->lock);
+      while (mags[i]->n > 0)
+	_pool_put (pool, mags[i]->obj[--mags[i]->n]);
+      pthread_mutex_unlock (&pool->lock);
+    }
+    FREE (&mags[i]);
+  }
+  pthread_mutex_unlock (&PoolsLock);
+  safe_pfree (mags);
+}
+
+static void _pool_init_key (void)
+{
+  pthread_key_create (&PoolKey, &_pool_thread_done);
+}
+
+/* returns magazine of current thread or NULL if pool has no magazines */
+static pool_mag *_pool_magazine (pool_t *pool)
+{
+  pool_mag **mags, *mag;
+  unsigned int i;
+
+  if (pool->id == 0)			/* register it now */
+  {
+    pthread_mutex_lock (&PoolsLock);
+    for (i = 1; pool->id == 0 && i < POOL_MAX; i++)
+      if (Pools[i] == NULL)
+      {
+	Pools[i] = pool;
+	pool->id = i;
+      }
+    pthread_mutex_unlock (&PoolsLock);
+    if (pool->id == 0)			/* too many pools */
+      return NULL;
+  }
+  pthread_once (&PoolOnce, &_pool_init_key);
+  if ((mags = pthread_getspecific (PoolKey)) == NULL)
+  {
+    mags = safe_calloc (POOL_MAX, sizeof(pool_mag *));
+    pthread_setspecific (PoolKey, mags);
+  }
+  if ((mag = mags[pool->id]) == NULL)
+  {
+    mags[pool->id] = mag = safe_malloc (sizeof(pool_mag));
+    mag->gen = PoolGen[pool->id];
+    mag->n = 0;
+  }
+  else if (mag->gen != PoolGen[pool->id]) /* objects were freed by forget */
+  {
+    mag->gen = PoolGen[pool->id];
+    mag->n = 0;
+  }
+  return mag;
+}
+
+void *Pool_Alloc (pool_t *pool)
+{
+  pool_mag *mag = _pool_magazine (pool);
+  void *o;
+
+  if (mag && mag->n > 0)
+    return mag->obj[--mag->n];
+  pthread_mutex_lock (&pool->lock);
+  if (mag)				/* refill half of magazine */
+    while (mag->n < POOL_CAP(pool) / 2)
+      mag->obj[mag->n++] = _pool_get (pool);
+  o = _pool_get (pool);
+  pthread_mutex_unlock (&pool->lock);
+  return o;
+}
+
+void Pool_Free (pool_t *pool, void *o)
+{
+  pool_mag *mag = _pool_magazine (pool);
+
+  if (o == NULL)
+    return;
+  if (mag && mag->n < POOL_CAP(pool))
+  {
+    mag->obj[mag->n++] = o;
+    return;
+  }
+  pthread_mutex_lock (&pool->lock);
+  if (mag)				/* flush half of magazine */
+    while (mag->n > POOL_CAP(pool) / 2)
+      _pool_put (pool, mag->obj[--mag->n]);
+  _pool_put (pool, o);
+  pthread_mutex_unlock (&pool->lock);
+}
+
+/* frees every block, all objects of pool become invalid */
+void Pool_Forget (pool_t *pool)
+{
+  struct pool_block *b;
+
+  pthread_mutex_lock (&PoolsLock);
+  if (pool->id != 0)			/* invalidate magazines */
+  {
+    Pools[pool->id] = NULL;
+    PoolGen[pool->id]++;
+    pool->id = 0;
+  }
+  pthread_mutex_lock (&pool->lock);
+  while ((b = pool->blocks) != NULL)
+  {
+    pool->blocks = b->next;
+    FREE (&b);
+    Mem_Account (pool->mclass, -(ssize_t)POOL_BSIZE(pool));
+  }
+  pool->partial = NULL;
+  pool->nfree = pool->nblocks = 0;
+  pool->asize = 0;
+  pthread_mutex_unlock (&pool->lock);
+  pthread_mutex_unlock (&PoolsLock);
+}
+
 
 /*
  * converts null-terminated string src to upper case string
@@ -177,6 +177,12 @@ static lid_t _Falloc = 0;
 
 #define strlena(x) (x ? (strlen(x)+1) : 0)
 
+/* accounting of memory used by records */
+static int _mc_records = 0;
+#define _rec_count(s) MEM_COUNT (_mc_records, "listfile records", s)
+#define _hr_size(h) (ssize_t)(safe_strlen ((h)->hostmask) + 1 + \
+			      sizeof(user_hr) - sizeof((h)->hostmask))
+
 /*
  * Usersfile manipulation functions
  */
@@ -189,6 +195,7 @@ static int _addhost (user_hr **hr, const char *uh)
 
   sz = safe_strlen (uh) + 1;
   *hr = safe_malloc (sz + sizeof(user_hr) - sizeof(h->hostmask));
+  _rec_count (sz + sizeof(user_hr) - sizeof(h->hostmask));
   _R_h += sz + sizeof(user_hr) - sizeof(h->hostmask);
   memcpy ((*hr)->hostmask, uh, sz);
   (*hr)->next = h;
@@ -202,6 +209,7 @@ static void _delhost (user_hr **hr)
 
   *hr = h->next;
   _R_h -= safe_strlen (h->hostmask) + 1 + sizeof(user_hr) - sizeof(h->hostmask);
+  _rec_count (-_hr_size (h));
   FREE (&h);
 }
 
@@ -574,6 +582,7 @@ static struct clrec_t *_add_userrecord (const char *name, userflag uf, lid_t id)
   else if (i >= 0)
   {
     user = safe_calloc (1, sizeof(struct clrec_t));
+    _rec_count (sizeof(struct clrec_t));
     /* set fields */
     user->lname = safe_strdup (name);
     i = safe_strlen (name);
@@ -608,6 +617,7 @@ static struct clrec_t *_add_userrecord (const char *name, userflag uf, lid_t id)
     if (user)
     {
       _del_lid (user->uid, 0);
+      _rec_count (-(ssize_t)sizeof(struct clrec_t));
       FREE (&user->lname);
       FREE (&user->lclname);
       FREE (&user);
@@ -687,6 +697,7 @@ static void _delete_userrecord (struct clrec_t *user, int to_unlock)
     _f += strlena (chr->greeting) + sizeof(user_chr);
     FREE (&chr->greeting);
     user->channels = chr->next;
+    _rec_count (-(ssize_t)sizeof(user_chr));
     FREE (&chr);
     chr = user->channels;
   }
@@ -708,11 +719,13 @@ static void _delete_userrecord (struct clrec_t *user, int to_unlock)
     _f += strlena (f->value) + sizeof(user_fr);
     FREE (&f->value);
     user->fields = f->next;
+    _rec_count (-(ssize_t)sizeof(user_fr));
     FREE (&f);
   }
   pthread_mutex_lock (&FLock);
   _R_f -= _f;
   pthread_mutex_unlock (&FLock);
+  _rec_count (-(ssize_t)sizeof(struct clrec_t));
   FREE (&user);
   LISTFILEMODIFIED;
 }
@@ -1338,6 +1351,7 @@ static inline user_chr **_add_channel (user_chr **chr, lid_t i)
 {
   register user_chr *c = safe_calloc (1, sizeof(user_chr));
 
+  _rec_count (sizeof(user_chr));
   while (*chr) chr = &(*chr)->next;
   pthread_mutex_lock (&FLock);
   _R_f += sizeof(user_chr);
@@ -1356,6 +1370,7 @@ static inline void _del_channel (user_chr **chr, user_chr *c)
   pthread_mutex_lock (&FLock);
   _R_f -= strlena (c->greeting) + sizeof(user_chr);
   pthread_mutex_unlock (&FLock);
+  _rec_count (-(ssize_t)sizeof(user_chr));
   FREE (&c->greeting);
   FREE (&c);
 }
@@ -1450,6 +1465,7 @@ int Set_Field (struct clrec_t *user, const char *field, const char *val,
 	  pthread_mutex_lock (&FLock);
 	  _R_f -= strlena (f->value) + sizeof(user_fr);
 	  pthread_mutex_unlock (&FLock);
+	  _rec_count (-(ssize_t)sizeof(user_fr));
 	  FREE (&f->value);
 	  FREE (&f);
 	  LISTFILEMODIFIED;
@@ -1488,6 +1504,7 @@ int Set_Field (struct clrec_t *user, const char *field, const char *val,
       {
 	while (f->next) f = f->next;
 	f->next = safe_calloc (1, sizeof(user_fr));
+	_rec_count (sizeof(user_fr));
 	pthread_mutex_lock (&FLock);
 	_R_f += sizeof(user_fr);
 	pthread_mutex_unlock (&FLock);
@@ -1497,6 +1514,7 @@ int Set_Field (struct clrec_t *user, const char *field, const char *val,
       else
       {
 	f = user->fields = safe_calloc (1, sizeof(user_fr));
+	_rec_count (sizeof(user_fr));
 	pthread_mutex_lock (&FLock);
 	_R_f += sizeof(user_fr);
 	pthread_mutex_unlock (&FLock);
@@ -1969,6 +1987,7 @@ static int _cral_clear (void)
       *cral->x.chr = c->next;
       pthread_mutex_unlock (cral->a.mutex);
       r += strlena (c->greeting) + sizeof(user_chr);
+      _rec_count (-(ssize_t)sizeof(user_chr));
       FREE (&c->greeting);
       FREE (&c);
     }
@@ -2210,6 +2229,7 @@ static int _load_listfile (const char *filename, int update)
 	    ur->host = hr->next;
 	    _R_h -= safe_strlen (hr->hostmask) + 1 + sizeof(user_hr) -
 		    sizeof(hr->hostmask);
+	    _rec_count (-_hr_size (hr));
 	    FREE (&hr);
 	  }
 	  rw_unlock (&HLock);
@@ -2258,6 +2278,7 @@ static int _load_listfile (const char *filename, int update)
 	    chr = ur->channels;
 	    ur->channels = chr->next;
 	    _f -= strlena (chr->greeting) + sizeof(user_chr);
+	    _rec_count (-(ssize_t)sizeof(user_chr));
 	    FREE (&chr->greeting);
 	    FREE (&chr);
 	  }
@@ -2266,6 +2287,7 @@ static int _load_listfile (const char *filename, int update)
 	    fr = ur->fields;
 	    ur->fields = fr->next;
 	    _f -= strlena (fr->value) + sizeof(user_fr);
+	    _rec_count (-(ssize_t)sizeof(user_fr));
 	    FREE (&fr->value);
 	    FREE (&fr);
 	  }
@@ -2825,6 +2847,7 @@ static int dc_chattr (struct peer_t *dcc, char *args)
       _R_f -= strlena (chr->greeting) + sizeof(user_chr);
       pthread_mutex_unlock (&FLock);
       DBG ("list.c:dc_chattr:deleting empty %s from %s.", Chan, user->lname);
+      _rec_count (-(ssize_t)sizeof(user_chr));
       FREE (&chr->greeting);
       FREE (&chr);
     }
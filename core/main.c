@@ -31,6 +31,8 @@
 #include <signal.h>
 #include <locale.h>
 
+#include "tree.h"
+
 #include "init.h"
 #include "direct.h"
 
@@ -413,6 +415,13 @@ static void print_version (void)
 OS: %s %s on %s.\n"), buf.sysname, buf.release, buf.machine);
 }
 
+static int _mc_tree = 0;
+
+static void _tree_account (long int s)
+{
+  MEM_COUNT (_mc_tree, "tree nodes", s);
+}
+
 int main (int argc, char *argv[])
 {
   int have_con = 0;
@@ -424,6 +433,7 @@ int main (int argc, char *argv[])
   char buff[STRING];
   pthread_t sit;
 
+  Tree_Account = &_tree_account;	/* before any tree is created */
   if ((c = setlocale (LC_ALL, ""))) /* set locale according to environment now */
     strfcpy (locale, c, sizeof(locale));
   if ((c = strchr (locale, '.')))
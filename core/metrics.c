@@ -0,0 +1,523 @@
+/*
+ * Copyright (C) 2026  Andrej N. Gritsenko <andrej@rep.kiev.ua>
+ *
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License along
+ *     with this program; if not, write to the Free Software Foundation, Inc.,
+ *     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * This file is part of FoxEye's source: runtime metrics registry.
+ */
+
+#include "foxeye.h"
+#include "init.h"
+
+#include <ctype.h>
+#include <errno.h>
+
+/*
+ * Each metric owns one or more slots. Each thread has own set of slots,
+ * allocated by chunks when thread touches the metric first time, so any
+ * update is just an addition to thread's slot without any lock. Readers
+ * sum slots of all threads under lock. When thread exits its slots are
+ * added to retired ones. Records of metrics are never freed so name and
+ * labels may be used by reader after registry is unlocked.
+ */
+#define METRIC_CHUNK 256	/* slots in a chunk */
+
+/*
+ * Latency is kept in HDR-like log-linear buckets: values below LAT_SUB
+ * have own buckets and each power of 2 above is split into LAT_SUB ones,
+ * so error is below 25% in range from 1 microsecond up to 4 minutes.
+ * Latency metric has LAT_BUCKETS slots and then sum of values.
+ */
+#define LAT_SUB 4		/* buckets per power of 2 */
+#define LAT_BUCKETS (LAT_SUB * 27)
+
+typedef struct metric_thread
+{
+  struct metric_thread *prev, *next;
+  long long *chunk[METRIC_SLOTS / METRIC_CHUNK];
+} metric_thread;
+
+typedef struct
+{
+  char *name, *labels, *help;
+  metric_t type;
+  unsigned int slot;		/* first slot */
+  unsigned int nb;		/* number of bounds for histogram */
+  long long *bounds;		/* histogram slots: nb+1 buckets, then sum */
+  long long (*func) (void);	/* gauge callback */
+} metric_rec;
+
+static pthread_mutex_t MetricsLock = PTHREAD_MUTEX_INITIALIZER;
+static metric_rec Metrics[METRICS_MAX];
+static unsigned int MetricsNum = 1;	/* 0 is never used */
+static unsigned int MetricSlots = 0;
+static long long MetricRetired[METRIC_SLOTS];
+static metric_thread *MetricThreads = NULL;
+static pthread_key_t MetricKey;
+static pthread_once_t MetricOnce = PTHREAD_ONCE_INIT;
+
+static void _metric_thread_done (void *data)
+{
+  metric_thread *mt = data;
+  register unsigned int i, j;
+
+  pthread_mutex_lock (&MetricsLock);
+  for (i = 0; i < METRIC_SLOTS / METRIC_CHUNK; i++)
+    if (mt->chunk[i])
+      for (j = 0; j < METRIC_CHUNK; j++)
+	MetricRetired[i * METRIC_CHUNK + j] += mt->chunk[i][j];
+  if (mt->prev)
+    mt->prev->next = mt->next;
+  else
+    MetricThreads = mt->next;
+  if (mt->next)
+    mt->next->prev = mt->prev;
+  pthread_mutex_unlock (&MetricsLock);
+  for (i = 0; i < METRIC_SLOTS / METRIC_CHUNK; i++)
+    FREE (&mt->chunk[i]);
+  safe_pfree (mt);
+}
+
+static void _metric_init_key (void)
+{
+  pthread_key_create (&MetricKey, &_metric_thread_done);
+}
+
+/* returns pointer to slot of current thread */
+static long long *_metric_slot (unsigned int slot)
+{
+  metric_thread *mt;
+  long long *chunk;
+
+  pthread_once (&MetricOnce, &_metric_init_key);
+  if ((mt = pthread_getspecific (MetricKey)) == NULL)
+  {
+    mt = safe_calloc (1, sizeof(metric_thread));
+    pthread_setspecific (MetricKey, mt);
+    pthread_mutex_lock (&MetricsLock);
+    if ((mt->next = MetricThreads) != NULL)
+      mt->next->prev = mt;
+    MetricThreads = mt;
+    pthread_mutex_unlock (&MetricsLock);
+  }
+  if ((chunk = mt->chunk[slot / METRIC_CHUNK]) == NULL)
+  {
+    chunk = safe_calloc (METRIC_CHUNK, sizeof(long long));
+    pthread_mutex_lock (&MetricsLock);	/* publish it for readers */
+    mt->chunk[slot / METRIC_CHUNK] = chunk;
+    pthread_mutex_unlock (&MetricsLock);
+  }
+  return &chunk[slot % METRIC_CHUNK];
+}
+
+/* sums slot of all threads, called with MetricsLock locked */
+static long long _metric_shards (unsigned int slot)
+{
+  metric_thread *mt;
+  long long v = 0;
+
+  for (mt = MetricThreads; mt; mt = mt->next)
+    if (mt->chunk[slot / METRIC_CHUNK])
+      v += mt->chunk[slot / METRIC_CHUNK][slot % METRIC_CHUNK];
+  return v;
+}
+
+/* name should be [a-zA-Z_:][a-zA-Z0-9_:]* as Prometheus requires */
+static int _metric_valid_name (const char *name)
+{
+  if (!name || !(isalpha ((uchar)*name) || *name == '_' || *name == ':'))
+    return 0;
+  while (*++name)
+    if (!(isalnum ((uchar)*name) || *name == '_' || *name == ':'))
+      return 0;
+  return 1;
+}
+
+int Metric_Register (const char *name, const char *labels, const char *help,
+		     metric_t type, const long long *bounds, int nb)
+{
+  register unsigned int i;
+  unsigned int ns;
+  const char *err = NULL;
+
+  if (!_metric_valid_name (name))
+  {
+    ERROR ("metrics: invalid metric name \"%s\".", NONULL(name));
+    return -1;
+  }
+  if (labels == NULL)
+    labels = "";
+  if (type != METRIC_HISTOGRAM || nb < 0)
+    nb = 0;
+  if (type == METRIC_HISTOGRAM)
+    ns = nb + 2;
+  else if (type == METRIC_LATENCY)
+    ns = LAT_BUCKETS + 1;
+  else
+    ns = 1;
+  pthread_mutex_lock (&MetricsLock);
+  for (i = 1; i < MetricsNum; i++)
+    if (!strcmp (Metrics[i].name, name) &&
+	!strcmp (NONULL(Metrics[i].labels), labels))
+      break;
+  if (i < MetricsNum)			/* already registered */
+  {
+    if (Metrics[i].type != type || Metrics[i].nb != (unsigned int)nb)
+      err = "registered with another type";
+  }
+  else if (i == METRICS_MAX || MetricSlots + ns > METRIC_SLOTS)
+    err = "no space to register";
+  else
+  {
+    Metrics[i].name = safe_strdup (name);
+    Metrics[i].labels = safe_strdup (labels); /* NULL if empty */
+    Metrics[i].help = safe_strdup (help);
+    Metrics[i].type = type;
+    Metrics[i].slot = MetricSlots;
+    Metrics[i].nb = nb;
+    if (nb)
+    {
+      Metrics[i].bounds = safe_malloc (nb * sizeof(long long));
+      memcpy (Metrics[i].bounds, bounds, nb * sizeof(long long));
+    }
+    Metrics[i].func = NULL;
+    MetricSlots += ns;
+    MetricsNum++;
+  }
+  pthread_mutex_unlock (&MetricsLock);
+  /* logging may count something so do it with registry unlocked */
+  if (err)
+  {
+    ERROR ("metrics: metric %s{%s}: %s.", name, labels, err);
+    return -1;
+  }
+  return (int)i;
+}
+
+void Metric_Add (int id, long long v)
+{
+  if (id <= 0 || id >= METRICS_MAX)
+    return;
+  *_metric_slot (Metrics[id].slot) += v;
+}
+
+void Metric_Set (int id, long long v)
+{
+  if (id <= 0 || id >= METRICS_MAX || Metrics[id].type != METRIC_GAUGE)
+    return;
+  pthread_mutex_lock (&MetricsLock);
+  MetricRetired[Metrics[id].slot] = v - _metric_shards (Metrics[id].slot);
+  pthread_mutex_unlock (&MetricsLock);
+}
+
+void Metric_Gauge (int id, long long (*func) (void))
+{
+  if (id <= 0 || id >= METRICS_MAX || Metrics[id].type != METRIC_GAUGE)
+    return;
+  pthread_mutex_lock (&MetricsLock);
+  Metrics[id].func = func;
+  pthread_mutex_unlock (&MetricsLock);
+}
+
+static unsigned int _lat_bucket (long long v)
+{
+  register unsigned int e = 0;
+
+  if (v < LAT_SUB)
+    return (v < 0) ? 0 : (unsigned int)v;
+  while ((v >> e) >= 2 * LAT_SUB)
+    e++;
+  /* now (v >> e) is in range [LAT_SUB,2*LAT_SUB) */
+  e = LAT_SUB * (e + 1) + (unsigned int)(v >> e) - LAT_SUB;
+  return (e < LAT_BUCKETS) ? e : LAT_BUCKETS - 1;
+}
+
+/* returns highest value which falls into the bucket */
+static long long _lat_value (unsigned int i)
+{
+  if (i < LAT_SUB)
+    return i;
+  return ((long long)(i % LAT_SUB + LAT_SUB + 1) << (i / LAT_SUB - 1)) - 1;
+}
+
+void Metric_Observe (int id, long long v)
+{
+  register unsigned int i;
+  long long *b;
+
+  if (id <= 0 || id >= METRICS_MAX)
+    return;
+  if (Metrics[id].type == METRIC_LATENCY)
+  {
+    (*_metric_slot (Metrics[id].slot + _lat_bucket (v)))++;
+    *_metric_slot (Metrics[id].slot + LAT_BUCKETS) += v;
+    return;
+  }
+  if (Metrics[id].type != METRIC_HISTOGRAM)
+    return;
+  b = Metrics[id].bounds;
+  for (i = 0; i < Metrics[id].nb; i++)	/* few bounds, so linear search */
+    if (v <= b[i])
+      break;
+  (*_metric_slot (Metrics[id].slot + i))++;
+  *_metric_slot (Metrics[id].slot + Metrics[id].nb + 1) += v;
+}
+
+long long Metric_Clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* percentile q (in 1/1000) of latency metric from bucket values */
+static long long _lat_percentile (long long *b, long long count, int q)
+{
+  register unsigned int i;
+  long long rank, c = 0;
+
+  if (count == 0)
+    return 0;
+  rank = (count * q + 999) / 1000;
+  for (i = 0; i < LAT_BUCKETS - 1; i++)
+    if ((c += b[i]) >= rank)
+      break;
+  return _lat_value (i);
+}
+
+static long long _lat_count (long long *b)
+{
+  register unsigned int i;
+  long long c = 0;
+
+  for (i = 0; i < LAT_BUCKETS; i++)
+    c += b[i];
+  return c;
+}
+
+/*
+ * Slow operations are not reported at once since caller may hold some lock
+ * which logging needs, so they are kept here until sheduler reports them.
+ */
+#define SLOW_MAX 32
+
+static pthread_mutex_t SlowLock = PTHREAD_MUTEX_INITIALIZER;
+static char SlowOps[SLOW_MAX][STRING];
+static unsigned int SlowNum = 0, SlowLost = 0;
+
+void Metric_Slow (long long usec, const char *what, const char *name)
+{
+  if (slow_threshold <= 0 || usec < slow_threshold * 1000)
+    return;
+  pthread_mutex_lock (&SlowLock);
+  if (SlowNum < SLOW_MAX)
+    snprintf (SlowOps[SlowNum++], sizeof(SlowOps[0]), "%s %s: %lld.%03lld ms",
+	      what, NONULL(name), usec / 1000, usec % 1000);
+  else
+    SlowLost++;
+  pthread_mutex_unlock (&SlowLock);
+}
+
+/* prints "name{labels}" or "name{labels,extra}" */
+static void _metric_print_name (FILE *fp, metric_rec *m, const char *suffix,
+				const char *extra)
+{
+  if (m->labels && extra)
+    fprintf (fp, "%s%s{%s,%s}", m->name, suffix, m->labels, extra);
+  else if (m->labels || extra)
+    fprintf (fp, "%s%s{%s}", m->name, suffix, m->labels ? m->labels : extra);
+  else
+    fprintf (fp, "%s%s", m->name, suffix);
+}
+
+static void _metric_print (FILE *fp, metric_rec *m, long long *vals)
+{
+  register unsigned int i;
+  long long v;
+  char le[32];
+
+  if (m->type != METRIC_HISTOGRAM)
+  {
+    _metric_print_name (fp, m, "", NULL);
+    fprintf (fp, " %lld\n", vals[m->slot]);
+    return;
+  }
+  for (i = 0, v = 0; i <= m->nb; i++)
+  {
+    v += vals[m->slot + i];		/* buckets are cumulative */
+    if (i < m->nb)
+      snprintf (le, sizeof(le), "le=\"%lld\"", m->bounds[i]);
+    else
+      strfcpy (le, "le=\"+Inf\"", sizeof(le));
+    _metric_print_name (fp, m, "_bucket", le);
+    fprintf (fp, " %lld\n", v);
+  }
+  _metric_print_name (fp, m, "_sum", NULL);
+  fprintf (fp, " %lld\n", vals[m->slot + m->nb + 1]);
+  _metric_print_name (fp, m, "_count", NULL);
+  fprintf (fp, " %lld\n", v);
+}
+
+static void _lat_print (FILE *fp, metric_rec *m, long long *vals)
+{
+  static const struct { int q; const char *label; } qs[] = {
+    { 500, "quantile=\"0.5\"" }, { 900, "quantile=\"0.9\"" },
+    { 990, "quantile=\"0.99\"" }, { 999, "quantile=\"0.999\"" } };
+  register unsigned int i;
+  long long *b = &vals[m->slot];
+  long long c = _lat_count (b);
+
+  for (i = 0; i < sizeof(qs) / sizeof(*qs); i++)
+  {
+    _metric_print_name (fp, m, "", qs[i].label);
+    fprintf (fp, " %lld\n", _lat_percentile (b, c, qs[i].q));
+  }
+  _metric_print_name (fp, m, "_sum", NULL);
+  fprintf (fp, " %lld\n", b[LAT_BUCKETS]);
+  _metric_print_name (fp, m, "_count", NULL);
+  fprintf (fp, " %lld\n", c);
+}
+
+/* sums all values and calls gauge callbacks, returns allocated array */
+static long long *_metric_values (unsigned int *num)
+{
+  long long *vals;
+  long long (*funcs[METRICS_MAX]) (void);
+  register unsigned int i;
+  unsigned int n, ns;
+
+  pthread_mutex_lock (&MetricsLock);
+  n = MetricsNum;
+  ns = MetricSlots;
+  vals = safe_malloc ((ns + 1) * sizeof(long long));
+  for (i = 0; i < ns; i++)
+    vals[i] = MetricRetired[i] + _metric_shards (i);
+  for (i = 1; i < n; i++)
+    funcs[i] = Metrics[i].func;
+  pthread_mutex_unlock (&MetricsLock);
+  /* callbacks may want some locks so call them with registry unlocked */
+  for (i = 1; i < n; i++)
+    if (funcs[i])
+      vals[Metrics[i].slot] = funcs[i]();
+  *num = n;
+  return vals;
+}
+
+/* writes all metrics in Prometheus text format, returns number of metrics */
+int Metrics_Write (FILE *fp)
+{
+  static const char *types[] = { "counter", "gauge", "histogram", "summary" };
+  long long *vals;
+  register unsigned int i, j;
+  unsigned int n;
+
+  vals = _metric_values (&n);
+  /* metrics with the same name should be grouped under one HELP line */
+  for (i = 1; i < n; i++)
+  {
+    for (j = 1; j < i; j++)
+      if (!strcmp (Metrics[j].name, Metrics[i].name))
+	break;
+    if (j < i)				/* already printed */
+      continue;
+    if (Metrics[i].help)
+      fprintf (fp, "# HELP %s %s\n", Metrics[i].name, Metrics[i].help);
+    fprintf (fp, "# TYPE %s %s\n", Metrics[i].name, types[Metrics[i].type]);
+    for (j = i; j < n; j++)
+      if (j != i && strcmp (Metrics[j].name, Metrics[i].name))
+	continue;
+      else if (Metrics[j].type == METRIC_LATENCY)
+	_lat_print (fp, &Metrics[j], vals);
+      else
+	_metric_print (fp, &Metrics[j], vals);
+  }
+  FREE (&vals);
+  return (int)n - 1;
+}
+
+/* called by sheduler each second */
+void _fe_metrics_snapshot (void)
+{
+  static time_t last = 0;
+  char tmp[LONG_STRING];
+  FILE *fp;
+
+  if (!*metrics_file || metrics_interval <= 0 ||
+      Time - last < metrics_interval)
+    return;
+  last = Time;
+  snprintf (tmp, sizeof(tmp), "%s.tmp", metrics_file);
+  if ((fp = fopen (tmp, "w")) == NULL)
+  {
+    ERROR ("metrics: cannot create %s: %s", tmp, strerror (errno));
+    return;
+  }
+  Metrics_Write (fp);
+  /* rename it at once so reader never gets partial file */
+  if (fclose (fp) != 0 || rename (tmp, metrics_file) != 0)
+  {
+    ERROR ("metrics: cannot write %s: %s", metrics_file, strerror (errno));
+    unlink (tmp);
+  }
+}
+
+/* called by sheduler each second */
+void _fe_metrics_slow_report (void)
+{
+  char ops[SLOW_MAX][STRING];
+  unsigned int i, n, lost;
+
+  pthread_mutex_lock (&SlowLock);
+  n = SlowNum;
+  lost = SlowLost;
+  memcpy (ops, SlowOps, n * sizeof(ops[0]));
+  SlowNum = SlowLost = 0;
+  pthread_mutex_unlock (&SlowLock);
+  for (i = 0; i < n; i++)
+    Add_Request (I_LOG, "*", F_WARN, "slow %s", ops[i]);
+  if (lost)
+    Add_Request (I_LOG, "*", F_WARN, "slow: %u more slow operations missed",
+		 lost);
+}
+
+/* shows percentiles of latency metrics which name or labels match mask */
+void Status_Latency (INTERFACE *iface, const char *mask)
+{
+  long long *vals, *b, c;
+  unsigned int i, n, x = 0;
+
+  vals = _metric_values (&n);
+  for (i = 1; i < n; i++)
+  {
+    if (Metrics[i].type != METRIC_LATENCY)
+      continue;
+    if (mask && match (mask, Metrics[i].name) < 0 &&
+	(!Metrics[i].labels || match (mask, Metrics[i].labels) < 0))
+      continue;
+    b = &vals[Metrics[i].slot];
+    if ((c = _lat_count (b)) == 0)
+      continue;
+    New_Request (iface, 0, "%s{%s}: %lld, avg %lld, 50%% %lld, 90%% %lld, 99%% %lld, 99.9%% %lld us",
+		 Metrics[i].name, NONULL(Metrics[i].labels), c,
+		 b[LAT_BUCKETS] / c, _lat_percentile (b, c, 500),
+		 _lat_percentile (b, c, 900), _lat_percentile (b, c, 990),
+		 _lat_percentile (b, c, 999));
+    x++;
+  }
+  FREE (&vals);
+  if (x == 0)
+    New_Request (iface, 0, "No latency data found.");
+}
@@ -167,14 +167,91 @@ void StrTrim (char *);
 /* helper function for modules and UIs */
 #define CheckVersion if (strncmp(VERSION,_VERSION,4)) return NULL
 
+/* memory accounting: bytes and allocations per class, where class is pair
+   of module name and kind of allocation site; counters are kept per thread
+   so accounting costs couple of additions only */
+#define MEM_CLASSES 128		/* max number of classes, 0 is "other" */
+#define MEM_HISTORY 24		/* hourly high-watermarks to keep */
+
+#ifndef MODULE_NAME
+# define MODULE_NAME "core"	/* modules have it defined by Makefile */
+#endif
+
+int Mem_Class (const char *, const char *);	/* module, kind */
+void Mem_Account (int, ssize_t);		/* class, +bytes or -bytes */
+
+/* usage: static int var = 0; ... MEM_COUNT (var, "kind", sizeof(x)); */
+#define MEM_COUNT(v,n,s) Mem_Account ((v) ? (v) : \
+				      ((v) = Mem_Class (MODULE_NAME, n)), s)
+
+/* runtime metrics: counters, gauges and histograms in Prometheus style where
+   name and labels (such as 'type="log"') identify the metric; each thread
+   updates own copy so update needs no lock, values are summed on output */
+#define METRICS_MAX 1024	/* max number of metrics */
+#define METRIC_SLOTS 32768	/* max values, histogram takes bounds+2 and
+				   latency takes 109 */
+
+/* latency is histogram of microseconds reported as percentiles */
+typedef enum { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM,
+	       METRIC_LATENCY } metric_t;
+
+/* name, labels, help, type, bounds, number of bounds; returns id or -1 */
+int Metric_Register (const char *, const char *, const char *, metric_t,
+		     const long long *, int);
+void Metric_Add (int, long long);		/* counter or gauge */
+void Metric_Set (int, long long);		/* gauge only */
+void Metric_Gauge (int, long long (*) (void));	/* gauge callback or NULL */
+void Metric_Observe (int, long long);		/* histogram or latency */
+long long Metric_Clock (void);			/* monotonic, microseconds */
+void Metric_Slow (long long, const char *, const char *); /* usec, what, name */
+
+/* usage: static int var = 0; ... METRIC_COUNT (var, "name", NULL, "help", 1); */
+#define METRIC_COUNT(v,n,l,h,x) Metric_Add ((v) ? (v) : \
+			((v) = Metric_Register (n, l, h, METRIC_COUNTER, NULL, 0)), x)
+/* the same for latency, x is duration in microseconds */
+#define METRIC_TIME(v,n,l,h,x) Metric_Observe ((v) ? (v) : \
+			((v) = Metric_Register (n, l, h, METRIC_LATENCY, NULL, 0)), x)
+
+/* object pools: blocks of objects of the same size, each thread keeps small
+   magazine of free objects so alloc/free don't need any lock usually, fully
+   freed blocks are returned to system when pool has enough free objects */
+#define POOL_MAX 128		/* max number of pools having magazines */
+#define POOL_MAGAZINE 16	/* max objects in per-thread magazine */
+
+typedef struct pool_t
+{
+  const char *name;
+  const char *module;		/* for accounting */
+  int mclass;			/* accounting class, 0 if not known yet */
+  size_t size;			/* object size, rounded */
+  unsigned int per_block;	/* objects in single block */
+  unsigned int id;		/* index in magazines, 0 if none yet */
+  pthread_mutex_t lock;		/* for everything below */
+  struct pool_block *blocks, *partial; /* all and having free objects */
+  unsigned int nfree;		/* free objects in blocks */
+  unsigned int nblocks, maxblocks;
+  unsigned long int trimmed;	/* blocks returned to system */
+  size_t asize;			/* allocated bytes */
+} pool_t;
+
+#define POOL_INITIALIZER(n,s,b) { n, MODULE_NAME, 0, s, b, 0, \
+				  PTHREAD_MUTEX_INITIALIZER, \
+				  NULL, NULL, 0, 0, 0, 0, 0 }
+
+void *Pool_Alloc (pool_t *) __attribute__((warn_unused_result));
+void Pool_Free (pool_t *, void *);
+void Pool_Forget (pool_t *);
+
 /* macro prototype for different structures allocation functions
    it takes three arguments:
    - first is typedef of structure
-   - second is template XXX for integers XXXalloc, XXXnum, and XXXmax that
-     will contain number of allocated, used and max used respectively
-   - third is member of structure that may be used as link in chain
-   macro creates integers mentioned above and three functions (NNN here is first
-   argument of macro):
+   - second is template XXX for integers XXXnum and XXXmax that will contain
+     number of used and max used respectively, they are protected by the
+     same lock which caller uses for the structures
+   - third is member of structure that was used as link in chain, it's not
+     used anymore since pool keeps free objects itself
+   macro creates pool (see above) with blocks of ALLOCSIZE objects, integers
+   mentioned above, and three functions (NNN here is first argument of macro):
      NNN *alloc_NNN(void);
    and
      void free_NNN(NNN *);
@@ -182,61 +259,34 @@ void StrTrim (char *);
      void forget_NNN(void);
    to prevent memory leak always use the call shown below on module termination
    for each defined ALLOCATABLE_TYPE(NNN,...):
-     _forget_(NNN); */
+     _forget_(NNN);
+   pool of NNN (to get statistics from it) may be accessed as _pool_(NNN) */
 
 #define ALLOCSIZE 32
 
 #define ALLOCATABLE_TYPE(type,tvar,next) \
-static size_t tvar##asize = 0; \
 static unsigned int tvar##num = 0, tvar##max = 0; \
-struct ____##type { \
-  struct ____##type *prv; \
-  type a[ALLOCSIZE]; \
-}; \
-static struct ____##type *____L##type = NULL; \
-static type *Free##tvar = NULL; \
+static pool_t ____P##type = POOL_INITIALIZER (#type, sizeof(type), ALLOCSIZE); \
 	__attribute__((warn_unused_result)) \
-static type *alloc_##type (void) \
+static inline type *alloc_##type (void) \
 { \
-  type *cur; \
-  if (!Free##tvar) \
-  { \
-    register int i = ALLOCSIZE; \
-    struct ____##type *_l = safe_malloc (sizeof(struct ____##type)); \
-    _l->prv = ____L##type; \
-    ____L##type = _l; \
-    Free##tvar = cur = _l->a; \
-    tvar##asize += sizeof(struct ____##type); \
-    while ((--i)) \
-    { \
-      cur->next = (void *)&cur[1]; \
-      cur++; \
-    } \
-    cur->next = NULL; \
-  } \
-  cur = Free##tvar; \
-  Free##tvar = (type *)cur->next; \
   tvar##num++; \
   if (tvar##num >= tvar##max) \
     tvar##max = tvar##num + 1; \
-  return cur; \
+  return Pool_Alloc (&____P##type); \
 } \
 static inline void free_##type (type *cur) \
 { \
-  cur->next = (void *)Free##tvar; \
-  Free##tvar = cur; \
+  Pool_Free (&____P##type, cur); \
   tvar##num--; \
 } \
 static inline void forget_##type (void) \
 { \
-  struct ____##type *_l; \
-  while ((_l = ____L##type)) \
-  { \
-    ____L##type = _l->prv; \
-    FREE (&_l); \
-  } \
+  Pool_Forget (&____P##type); \
 }
 
+#define _pool_(a) (&____P##a)
+
 #ifdef STATIC
 # define _forget_(a)
 #else
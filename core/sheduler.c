@@ -458,6 +458,9 @@ static void *_scheduler_thread (void *data)
     if (j)
       dprint (3, "Sheduler: removed %u flood timer(s), remained %u/%u",
 	      j, _SFnum, MAXTABLESIZE);
+    /* report slow operations and write metrics snapshot if it's time */
+    _fe_metrics_slow_report ();
+    _fe_metrics_snapshot ();
 //    pthread_mutex_lock (&LockShed);
     /* update time variables */
     localtime_r (&Time, &tm);
@@ -478,6 +481,8 @@ static void *_scheduler_thread (void *data)
       DateString[-1] = '\0';		/* split TimeString and DateString */
       /* flush all files */
       Send_Signal (I_FILE, "*", S_TIMEOUT);
+      /* update memory high-watermarks */
+      _fe_memory_sample (tm.tm_hour != tm0.tm_hour);
       /* run Crontable; will not check for missed minutes due to BT_TimeShift */
       memset (&sh, 0, sizeof(sh));
       if (tm.tm_min > 31)
@@ -31,7 +31,10 @@
 #include <errno.h>
 #include <stdlib.h>
 
+#include <tree.h>
+
 #include "socket.h"
+#include "init.h"
 
 #ifndef HAVE_SIGACTION
 # define sigaction sigvec
@@ -52,6 +55,10 @@
 # include <sys/ioctl.h>
 #endif
 
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+
 #ifdef HAVE_ALLOCA_H
 # include <alloca.h>
 #endif
@@ -78,6 +85,7 @@
  * Sequence:		socket.domain:	pollfd.fd:
  * unallocated		NULL		-2
  * allocated		NULL		>= 0
+ * accepted		NULL		>= 0	(until resolver sets it)
  * domain resolved	domain		>= 0
  * shutdown		domain		-1
  * unallocated		NULL		-2
@@ -89,7 +97,9 @@ typedef struct
   void (*callback)(void *);
   void *callback_data;
   volatile sig_atomic_t ready;
+  volatile sig_atomic_t blocked;	/* write got EAGAIN, callback on POLLOUT */
   unsigned short port;
+  unsigned int gen;		/* to recognize reused one */
 } socket_t;
 
 typedef union {
@@ -143,6 +153,8 @@ static idx_t allocate_socket ()
   Socket[idx].domain = NULL;
   Socket[idx].ipname = NULL;
   Socket[idx].ready = FALSE;
+  Socket[idx].blocked = FALSE;
+  Socket[idx].gen++;
   if (idx == _Snum)
     _Snum++;
   DBG ("allocate_socket: got socket %hd", idx);
@@ -218,6 +230,19 @@ static void _socket_acquire_lock(void)
   pthread_cleanup_pop(0);	/* leaves mutex locked */
 }
 
+static int _mt_bytes_in = 0, _mt_bytes_out = 0;	/* metric ids */
+
+/* socket buffer is full: let poll thread run callback when it's writable */
+static ssize_t _socket_blocked(idx_t idx)
+{
+  pthread_mutex_lock(&LockPoll);
+  Socket[idx].blocked = TRUE;
+  Pollfd[idx].events |= POLLOUT;
+  pthread_cond_broadcast(&PollIntr); /* it may poll without POLLOUT now */
+  pthread_mutex_unlock(&LockPoll);
+  return 0;
+}
+
 /*
  * returns E_NOSOCKET on error and E_AGAIN on wait to connection
  */
@@ -244,7 +269,11 @@ ssize_t ReadSocket (char *buf, idx_t idx, size_t sr)
   /*if (rev & (POLLIN | POLLPRI))*/ {	/* even dead socket can contain data */
     DBG ("trying read socket %hd", idx);
     if ((sg = read (Pollfd[idx].fd, buf, sr)) > 0)
+    {
       DBG ("got from socket %hd:[%-*.*s]", idx, (int)sg, (int)sg, buf);
+      METRIC_COUNT (_mt_bytes_in, "foxeye_socket_bytes_total",
+		    "direction=\"in\"", "Bytes transferred via sockets", sg);
+    }
     if (sg == 0) {
       sg = E_EOF;
     } else if (sg < 0) {
@@ -288,12 +317,70 @@ ssize_t WriteSocket (idx_t idx, const char *buf, size_t *ptr, size_t *sw)
   sg = write (Pollfd[idx].fd, &buf[*ptr], *sw);
   errnosave = errno;			/* save it as unlock can change it */
   if (sg < 0)
-    return (errnosave == EAGAIN) ? 0 : (E_ERRNO - errnosave);
+    return (errnosave == EAGAIN) ? _socket_blocked(idx) : (E_ERRNO - errnosave);
   else if (sg == 0)			/* remote end closed connection */
     return E_EOF;
   *ptr += sg;
   *sw -= sg;
   Socket[idx].ready = TRUE;		/* connected as we sent something */
+  METRIC_COUNT (_mt_bytes_out, "foxeye_socket_bytes_total",
+		"direction=\"out\"", "Bytes transferred via sockets", sg);
+  return (sg);
+}
+
+/*
+ * sends data from file fd at offset *ptr, kernel does copying if it can
+ * returns: < 0 if error or number of sent bytes
+ */
+ssize_t SendFileSocket (idx_t idx, int fd, off_t *ptr, size_t *sw)
+{
+  ssize_t sg;
+  int errnosave;
+#ifndef HAVE_SYS_SENDFILE_H
+  char buf[16384];
+  size_t sr;
+#endif
+
+  pthread_testcancel();			/* for non-POSIX systems */
+  if (idx < 0 || idx >= _Snum || Pollfd[idx].fd < 0)
+    return E_NOSOCKET;
+  if (fd < 0 || !sw || !ptr)
+    return 0;
+  if (*sw == 0)
+    return 0;
+  pthread_mutex_lock(&LockPoll);
+  Pollfd[idx].events |= POLLOUT;	/* get ready for next check */
+  Pollfd[idx].revents &= ~POLLOUT;	/* we'll write socket, reset state */
+  pthread_mutex_unlock(&LockPoll);
+  DBG ("trying send file %d to socket %hd: %lld +%zu", fd, idx,
+       (long long)*ptr, *sw);
+#ifdef HAVE_SYS_SENDFILE_H
+  sg = sendfile (Pollfd[idx].fd, fd, ptr, *sw); /* it updates *ptr */
+  errnosave = errno;
+  if (sg < 0)
+    return (errnosave == EAGAIN) ? _socket_blocked(idx) : (E_ERRNO - errnosave);
+#else
+  sr = *sw;
+  if (sr > sizeof(buf))
+    sr = sizeof(buf);
+  sg = pread (fd, buf, sr, *ptr);
+  if (sg < 0)
+    return (E_ERRNO - errno);
+  if (sg > 0) {
+    sg = write (Pollfd[idx].fd, buf, sg);
+    errnosave = errno;
+    if (sg < 0)
+      return (errnosave == EAGAIN) ? _socket_blocked(idx) :
+				       (E_ERRNO - errnosave);
+    *ptr += sg;
+  }
+#endif
+  if (sg == 0)				/* file is shorter than expected */
+    return E_EOF;
+  *sw -= sg;
+  Socket[idx].ready = TRUE;		/* connected as we sent something */
+  METRIC_COUNT (_mt_bytes_out, "foxeye_socket_bytes_total",
+		"direction=\"out\"", "Bytes transferred via sockets", sg);
   return (sg);
 }
 
@@ -421,6 +508,444 @@ static inline const char *_get_socket_ipname (inet_addr_t *addr, char *buf,
 #define _make_socket_ipname(__a,__b,__c) \
 	safe_strdup(_get_socket_ipname(__a,__b,__c))
 
+/* ---------------------------------------------------------------------------
+ * Resolver: lookups are done by a pool of up to dns-threads threads, results
+ *  are cached for dns-cache-ttl seconds (failures for dns-negative-ttl) and
+ *  any identical request made meanwhile just waits for the same lookup.
+ */
+typedef struct resolv_patch
+{
+  struct resolv_patch *next;
+  idx_t idx;
+  unsigned int gen;
+} resolv_patch;
+
+typedef struct resolv_t
+{
+  struct resolv_t *next;		/* in list of all entries */
+  struct resolv_t *qnext;		/* in queue of lookups */
+  char *key;				/* tree key */
+  const char *name;			/* domain (part of key) for forward */
+  resolv_patch *patches;		/* accepted sockets to set domain */
+  char *host;				/* result of reverse lookup */
+  time_t expire;
+  unsigned int waiters;
+  int reverse;
+  int done;
+  int error;				/* EAI_* code, 0 if success */
+  int syserr;				/* errno for EAI_SYSTEM */
+  int family, flags;			/* hints for forward lookup */
+  socklen_t len;
+  inet_addr_t addr;			/* result of forward or reverse query */
+} resolv_t;
+
+static pthread_mutex_t ResolvLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ResolvWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ResolvCond = PTHREAD_COND_INITIALIZER;
+
+static NODE *_R_tree = NULL;
+static resolv_t *_R_all = NULL;
+static resolv_t *_R_queue = NULL, *_R_qlast = NULL;
+static unsigned int _R_num = 0, _R_pending = 0, _R_threads = 0, _R_idle = 0;
+static unsigned long int _R_hits = 0, _R_misses = 0;
+static time_t _R_purged = 0;
+
+/* replaceable backend, see SetResolverBackend() */
+static int (*_resolv_gai) (const char *, const char *, const struct addrinfo *,
+			   struct addrinfo **) = &getaddrinfo;
+static void (*_resolv_fai) (struct addrinfo *) = &freeaddrinfo;
+static int (*_resolv_gni) (const struct sockaddr *, socklen_t, char *,
+			   socklen_t, char *, socklen_t, int) = &getnameinfo;
+
+static void _resolv_do_forward (resolv_t *r)
+{
+  struct addrinfo hints, *ai;
+  int i;
+#ifdef HAVE_LIBIDN
+  char *idndomain;
+#endif
+
+  memset (&hints, 0, sizeof(hints));
+  hints.ai_family = r->family;
+  hints.ai_flags = r->flags;
+#ifdef HAVE_LIBIDN
+  i = idna_to_ascii_lz(r->name, &idndomain, IDNA_USE_STD3_ASCII_RULES);
+  if (i == IDNA_SUCCESS) {
+    i = _resolv_gai(idndomain, NULL, &hints, &ai);
+    free(idndomain);
+  } else //TODO: debug diagnostics?
+#endif
+  i = _resolv_gai (r->name, NULL, &hints, &ai);
+  if (i == 0)
+  {
+    r->len = ai->ai_addrlen;
+    memcpy (&r->addr.sa, ai->ai_addr, r->len);
+    _resolv_fai (ai);
+  }
+  else if (i == EAI_SYSTEM)
+    r->syserr = errno;
+  r->error = i;
+}
+
+static void _resolv_do_reverse (resolv_t *r)
+{
+  char hname[NI_MAXHOST+1];
+  int i;
+
+  i = _resolv_gni (&r->addr.sa, r->len, hname, sizeof(hname), NULL, 0, 0);
+#ifdef STRICT_BACKRESOLV
+  if (i == 0) {
+    /* make direct resolving of hname and compare it with addr */
+    struct addrinfo *ai, *aii;
+    struct addrinfo hints;
+
+    memset (&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+#ifdef ENABLE_IPV6
+    hints.ai_family = r->addr.sa.sa_family;
+    if (hints.ai_family == AF_INET6)
+      hints.ai_flags = AI_V4MAPPED;
+#endif
+    i = _resolv_gai (hname, NULL, &hints, &ai);
+    if (i == 0) {
+      for (aii = ai; aii != NULL; aii = aii->ai_next) {
+	inet_addr_t *ha = (inet_addr_t *)aii->ai_addr;
+
+#ifdef ENABLE_IPV6
+	if (ha->sa.sa_family == AF_INET6) {
+	  if (memcmp(&ha->s_in6.sin6_addr, &r->addr.s_in6.sin6_addr,
+		     sizeof(r->addr.s_in6.sin6_addr)) == 0)
+	    break;
+	} else if (ha->sa.sa_family == AF_INET)
+#endif
+	  if (memcmp(&ha->s_in.sin_addr.s_addr, &r->addr.s_in.sin_addr.s_addr,
+		     sizeof(r->addr.s_in.sin_addr.s_addr)) == 0)
+	    break;
+      }
+      _resolv_fai (ai);
+      if (aii == NULL) {
+	DBG("socket:resolver: none of domain %s resolves match %s", hname,
+	    &r->key[1]);
+	i = EAI_NONAME;
+      }
+    } else
+      DBG("socket:resolver: domain %s does not resolve, using %s", hname,
+	  &r->key[1]);
+  }
+#endif
+  if (i == 0) {			/* subst canonical name */
+#ifdef HAVE_LIBIDN
+    char *dechost;
+
+    if (idna_to_unicode_lzlz(hname, &dechost, 0) == IDNA_SUCCESS) {
+      r->host = safe_strdup(dechost);
+      free(dechost);
+    } else //TODO: debug errors
+#endif
+    r->host = safe_strdup (hname);
+  }
+  r->error = i;
+}
+
+/* sets domain for accepted sockets which are still alive */
+static void _resolv_patch_sockets (resolv_patch *p, const char *host)
+{
+  resolv_patch *next;
+
+  for (; p; p = next)
+  {
+    next = p->next;
+    pthread_mutex_lock (&LockPoll);
+    if (host && p->idx < _Snum && Pollfd[p->idx].fd >= 0 &&
+	Socket[p->idx].gen == p->gen && Socket[p->idx].domain == NULL)
+    {
+      Socket[p->idx].domain = safe_strdup (host);
+      DBG ("socket:resolver: socket %hd got domain %s", p->idx, host);
+    }
+    pthread_mutex_unlock (&LockPoll);
+    FREE (&p);
+  }
+}
+
+/* does lookup for r, called and returns with ResolvLock locked */
+static void _resolv_run (resolv_t *r)
+{
+  resolv_patch *p;
+
+  r->waiters++;				/* keep it while unlocked */
+  pthread_mutex_unlock (&ResolvLock);
+  if (r->reverse)
+    _resolv_do_reverse (r);
+  else
+    _resolv_do_forward (r);
+  pthread_mutex_lock (&ResolvLock);
+  r->done = 1;
+  _R_pending--;
+  r->expire = Time + (r->error ? dns_negative_ttl : dns_cache_ttl);
+  pthread_cond_broadcast (&ResolvCond);
+  if ((p = r->patches))
+  {
+    r->patches = NULL;
+    pthread_mutex_unlock (&ResolvLock);
+    _resolv_patch_sockets (p, r->error ? NULL : r->host);
+    pthread_mutex_lock (&ResolvLock);
+  }
+  r->waiters--;
+}
+
+static void *_resolv_thread (void __attribute__((unused)) *data)
+{
+  resolv_t *r;
+
+  pthread_mutex_lock (&ResolvLock);
+  FOREVER
+  {
+    while ((r = _R_queue) == NULL)
+    {
+      _R_idle++;
+      pthread_cond_wait (&ResolvWork, &ResolvLock);
+      _R_idle--;
+    }
+    if ((_R_queue = r->qnext) == NULL)
+      _R_qlast = NULL;
+    _resolv_run (r);
+  }
+  /* never reached */
+  return NULL;
+}
+
+/* forget all expired entries which nobody uses, called with lock */
+static void _resolv_purge (void)
+{
+  resolv_t *r, **pr;
+
+  _R_purged = Time;
+  for (pr = &_R_all; (r = *pr); )
+    if (r->done && r->expire <= Time && r->waiters == 0 && r->patches == NULL)
+    {
+      *pr = r->next;
+      if (Delete_Key (_R_tree, r->key, r))
+	ERROR ("socket:resolver: tree error on %s", r->key);
+      FREE (&r->key);
+      FREE (&r->host);
+      FREE (&r);
+      _R_num--;
+    }
+    else
+      pr = &r->next;
+}
+
+/* returns entry for key, starting lookup if needed, called with lock */
+static resolv_t *_resolv_get (const char *key, size_t nameoff, int reverse,
+			      int family, int flags, inet_addr_t *addr,
+			      socklen_t len)
+{
+  resolv_t *r;
+  pthread_t th;
+
+  if ((r = Find_Key (_R_tree, key)))
+  {
+    if (!r->done || r->expire > Time)
+    {
+      _R_hits++;			/* cached or already in progress */
+      return r;
+    }
+    FREE (&r->host);			/* expired so refresh it */
+  }
+  else
+  {
+    if (_R_purged != Time)
+      _resolv_purge();
+    r = safe_calloc (1, sizeof(resolv_t));
+    r->key = safe_strdup (key);
+    r->reverse = reverse;
+    if (Insert_Key (&_R_tree, r->key, r, 1))
+      ERROR ("socket:resolver: tree error on %s", key);
+    r->next = _R_all;
+    _R_all = r;
+    _R_num++;
+  }
+  _R_misses++;
+  _R_pending++;
+  r->name = &r->key[nameoff];
+  r->family = family;
+  r->flags = flags;
+  if (addr)
+  {
+    r->len = len;
+    memcpy (&r->addr.sa, &addr->sa, len);
+  }
+  r->done = 0;
+  r->error = r->syserr = 0;
+  r->qnext = NULL;
+  if (_R_qlast)
+    _R_qlast->qnext = r;
+  else
+    _R_queue = r;
+  _R_qlast = r;
+  if (_R_idle)
+    pthread_cond_signal (&ResolvWork);
+  else if (_R_threads < (dns_threads > 0 ? (unsigned int)dns_threads : 1))
+  {
+    if (pthread_create (&th, NULL, &_resolv_thread, NULL) == 0)
+    {
+      pthread_detach (th);
+      _R_threads++;
+    }
+    else
+      ERROR ("socket:resolver: cannot create thread");
+  }
+  if (_R_threads == 0)			/* no threads so do it ourself */
+  {
+    if ((_R_queue = r->qnext) == NULL)
+      _R_qlast = NULL;
+    _resolv_run (r);
+  }
+  return r;
+}
+
+static void _resolv_wait_cleanup (void *data)
+{
+  ((resolv_t *)data)->waiters--;
+  pthread_mutex_unlock (&ResolvLock);
+}
+
+/* waits for lookup result, called with lock, returns unlocked */
+static void _resolv_wait (resolv_t *r)
+{
+  r->waiters++;
+  pthread_cleanup_push (&_resolv_wait_cleanup, r);
+  while (!r->done)
+    pthread_cond_wait (&ResolvCond, &ResolvLock);
+  pthread_cleanup_pop (0);		/* caller will call it */
+}
+
+/* returns 0 on success or socket error code */
+static int _resolv_forward (const char *name, int family, int flags,
+			    inet_addr_t *addr, socklen_t *len)
+{
+  resolv_t *r;
+  int i;
+  size_t sz;
+  char key[NI_MAXHOST+32];
+
+  if (strlen (name) > NI_MAXHOST)
+    return E_NOSUCHDOMAIN;
+  /* numeric address needs no lookup and shouldn't wait in the queue */
+  memset (addr, 0, sizeof(inet_addr_t));
+  if (family != AF_INET6 &&
+      inet_pton (AF_INET, name, &addr->s_in.sin_addr) == 1)
+  {
+    addr->s_in.sin_family = AF_INET;
+    *len = sizeof(addr->s_in);
+    return 0;
+  }
+#ifdef ENABLE_IPV6
+  if (family != AF_INET &&
+      inet_pton (AF_INET6, name, &addr->s_in6.sin6_addr) == 1)
+  {
+    addr->s_in6.sin6_family = AF_INET6;
+    *len = sizeof(addr->s_in6);
+    return 0;
+  }
+#endif
+  snprintf (key, sizeof(key), "%d:%d:", family, flags);
+  sz = strlen (key);
+  strfcpy (&key[sz], name, sizeof(key) - sz);
+  pthread_mutex_lock (&ResolvLock);
+  r = _resolv_get (key, sz, 0, family, flags, NULL, 0);
+  _resolv_wait (r);
+  if ((i = r->error) == 0)
+  {
+    *len = r->len;
+    memcpy (&addr->sa, &r->addr.sa, r->len);
+  }
+  else if (i == EAI_SYSTEM)
+    i = E_ERRNO - r->syserr;
+  else if (i == EAI_AGAIN)
+    i = E_RESOLVTIMEOUT;
+  else
+    i = E_NOSUCHDOMAIN;
+  _resolv_wait_cleanup (r);
+  return i;
+}
+
+/* fills buf with domain for addr, returns 0 on success */
+static int _resolv_reverse (inet_addr_t *addr, socklen_t len,
+			    const char *ipname, char *buf, size_t bs)
+{
+  resolv_t *r;
+  int i;
+  char key[NI_MAXHOST+2];
+
+  key[0] = '@';
+  strfcpy (&key[1], ipname, sizeof(key) - 1);
+  pthread_mutex_lock (&ResolvLock);
+  r = _resolv_get (key, 1, 1, 0, 0, addr, len);
+  _resolv_wait (r);
+  if ((i = r->error) == 0)
+    strfcpy (buf, r->host, bs);
+  _resolv_wait_cleanup (r);
+  return i;
+}
+
+/* sets domain for accepted socket now if known, or when lookup finishes */
+static void _resolv_reverse_async (inet_addr_t *addr, socklen_t len, idx_t idx)
+{
+  resolv_t *r;
+  resolv_patch *p;
+  char key[NI_MAXHOST+2];
+
+  key[0] = '@';
+  strfcpy (&key[1], Socket[idx].ipname, sizeof(key) - 1);
+  pthread_mutex_lock (&ResolvLock);
+  r = _resolv_get (key, 1, 1, 0, 0, addr, len);
+  if (r->done)
+  {
+    if (r->error == 0)			/* socket isn't published yet */
+      Socket[idx].domain = safe_strdup (r->host);
+  }
+  else
+  {
+    p = safe_malloc (sizeof(resolv_patch));
+    p->idx = idx;
+    p->gen = Socket[idx].gen;
+    p->next = r->patches;
+    r->patches = p;
+  }
+  pthread_mutex_unlock (&ResolvLock);
+}
+
+/* replaces resolver functions and drops the cache, NULL means default */
+void SetResolverBackend (int (*gai) (const char *, const char *,
+				     const struct addrinfo *,
+				     struct addrinfo **),
+			 void (*fai) (struct addrinfo *),
+			 int (*gni) (const struct sockaddr *, socklen_t, char *,
+				     socklen_t, char *, socklen_t, int))
+{
+  resolv_t *r;
+
+  pthread_mutex_lock (&ResolvLock);
+  _resolv_gai = gai ? gai : &getaddrinfo;
+  _resolv_fai = fai ? fai : &freeaddrinfo;
+  _resolv_gni = gni ? gni : &getnameinfo;
+  for (r = _R_all; r; r = r->next)	/* let all them expire */
+    if (r->done)
+      r->expire = 0;
+  _resolv_purge();
+  pthread_mutex_unlock (&ResolvLock);
+}
+
+/* simple report */
+void Status_Resolver (INTERFACE *iface)
+{
+  pthread_mutex_lock (&ResolvLock);
+  New_Request (iface, F_REPORT, "Resolver: %u names cached (%u in progress), %u threads, %lu hits, %lu misses.",
+	       _R_num, _R_pending, _R_threads, _R_hits, _R_misses);
+  pthread_mutex_unlock (&ResolvLock);
+}
+
 /* For a listening process - we have to get ECONNREFUSED to own port :) */
 int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
 		unsigned short port,
@@ -432,9 +957,6 @@ int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
   inet_addr_t addr;
   struct linger ling;
   char hname[NI_MAXHOST+1];
-#ifdef HAVE_LIBIDN
-  char *idndomain;
-#endif
 
   /* check for errors! */
   if (idx < 0 || idx >= _Snum || Pollfd[idx].fd < 0)
@@ -454,24 +976,15 @@ int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
     len = SUN_LEN (&addr.s_un);
     Socket[idx].port = 0;		/* should be 0 for Unix socket */
   } else if (bind_to) {
-    struct addrinfo *ai;
+    DBG("trying to resolve address %s to bind to it", bind_to);
 #ifndef ENABLE_IPV6
-    static struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = 0,
-				       .ai_protocol = 0, .ai_flags = 0 };
-
-    i = getaddrinfo (bind_to, NULL, &hints, &ai);
+    i = _resolv_forward (bind_to, AF_INET, 0, &addr, &len);
 #else
-    i = getaddrinfo (bind_to, NULL, NULL, &ai);
+    i = _resolv_forward (bind_to, AF_UNSPEC, AI_V4MAPPED | AI_ADDRCONFIG,
+			 &addr, &len);
 #endif
-    DBG("trying to resolve address %s to bind to it", bind_to);
     if (i == 0)
     {
-	inet_addr_t *ha = (inet_addr_t *)ai->ai_addr;
-
-	len = ai->ai_addrlen;
-	memcpy(&addr.sa, &ha->sa, len);
-	/* addr.sa.sa_family = ai->ai_family; */
-	freeaddrinfo (ai);
 #ifdef ENABLE_IPV6
 	if (addr.sa.sa_family != AF_INET) {
 	  int cancelstate;
@@ -492,12 +1005,8 @@ int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
 	}
 #endif
     }
-    else if (i == EAI_AGAIN)
-	return E_RESOLVTIMEOUT;
-    else if (i == EAI_SYSTEM)
-	return (E_ERRNO - errno);
     else
-	return E_NOSUCHDOMAIN;
+      return i;
     /* sockaddr_in is compatible with sockaddr_in6 up to port member */
     if (type == M_LIST || type == M_LINP)
       addr.s_in.sin_port = htons(port);
@@ -532,36 +1041,19 @@ int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
     if (listen (sockfd, 3) < 0)
       return (E_ERRNO - errno);
   } else {
-    struct addrinfo *ai;
-    static struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = 0,
-				       .ai_protocol = 0, .ai_flags = 0 };
+    int family = AF_INET, flags = 0;
 
 #ifdef ENABLE_IPV6
     if (bind_to == NULL)
-      hints.ai_family = AF_UNSPEC;
-    else
-      hints.ai_family = addr.sa.sa_family;
-    if (hints.ai_family == AF_INET6)
-      hints.ai_flags = AI_V4MAPPED;
+      family = AF_UNSPEC;
     else
-      hints.ai_flags = 0;
-#endif
-#ifdef HAVE_LIBIDN
-    i = idna_to_ascii_lz(domain, &idndomain, IDNA_USE_STD3_ASCII_RULES);
-    if (i == IDNA_SUCCESS) {
-      i = getaddrinfo(idndomain, NULL, &hints, &ai);
-      free(idndomain);
-    } else //TODO: debug diagnostics?
+      family = addr.sa.sa_family;
+    if (family == AF_INET6)
+      flags = AI_V4MAPPED;
 #endif
-    i = getaddrinfo (domain, NULL, &hints, &ai);
+    i = _resolv_forward (domain, family, flags, &addr, &len);
     if (i == 0)
     {
-	inet_addr_t *ha = (inet_addr_t *)ai->ai_addr;
-
-	len = ai->ai_addrlen;
-	memcpy(&addr.sa, &ha->sa, len);
-	/* addr.sa.sa_family = ai->ai_family; */
-	freeaddrinfo (ai);
 #ifdef ENABLE_IPV6
 	if (bind_to == NULL && addr.sa.sa_family != AF_INET) {
 	  int cancelstate;
@@ -582,15 +1074,21 @@ int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
 	}
 #endif
     }
-    else if (i == EAI_AGAIN)
-	return E_RESOLVTIMEOUT;
-    else if (i == EAI_SYSTEM)
-	return (E_ERRNO - errno);
     else
-	return E_NOSUCHDOMAIN;
+      return i;
     /* sockaddr_in is compatible with sockaddr_in6 up to port member */
     addr.s_in.sin_port = htons(port);
-    if ((i = connect (sockfd, &addr.sa, len)) < 0)
+    if (type == M_NBLK)		/* caller will wait for POLLOUT itself */
+    {
+#ifdef HAVE_SYS_FILIO_H
+      i = 1;
+      ioctl (sockfd, FIONBIO, &i);
+#else
+      fcntl (sockfd, F_SETFL, O_NONBLOCK);
+#endif
+    }
+    if ((i = connect (sockfd, &addr.sa, len)) < 0 &&
+	(type != M_NBLK || errno != EINPROGRESS))
       return (E_ERRNO - errno);
     Socket[idx].port = port;
     //pthread_mutex_lock (&LockPoll);
@@ -610,22 +1108,19 @@ int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
 #else
   fcntl (sockfd, F_SETFL, O_NONBLOCK | O_ASYNC);
 #endif
-  if (type != M_UNIX)
+  if (type == M_NBLK)		/* don't wait for reverse lookup either */
   {
     Socket[idx].ipname = _make_socket_ipname(&addr, hname, sizeof(hname));
-    i = getnameinfo (&addr.sa, len, hname, sizeof(hname), NULL, 0, 0);
-#ifdef HAVE_LIBIDN
-    idndomain = NULL;
-#endif
-    if (i == 0) {		/* no errors */
-#ifdef HAVE_LIBIDN
-      i = idna_to_unicode_lzlz(hname, &idndomain, 0);
-      if (i == IDNA_SUCCESS)
-	domain = idndomain;
-      else //TODO: debug errors
-#endif
-      domain = hname;
-    } else if (domain == NULL)	/* else make it not NULL */
+    if (domain == NULL)
+      domain = Socket[idx].ipname;
+  }
+  else if (type != M_UNIX)
+  {
+    Socket[idx].ipname = _make_socket_ipname(&addr, hname, sizeof(hname));
+    if (_resolv_reverse (&addr, len, Socket[idx].ipname, hname,
+			 sizeof(hname)) == 0)
+      domain = hname;		/* no errors */
+    else if (domain == NULL)	/* else make it not NULL */
       domain = Socket[idx].ipname;
   }
   if (callback != NULL)
@@ -633,10 +1128,6 @@ int SetupSocket(idx_t idx, const char *domain, const char *bind_to,
   else
     i = 0;
   Socket[idx].domain = safe_strdup (domain);
-#ifdef HAVE_LIBIDN
-  if (idndomain != NULL)
-    free(idndomain);
-#endif
   _socket_acquire_lock();
   Pollfd[idx].events = POLLIN | POLLPRI | POLLOUT;
   pthread_mutex_unlock (&LockPoll);
@@ -769,61 +1260,8 @@ idx_t AnswerSocket (idx_t listen)
     goto done;
   }
   Socket[idx].ipname = _make_socket_ipname(&addr, hname, sizeof(hname));
-  i = getnameinfo (&addr.sa, len, hname, sizeof(hname), NULL, 0, 0);
-#ifdef STRICT_BACKRESOLV
-  if (i == 0) {
-    /* make direct resolving of hname and compare it with addr */
-    struct addrinfo *ai, *aii;
-    static struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = 0,
-				       .ai_protocol = 0, .ai_flags = 0 };
-
-#ifdef ENABLE_IPV6
-    hints.ai_family = addr.sa.sa_family;
-    if (hints.ai_family == AF_INET6)
-      hints.ai_flags = AI_V4MAPPED;
-    else
-      hints.ai_flags = 0;
-#endif
-    i = getaddrinfo (hname, NULL, &hints, &ai);
-    if (i == 0) {
-      for (aii = ai; aii != NULL; aii = aii->ai_next) {
-	inet_addr_t *ha = (inet_addr_t *)aii->ai_addr;
-
-#ifdef ENABLE_IPV6
-	if (ha->sa.sa_family == AF_INET6) {
-	  if (memcmp(&ha->s_in6.sin6_addr, &addr.s_in6.sin6_addr,
-		     sizeof(addr.s_in6.sin6_addr)) == 0)
-	    break;
-	} else if (ha->sa.sa_family == AF_INET)
-#endif
-	  if (memcmp(&ha->s_in.sin_addr.s_addr, &addr.s_in.sin_addr.s_addr,
-		     sizeof(addr.s_in.sin_addr.s_addr)) == 0)
-	    break;
-      }
-      freeaddrinfo (ai);
-      if (aii == NULL) {
-	DBG("socket:AnswerSocket: none of domain %s resolves match %s", hname,
-	    Socket[idx].ipname);
-	i = -1;
-      }
-    } else
-      DBG("socket:AnswerSocket: domain %s does not resolve, using %s", hname,
-	  Socket[idx].ipname);
-  }
-#endif
-  if (i == 0) {			/* subst canonical name */
-#ifdef HAVE_LIBIDN
-    char *dechost;
-
-    i = idna_to_unicode_lzlz(hname, &dechost, 0);
-    if (i == IDNA_SUCCESS) {
-      Socket[idx].domain = safe_strdup(dechost);
-      free(dechost);
-    } else //TODO: debug errors
-#endif
-    Socket[idx].domain = safe_strdup (hname);
-  } else			/* error of getnameinfo() */
-    Socket[idx].domain = safe_strdup(Socket[idx].ipname);
+  /* don't wait for DNS, SocketDomain() returns IP until it's resolved */
+  _resolv_reverse_async (&addr, len, idx);
 done:
   Socket[idx].ready = TRUE;
   /* done so remove thread cleanup leaving socket intact */
@@ -839,7 +1277,8 @@ const char *SocketDomain (idx_t idx, unsigned short *port)
   {
     if (port)
       *port = Socket[idx].port;
-    d = Socket[idx].domain;
+    if ((d = Socket[idx].domain) == NULL)	/* not resolved yet */
+      d = Socket[idx].ipname;
   }
   return NONULL(d);
 }
@@ -971,8 +1410,13 @@ static void *_poll_thread(void __attribute__((unused)) *data)
     /* send callbacks if some data are ready to get */
     for (i = 0; i < _Snum; i++) {
       if (Pollfd[i].fd >= 0 &&
-	  (Pollfd[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0 &&
+	  ((Pollfd[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0 ||
+	   /* connection is complete but nobody checked it yet */
+	   ((Pollfd[i].revents & POLLOUT) && Socket[i].ready == FALSE) ||
+	   /* socket buffer was full and writer waits for room */
+	   ((Pollfd[i].revents & POLLOUT) && Socket[i].blocked)) &&
 	  Socket[i].callback != NULL) {
+	Socket[i].blocked = FALSE;
 	DBG("socket.c:run callback due to revents %04hx on %hd", Pollfd[i].revents, i);
 	Socket[i].callback(Socket[i].callback_data);
       }
@@ -23,6 +23,7 @@
 
 #define M_RAW		0
 #define M_POLL		M_RAW
+#define M_NBLK		1	/* as M_RAW but connect() doesn't wait */
 #define M_LIST		3
 #define M_LINP		4
 #define M_UNIX		5
@@ -49,6 +50,7 @@ void ResetSocket (idx_t, unsigned short);	/* reset after failed setup */
 int KillSocket (idx_t *);			/* forget the socket */
 ssize_t ReadSocket (char *, idx_t, size_t);
 ssize_t WriteSocket (idx_t, const char *, size_t *, size_t *);
+ssize_t SendFileSocket (idx_t, int, off_t *, size_t *);
 idx_t AnswerSocket (idx_t);
 const char *SocketDomain (idx_t, unsigned short *); /* returns nonull value! */
 const char *SocketIP (idx_t);			/* the same but text IP */
@@ -56,6 +58,13 @@ const char *SocketMyIP (idx_t, char *, size_t);
 char *SocketError (int, char *, size_t);
 void AssociateSocket (idx_t, void (*)(void *), void *);
 
+struct addrinfo;
+void SetResolverBackend (int (*)(const char *, const char *,
+				 const struct addrinfo *, struct addrinfo **),
+			 void (*)(struct addrinfo *),
+			 int (*)(const struct sockaddr *, socklen_t, char *,
+				 socklen_t, char *, socklen_t, int));
+
 int _fe_init_sockets (void);
 
 #endif /* _SOCKET_H */
@@ -24,6 +24,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 
 #include <init.h>
 #include <sheduler.h>
@@ -41,19 +42,43 @@ static char autolog_timestamp[32] = "[%H:%M] ";	/* with ending space */
 static char autolog_lname_prefix[8] = "=";
 static bool autolog_by_lname = TRUE;
 static long int autolog_autoclose = 600;	/* in seconds */
+static long int autolog_open_files = 64;	/* size of fd cache */
 
 
-typedef struct
+#define AUTOLOGBUFSIZE	(2 * HUGE_STRING)	/* size of single buffer chunk */
+#define AUTOLOGMAXBUFS	16		/* max chunks of unsaved data per file */
+#define AUTOLOGDIRS	32		/* size of cache of existing directories */
+
+typedef struct autologbuf_t
 {
+  struct autologbuf_t *next;
+  size_t used;
+  char buf[AUTOLOGBUFSIZE];
+} autologbuf_t;
+
+/* file shared by all loggers which have the same path */
+typedef struct autologfile_t
+{
+  struct autologfile_t *next;	/* LRU list, most recently used first */
+  struct autologfile_t *prev;
   char *path;
-  int fd;
+  int fd;			/* -1 if closed by fd cache */
+  int users;			/* number of loggers using it */
+  int error;			/* fatal error from writer, 0 if none */
+  bool busy;			/* writer is doing file operations now */
+  autologbuf_t *head;		/* unsaved data */
+  autologbuf_t *tail;
+  unsigned int nbufs;
+} autologfile_t;
+
+typedef struct
+{
+  autologfile_t *f;
   tid_t timer;
   time_t timestamp;
   int reccount;
   int day;
   char *lname;
-  size_t inbuf;
-  char buf[HUGE_STRING];
 } autologdata_t;
 
 typedef struct autolog_t
@@ -90,69 +115,259 @@ static iftype_t _autolog_nolog_s (INTERFACE *iface, ifsig_t sig)
   return 0;
 }
 
-static int flush_autolog (autologdata_t *log)
+/*
+ * Opened files are kept in LRU list Autologs, and unused ones are closed
+ * only when number of opened files exceeds "autolog-open-files". All data
+ * is appended into file buffers and background thread AutologWriter writes
+ * them once per second with writev(). AutologLock protects the list, file
+ * descriptors and buffers, writer releases it while doing file operations
+ * and sets busy on the file so anyone who wants to close fd should wait.
+ */
+static autologfile_t *Autologs = NULL;
+static autologfile_t *AutologsLast = NULL;
+static int AutologsNum = 0;		/* files in the list */
+static int AutologsOpened = 0;		/* opened descriptors */
+static unsigned int AutologsHits = 0;	/* fd cache statistics */
+static unsigned int AutologsMiss = 0;
+
+static pthread_mutex_t AutologLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t AutologIdle = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t AutologWake = PTHREAD_COND_INITIALIZER;
+static pthread_t AutologWriter;
+static bool AutologWriterRun = FALSE;
+
+static autologbuf_t *AutologBufFree = NULL;
+
+/* all _autolog_* functions below should be called with AutologLock held */
+static void _autolog_free_bufs (autologbuf_t *b)
 {
-  ssize_t x;
+  autologbuf_t *next;
+
+  for (; b; b = next)
+  {
+    next = b->next;
+    b->next = AutologBufFree;
+    AutologBufFree = b;
+  }
+}
+
+static void _autolog_wait_idle (autologfile_t *f)
+{
+  while (f->busy)
+    pthread_cond_wait (&AutologIdle, &AutologLock);
+}
+
+/* moves file to top of LRU list */
+static void _autolog_touch (autologfile_t *f)
+{
+  if (f == Autologs)
+    return;
+  f->prev->next = f->next;		/* f->prev is not NULL here */
+  if (f->next)
+    f->next->prev = f->prev;
+  else
+    AutologsLast = f->prev;
+  f->prev = NULL;
+  f->next = Autologs;
+  Autologs->prev = f;
+  Autologs = f;
+}
+
+/*
+ * Writes all unsaved data of the file with as few writev() as possible,
+ * releasing lock meanwhile. Returns 0 on success or error code.
+ */
+static int _autolog_flush_locked (autologfile_t *f)
+{
+  struct iovec iov[AUTOLOGMAXBUFS];
   struct flock lck;
-  int es;
+  autologbuf_t *chain, *b, *bb;
+  ssize_t x;
+  size_t off, o;
+  int i, fd, es = 0;
 
-  if (log->inbuf == 0)
+  _autolog_wait_idle (f);
+  if ((chain = f->head) == NULL)
     return 0;
-  if (log->fd < 0)
-    return EBADF;
-  dprint (5, "autolog: trying logfile %s: %zu bytes", log->path, log->inbuf);
+  if (f->fd < 0)			/* closed by fd cache, reopen it */
+  {
+    f->fd = open (f->path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (f->fd < 0)
+      return errno;
+    AutologsOpened++;
+  }
+  fd = f->fd;
+  f->head = f->tail = NULL;		/* new data will go into new chain */
+  f->nbufs = 0;
+  f->busy = TRUE;
+  pthread_mutex_unlock (&AutologLock);
+  dprint (5, "autolog: writing logfile %s", f->path);
   memset (&lck, 0, sizeof (struct flock));
   lck.l_type = F_WRLCK;
   lck.l_whence = SEEK_END;
-  if (fcntl (log->fd, F_SETLK, &lck) < 0)
-    return errno;		/* cannot lock the file */
-  lseek (log->fd, 0, SEEK_END);
-  x = write (log->fd, log->buf, log->inbuf);
-  es = errno;
-  lck.l_type = F_UNLCK;
-  fcntl (log->fd, F_SETLK, &lck);
-  if (x < 0)
-    return es;			/* fatal error on write! */
-  log->inbuf = 0;
-  return 0;
+  if (fcntl (fd, F_SETLK, &lck) < 0)
+    es = errno;				/* cannot lock the file */
+  else
+  {
+    lseek (fd, 0, SEEK_END);
+    /* chain may be longer than iov after retries so write it in parts */
+    b = chain;
+    off = 0;
+    while (b)
+    {
+      for (bb = b, o = off, i = 0; bb && i < AUTOLOGMAXBUFS; bb = bb->next, i++)
+      {
+	iov[i].iov_base = &bb->buf[o];
+	iov[i].iov_len = bb->used - o;
+	o = 0;
+      }
+      x = writev (fd, iov, i);
+      if (x < 0 && errno == EINTR)
+	continue;
+      if (x <= 0)
+      {
+	es = x ? errno : ENOSPC;
+	break;
+      }
+      /* skip written data, writev() may do partial write */
+      while (b && (size_t)x >= b->used - off)
+      {
+	x -= (b->used - off);
+	b = b->next;
+	off = 0;
+      }
+      off += x;
+    }
+    lck.l_type = F_UNLCK;
+    fcntl (fd, F_SETLK, &lck);
+    if (es == EACCES || es == EAGAIN)	/* it's not a lock failure */
+      es = EIO;
+  }
+  pthread_mutex_lock (&AutologLock);
+  f->busy = FALSE;
+  pthread_cond_broadcast (&AutologIdle);
+  if (es == EACCES || es == EAGAIN)	/* locked, put chain back */
+  {
+    for (b = chain, i = 1; b->next; b = b->next, i++);
+    if ((b->next = f->head) == NULL)
+      f->tail = b;
+    f->head = chain;
+    f->nbufs += i;
+    return es;
+  }
+  _autolog_free_bufs (chain);
+  return es;				/* fatal error on write if not 0 */
 }
 
-#define MAXLOGQUEUE 50
+/* closes descriptors of unused files until number of them fits the cache */
+static void _autolog_shrink (void)
+{
+  autologfile_t *f, *prev;
+
+  for (f = AutologsLast; f && AutologsOpened > autolog_open_files; f = prev)
+  {
+    prev = f->prev;
+    if (f->busy || f->head)		/* writer will do it later */
+      continue;
+    if (f->fd >= 0)
+    {
+      close (f->fd);
+      f->fd = -1;
+      AutologsOpened--;
+    }
+    if (f->users > 0)			/* it will be reopened on write */
+      continue;
+    if (prev)
+      prev->next = f->next;
+    else
+      Autologs = f->next;
+    if (f->next)
+      f->next->prev = prev;
+    else
+      AutologsLast = prev;
+    AutologsNum--;
+    FREE (&f->path);
+    FREE (&f);
+  }
+}
 
-static int __flush_autolog (autolog_t *log, int quiet)
+static void *_autolog_writer (void *unused)
 {
-  int x = flush_autolog (log->d);			/* try to write it */
+  autologfile_t *f;
+  struct timespec ts;
+  int x;
 
-  if (x == EACCES || x == EAGAIN)			/* file locked */
+  pthread_mutex_lock (&AutologLock);
+  while (AutologWriterRun)
   {
-    if (log->iface->qsize > MAXLOGQUEUE) /* check if it's locked too far ago */
+    for (f = Autologs; f; f = f->next)
     {
-      if (!quiet)
-	ERROR ("Logfile %s is locked but queue grew to %d, abort logging to it.",
-	       log->d->path, log->iface->qsize);
-      return -1;
+      if (f->head == NULL || f->busy || f->error)
+	continue;
+      x = _autolog_flush_locked (f);
+      if (x && x != EACCES && x != EAGAIN)
+	f->error = x;			/* dispatcher will report it */
+      /* file cannot be freed while we were busy so f->next is valid */
     }
-    return 0;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec++;
+    pthread_cond_timedwait (&AutologWake, &AutologLock, &ts);
   }
-  else if (x)						/* fatal error! */
+  pthread_mutex_unlock (&AutologLock);
+  return NULL;
+}
+
+/* flushes all files, trying to get lock on each for up to 100 ms */
+static void _autolog_flush_all (int quiet)
+{
+  autologfile_t *f;
+  struct timeval tv0, tv;
+
+  pthread_mutex_lock (&AutologLock);
+  for (f = Autologs; f; f = f->next)
   {
-    if (!quiet)
+    gettimeofday (&tv0, NULL);
+    while (!f->error && f->head)
     {
+      int x = _autolog_flush_locked (f);
+
+      if (x != EACCES && x != EAGAIN)
+	break;
+      if (gettimeofday (&tv, NULL) ||
+	  tv.tv_usec > tv0.tv_usec + 100000) /* wait up to 100 ms */
+      {
+	if (!quiet)
+	  ERROR ("autolog: time out on closing %s.", f->path);
+	break;
+      }
+    }
+  }
+  pthread_mutex_unlock (&AutologLock);
+}
+
+#define MAXLOGQUEUE 50
+
+static int __check_autolog (autolog_t *log, int quiet)
+{
+  int x = log->d->f->error;
+  char buf[STRING];
+
+  if (x == 0)
+    return 1;
+  if (!quiet)
+  {
 #if _GNU_SOURCE
-      register const char *str = strerror_r (x, log->d->buf, sizeof(log->d->buf));
-      ERROR ("Couldn't write to logfile %s (%s), abort logging to it.",
-             log->d->path, str);
+    register const char *str = strerror_r (x, buf, sizeof(buf));
+    ERROR ("Couldn't write to logfile %s (%s), abort logging to it.",
+	   log->d->f->path, str);
 #else
-      if (strerror_r(x, log->d->buf, sizeof(log->d->buf)) != 0)
-        snprintf(log->d->buf, sizeof(log->d->buf), "(failed to decode err=%d)", x);
-      ERROR ("Couldn't write to logfile %s (%s), abort logging to it.",
-	     log->d->path, log->d->buf);
+    if (strerror_r(x, buf, sizeof(buf)) != 0)
+      snprintf(buf, sizeof(buf), "(failed to decode err=%d)", x);
+    ERROR ("Couldn't write to logfile %s (%s), abort logging to it.",
+	   log->d->f->path, buf);
 #endif
-    }
-    return -1;
   }
-  log->d->timestamp = Time;				/* all is OK */
-  return 1;
+  return -1;
 }
 
 /* inline substitution to disable warnings */
@@ -175,36 +390,66 @@ static inline size_t __strftime (char *l, size_t s, char *f, struct tm *t)
 static int autolog_add (autolog_t *log, char *ts, char *text, size_t sp,
 			struct tm *tm, int quiet)
 {
-  size_t ptr, sz, sts;
+  autologfile_t *f = log->d->f;
+  autologbuf_t *b;
+  size_t sz, sts;
 
-  if (log->d->inbuf && __flush_autolog (log, quiet) < 0)
+  if (__check_autolog (log, quiet) < 0)
     return -1;		/* error happened */
   if (text && text[0] == 0)
     return 1;		/* nothing to put */
-  DBG ("autolog:autolog_add: to=\"%s\" text=\"%s%s%s\"", log->d->path, ts, sp ? autolog_ctl_prefix : "", NONULL(text));
+  DBG ("autolog:autolog_add: to=\"%s\" text=\"%s%s%s\"", f->path, ts, sp ? autolog_ctl_prefix : "", NONULL(text));
   sz = safe_strlen (text);
-  ptr = log->d->inbuf;
-  if (ptr + sp + sz + safe_strlen (ts) + 1 >= sizeof(log->d->buf))
-    return 0;		/* try assuming that timestamp is ts long */
+  if (sp + sz + safe_strlen (ts) + 1 >= AUTOLOGBUFSIZE)
+    sz = AUTOLOGBUFSIZE - sp - safe_strlen (ts) - 2; /* truncate it */
+  pthread_mutex_lock (&AutologLock);
+  b = f->tail;
+  if (b == NULL || b->used + sp + sz + safe_strlen (ts) + 1 >= AUTOLOGBUFSIZE)
+  {
+    /* try assuming that timestamp is ts long */
+    if (f->nbufs >= AUTOLOGMAXBUFS)	/* file is locked too long */
+    {
+      pthread_mutex_unlock (&AutologLock);
+      if (log->iface->qsize > MAXLOGQUEUE) /* check if it's locked too far ago */
+      {
+	if (!quiet)
+	  ERROR ("Logfile %s is locked but queue grew to %d, abort logging to it.",
+		 f->path, log->iface->qsize);
+	return -1;
+      }
+      return 0;
+    }
+    if ((b = AutologBufFree) != NULL)
+      AutologBufFree = b->next;
+    else
+      b = safe_malloc (sizeof(autologbuf_t));
+    b->next = NULL;
+    b->used = 0;
+    if (f->tail)
+      f->tail->next = b;
+    else
+      f->head = b;
+    f->tail = b;
+    f->nbufs++;
+  }
   if (*ts)						/* do timestamp */
   {
-    sts = __strftime (&log->d->buf[ptr], sizeof(log->d->buf) - ptr - 1, ts, tm);
-    if (sts >= sizeof(log->d->buf) - ptr)
-      sts = sizeof(log->d->buf) - 1;
+    sts = __strftime (&b->buf[b->used], sizeof(b->buf) - b->used - sp - sz - 1,
+		      ts, tm);
+    if (sts >= sizeof(b->buf) - b->used - sp - sz - 1)
+      sts = 0;				/* it's too long so it was failed */
   }
   else
     sts = 0;
-  if (ptr + sp + sz + sts + 1 >= sizeof(log->d->buf))
-    return 0;		/* so we know full size so check it */
   if (sp)						/* do prefix */
-    memcpy (&log->d->buf[ptr+sts], autolog_ctl_prefix, sp);
+    memcpy (&b->buf[b->used+sts], autolog_ctl_prefix, sp);
   if (sz)						/* do message itself */
-    memcpy (&log->d->buf[ptr+sts+sp], text, sz);
-  ptr += sts + sp + sz;
-  log->d->buf[ptr++] = '\n';
-  log->d->inbuf = ptr;
-  if (__flush_autolog (log, quiet) < 0)
-    return -1;
+    memcpy (&b->buf[b->used+sts+sp], text, sz);
+  b->used += sts + sp + sz;
+  b->buf[b->used++] = '\n';
+  _autolog_touch (f);
+  pthread_mutex_unlock (&AutologLock);
+  log->d->timestamp = Time;
   DBG ("autolog:autolog_add: success");
   return 1;	/* it already in buffer */
 }
@@ -292,31 +537,131 @@ static int _autolog_makepath (char *buf, size_t sb, char *net, const char *tgt,
   return 0; /* all OK */
 }
 
+static char *AutologDirs[AUTOLOGDIRS];	/* cache of existing directories */
+static int AutologDirsNext = 0;
+
+/* creates directories for path starting from longest known existing one */
+static int _autolog_mkdirs (char *path)
+{
+  char *p;
+  size_t s, bs = 0;
+  int i;
+
+  for (i = 0; i < AUTOLOGDIRS; i++)
+    if (AutologDirs[i] && (s = strlen (AutologDirs[i])) > bs &&
+	!strncmp (path, AutologDirs[i], s) && path[s] == '/')
+      bs = s;
+  /* known one is recreated too since it might be removed meanwhile */
+  for (p = &path[bs ? bs : 1]; (p = strchr (p, '/')); *p++ = '/')
+  {
+    *p = '\0';
+    if (mkdir (path, S_IRWXU | S_IRGRP | S_IXGRP) < 0 && errno != EEXIST)
+    {
+      *p = '/';
+      return -1;
+    }
+  }
+  if ((p = strrchr (path, '/')) != NULL && (size_t)(p - path) > bs)
+  {
+    *p = '\0';				/* remember deepest directory */
+    FREE (&AutologDirs[AutologDirsNext]);
+    AutologDirs[AutologDirsNext] = safe_strdup (path);
+    AutologDirsNext = (AutologDirsNext + 1) % AUTOLOGDIRS;
+    *p = '/';
+  }
+  return 0;
+}
+
+static void _autolog_forget_dirs (void)
+{
+  int i;
+
+  for (i = 0; i < AUTOLOGDIRS; i++)
+    FREE (&AutologDirs[i]);
+}
+
 static inline int open_log_file(char *path, int do_dir)
 {
-  char *p, *p2;
   int rc;
 
   rc = open (path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
   if (rc >= 0 || !do_dir || errno != ENOENT)
     return rc;
-  p2 = NULL;
-  while ((p = strrchr(path, '/'))) {
-    if (p2)
-      *p2 = '/';
-    p2 = p;
-    *p = '\0';
-    rc = mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP);
-    if (rc == 0)
+  if (_autolog_mkdirs (path) < 0)
+    return -1;
+  return open (path, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP);
+}
+
+/* gets file from the cache or opens it, returns NULL on error */
+static autologfile_t *_autolog_file_get (char *path)
+{
+  autologfile_t *f;
+  int fd;
+
+  pthread_mutex_lock (&AutologLock);
+  for (f = Autologs; f; f = f->next)
+    if (!strcmp (f->path, path))
       break;
-    if (errno != ENOENT) {
-      *p = '/';
-      return rc;
+  if (f && f->fd >= 0)
+    AutologsHits++;
+  else
+  {
+    AutologsMiss++;
+    fd = open_log_file (path, 1);
+    if (fd < 0)
+    {
+      pthread_mutex_unlock (&AutologLock);
+      return NULL;
+    }
+    if (f == NULL)
+    {
+      f = safe_calloc (1, sizeof(autologfile_t));
+      f->path = safe_strdup (path);
+      if ((f->next = Autologs) != NULL)
+	Autologs->prev = f;
+      else
+	AutologsLast = f;
+      Autologs = f;
+      AutologsNum++;
+    }
+    f->fd = fd;
+    AutologsOpened++;
+  }
+  f->error = 0;
+  f->users++;
+  _autolog_touch (f);
+  _autolog_shrink();
+  pthread_mutex_unlock (&AutologLock);
+  return f;
+}
+
+/* releases file, it's kept in the cache while there is space for it */
+static void _autolog_file_put (autologfile_t *f)
+{
+  pthread_mutex_lock (&AutologLock);
+  f->users--;
+  pthread_cond_signal (&AutologWake);	/* write it as soon as possible */
+  _autolog_shrink();
+  pthread_mutex_unlock (&AutologLock);
+}
+
+/* closes all descriptors so files will be reopened on next write */
+static void _autolog_reopen_all (void)
+{
+  autologfile_t *f;
+
+  pthread_mutex_lock (&AutologLock);
+  for (f = Autologs; f; f = f->next)
+  {
+    _autolog_wait_idle (f);
+    if (f->fd >= 0)
+    {
+      close (f->fd);
+      f->fd = -1;
+      AutologsOpened--;
     }
   }
-  if (p2)
-    *p2 = '/';
-  return open_log_file(path, do_dir); /* do it again */
+  pthread_mutex_unlock (&AutologLock);
 }
 
 /* accepts: S_TERMINATE, S_SHUTDOWN, S_FLUSH */
@@ -324,7 +669,6 @@ static iftype_t _autolog_name_signal (INTERFACE *iface, ifsig_t sig)
 {
   autolog_t *log = (autolog_t *)iface->data;
   struct tm tm;
-  struct timeval tv0, tv;
 
   if (!(iface->ift & I_DIED)) switch (sig)	/* is it terminated already? */
   {
@@ -338,27 +682,14 @@ static iftype_t _autolog_name_signal (INTERFACE *iface, ifsig_t sig)
       break;
     case S_FLUSH:
       if (iface->qsize > 0) /* so there is queue... just reopen the log file */
-      {
-	close (log->d->fd);
-	log->d->fd = open_log_file (log->d->path, 0);
-	return 0;
-      }			/* else terminate it on flush to get right timestamps */
+	return 0;	/* module closes all files and writer reopens them */
+			/* else terminate it on flush to get right timestamps */
     case S_TERMINATE:
       localtime_r (&log->d->timestamp, &tm);
-      gettimeofday (&tv0, NULL);
-      if (autolog_add (log, autolog_close, NULL, 0, &tm, 0) >= 0)
-	while (__flush_autolog (log, 0) == 0)	/* retry if file is locked */
-	  if (gettimeofday (&tv, NULL) ||
-	      tv.tv_usec > tv0.tv_usec + 100000) /* wait up to 100 ms */
-	  {
-	    ERROR ("autolog: time out on closing %s.", log->d->path);
-	    break;
-	  }
+      autolog_add (log, autolog_close, NULL, 0, &tm, 0); /* writer will save it */
       if (log->d->timer >= 0)
 	KillTimer(log->d->timer);
-      if (log->d->fd >= 0)
-	close (log->d->fd);
-      FREE (&log->d->path);
+      _autolog_file_put (log->d->f);
       FREE (&log->d->lname);
       log->iface = NULL;
       iface->data = NULL;
@@ -367,8 +698,6 @@ static iftype_t _autolog_name_signal (INTERFACE *iface, ifsig_t sig)
     case S_SHUTDOWN:
       localtime_r (&log->d->timestamp, &tm);
       autolog_add (log, autolog_close, NULL, 0, &tm, 1); /* ignore result */
-      if (log->d->fd >= 0)
-	close (log->d->fd);
       log->iface = NULL;
       iface->data = NULL;
       iface->ift |= I_DIED;
@@ -382,8 +711,8 @@ static int _autolog_name_request (INTERFACE *iface, REQUEST *req)
 {
   ssize_t x;
   autolog_t *log;
+  autologfile_t *f;
   struct tm tm;
-  struct timeval tv0, tv;
 
   if (req) DBG ("_autolog_name_request: message for %s", req->to);
   log = (autolog_t *)iface->data;
@@ -413,37 +742,32 @@ static int _autolog_name_request (INTERFACE *iface, REQUEST *req)
       if (Inspect_Client (n, NULL, path, &l, NULL, NULL, NULL) &&
 	  safe_strcmp (l, log->d->lname))	/* Lname was changed? */
       {
-	gettimeofday (&tv0, NULL);
-	if (autolog_add (log, autolog_close, NULL, 0, &tm, 0) >= 0)
-	  while (__flush_autolog (log, 0) == 0)	/* retry if file is locked */
-	    if (gettimeofday (&tv, NULL) ||
-		tv.tv_usec > tv0.tv_usec + 100000) /* wait up to 100 ms */
-	    {
-	      ERROR ("autolog: time out on closing %s.", log->d->path);
-	      break;
-	    }
-	if (log->d->fd >= 0)
-	  close (log->d->fd);
-	FREE (&log->d->path);
+	autolog_add (log, autolog_close, NULL, 0, &tm, 0); /* ignore result */
 	FREE (&log->d->lname);
 	if (_autolog_makepath (path, sizeof(path), n, l ? l : (char *)req->to,
 			       l ? strlen(l) : (size_t)(n - req->to - 1),
 			       l ? autolog_lname_prefix : NULL, &tm))
 	{
 	  ERROR ("autolog: could not make path for %s.", req->to);
-	  log->d->fd = -1;
+	  f = NULL;
 	}
-	else if ((log->d->fd = open_log_file (path, 1)) < 0)
+	else if ((f = _autolog_file_get (path)) == NULL)
 	  ERROR ("autolog: could not open log file %s: %s", path, strerror (errno));
-	if (log->d->fd < 0)
+	if (f == NULL)
 	{
 	  dprint (3, "autolog:_autolog_name_request: halted logger \"%s\"",
 		  log->iface->name);
+	  if (log->d->timer >= 0)
+	    KillTimer(log->d->timer);
+	  _autolog_file_put (log->d->f);
+	  log->iface = NULL;
+	  iface->data = NULL;
+	  iface->ift |= I_DIED;
 	  return REQ_OK;
 	}
-	log->d->path = safe_strdup (path);
+	_autolog_file_put (log->d->f);
+	log->d->f = f;
 	log->d->reccount = 0;
-	log->d->inbuf = 0;
 	log->d->day = tm.tm_mday;
 	log->d->lname = safe_strdup (l);
 	autolog_add (log, autolog_open, NULL, 0, &tm, 0); /* ignore result */
@@ -551,7 +875,7 @@ static int _autolog_net_request (INTERFACE *iface, REQUEST *req)
   if (req && (req->flag & AUTOLOG_LEVELS) && Have_Wildcard (req->to) < 0)
   {
     autolog_t *log;
-    int fd;
+    autologfile_t *f;
     struct tm tm;
     const char *tpath;
     char *p;
@@ -601,11 +925,11 @@ static int _autolog_net_request (INTERFACE *iface, REQUEST *req)
 			   &tm))
     {
       ERROR ("autolog: could not make path for %s", tpath);
-      fd = -1;
+      f = NULL;
     }
-    else if ((fd = open_log_file (path, 1)) < 0)
+    else if ((f = _autolog_file_get (path)) == NULL)
       ERROR ("autolog: could not open log file %s: %s", path, strerror (errno));
-    if (fd < 0)
+    if (f == NULL)
     {
       log = _get_autolog_t ((autolognet_t *)iface->data);
       FREE (&log->d);
@@ -617,10 +941,10 @@ static int _autolog_net_request (INTERFACE *iface, REQUEST *req)
     log = _get_autolog_t ((autolognet_t *)iface->data);	/* make structure */
     if (!log->d)
       log->d = safe_malloc (sizeof(autologdata_t));
-    log->d->path = safe_strdup (path);
-    log->d->fd = fd;
+    log->d->f = f;
+    log->d->timer = -1;
+    log->d->timestamp = Time;
     log->d->reccount = 0;
-    log->d->inbuf = 0;
     log->d->day = tm.tm_mday;
     log->d->lname = NULL;
     if (tpath != (char *)req->to)
@@ -680,6 +1004,7 @@ static iftype_t _autolog_mass_signal (INTERFACE *iface, ifsig_t sig)
 	if (sig != S_SHUTDOWN)
 	  FREE (&net);
       }
+      _autolog_flush_all (sig == S_SHUTDOWN);
       _autolog_mass = NULL;
       iface->ift |= I_DIED;
       return I_DIED;
@@ -733,6 +1058,7 @@ static void autolog_register (void)
 		  sizeof(autolog_lname_prefix), 0);
   RegisterBoolean ("autolog-by-lname", &autolog_by_lname);
   RegisterInteger ("autolog-autoclose", &autolog_autoclose);
+  RegisterInteger ("autolog-open-files", &autolog_open_files);
 }
 
 /*
@@ -749,6 +1075,33 @@ static iftype_t module_autolog_signal (INTERFACE *iface, ifsig_t sig)
       Delete_Help ("autolog");
       if (_autolog_mass)
 	_autolog_mass_signal (_autolog_mass, sig);
+      /* all is flushed now so stop the writer and free everything */
+      pthread_mutex_lock (&AutologLock);
+      AutologWriterRun = FALSE;
+      pthread_cond_signal (&AutologWake);
+      pthread_mutex_unlock (&AutologLock);
+      pthread_join (AutologWriter, NULL);
+      while (Autologs)
+      {
+	autologfile_t *f = Autologs;
+
+	Autologs = f->next;
+	if (f->fd >= 0)
+	  close (f->fd);
+	_autolog_free_bufs (f->head);	/* unsaved data is lost */
+	FREE (&f->path);
+	FREE (&f);
+      }
+      AutologsLast = NULL;
+      AutologsNum = AutologsOpened = 0;
+      while (AutologBufFree)
+      {
+	autologbuf_t *b = AutologBufFree;
+
+	AutologBufFree = b->next;
+	FREE (&b);
+      }
+      _autolog_forget_dirs();
       UnregisterVariable ("autolog-ctl-prefix");
       UnregisterVariable ("autolog-path");
       UnregisterVariable ("autolog-serv-path");
@@ -759,6 +1112,7 @@ static iftype_t module_autolog_signal (INTERFACE *iface, ifsig_t sig)
       UnregisterVariable ("autolog-lname-prefix");
       UnregisterVariable ("autolog-by-lname");
       UnregisterVariable ("autolog-autoclose");
+      UnregisterVariable ("autolog-open-files");
       return I_DIED;
     case S_REG:
       /* reregister all */
@@ -774,15 +1128,24 @@ static iftype_t module_autolog_signal (INTERFACE *iface, ifsig_t sig)
 
 	for (net = (autolognet_t *)_autolog_mass->data; net; net = net->prev)
 	  for (log = net->log; log; log = log->prev)
-	    if (log->iface && log->d && log->d->fd >= 0)
+	    if (log->iface && log->d && log->d->f)
 	      New_Request (tmp, F_REPORT,
 			   _("Auto log #%d: file \"%s\" for client %s."),
-			   ++i, log->d->path, log->iface->name);
+			   ++i, log->d->f->path, log->iface->name);
 	if (i == 0)
 	  New_Request (tmp, F_REPORT, _("Module autolog: no opened logs."));
+	pthread_mutex_lock (&AutologLock);
+	New_Request (tmp, F_REPORT,
+		     _("Module autolog: %d files in cache, %d of them opened, %u hits, %u misses."),
+		     AutologsNum, AutologsOpened, AutologsHits, AutologsMiss);
+	pthread_mutex_unlock (&AutologLock);
 	Unset_Iface();
       }
       break;
+    case S_FLUSH:
+      /* reopen all files so they could be rotated by external tools */
+      _autolog_reopen_all();
+      break;
     default: ;
   }
   return 0;
@@ -796,6 +1159,13 @@ static iftype_t module_autolog_signal (INTERFACE *iface, ifsig_t sig)
 SigFunction ModuleInit (char *args)
 {
   CheckVersion;
+  AutologWriterRun = TRUE;
+  if (pthread_create (&AutologWriter, NULL, &_autolog_writer, NULL))
+  {
+    AutologWriterRun = FALSE;
+    ERROR ("autolog: cannot create writer thread!");
+    return (NULL);
+  }
   strfcpy (autolog_open, _("IRC log started %c"), sizeof(autolog_open));
   strfcpy (autolog_close, _("IRC log ended %c"), sizeof(autolog_close));
   strfcpy (autolog_daychange, _("Day changed: %a %x"), sizeof(autolog_daychange));
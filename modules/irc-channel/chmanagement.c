@@ -47,14 +47,32 @@ typedef struct
   uchar admin, anonymous, halfop;
 } m_c;
 
+#define	MODEBUF_CHANGES	64	/* changes kept until flush */
+#define	MODEBUF_TEXT	4*STRING /* space for arguments and reasons */
+
+/* order in which queued changes are sent, lower first */
+#define	MPRIO_DEOP	0	/* -a -o -h */
+#define	MPRIO_MODE	1	/* channel modes and lists (bans, etc.) */
+#define	MPRIO_KICK	2
+#define	MPRIO_OP	3	/* +a +o +h */
+#define	MPRIO_VOICE	4	/* +v -v */
+#define	MPRIO_NONE	-1	/* cancelled or sent already */
+
+typedef struct
+{
+  char mc;			/* mode char or 0 for kick */
+  char add;			/* '+' or '-' */
+  signed char prio;
+  short arg, reason;		/* offsets in text or -1 */
+} modechg;
+
 typedef struct
 {
   int changes;
-  size_t pos, apos;
-  const char *cmd;
+  size_t tpos;
   char modechars[MODECHARSMAX];
-  char mchg[STRING];
-  char args[STRING];
+  modechg chg[MODEBUF_CHANGES];
+  char text[MODEBUF_TEXT];
 } modebuf;
 
 static m_c *ModeChars = NULL;
@@ -270,27 +288,132 @@ static char *_make_literal_mask (char *mask, char *uh, size_t s)
   return mask;
 }
 
-static void _flush_mode (IRC *net, CHANNEL *chan, modebuf *mbuf)
+static void _init_modebuf (IRC *net, modebuf *mbuf)
+{
+  _make_modechars (mbuf->modechars, net);
+  mbuf->changes = 0;
+  mbuf->tpos = 0;
+}
+
+/* puts s[len] into mbuf text, returns offset there */
+static short _modebuf_text (modebuf *mbuf, const char *s, size_t len)
 {
+  short off = mbuf->tpos;
 
-  if (mbuf->cmd == NULL || mbuf->changes == 0)
+  memcpy (&mbuf->text[off], s, len);
+  mbuf->text[off + len] = 0;
+  mbuf->tpos += len + 1;
+  return off;
+}
+
+static void _send_mode_line (IRC *net, CHANNEL *chan, char *mchg, size_t *pos,
+			     char *args, size_t *apos)
+{
+  if (*pos == 0)
     return;
   /* OpenSolaris is bugged with %.s so sending chan->real here in hope it
      will work */
-  mbuf->mchg[mbuf->pos] = 0;
-  mbuf->args[mbuf->apos] = 0;
-  DBG("_flush_mode:%s %s %s %s", mbuf->cmd, chan->real, mbuf->mchg, mbuf->args);
-  New_Request (net->neti, 0, "%s %s %s %s", mbuf->cmd, chan->real,
-	       mbuf->mchg, mbuf->args);
-  mbuf->cmd = NULL;
-  mbuf->changes = mbuf->pos = mbuf->apos = 0;
+  mchg[*pos] = 0;
+  args[*apos] = 0;
+  DBG("_flush_mode:MODE %s %s %s", chan->real, mchg, args);
+  New_Request (net->neti, 0, "MODE %s %s %s", chan->real, mchg, args);
+  *pos = *apos = 0;
 }
 
+/* send all queued changes: modes packed up to MODES per line, kicks with
+   the same reason packed up to TARGMAX per line, in order of priority */
+static void _flush_mode (IRC *net, CHANNEL *chan, modebuf *mbuf)
+{
+  modechg *chg, *k;
+  int prio, n, i, x, xk, maxm, maxk;
+  size_t pos, apos, s;
+  char sign;
+  char *a;
+  char mchg[STRING];
+  char args[STRING];
+
+  if (mbuf->changes == 0)
+    return;
+  maxm = net->maxmodes > 0 ? net->maxmodes : MODEBUF_CHANGES;
+  maxk = net->maxtargets > 0 ? net->maxtargets : MODEBUF_CHANGES;
+  pos = apos = 0;
+  sign = 0;
+  x = 0;
+  for (prio = 0; prio <= MPRIO_VOICE; prio++)
+    for (n = 0; n < mbuf->changes; n++)
+    {
+      chg = &mbuf->chg[n];
+      if (chg->prio != prio)
+	continue;
+      chg->prio = MPRIO_NONE;
+      if (chg->mc == 0)			/* kick */
+      {
+	_send_mode_line (net, chan, mchg, &pos, args, &apos);
+	s = strlen (&mbuf->text[chg->arg]);
+	memcpy (mchg, &mbuf->text[chg->arg], s);
+	/* collect all other kicks with the same reason */
+	for (i = n + 1, xk = 1; i < mbuf->changes && xk < maxk; i++)
+	{
+	  k = &mbuf->chg[i];
+	  if (k->prio != MPRIO_KICK ||
+	      strcmp (&mbuf->text[k->reason], &mbuf->text[chg->reason]))
+	    continue;
+	  a = &mbuf->text[k->arg];
+	  if (s + strlen (a) + 1 >= sizeof(mchg))
+	    break;
+	  mchg[s++] = ',';
+	  memcpy (&mchg[s], a, strlen (a));
+	  s += strlen (a);
+	  k->prio = MPRIO_NONE;
+	  xk++;
+	}
+	mchg[s] = 0;
+	DBG("_flush_mode:KICK %s %s :%s", chan->real, mchg,
+	    &mbuf->text[chg->reason]);
+	if (mbuf->text[chg->reason])
+	  New_Request (net->neti, 0, "KICK %s %s :%s", chan->real, mchg,
+		       &mbuf->text[chg->reason]);
+	else
+	  New_Request (net->neti, 0, "KICK %s %s", chan->real, mchg);
+	sign = 0;
+	x = 0;
+	continue;
+      }
+      a = chg->arg < 0 ? NULL : &mbuf->text[chg->arg];
+      s = safe_strlen (a);
+      if (x == maxm || (s && apos + s + 1 >= sizeof(args)) ||
+	  pos + 2 >= sizeof(mchg))
+      {
+	_send_mode_line (net, chan, mchg, &pos, args, &apos);
+	sign = 0;
+	x = 0;
+      }
+      if (sign != chg->add)
+	mchg[pos++] = sign = chg->add;
+      mchg[pos++] = chg->mc;
+      if (s)
+      {
+	if (apos)
+	  args[apos++] = ' ';
+	memcpy (&args[apos], a, s);
+	apos += s;
+      }
+      x++;
+    }
+  _send_mode_line (net, chan, mchg, &pos, args, &apos);
+  mbuf->changes = 0;
+  mbuf->tpos = 0;
+}
+
+/* queue mode change; the same change queued already is ignored and opposite
+   one cancels it since it was made to change current state */
 static void _push_mode (IRC *net, LINK *target, modebuf *mbuf,
 			modeflag mch, int add, char *mask)
 {
-  char *CMD_MODE = "MODE";
   size_t i, m = 0;
+  int n;
+  char mc;
+  modechg *chg;
 
   if (_find_me_op (net, target->chan))
     i = 1;
@@ -303,15 +426,14 @@ static void _push_mode (IRC *net, LINK *target, modebuf *mbuf,
   if (mch == A_KEYSET) {
     if (mask == NULL)
       return; /* illegal modechange! */
-  } else if (mch != A_LIMIT) {
+    mc = 'k';
+  } else if (mch == A_LIMIT) {
+    mc = 'l';
+  } else {
     while (m < MODECHARSMAX && !(mch & ((modeflag)1<<m))) m++;
     if (m == MODECHARSMAX || mbuf->modechars[m] == 0)
       return; /* oops, illegal mode! */
-  }
-  if (mbuf->cmd != CMD_MODE || mbuf->changes == net->maxmodes)
-  {
-    _flush_mode (net, target->chan, mbuf);
-    mbuf->cmd = CMD_MODE;
+    mc = mbuf->modechars[m];
   }
   /* check for user-on-chan mode changes */
   if (mch & (A_ADMIN | A_OP | A_HALFOP | A_VOICE))
@@ -326,36 +448,41 @@ static void _push_mode (IRC *net, LINK *target, modebuf *mbuf,
   }
   else
     i = safe_strlen (mask);
-  /* check if we need flush */
-  if (mbuf->apos && mbuf->apos + i >= sizeof(mbuf->args) - 2)
-    _flush_mode (net, target->chan, mbuf);
-  if (mbuf->pos && ((add && *mbuf->mchg == '-') || (!add && *mbuf->mchg == '+')))
-    _flush_mode (net, target->chan, mbuf);
-  /* add change to mbuf */
-  if (!mbuf->changes)
+  if (i > HOSTMASKLEN)			/* it's impossible but anyway */
+    i = HOSTMASKLEN;
+  target->lmct = Time;
+  /* check if the same or opposite change is queued already */
+  for (n = 0; n < mbuf->changes; n++)
   {
-    if (add)
-      *mbuf->mchg = '+';
-    else
-      *mbuf->mchg = '-';
-    mbuf->pos++;
+    chg = &mbuf->chg[n];
+    if (chg->prio == MPRIO_NONE || chg->mc != mc)
+      continue;
+    if (!i && chg->arg >= 0)
+      continue;
+    if (i && (chg->arg < 0 || strncmp (&mbuf->text[chg->arg], mask, i) ||
+	      mbuf->text[chg->arg + i]))
+      continue;
+    if (chg->add != (add ? '+' : '-'))
+    {
+      DBG("_push_mode: cancelled %c%c", chg->add, mc);
+      chg->prio = MPRIO_NONE;
+    }
+    return;
   }
-  if (mch == A_LIMIT)
-    mbuf->mchg[mbuf->pos++] = 'l';
-  else if (mch == A_KEYSET)
-    mbuf->mchg[mbuf->pos++] = 'k';
+  if (mbuf->changes == MODEBUF_CHANGES ||
+      mbuf->tpos + i + 1 > sizeof(mbuf->text))
+    _flush_mode (net, target->chan, mbuf);
+  chg = &mbuf->chg[mbuf->changes++];
+  chg->mc = mc;
+  chg->add = add ? '+' : '-';
+  if (mch & A_VOICE)
+    chg->prio = MPRIO_VOICE;
+  else if (mch & (A_ADMIN | A_OP | A_HALFOP))
+    chg->prio = add ? MPRIO_OP : MPRIO_DEOP;
   else
-    mbuf->mchg[mbuf->pos++] = mbuf->modechars[m];
-  mbuf->changes++;
-  target->lmct = Time;
-  if (!i)
-    return;
-  if (i >= sizeof(mbuf->args) - mbuf->apos) /* it's impossible but anyway */
-    i = sizeof(mbuf->args) - mbuf->apos - 1;
-  if (mbuf->apos)
-    mbuf->args[mbuf->apos++] = ' ';
-  memcpy (&mbuf->args[mbuf->apos], mask, i);
-  mbuf->apos += i;
+    chg->prio = MPRIO_MODE;
+  chg->arg = i ? _modebuf_text (mbuf, mask, i) : -1;
+  chg->reason = -1;
 }
 
 static void _push_listfile_mode (IRC *net, LINK *target, modebuf *mbuf,
@@ -406,40 +533,46 @@ static void _push_listfile_mode (IRC *net, LINK *target, modebuf *mbuf,
 static void _push_kick (IRC *net, LINK *target, modebuf *mbuf,
 		        char *reason)
 {
-  char *CMD_KICK = "KICK";
   char *c;
   size_t i, m;
+  int n;
+  modechg *chg, *last = NULL;
 
   if (!_find_me_op (net, target->chan))
     return; /* I'm not op there */
-  if (mbuf->cmd != CMD_KICK || mbuf->changes == net->maxtargets)
-  {
-    _flush_mode (net, target->chan, mbuf);
-    mbuf->cmd = CMD_KICK;
-  }
   m = safe_strlen (target->nick->host);
   c = memchr (target->nick->host, '!', m);
   if (c)
     m = c - target->nick->host;
-  if (mbuf->pos && mbuf->pos + m >= sizeof(mbuf->args) - 2)
-    _flush_mode (net, target->chan, mbuf);
   i = safe_strlen (reason);
-  if (i >= sizeof(mbuf->args) - 1)
-    i = sizeof(mbuf->args) - 2;
-  if (mbuf->apos && (i != mbuf->apos - 1 ||
-      safe_strncmp (&mbuf->args[1], reason, mbuf->apos - 1)))
-    _flush_mode (net, target->chan, mbuf);
-  if (!mbuf->apos && i != 0) /* write reason */
+  if (i >= STRING - 1)
+    i = STRING - 2;
+  for (n = 0; n < mbuf->changes; n++)
+  {
+    chg = &mbuf->chg[n];
+    if (chg->prio != MPRIO_KICK)
+      continue;
+    if (!strncmp (&mbuf->text[chg->arg], target->nick->host, m) &&
+	mbuf->text[chg->arg + m] == 0)
+      return;				/* already queued */
+    last = chg;
+  }
+  if (mbuf->changes == MODEBUF_CHANGES ||
+      mbuf->tpos + m + i + 2 > sizeof(mbuf->text))
   {
-    *mbuf->args = ':';
-    memcpy (&mbuf->args[1], reason, i);
-    mbuf->apos = i + 1;
+    _flush_mode (net, target->chan, mbuf);
+    last = NULL;
   }
-  if (mbuf->pos)
-    mbuf->mchg[mbuf->pos++] = ',';
-  memcpy (&mbuf->mchg[mbuf->pos], target->nick->host, m);
-  mbuf->pos += m;
-  mbuf->changes++;
+  chg = &mbuf->chg[mbuf->changes++];
+  chg->mc = 0;
+  chg->add = 0;
+  chg->prio = MPRIO_KICK;
+  chg->arg = _modebuf_text (mbuf, target->nick->host, m);
+  if (last && !strncmp (&mbuf->text[last->reason], NONULL(reason), i) &&
+      mbuf->text[last->reason + i] == 0)
+    chg->reason = last->reason;		/* share the same reason text */
+  else
+    chg->reason = _modebuf_text (mbuf, NONULL(reason), i);
 }
 
 typedef struct
@@ -670,9 +803,7 @@ void ircch_recheck_modes (IRC *net, LINK *target, userflag sf, userflag cf,
     return;		/* I cannot have any permissions to operate */
   if (Time - target->lmct < ircch_mode_timeout)
     return;		/* don't push too fast modechanges, it will abuse */
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   /* make resulting flags */
   rf = _make_rf (net, sf, cf);
   /* first of all check if user has access: channel and U_ACCESS has priority */
@@ -693,26 +824,21 @@ void ircch_recheck_channel_modes (IRC *net, CHANNEL *ch)
   DBG("irc-channel:ircch_recheck_channel_modes: me=%p", me);
   if (me == NULL)
     return;
-  _make_modechars(mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   _recheck_channel_modes(net, me, &mbuf);
   _flush_mode (net, ch, &mbuf);
 }
 
 static void _ircch_expire_exempts (IRC *net, CHANNEL *ch, modebuf *mbuf)
 {
-  LIST *list, *list2;
+  LIST *list;
   struct clrec_t *cl;
   userflag uf, cf;
 
   /* check exceptions and remove all expired if no matched bans left */
-  for (list = ch->exempts; list; list = list->next)
+  for (list = ch->exempts.list; list; list = list->next)
   {
-    for (list2 = ch->bans; list2; list2 = list2->next)
-      if (match (list2->what, list->what) > 0)	/* there is a ban... */
-	break;
-    if (list2)
+    if (ircch_match_mask (&ch->bans, list->what, NULL))	/* there is a ban... */
       continue;					/* ...so keep it */
     if ((cl = Find_Clientrecord (list->what, NULL, &uf, &net->name[1])))
     {
@@ -740,7 +866,7 @@ int ircch_parse_modeline (IRC *net, CHANNEL *chan, LINK *origin, char *prefix,
 {
   LINK *target;
   char *pstr, *schr;
-  LIST **list;
+  MASKLIST *list;
   struct binding_t *bind;
   char mf, mc;
   userflag ocf, orf, trf, gcf;
@@ -751,9 +877,7 @@ int ircch_parse_modeline (IRC *net, CHANNEL *chan, LINK *origin, char *prefix,
   modebuf mbuf;
 
   nextpar = nignpar = 0;
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   if (origin && origin->nick->lname)
     orf = _make_rf (net, uf,
 		    (ocf = Get_Clientflags (origin->nick->lname, chan->chi->name)));
@@ -876,7 +1000,7 @@ int ircch_parse_modeline (IRC *net, CHANNEL *chan, LINK *origin, char *prefix,
 	{
 	  LIST *item;
 
-	  if ((item = ircch_find_mask (*list, schr)))
+	  if ((item = ircch_find_mask (list, schr)))
 	    ircch_remove_mask (list, item);
 	  /* if ban was removed then remove all matched dynamic exceptions */
 	  if (mc == 'b' && !(net->features & L_NOEXEMPTS) &&
@@ -1019,8 +1143,8 @@ int ircch_parse_modeline (IRC *net, CHANNEL *chan, LINK *origin, char *prefix,
 	{
 	  chan->mode &= ~mch;
 	  /* if '-i' then clear invites list because server do that too */
-	  if (mc == 'i') while (chan->invites)
-	    ircch_remove_mask (&chan->invites, chan->invites);
+	  if (mc == 'i')
+	    ircch_clear_masks (&chan->invites);
 	}
 	else
 	{
@@ -1101,9 +1225,7 @@ void ircch_enforcer (IRC *net, CHANNEL *chan)
   LIST *ban, *ex;
   modebuf mbuf;
 
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   cf = Get_Clientflags (chan->chi->name, "");	/* get all flags */
   for (link = chan->nicks; link; link = link->prevnick)
     if (!(link->mode & (A_ADMIN | A_OP | A_HALFOP)) || !(cf & U_FRIEND))
@@ -1119,17 +1241,17 @@ void ircch_enforcer (IRC *net, CHANNEL *chan)
 	rf = 0;
       if (rf & (U_FRIEND | U_MASTER | U_OP | U_HALFOP | U_ACCESS))
 	continue;
-      for (ban = chan->bans, ex = NULL; ban; ban = ban->next)
-	if (match (ban->what, link->nick->host) > 0)
-	{
-	  for (ex = chan->exempts; ex; ex = ex->next)
-	    if (match (ban->what, ex->what) > 0 &&
-		match (ex->what, link->nick->host) > 0)
-	      break;
-	  if (!ex)
+      for (ban = NULL;
+	   (ban = ircch_match_mask (&chan->bans, link->nick->host, ban)); )
+      {
+	for (ex = NULL;
+	     (ex = ircch_match_mask (&chan->exempts, link->nick->host, ex)); )
+	  if (match (ban->what, ex->what) > 0)
 	    break;
-	}
-      if (ban && !ex)
+	if (!ex)
+	  break;
+      }
+      if (ban)
 	_push_kick (net, link, &mbuf, "you are banned");
     }
   _flush_mode (net, chan, &mbuf);
@@ -1146,7 +1268,7 @@ static void _ircch_expire_bans (IRC *net, CHANNEL *ch, modebuf *mbuf)
   if (ircch_ban_keep > 0)
   {
     t = Time - ircch_ban_keep * 60;
-    for (list = ch->bans; list; list = list->next)
+    for (list = ch->bans.list; list; list = list->next)
     {
       if (list->since > t)
 	continue;
@@ -1171,9 +1293,7 @@ void ircch_expire (IRC *net, CHANNEL *ch)
 
   if ((Get_Clientflags (ch->chi->name, "") & U_NOAUTH))	/* -dynamic */
     return;
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   _ircch_expire_bans (net, ch, &mbuf);
   if (!(net->features & L_NOEXEMPTS))
     _ircch_expire_exempts (net, ch, &mbuf);
@@ -1514,9 +1634,7 @@ static int ssirc_kick (struct peer_t *who, INTERFACE *where, char *args)
 		 where->name);
     return -1;
   }
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   /* TODO: work with nicks list too? */
   reason = NextWord_Unquoted (target, args, sizeof(target));
   if (net->lc)				/* determine and check target */
@@ -1582,9 +1700,7 @@ static int ssirc_kickban (struct peer_t *who, INTERFACE *where, char *args)
     flag = *args++;
   else
     flag = 0;
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   reason = NextWord_Unquoted (target, args, sizeof(target));
   if (net->lc)				/* determine and check target */
     net->lc ((tgt = lct), target, sizeof(lct));
@@ -1650,9 +1766,7 @@ static int _ssirc_setmode (struct peer_t *who, INTERFACE *where, char *args,
 		 where->name);
     return -1;
   }
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   /* TODO: work with nicks list too! */
   if (net->lc)				/* determine and check target */
     net->lc ((tgt = lct), target, sizeof(lct));
@@ -1746,9 +1860,7 @@ static int ssirc_reset (struct peer_t *who, INTERFACE *where, char *args)
 		 where->name);
     return -1;
   }
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   if (mf & A_DENIED)
   {
     _ircch_expire_bans (net, ch, &mbuf);
@@ -1761,6 +1873,7 @@ static int ssirc_reset (struct peer_t *who, INTERFACE *where, char *args)
     _ircch_expire_invites (net, ch, &mbuf);
     _ircch_raise_invites (net, ch, &mbuf);
   }
+  _flush_mode (net, ch, &mbuf);
   return 1;
 }
 
@@ -1893,9 +2006,7 @@ static void _ctcp_opping(INTERFACE *client, unsigned char *who, char *lname,
   if (!tgt)
     return;			/* cannot flag requestor there */
   /* do flagging */
-  _make_modechars (mbuf.modechars, net);
-  mbuf.changes = mbuf.pos = mbuf.apos = 0;
-  mbuf.cmd = NULL;
+  _init_modebuf (net, &mbuf);
   _push_mode (net, tgt, &mbuf, set, 1, NULL);
   _flush_mode (net, tgt->chan, &mbuf);
 }
@@ -90,53 +90,212 @@ static void _ircch_destroy_nick (void *);
 
 /* --- Internal functions --------------------------------------------------- */
 
-int ircch_add_mask (LIST **list, char *by, size_t sby, char *what)
+#define MASKS_HASH_MIN	16		/* initial size of mask hash tables */
+
+static LIST *_ircch_new_list (char *by, size_t sby, char *what)
 {
   LIST *topic;
 
-  while (*list)
-    if (!strcmp ((*list)->what, what))
-      return 0;					/* the same already exist */
-    else
-      list = &(*list)->next;
   topic = safe_malloc (sizeof(LIST) + safe_strlen (what) + sby + 1);
-  topic->next = NULL;
+  topic->next = topic->prev = topic->hnext = topic->inext = NULL;
+  topic->key = NULL;
   topic->since = Time;
   memcpy (topic->by, by, sby);
   topic->by[sby] = 0;
   topic->what = &topic->by[sby+1];
   strcpy (topic->what, what);
-  *list = topic;
-  dprint (2, "ircch_add_mask: {%lu %s} %s", (unsigned long int)topic->since, topic->by, topic->what);
+  return topic;
+}
+
+static unsigned int _ircch_mask_hash (const char *s)
+{
+  register unsigned int h = 2166136261U;
+
+  while (*s)
+    h = (h ^ (unsigned char)*s++) * 16777619U;
+  return h;
+}
+
+/* returns literal host part of mask, or domain if it's "*.domain", or NULL
+   if mask has wildcards there; any text matched by mask ends with "@key"
+   or with ".key" so we can find candidates by suffixes of the text host */
+static char *_ircch_mask_key (char *mask)
+{
+  char *c = strrchr (mask, '@');
+
+  if (!c++)
+    return NULL;
+  if (c[0] == '*' && c[1] == '.')
+    c += 2;
+  if (!*c || strpbrk (c, "*?[]{}\\,"))
+    return NULL;
+  return c;
+}
+
+static void _ircch_index_mask (MASKLIST *set, LIST *mask)
+{
+  LIST **h;
+
+  h = &set->exact[_ircch_mask_hash (mask->what) & (set->hsize - 1)];
+  mask->hnext = *h;
+  *h = mask;
+  if (mask->key)
+    h = &set->byhost[_ircch_mask_hash (mask->key) & (set->hsize - 1)];
+  else
+    h = &set->wild;
+  mask->inext = *h;
+  *h = mask;
+}
+
+static void _ircch_rehash_masks (MASKLIST *set, unsigned int hsize)
+{
+  LIST *mask;
+
+  dprint (4, "ircch: resizing mask hash %u -> %u", set->hsize, hsize);
+  FREE (&set->exact);
+  FREE (&set->byhost);
+  set->exact = safe_calloc (hsize, sizeof(LIST *));
+  set->byhost = safe_calloc (hsize, sizeof(LIST *));
+  set->hsize = hsize;
+  set->wild = NULL;
+  for (mask = set->list; mask; mask = mask->next)
+    _ircch_index_mask (set, mask);
+}
+
+int ircch_add_mask (MASKLIST *set, char *by, size_t sby, char *what)
+{
+  LIST *mask;
+
+  if (ircch_find_mask (set, what))
+    return 0;					/* the same already exist */
+  mask = _ircch_new_list (by, sby, what);
+  mask->key = _ircch_mask_key (mask->what);
+  /* keep list in order of adding for expiration */
+  if ((mask->prev = set->last))
+    set->last->next = mask;
+  else
+    set->list = mask;
+  set->last = mask;
+  if (++set->num > 2 * set->hsize)
+    _ircch_rehash_masks (set, set->hsize ? 2 * set->hsize : MASKS_HASH_MIN);
+  else
+    _ircch_index_mask (set, mask);
+  dprint (2, "ircch_add_mask: {%lu %s} %s", (unsigned long int)mask->since, mask->by, mask->what);
   return 1;
 }
 
-LIST *ircch_find_mask (LIST *list, char *mask)
+LIST *ircch_find_mask (MASKLIST *set, char *mask)
 {
-  while (list)
+  LIST *list;
+
+  if (!set->hsize)
+    return NULL;
+  for (list = set->exact[_ircch_mask_hash (mask) & (set->hsize - 1)]; list;
+       list = list->hnext)
     if (!strcmp (list->what, mask))
       break;
-    else
-      list = list->next;
   if (list)
     dprint (4, "ircch_find_mask: {%lu %s} %s", (unsigned long int)list->since, list->by, list->what);
   return list;
 }
 
-void ircch_remove_mask (LIST **list, LIST *mask)
+/* returns next mask after prev (or first if prev is NULL) which matches
+   the text, text is nick!user@host or a mask; order is unspecified */
+LIST *ircch_match_mask (MASKLIST *set, const char *text, LIST *prev)
 {
-  while (*list)
-    if (*list == mask)
-      break;
-    else
-      list = &(*list)->next;
-  if (*list)
-    *list = mask->next;
-  if (mask)
-    dprint (2, "ircch_remove_mask: {%lu %s} %s", (unsigned long int)mask->since, mask->by, mask->what);
+  const char *key;
+  LIST *mask;
+
+  if (!set->num || !text)
+    return NULL;
+  if (!prev || prev->key)
+  {
+    if ((key = strrchr (text, '@')))
+      key++;
+    while (key)			/* check host and each its domain */
+    {
+      if (!prev)
+	mask = set->byhost[_ircch_mask_hash (key) & (set->hsize - 1)];
+      else if (strcmp (key, prev->key))
+	mask = NULL;		/* it's not the one where we stopped */
+      else
+      {
+	mask = prev->inext;
+	prev = NULL;
+      }
+      for (; mask; mask = mask->inext)
+	if (!strcmp (mask->key, key) && match (mask->what, text) > 0)
+	  return mask;
+      if ((key = strchr (key, '.')))
+	key++;
+    }
+    if (prev)
+      return NULL;		/* prev was not matched to text? */
+    mask = set->wild;
+  }
+  else
+    mask = prev->inext;
+  for (; mask; mask = mask->inext)
+    if (match (mask->what, text) > 0)
+      return mask;
+  return NULL;
+}
+
+void ircch_remove_mask (MASKLIST *set, LIST *mask)
+{
+  LIST **h, *l;
+
+  if (!mask)
+    return;
+  h = &set->exact[_ircch_mask_hash (mask->what) & (set->hsize - 1)];
+  if (*h == mask)
+    *h = mask->hnext;
+  else
+  {
+    for (l = *h; l && l->hnext != mask; l = l->hnext);
+    if (l)
+      l->hnext = mask->hnext;
+  }
+  if (mask->key)
+    h = &set->byhost[_ircch_mask_hash (mask->key) & (set->hsize - 1)];
+  else
+    h = &set->wild;
+  if (*h == mask)
+    *h = mask->inext;
+  else
+  {
+    for (l = *h; l && l->inext != mask; l = l->inext);
+    if (l)
+      l->inext = mask->inext;
+  }
+  if (mask->prev)
+    mask->prev->next = mask->next;
+  else
+    set->list = mask->next;
+  if (mask->next)
+    mask->next->prev = mask->prev;
+  else
+    set->last = mask->prev;
+  set->num--;
+  dprint (2, "ircch_remove_mask: {%lu %s} %s", (unsigned long int)mask->since, mask->by, mask->what);
   FREE (&mask);
 }
 
+void ircch_clear_masks (MASKLIST *set)
+{
+  LIST *mask;
+
+  while ((mask = set->list))
+  {
+    set->list = mask->next;
+    FREE (&mask);
+  }
+  FREE (&set->exact);
+  FREE (&set->byhost);
+  set->last = set->wild = NULL;
+  set->num = set->hsize = 0;
+}
+
 static void _ircch_add_lname (NICK *nick, char *lname)
 {
   LEAF *leaf = Find_Leaf (nick->net->lnames, lname, 1);
@@ -406,13 +565,10 @@ static void _ircch_destroy_channel (void *cht)
 	ERROR ("_ircch_destroy_channel: tree error");
       _ircch_destroy_nick (nt);
     }
-  ircch_remove_mask (&((CHANNEL *)cht)->topic, ((CHANNEL *)cht)->topic);
-  while (((CHANNEL *)cht)->bans)
-    ircch_remove_mask (&((CHANNEL *)cht)->bans, ((CHANNEL *)cht)->bans);
-  while (((CHANNEL *)cht)->exempts)
-    ircch_remove_mask (&((CHANNEL *)cht)->exempts, ((CHANNEL *)cht)->exempts);
-  while (((CHANNEL *)cht)->invites)
-    ircch_remove_mask (&((CHANNEL *)cht)->invites, ((CHANNEL *)cht)->invites);
+  FREE (&((CHANNEL *)cht)->topic);
+  ircch_clear_masks (&((CHANNEL *)cht)->bans);
+  ircch_clear_masks (&((CHANNEL *)cht)->exempts);
+  ircch_clear_masks (&((CHANNEL *)cht)->invites);
   KillTimer (((CHANNEL *)cht)->tid);
   Stop_Schedule (((CHANNEL *)cht)->chi, S_TIMEOUT, "*", "*", "*", "*", "*");
   FREE (&((CHANNEL *)cht)->key);
@@ -497,6 +653,26 @@ static void _ircch_destroy_nick (void *nt)		/* definition */
 
 ALLOCATABLE_TYPE(SplitMember, SML, next) /* alloc_SplitMember, free_SplitMember */
 
+/* remove the member from netsplit list and free it */
+static void _ircch_split_member_delete (netsplit *split, SplitMember *sm)
+{
+  if (split->njlast == sm)	/* keep channel of netjoin if we can */
+    for (split->njlast = sm->prev; split->njlast;
+	 split->njlast = split->njlast->prev)
+      if (split->njlast->member->chan == sm->member->chan)
+	break;
+  if (sm->prev)
+    sm->prev->next = sm->next;
+  else
+    split->members = sm->next;
+  if (sm->next)
+    sm->next->prev = sm->prev;
+  else
+    split->last = sm->prev;
+  sm->member->split = NULL;
+  free_SplitMember (sm);
+}
+
 static void _ircch_destroy_network (IRC *net)
 {
   netsplit *split;
@@ -517,10 +693,12 @@ static void _ircch_destroy_network (IRC *net)
   Destroy_Tree (&net->nicks, &_ircch_destroy_nick); /* it must be already empty */
   Destroy_Tree (&net->lnames, NULL);
   FREE (&net->name);
+  Destroy_Tree (&net->splitservers, NULL);
   while ((split = net->splits))
   {
     net->splits = split->prev;
     FREE (&split->servers);
+    FREE (&split->gone);
     while (split->members)
     {
       sm = split->members->next;
@@ -583,6 +761,7 @@ static LINK *_ircch_get_link (IRC *net, char *lcn, CHANNEL *ch)
   link->prevnick = ch->nicks;
   link->nick = nt;
   link->prevchan = nt->channels;
+  link->split = NULL;
   link->mode = 0;
   link->count = 0;
   link->lmct = 0;
@@ -902,8 +1081,7 @@ static void _ircch_netjoin_log (netsplit *split, char *channame,
 static void _ircch_netjoin_report (IRC *net, netsplit *split, CHANNEL *chan)
 {
   NICK *nick;
-  SplitMember **mm = &split->members;
-  SplitMember *sm;
+  SplitMember *sm, *next;
   LINK *link;
   char *c;
   size_t s = 0, nl;
@@ -914,14 +1092,12 @@ static void _ircch_netjoin_report (IRC *net, netsplit *split, CHANNEL *chan)
   char str[MESSAGEMAX];
   char buf[STRING];
 
-  while ((sm = *mm))
+  for (sm = split->members; sm; sm = next)
   {
+    next = sm->next;
     if (sm->member->chan != chan ||  /* that one is on another channel, skip */
 	!(sm->member->mode & A_ISON))	/* it isn't returned even */
-    {
-      mm = &(*mm)->next;
       continue;
-    }
     nick = sm->member->nick;
     /* add to list for logging */
     m = _ircch_get_userchar (net, sm->member->mode);
@@ -962,14 +1138,13 @@ static void _ircch_netjoin_report (IRC *net, netsplit *split, CHANNEL *chan)
 	bind->func (nick->host, nick->lname, chan->chi);
     }
     /* remove it from the split members list */
-    *mm = sm->next;
+    _ircch_split_member_delete (split, sm);
     /* remove user from split if there was no LINK left */
     for (link = nick->channels; link; link = link->prevchan)
       if (!(link->mode & A_ISON))
 	break;
     if (!link)
       nick->split = NULL;
-    free_SplitMember (sm);
   }
   /* report all still unreported netjoin */
   if (s)
@@ -978,30 +1153,25 @@ static void _ircch_netjoin_report (IRC *net, netsplit *split, CHANNEL *chan)
 
 /* "finishclose" NJOIN, i.e. report one user that still is in split list as if
  * them are lost in netsplit */
-static void _ircch_netsplit_lost_report (IRC *net, SplitMember **sm, char *msg)
+static void _ircch_netsplit_lost_report (IRC *net, netsplit *split, NICK *nick)
 {
-  SplitMember *s;
-  NICK *nick, *n = NULL;
+  LINK *link, *next;
+  NICK *n;
 
-  nick = (*sm)->member->nick;
   dprint (5, "_ircch_netsplit_lost_report: %s (%s)", nick->name,
 	  NONULLP(nick->lname));
   nick->split = NULL;				/* remove it ASAP */
-  while ((s = *sm))
+  for (link = nick->channels; link; link = next)
   {
-    if (s->member->nick != nick)		/* do recursion only for nick */
-    {
-      sm = &s->next;
-      continue;
-    }
+    next = link->prevchan;
+    if (!link->split || link->split->split != split)
+      continue;					/* do recursion only for split */
     _ircch_quited_log (nick, nick->lname,
 		       nick->lname ? (Get_Clientflags (nick->lname, NULL) |
 				Get_Clientflags (nick->lname, &net->name[1])) : 0,
-		       s->member, nick->host, msg);
-    n = _ircch_destroy_link (s->member);	/* remove link */
-    *sm = s->next;				/* remove from list */
-    free_SplitMember (s);
-    if (n)
+		       link, nick->host, split->servers);
+    _ircch_split_member_delete (split, link->split); /* remove from list */
+    if ((n = _ircch_destroy_link (link)))	/* remove link */
     {
       if (Delete_Key (net->nicks, n->name, n))
 	ERROR ("_ircch_netsplit_lost_report: tree error");
@@ -1019,11 +1189,13 @@ static void _ircch_netsplit_terminate (IRC *net, netsplit **ptr)
 {
   netsplit *split;
   LEAF *l = NULL;
-  SplitMember **s;
+  NICK *nick;
 
   split = *ptr;
   *ptr = split->prev;
   dprint (5, "_ircch_netsplit_terminate: %s", split->servers);
+  if (Delete_Key (net->splitservers, split->gone, split))
+    ERROR ("_ircch_netsplit_terminate: tree error");
   /* report all channels if got netsplit right now */
   if (split->stage == 0)
     _ircch_netsplit_report (net, split);
@@ -1031,16 +1203,18 @@ static void _ircch_netsplit_terminate (IRC *net, netsplit **ptr)
   while ((l = Next_Leaf (net->channels, l, NULL)))
     _ircch_netjoin_report (net, split, l->s.data);
   /* now only those who lost in split left! */
-  for (s = &split->members; *s; )
+  while (split->members)
   {
+    nick = split->members->member->nick;
     /* sanity check! */
-    if ((*s)->member->nick->split != split)
+    if (nick->split != split)
       ERROR ("_ircch_netsplit_terminate: member %s is from another split!",
-	     (*s)->member->nick->name);
-    _ircch_netsplit_lost_report (net, s, split->servers);
+	     nick->name);
+    _ircch_netsplit_lost_report (net, split, nick);
   }
   /* free all allocations */
   FREE (&split->servers);
+  FREE (&split->gone);
   FREE (&split);
 }
 
@@ -1078,14 +1252,12 @@ static void _ircch_netsplit_terminate (IRC *net, netsplit **ptr)
  */
 
 /* find netsplit in network's list */
-static netsplit **_ircch_netsplit_find (IRC *net, const char *server)
+static netsplit *_ircch_netsplit_find (IRC *net, const char *server)
 {
-  netsplit **split;
+  char lcs[HOSTLEN+1];
 
-  for (split = &net->splits; *split; split = &(*split)->prev)
-    if (!strcasecmp (server, NextWord((*split)->servers)))
-      return split;
-  return NULL;
+  unistrlower (lcs, server, sizeof(lcs));
+  return Find_Key (net->splitservers, lcs);
 }
 
 /* add every channel for the user into netsplit list */
@@ -1093,51 +1265,62 @@ static void _ircch_netsplit_add (IRC *net, char *servers, NICK *nick)
 {
   netsplit *split;
   netsplit **tmp;
-  SplitMember **sm;
+  SplitMember *sm;
   LINK *link;
+  char lcs[HOSTLEN+1];
 
   dprint (5, "_ircch_netsplit_add for %s: %s", nick->name, servers);
-  if ((tmp = _ircch_netsplit_find (net, NextWord(servers))) &&
-      strcmp (servers, (*tmp)->servers))
+  if ((split = _ircch_netsplit_find (net, NextWord(servers))) &&
+      strcmp (servers, split->servers))
   {
     ERROR ("_ircch_netsplit_add: duplicate split, previous was for servers %s!",
-	   (*tmp)->servers);
+	   split->servers);
+    for (tmp = &net->splits; *tmp != split; tmp = &(*tmp)->prev);
     _ircch_netsplit_terminate (net, tmp);
-    tmp = NULL;
+    split = NULL;
   }
-  if (tmp)
-    split = *tmp;
-  else
+  if (!split)
   {
     DBG ("_ircch_netsplit_add: %s", servers);
+    unistrlower (lcs, NextWord(servers), sizeof(lcs));
     split = safe_malloc (sizeof(netsplit));
     split->servers = safe_strdup (servers);
+    split->gone = safe_strdup (lcs);
     split->stage = 0;
     split->prev = net->splits;
-    split->members = NULL;
+    split->members = split->last = NULL;
     split->njlast = NULL;
     split->at = Time;
     net->splits = split;
+    if (Insert_Key (&net->splitservers, split->gone, split, 1))
+      ERROR ("_ircch_netsplit_add: tree error");
   }
-  /* find the end and consistency check at the same time */
-  sm = &split->members;
-  for (sm = &split->members; *sm; sm = &(*sm)->next)
-    if ((*sm)->member->nick == nick)
+  /* consistency check */
+  for (link = nick->channels; link; link = link->prevchan)
+    if (link->split && link->split->split == split)
       break;
-  if (*sm)
+  if (link)
   {
     ERROR ("_ircch_netsplit_add: %s is already in split list!", nick->name);
     return;
   }
   for (link = nick->channels; link; link = link->prevchan)
   {
-    *sm = alloc_SplitMember();
-    (*sm)->member = link;
-    split->njlast = *sm;
-    sm = &(*sm)->next;
+    if (link->split)			/* left from previous split, drop it */
+      _ircch_split_member_delete (link->split->split, link->split);
+    sm = alloc_SplitMember();
+    sm->member = link;
+    sm->split = split;
+    sm->next = NULL;
+    if ((sm->prev = split->last))
+      split->last->next = sm;
+    else
+      split->members = sm;
+    split->last = sm;
+    link->split = sm;
+    split->njlast = sm;
     DBG ("_ircch_netsplit_add: %s", link->chan->chi->name);
   }
-  *sm = NULL;	/* there is no implicit value there! */
   split->njlastact = Time;
   if (nick->channels)
   {
@@ -1162,8 +1345,7 @@ static void _ircch_netjoin_add (IRC *net, LINK *link)
     New_Request (net->neti, F_QUICK, "LINKS %s", NextWord(split->servers));
     split->stage = 2;			/* going to stage 2 now */
   }
-  for (sm = split->members; sm && sm->member != link; sm = sm->next);
-  if (!sm)
+  if (!(sm = link->split) || sm->split != split)
   {
     ERROR ("_ircch_netjoin_add: link %s@%s absent in split list!",
 	   link->nick->name, link->chan->chi->name);
@@ -1181,46 +1363,37 @@ static void _ircch_netjoin_add (IRC *net, LINK *link)
 /* removes the user from netsplit list and clears nick->split */
 static void _ircch_netsplit_remove_nick (NICK *nick)
 {
-  SplitMember **s = &nick->split->members;
-  register SplitMember *sm;
+  netsplit *split = nick->split;
+  LINK *link;
 
   DBG ("_ircch_netsplit_remove_nick: %s", nick->name);
   nick->split = NULL;
   /* since _ircch_net_got_activity called we have nick->split->njlast == NULL */
-  while ((sm = *s))
-  {
-    if (sm->member->nick == nick)
-    {
-      *s = sm->next;
-      free_SplitMember (sm);
-    }
-    else
-      s = &sm->next;
-  }
+  for (link = nick->channels; link; link = link->prevchan)
+    if (link->split && link->split->split == split)
+      _ircch_split_member_delete (split, link->split);
 }
 
 /* silently "close" netsplit for a channel, i.e. just purge every entry
  * matching this channel from netsplit list */
 static void _ircch_netsplit_purge_channel (netsplit *split, CHANNEL *ch)
 {
-  SplitMember **s = &split->members;
-  register SplitMember *sm;
+  SplitMember *sm, *next;
   NICK *nick;
+  LINK *link;
 
-  while (*s)
+  for (sm = split->members; sm; sm = next)
   {
-    if ((*s)->member->chan == ch)
-    {
-      nick = (*s)->member->nick;
-      sm = *s;
-      *s = sm->next;
-      free_SplitMember (sm);
-      for (sm = split->members; sm && sm->member->nick != nick; sm = sm->next);
-      if (!sm)		/* this nick is nowhere now, no more split for them */
-	nick->split = NULL; /* nick will be deleted by purging channel later */
-    }
-    else
-      s = &(*s)->next;
+    next = sm->next;
+    if (sm->member->chan != ch)
+      continue;
+    nick = sm->member->nick;
+    _ircch_split_member_delete (split, sm);
+    for (link = nick->channels; link; link = link->prevchan)
+      if (link->split && link->split->split == split)
+	break;
+    if (!link)		/* this nick is nowhere now, no more split for them */
+      nick->split = NULL; /* nick will be deleted by purging channel later */
   }
 }
 
@@ -2334,9 +2507,9 @@ static int irc_topic (INTERFACE *iface, char *svname, char *me, unsigned char *p
   _ircch_recheck_link (net, link, lname, uf, cf, r, id);
   _ircch_net_got_activity (net, link);
   /* set structure */
-  ircch_remove_mask (&ch->topic, ch->topic);
+  FREE (&ch->topic);
   if (parv[1]) /* save it even if it's empty */
-    ircch_add_mask (&ch->topic, prefix, s, parv[1]);
+    ch->topic = _ircch_new_list (prefix, s, parv[1]);
   /* run bindings, log it... */
   snprintf (str, sizeof(str), "%s %s", ch->chi->name, parv[1]);
   for (bind = NULL; (bind = Check_Bindtable (BT_IrcTopic, str, uf, cf, bind)); )
@@ -2548,7 +2721,7 @@ static int irc_rpl_notopic (INTERFACE *iface, char *svname, char *me,
     return -1;		/* impossible... */
   ch = _ircch_get_channel (net, parv[1], 0);
   if (ch)
-    ircch_remove_mask (&ch->topic, ch->topic);
+    FREE (&ch->topic);
   /* don't logging it, UI will ask topic itself */
   return 0;
 }
@@ -2568,9 +2741,9 @@ static int irc_rpl_topic (INTERFACE *iface, char *svname, char *me,
   ch = _ircch_get_channel (net, parv[1], 0);
   if (ch)
   {
-    ircch_remove_mask (&ch->topic, ch->topic);
+    FREE (&ch->topic);
     if (parv[2] && *parv[2])
-      ircch_add_mask (&ch->topic, "", 0, parv[2]);
+      ch->topic = _ircch_new_list ("", 0, parv[2]);
   }
   /* %# - channel, %* - topic */
   printl (str, sizeof(str), format_irc_topic_is, 0, NULL, NULL, NULL,
@@ -2600,10 +2773,9 @@ static int irc_rpl_topicwhotime (INTERFACE *iface, char *svname, char *me,
     return -1;		/* it's impossible, I think */
   }
   topic = ch->topic;			/* store it */
-  ch->topic = NULL;			/* it will be reset */
-  ircch_add_mask (&ch->topic, parv[2], strlen (parv[2]), topic->what);
+  ch->topic = _ircch_new_list (parv[2], strlen (parv[2]), topic->what);
   ch->topic->since = strtoul (parv[3], NULL, 10);
-  ircch_remove_mask (&topic, topic);	/* unalloc stored */
+  FREE (&topic);			/* unalloc stored */
   localtime_r (&ch->topic->since, &tm);
   strftime (tdate, sizeof(tdate), "%c", &tm);
   /* %N - nick, %@ - when, %# - channel */
@@ -2822,14 +2994,14 @@ static int irc_rpl_links (INTERFACE *iface, char *svname, char *me,
 			  size_t (*lc) (char *, const char *, size_t))
 {/* Parameters: me <mask> <via> :<hopcount> <server info> */
   IRC *net = _ircch_get_network (iface->name, 0, lc);
-  netsplit **split;
+  netsplit *split;
 
   if (!net || parc < 3)
     return -1;		/* impossible... */
   else if (!(split = _ircch_netsplit_find (net, parv[1])))
     return 0;		/* server isn't in split */
   dprint (5, "ircch: got reply for split server %s", parv[1]);
-  (*split)->stage = 3;
+  split->stage = 3;
   _ircch_net_got_activity (net, NULL);
   return 1;
 }
@@ -2840,15 +3012,15 @@ static int irc_rpl_endoflinks (INTERFACE *iface, char *svname, char *me,
 			       size_t (*lc) (char *, const char *, size_t))
 {/* Parameters: me <mask> "End of /LINKS list" */
   IRC *net = _ircch_get_network (iface->name, 0, lc);
-  netsplit **split;
+  netsplit *split;
 
   if (!net || parc < 3)
     return -1;		/* impossible... */
   else if (!(split = _ircch_netsplit_find (net, parv[1])))
     return 0;		/* alien request or netsplit is over */
-  if ((*split)->stage == 3)	/* ok, netsplit seems to be over */
+  if (split->stage == 3)	/* ok, netsplit seems to be over */
     return 1;
-  _ircch_its_rejoin (net, *split);
+  _ircch_its_rejoin (net, split);
   return 1;
 }
 
@@ -3462,29 +3634,23 @@ static modeflag incl_irc (const char *netn, const char *channel, const char *nam
 	  unistrlower (&lcname[n], uh, sizeof(lcname) - n);
 	  FREE (&name2);
 	  /* check for exact invite/ban/exception */
-	  listi = ircch_find_mask (link->chan->invites, lcname);
+	  listi = ircch_find_mask (&ch->invites, lcname);
 	  if (listi) /* ignore bans if found */
 	    list = NULL;
 	  else
-	    list = ircch_find_mask (link->chan->bans, lcname);
+	    list = ircch_find_mask (&ch->bans, lcname);
 	  if (!list) /* ignore excepts if no ban */
 	    liste = NULL;
 	  else
-	    liste = ircch_find_mask (link->chan->exempts, lcname);
+	    liste = ircch_find_mask (&ch->exempts, lcname);
 	  /* check for matching */
 	  if (!listi && !liste && !list)
 	  {
-	    for (listi = link->chan->invites; listi; listi = listi->next)
-	      if (match (listi->what, lcname) > 0)
-		break;
+	    listi = ircch_match_mask (&ch->invites, lcname, NULL);
 	    if (!listi)
-	      for (list = link->chan->bans; list; list = list->next)
-		if (match (list->what, lcname) > 0)
-		  break;
+	      list = ircch_match_mask (&ch->bans, lcname, NULL);
 	    if (list)
-	      for (liste = link->chan->exempts; liste; liste = liste->next)
-		if (match (liste->what, lcname) > 0)
-		  break;
+	      liste = ircch_match_mask (&ch->exempts, lcname, NULL);
 	  }
 	  if (listi)
 	  {
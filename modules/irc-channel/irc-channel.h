@@ -46,14 +46,18 @@ typedef struct
 typedef struct SplitMember
 {
   struct SplitMember *next;
-  struct LINK *member;
+  struct SplitMember *prev;
+  struct LINK *member;		/* member->split points back here */
+  struct netsplit *split;
 } SplitMember;
 
 typedef struct netsplit
 {
   struct netsplit *prev;
   char *servers;		/* "left gone" string */
+  char *gone;			/* lower case "gone" server, key in IRC */
   SplitMember *members;		/* nicks@channels in this split */
+  SplitMember *last;
   SplitMember *njlast;		/* for netsplit and netjoin reporting */
   time_t at;			/* when started */
   time_t njlastact;
@@ -63,17 +67,32 @@ typedef struct netsplit
 typedef struct LIST
 {
   struct LIST *next;
+  struct LIST *prev;
+  struct LIST *hnext;		/* next with the same exact hash */
+  struct LIST *inext;		/* next with the same host hash or unindexed */
   char *what;
+  char *key;			/* host index key in what or NULL */
   time_t since;
   char by[1];			/* WARNING: structure of variable size! */
 } __attribute__ ((packed)) LIST;
 
+typedef struct MASKLIST		/* set of bans, exceptions, or invites */
+{
+  LIST *list;			/* all masks in order of adding */
+  LIST *last;
+  LIST **exact;			/* hashed by whole mask */
+  LIST **byhost;		/* hashed by literal host or "*.domain" */
+  LIST *wild;			/* masks which cannot be indexed by host */
+  unsigned int num, hsize;
+} MASKLIST;
+
 typedef struct LINK
 {
   struct CHANNEL *chan;
   struct LINK *prevnick;	/* chrec->nicks => link->prevnick ... */
   struct NICK *nick;
   struct LINK *prevchan;	/* nick->channels => link->prevchan... */
+  struct SplitMember *split;	/* if it's in netsplit list */
   modeflag mode;
   time_t activity;
   time_t lmct;			/* last modechange time by me */
@@ -87,7 +106,8 @@ typedef struct CHANNEL
   char *real;			/* Channel from our JOIN as is */
   LINK *nicks;
   char *key;
-  LIST *topic, *bans, *exempts, *invites;
+  LIST *topic;
+  MASKLIST bans, exempts, invites;
   modeflag mode;		/* current mode, +A_ME when not fully synced */
   modeflag mlock, munlock;	/* from config */
   unsigned short limit;		/* if 0 then unlimited, -1 = modeunlock +l */
@@ -120,6 +140,7 @@ typedef struct IRC
   NODE *lnames;			/* referenced data is last NICK */
   NICK *me;
   netsplit *splits;
+  NODE *splitservers;		/* referenced data is netsplit */
   invited_t *invited;
   time_t last_rejoin;
   int maxmodes, maxbans, maxtargets;
@@ -130,9 +151,11 @@ typedef struct IRC
 CHANNEL *ircch_find_service (const char *, IRC **);
 LINK *ircch_find_link (IRC *, char *, CHANNEL *);
 NICK *ircch_retry_nick (IRC *, const char *);
-int ircch_add_mask (LIST **, char *, size_t, char *);
-LIST *ircch_find_mask (LIST *, char *);
-void ircch_remove_mask (LIST **, LIST *);
+int ircch_add_mask (MASKLIST *, char *, size_t, char *);
+LIST *ircch_find_mask (MASKLIST *, char *);
+LIST *ircch_match_mask (MASKLIST *, const char *, LIST *);
+void ircch_remove_mask (MASKLIST *, LIST *);
+void ircch_clear_masks (MASKLIST *);
 
 void ircch_recheck_modes (IRC *, LINK *, userflag, userflag, char *, int);
 void ircch_recheck_channel_modes (IRC *, CHANNEL *);
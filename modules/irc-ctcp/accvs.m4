@@ -5,3 +5,5 @@ if test "$ac_cv_search_inet_ntop" != no; then :
   fi
 fi
 
+dnl Preallocation of files on DCC GET
+AC_CHECK_FUNCS(fallocate posix_fallocate)
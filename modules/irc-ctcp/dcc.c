@@ -23,6 +23,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include "modules.h"
 #include "direct.h"
@@ -34,6 +35,11 @@
 #define MINBLOCKSIZE	256
 #define MAXBLOCKSIZE	16384
 
+#define DCC_ACK_WAIT	1000	/* ms, max time to wait for ack */
+#define DCC_RATE_WAIT	50	/* ms, to wait while rate limit is reached */
+#define DCC_WRITEBLOCK	65536	/* disk write unit on getting */
+#define DCC_SENDERS	2	/* threads serving all DCC SEND transfers */
+
 typedef struct dcc_priv_t
 {
   pthread_mutex_t mutex;		/* for ->ptr ... ->wait_accept */
@@ -76,6 +82,8 @@ static long int ircdcc_resume_timeout = 30;
 static long int ircdcc_resume_min = 10000;
 static long int ircdcc_get_maxsize = 1000000000;
 static long int ircdcc_blocksize = 2048;
+static long int ircdcc_send_rate = 0;	/* bytes per second, 0 - unlimited */
+static long int ircdcc_total_rate = 0;
 static bool ircdcc_allow_dcc_chat = TRUE;
 static bool ircdcc_allow_resume = TRUE;
 static bool ircdcc_do_resume_send = (CAN_ASK | TRUE);	/* yes */
@@ -93,6 +101,76 @@ static char *format_dcc_request;
 #define ALLOCSIZE 2
 ALLOCATABLE_TYPE (dcc_priv_t, DCC, next) /* alloc_dcc_priv_t(), free_dcc_priv_t() */
 
+/* token bucket for rate limit, may hold up to one second of data */
+typedef struct dcc_bucket_t
+{
+  ssize_t tokens;			/* bytes allowed to send now */
+  struct timespec last;			/* time of last refill */
+} dcc_bucket_t;
+
+static dcc_bucket_t DccTotalBucket;	/* shared by all DCC SEND */
+static pthread_mutex_t DccTotalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _dcc_bucket_fill (dcc_bucket_t *b, long int rate,
+			      const struct timespec *now)
+{
+  long long int add;
+
+  add = ((now->tv_sec - b->last.tv_sec) * 1000LL +
+	 (now->tv_nsec - b->last.tv_nsec) / 1000000) * rate / 1000;
+  if (add <= 0)				/* keep fractions for next time */
+    return;
+  b->last = *now;
+  if (add > rate)
+    add = rate;
+  b->tokens += add;
+  if (b->tokens > rate)
+    b->tokens = rate;
+}
+
+/* returns how much of sz bytes rate limits allow to send now */
+static size_t _dcc_rate_allow (dcc_bucket_t *own, size_t sz)
+{
+  struct timespec now;
+  long int rate;
+
+  if (ircdcc_send_rate <= 0 && ircdcc_total_rate <= 0)
+    return sz;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  if ((rate = ircdcc_send_rate) > 0)
+  {
+    _dcc_bucket_fill (own, rate, &now);
+    if (own->tokens <= 0)
+      return 0;
+    if (sz > (size_t)own->tokens)
+      sz = own->tokens;
+  }
+  if ((rate = ircdcc_total_rate) > 0)
+  {
+    pthread_mutex_lock (&DccTotalLock);
+    _dcc_bucket_fill (&DccTotalBucket, rate, &now);
+    if (DccTotalBucket.tokens <= 0)
+      sz = 0;
+    else if (sz > (size_t)DccTotalBucket.tokens)
+      sz = DccTotalBucket.tokens;
+    pthread_mutex_unlock (&DccTotalLock);
+  }
+  return sz;
+}
+
+/* takes sent bytes from buckets, concurrent senders may go below zero a bit */
+static void _dcc_rate_spend (dcc_bucket_t *own, size_t sz)
+{
+  if (ircdcc_send_rate > 0)
+    own->tokens -= sz;
+  if (ircdcc_total_rate > 0)
+  {
+    pthread_mutex_lock (&DccTotalLock);
+    DccTotalBucket.tokens -= sz;
+    pthread_mutex_unlock (&DccTotalLock);
+  }
+}
+
 /* has no locks so non-thread calls only! */
 static dcc_priv_t *new_dcc (void)
 {
@@ -141,8 +219,10 @@ static void free_dcc (dcc_priv_t *dcc)
     m	got timeout? don't wait for DCC ACCEPT anymore
     m	kill thread 1 and if state!=P_QUIT then start connection
     2	got connected, start main interface (_dcc_X_handler())
-    2	terminate thread and socket when done
-    m	join thread 2 and finish all
+    2	terminate thread and socket when done, or for file sending give
+	it to senders (few threads shared by all transfers) and finish
+    s	send file, terminate socket when done
+    m	join thread 2, take it from senders if it's still there, finish all
 
 interfaces (L means listener; 1 - thread 1; 2a - pre-connect; 2b - connected):
     DCC CHAT    CTCP CHAT   DCC SEND    DCC SEND(p) sending     sending(p)
@@ -161,6 +241,8 @@ interface signal functions (requests disabled):
 	- P_INITIAL: waiting for outgoing connection or got incoming
 	- P_TALK: in file transfer */
 
+static void _dcc_isend_forget (dcc_priv_t *);
+
 /* when: before connection, in connection, on finishing stage 2 */
 static iftype_t _dcc_sig_2 (INTERFACE *iface, ifsig_t signal)
 {
@@ -255,6 +337,8 @@ static iftype_t _dcc_sig_2 (INTERFACE *iface, ifsig_t signal)
       pthread_cancel(dcc->th);
       Unset_Iface();			/* unlock dispatcher */
       pthread_join (dcc->th, NULL);	/* ...it die itself, waiting for it */
+      if (dcc->filename)		/* file may be still sent by sender */
+	_dcc_isend_forget (dcc);
       Set_Iface (NULL);			/* restore status quo */
       FREE (&dcc->filename);
       KillTimer (dcc->tid);		/* if it's still on timeout */
@@ -402,20 +486,387 @@ static void _dcc_inc_pre (pthread_t th, void **data, idx_t *as)
   Unset_Iface();
 }
 
-struct send_cleanup {
+/* transfer data, everything is freed by cleanup */
+struct dcc_xfer {
   idx_t socket;
-  char *buff;
-  FILE *f;
+  int fd;				/* file to send or get */
+  pthread_mutex_t mutex;		/* for ->ready, on getting */
+  pthread_cond_t cond;
+  bool ready;				/* socket has something to read */
+  dcc_bucket_t bucket;			/* own rate limit, on sending */
+  char *buf;				/* data not written yet, on getting */
+  size_t inbuf;
+  off_t bufoff;				/* file offset of ->buf */
+  char *partname;			/* hidden partial file, on getting */
+  const char *filename;			/* final name, on getting */
+  /* the rest is for sending, ->ready is locked by DccSendLock then */
+  dcc_priv_t *dcc;
+  struct dcc_xfer *next;		/* in DccSending list */
+  bool busy;				/* some sender works on it */
+  struct timespec when;			/* look at it again at that time */
+  uint32_t ptr, aptr;			/* ptr, ack ptr */
+  size_t bs, ahead;
+  unsigned char ack[16];		/* acks got from socket */
+  size_t ackgot;
+  time_t t, start;
+  size_t statistics[16];		/* to calculate average speed */
 };
 
-static void _send_handler_cleanup(void *ptr)
+static struct dcc_xfer *_dcc_xfer_new (idx_t socket)
+{
+  struct dcc_xfer *dx = safe_calloc(1, sizeof(struct dcc_xfer));
+
+  dx->socket = socket;
+  dx->fd = -1;
+  pthread_mutex_init (&dx->mutex, NULL);
+  pthread_cond_init (&dx->cond, NULL);
+  return dx;
+}
+
+/* called by sockets poll thread so should be quick */
+static void _dcc_xfer_wakeup (void *ptr)
+{
+  struct dcc_xfer *dx = ptr;
+
+  pthread_mutex_lock (&dx->mutex);
+  dx->ready = TRUE;
+  pthread_cond_signal (&dx->cond);
+  pthread_mutex_unlock (&dx->mutex);
+}
+
+static void _dcc_xfer_mutex_cleanup (void *ptr)
+{
+  pthread_mutex_unlock (ptr);
+}
+
+/* sets ts to ms milliseconds from now */
+static void _dcc_time_after (struct timespec *ts, long int ms)
+{
+  clock_gettime (CLOCK_REALTIME, ts);
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000)
+  {
+    ts->tv_nsec -= 1000000000;
+    ts->tv_sec++;
+  }
+}
+
+/* waits up to ms milliseconds or until socket has some data or room */
+static void _dcc_xfer_wait (struct dcc_xfer *dx, long int ms)
+{
+  struct timespec abstime;
+
+  _dcc_time_after (&abstime, ms);
+  pthread_mutex_lock (&dx->mutex);
+  pthread_cleanup_push (&_dcc_xfer_mutex_cleanup, &dx->mutex);
+  if (!dx->ready)
+    pthread_cond_timedwait (&dx->cond, &dx->mutex, &abstime);
+  dx->ready = FALSE;
+  pthread_cleanup_pop (1);
+}
+
+static void _dcc_xfer_cleanup (void *ptr)
+{
+  struct dcc_xfer *dx = ptr;
+
+  AssociateSocket (dx->socket, NULL, NULL);
+  KillSocket (&dx->socket);
+  if (dx->fd >= 0)
+    close (dx->fd);
+  FREE (&dx->buf);
+  FREE (&dx->partname);
+  pthread_cond_destroy (&dx->cond);
+  pthread_mutex_destroy (&dx->mutex);
+  FREE (&dx);
+}
+
+/* ----------------------------------------------------------------------------
+   senders: all DCC SEND transfers are served by few threads, each sender
+   picks a transfer which has some event on socket or which timer is out,
+   does one round of sending and goes to the next one; transfer may be
+   taken away from senders only when no sender works on it */
+
+static struct dcc_xfer *DccSending = NULL; /* transfers in progress */
+static pthread_mutex_t DccSendLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t DccSendWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t DccSendIdle = PTHREAD_COND_INITIALIZER;
+static pthread_t DccSenders[DCC_SENDERS];
+static unsigned int DccSendersNum = 0;
+
+/* called by sockets poll thread so should be quick */
+static void _dcc_isend_wakeup (void *ptr)
+{
+  struct dcc_xfer *dx = ptr;
+
+  pthread_mutex_lock (&DccSendLock);
+  dx->ready = TRUE;
+  pthread_cond_signal (&DccSendWork);
+  pthread_mutex_unlock (&DccSendLock);
+}
+
+/* does one round of sending, returns ms to wait or -1 if transfer is over */
+static long int _dcc_isend_step (struct dcc_xfer *dx)
+{
+  dcc_priv_t *dcc = dx->dcc;
+  uint32_t nptr, sr;
+  off_t off;
+  time_t t2;
+  size_t sz;
+  ssize_t sw;
+
+  pthread_mutex_lock (&dcc->mutex);
+  dcc->ptr = dx->ptr;
+  time (&t2);
+  if (dx->t != t2)
+  {
+    for (sw = 0, sr = 0; sr < 16; sr++)	/* use sr as temp */
+      sw += dx->statistics[sr];
+    sr = t2 - dx->start;
+    if (sr > 16)
+      sr = 16;
+    dcc->rate = sw/sr;
+    while (dx->t < t2)
+      dx->statistics[(++dx->t)%16] = 0;
+  }
+  pthread_mutex_unlock (&dcc->mutex);
+  /* take all acks came so far, only the last one matters */
+  sr = dx->aptr;
+  while ((sw = ReadSocket ((char *)&dx->ack[dx->ackgot], dx->socket,
+			   sizeof(dx->ack) - dx->ackgot)) > 0)
+  {
+    dx->ackgot += sw;
+    if (dx->ackgot < sizeof(nptr))
+      continue;
+    sz = dx->ackgot - dx->ackgot % sizeof(nptr); /* size of complete acks */
+    memcpy (&nptr, &dx->ack[sz - sizeof(nptr)], sizeof(nptr));
+    sr = ntohl (nptr);
+    dx->ackgot -= sz;
+    memmove (dx->ack, &dx->ack[sz], dx->ackgot);
+  }
+  if (sw < 0 && sw != E_AGAIN)
+    return -1;					/* connection error */
+  if (sr != dx->aptr)
+  {
+    DBG ("DCC SEND %s:got ack %#x.", dcc->filename, (int)sr);
+    if (sr < dx->aptr || sr > dx->ptr)		/* wrong ack */
+      return -1;
+    dx->aptr = sr;				/* updating aptr */
+  }
+  if (dx->aptr >= dcc->size)			/* all done! */
+    return -1;
+  /* send as much as ahead window and rate limits allow */
+  FOREVER
+  {
+    if (dx->ptr >= dcc->size || dx->aptr + dx->ahead + dx->bs <= dx->ptr)
+      return DCC_ACK_WAIT;			/* ack will wake us */
+    sz = dx->aptr + dx->ahead + dx->bs - dx->ptr;
+    if (sz > dcc->size - dx->ptr)
+      sz = dcc->size - dx->ptr;
+    if ((sz = _dcc_rate_allow (&dx->bucket, sz)) == 0)
+      return DCC_RATE_WAIT;
+    off = dx->ptr;
+    sw = SendFileSocket (dx->socket, dx->fd, &off, &sz);
+    if (sw < 0)
+      return -1;			/* socket died or file was truncated */
+    if (sw == 0)			/* buffer is full, POLLOUT will wake us */
+      return DCC_ACK_WAIT;
+    _dcc_rate_spend (&dx->bucket, sw);
+    dx->ptr += sw;				/* updating ptr */
+    dx->statistics[dx->t%16] += sw;
+    DBG ("DCC SEND %s:sent %zd bytes.", dcc->filename, sw);
+  }
+}
+
+/* reports result and lets _dcc_sig_2() finish the rest */
+static void _dcc_isend_finish (struct dcc_xfer *dx)
+{
+  char buff[MESSAGEMAX];
+  dcc_priv_t *dcc = dx->dcc;
+  char *lname;
+  const char *c;
+  userflag uf;
+  struct clrec_t *u;
+  struct binding_t *b;
+  uint32_t sr;
+
+  if (dx->ptr >= dcc->size)
+  {
+    c = strchr (dcc->l.iface->name, '@') + 1; /* network name */
+    Set_Iface (NULL);
+    if (dcc->lname[0])			/* we know Lname already */
+    {
+      lname = NULL;
+      uf = Get_Clientflags (dcc->lname, c);
+      c = dcc->lname;
+    }
+    else if ((u = Find_Clientrecord ((uchar *)dcc->uh, &c, &uf, c))) /* ok, find it */
+    {
+      lname = safe_strdup (c);
+      Unlock_Clientrecord (u);
+      c = NONULL((const char *)lname);
+    }
+    else				/* cannot recognize target Lname */
+    {
+      lname = NULL;
+      c = "";
+      uf = 0;
+    }
+    b = NULL;
+    while ((b = Check_Bindtable (BT_Upload, c, uf, U_ANYCH, b)))
+      if (b->name)
+	RunBinding (b, NULL, lname, dcc->l.iface->name, NULL, -1, dcc->filename);
+      else
+	b->func (dcc->uh, dcc->filename);
+    /* %L - Lname, %N - nick@net, %@ - user@host, %I - socket, %* - filename */
+    sr = strchr (dcc->uh, '!') - dcc->uh;
+    printl (buff, sizeof(buff), format_dcc_sentfile, 0, dcc->l.iface->name,
+	    &dcc->uh[sr+1], lname, NULL, dcc->socket + 1, 0, 0, dcc->filename);
+    Unset_Iface();
+    FREE (&lname);
+    LOG_CONN ("%s", buff);
+  }
+  else
+    ERROR ("DCC SEND %s failed: sent %lu out of %lu bytes.", dcc->filename,
+	   (unsigned long int)dx->ptr, (unsigned long int)dcc->size);
+  Set_Iface (NULL);
+  dcc->socket = -1;			/* it will be closed by cleanup */
+  dcc->l.iface->ift |= I_FINWAIT; /* all rest will be done by _dcc_sig_2() */
+  Unset_Iface();
+}
+
+static void _dcc_sender_cleanup (void *ptr)
+{
+  pthread_mutex_unlock (&DccSendLock);
+}
+
+static void *_dcc_sender (void __attribute__((unused)) *data)
 {
-  struct send_cleanup *scd = ptr;
+  struct dcc_xfer *dx, **pdx;
+  struct timespec now, abstime;
+  long int wait;
+  int cancelstate;
+
+  pthread_mutex_lock (&DccSendLock);
+  pthread_cleanup_push (&_dcc_sender_cleanup, NULL);
+  FOREVER
+  {
+    clock_gettime (CLOCK_REALTIME, &now);
+    abstime.tv_sec = 0;			/* nearest timer if nothing to do */
+    abstime.tv_nsec = 0;
+    for (pdx = &DccSending; (dx = *pdx); pdx = &dx->next)
+    {
+      if (dx->busy)
+	continue;
+      if (dx->ready || dx->when.tv_sec < now.tv_sec ||
+	  (dx->when.tv_sec == now.tv_sec && dx->when.tv_nsec <= now.tv_nsec))
+	break;
+      if (abstime.tv_sec == 0 || dx->when.tv_sec < abstime.tv_sec ||
+	  (dx->when.tv_sec == abstime.tv_sec &&
+	   dx->when.tv_nsec < abstime.tv_nsec))
+	abstime = dx->when;
+    }
+    if (dx == NULL)
+    {
+      if (abstime.tv_sec == 0)
+	pthread_cond_wait (&DccSendWork, &DccSendLock);
+      else
+	pthread_cond_timedwait (&DccSendWork, &DccSendLock, &abstime);
+      continue;
+    }
+    /* move it to end of list so others will be served first next time */
+    *pdx = dx->next;
+    for (; *pdx; pdx = &(*pdx)->next);
+    *pdx = dx;
+    dx->next = NULL;
+    dx->busy = TRUE;
+    dx->ready = FALSE;
+    pthread_mutex_unlock (&DccSendLock);
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancelstate);
+    if ((wait = _dcc_isend_step (dx)) < 0)
+      _dcc_isend_finish (dx);
+    else
+      _dcc_time_after (&dx->when, wait);
+    pthread_mutex_lock (&DccSendLock);
+    if (wait < 0)			/* nobody can find it after that */
+    {
+      for (pdx = &DccSending; *pdx != dx; pdx = &(*pdx)->next);
+      *pdx = dx->next;
+    }
+    dx->busy = FALSE;
+    pthread_cond_broadcast (&DccSendIdle);
+    if (wait < 0)
+    {
+      pthread_mutex_unlock (&DccSendLock);
+      _dcc_xfer_cleanup (dx);
+      pthread_mutex_lock (&DccSendLock);
+    }
+    pthread_setcancelstate (cancelstate, NULL);
+  }
+  pthread_cleanup_pop (1);
+  return NULL;
+}
 
-  KillSocket (&scd->socket);
-  FREE (&scd->buff);
-  if (scd->f)
-    fclose (scd->f);
+/* gives transfer to senders, starting them if needed
+   returns FALSE if there are no senders */
+static bool _dcc_isend_add (struct dcc_xfer *dx)
+{
+  struct dcc_xfer **pdx;
+
+  pthread_mutex_lock (&DccSendLock);
+  while (DccSendersNum < DCC_SENDERS &&
+	 pthread_create (&DccSenders[DccSendersNum], NULL, &_dcc_sender,
+			 NULL) == 0)
+    DccSendersNum++;
+  if (DccSendersNum == 0)
+  {
+    pthread_mutex_unlock (&DccSendLock);
+    return FALSE;
+  }
+  dx->ready = TRUE;			/* let start sending now */
+  dx->busy = FALSE;
+  dx->next = NULL;
+  for (pdx = &DccSending; *pdx; pdx = &(*pdx)->next);
+  *pdx = dx;
+  pthread_cond_signal (&DccSendWork);
+  pthread_mutex_unlock (&DccSendLock);
+  return TRUE;
+}
+
+/* takes transfer of dcc away from senders if it's still there */
+static void _dcc_isend_forget (dcc_priv_t *dcc)
+{
+  struct dcc_xfer *dx, **pdx;
+
+  pthread_mutex_lock (&DccSendLock);
+  FOREVER
+  {
+    for (pdx = &DccSending; (dx = *pdx); pdx = &dx->next)
+      if (dx->dcc == dcc)
+	break;
+    if (dx == NULL || !dx->busy)
+      break;
+    pthread_cond_wait (&DccSendIdle, &DccSendLock);
+  }
+  if (dx)
+    *pdx = dx->next;
+  pthread_mutex_unlock (&DccSendLock);
+  if (dx)
+  {
+    dcc->socket = -1;			/* it will be closed by cleanup */
+    _dcc_xfer_cleanup (dx);
+  }
+}
+
+/* called on module termination when all transfers are gone already */
+static void _dcc_senders_stop (void)
+{
+  while (DccSendersNum)
+  {
+    DccSendersNum--;
+    pthread_cancel (DccSenders[DccSendersNum]);
+    pthread_join (DccSenders[DccSendersNum], NULL);
+  }
 }
 
 /* connected for sending file, fields are now:
@@ -430,26 +881,20 @@ static void _send_handler_cleanup(void *ptr)
     .iface	thread interface (I_CONNECT nick@net)
     .socket	socket ID
     .th		thread ID
-    .mutex	initialised and unlocked */
+    .mutex	initialised and unlocked
+   file is opened here and then transfer is given to senders which send
+   file data by kernel directly from file to socket (if supported) */
 static void isend_handler (char *lname, char *ident, const char *host, void *data)
 {
-  char *buff;
+  char buff[MESSAGEMAX];
   dcc_priv_t *dcc = data;
-  FILE *f;
-  struct send_cleanup *scd;
-  uint32_t ptr, aptr, nptr;		/* ptr, ack ptr, net-ordered */
+  struct dcc_xfer *dx;
+  size_t bs;
   uint32_t sr;
-  time_t t, t2, start;
-  size_t bs, bptr, ahead;
-  ssize_t sw;
-  size_t statistics[16];		/* to calculate average speed */
-  //int rsm;				/* read socket mode */
-  bool wantack;
+  int cancelstate;
 
   dprint (5, "dcc:isend_handler for %s to \"%s\".", lname, dcc->lname);
-  scd = safe_calloc(1, sizeof(struct send_cleanup));
-  scd->socket = dcc->socket;
-  scd->buff = buff = safe_malloc (MAXBLOCKSIZE);
+  dx = _dcc_xfer_new (dcc->socket);
   Set_Iface (dcc->l.iface);
   if (host)				/* if it's from passive then it's NULL */
   {
@@ -457,14 +902,14 @@ static void isend_handler (char *lname, char *ident, const char *host, void *dat
     snprintf (&dcc->uh[sr], sizeof(dcc->uh) - sr, "!%s@%s", ident ? ident : "*",
 	      host ? host : "*");
   }					/* dcc->uh is nick!user@host now */
-  pthread_cleanup_push(&_send_handler_cleanup, scd);
+  pthread_cleanup_push(&_dcc_xfer_cleanup, dx);
   dcc->ptr = 0;
   dcc->rate = 0;
   if (dcc->startptr == 1)		/* it was '-flush' flag */
     dcc->startptr = 0;
   dcc->state = P_TALK;			/* now we can use mutex, ok */
-  scd->f = f = fopen (dcc->filename, "rb"); /* try to open file */
-  if (f == NULL)
+  dx->fd = open (dcc->filename, O_RDONLY); /* try to open file */
+  if (dx->fd < 0)
   {
 #if _GNU_SOURCE
     register const char *str = strerror_r (errno, buff, sizeof(buff));
@@ -474,129 +919,38 @@ static void isend_handler (char *lname, char *ident, const char *host, void *dat
       strfcpy(buff, "(failed to decode error)", sizeof(buff));
     ERROR ("DCC SEND: cannot open file %s: %s.", dcc->filename, buff);
 #endif
-    goto done;
   }
-  bs = ircdcc_blocksize;
-  if (bs > MAXBLOCKSIZE)
-    bs = MAXBLOCKSIZE;
-  if (bs < MINBLOCKSIZE)
-    bs = MINBLOCKSIZE;
-  Send_Signal (I_MODULE, "ui", S_FLUSH); /* notify the UI on transfer */
-  Unset_Iface();
-  fseek (f, dcc->startptr, SEEK_SET);
-  aptr = ptr = dcc->startptr;
-  ahead = dcc->ahead * bs;
-  start = time (&t);
-  memset (statistics, 0, sizeof(statistics));
-  //rsm = M_RAW;
-  wantack = FALSE;
-  FOREVER					/* cycle to send file */
+  else
   {
-    pthread_mutex_lock (&dcc->mutex);
-    dcc->ptr = ptr;
-    time (&t2);
-    if (t != t2)
+    bs = ircdcc_blocksize;
+    if (bs > MAXBLOCKSIZE)
+      bs = MAXBLOCKSIZE;
+    if (bs < MINBLOCKSIZE)
+      bs = MINBLOCKSIZE;
+    dx->dcc = dcc;
+    dx->bs = bs;
+    dx->ahead = dcc->ahead * bs;
+    dx->aptr = dx->ptr = dcc->startptr;
+    dx->start = time (&dx->t);
+    /* sockets may call it before it's in the list, that's harmless */
+    AssociateSocket (dx->socket, &_dcc_isend_wakeup, dx);
+    pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancelstate);
+    if (_dcc_isend_add (dx))
     {
-      for (sw = 0, sr = 0; sr < 16; sr++)	/* use sr as temp */
-	sw += statistics[sr];
-      sr = t2 - start;
-      if (sr > 16)
-	sr = 16;
-      dcc->rate = sw/sr;
-      while (t < t2)
-	statistics[(++t)%16] = 0;
+      Send_Signal (I_MODULE, "ui", S_FLUSH); /* notify the UI on transfer */
+      dx = NULL;			/* it's owned by senders now */
     }
-    pthread_mutex_unlock (&dcc->mutex);
-    if (wantack)
-      sw = ReadSocket ((char *)&nptr, dcc->socket, 4); /* next block ack */
     else
-      sw = 0;
-    if (sw < 0 && sw != E_AGAIN)
-      break;					/* connection error */
-    else if (sw > 0)
-    {
-      sr = ntohl (nptr);
-      DBG ("DCC SEND %s:got ack %#x.", dcc->filename, (int)sr);
-    }
-    else					/* try again */
-      sr = aptr;
-    if (sr < aptr || sr > ptr)			/* wrong ack */
-      break;
-    if (sr >= dcc->size)			/* all done! */
-      break;
-    //rsm = M_POLL;				/* don't cycle in M_RAW */
-    wantack = TRUE;
-    aptr = sr;					/* updating aptr */
-    if (aptr + ahead < ptr)
-      continue;					/* not ready to send anything */
-    sw = sr = fread (buff, 1, bs, f);		/* 0 if EOF or error */
-    bptr = 0;
-    while (sw)
-      if (WriteSocket (dcc->socket, buff, &bptr, &sw) < 0)
-	break;					/* if socket died */
-    if (sw || !sr)
-      break;
-    //rsm = M_RAW;				/* we polled already */
-    wantack = FALSE;
-    ptr += sr;					/* updating ptr */
-    statistics[t%16] += sr;
-    DBG ("DCC SEND %s:sent %u bytes.", dcc->filename, (unsigned int)sr);
+      ERROR ("DCC SEND %s: cannot create sender thread.", dcc->filename);
+    pthread_setcancelstate (cancelstate, NULL);
   }
-  if (ptr >= dcc->size)
+  if (dx)				/* failed so finish it here */
   {
-    const char *c;
-    userflag uf;
-    struct clrec_t *u;
-    struct binding_t *b;
-
-    c = strchr (dcc->l.iface->name, '@') + 1; /* network name */
-    Set_Iface (NULL);				/* it will disable cancellation */
-    if (dcc->lname[0])			/* we know Lname already */
-    {
-      lname = NULL;
-      uf = Get_Clientflags (dcc->lname, c);
-      c = dcc->lname;
-    }
-    else if ((u = Find_Clientrecord (buff, &c, &uf, c))) /* ok, find it */
-    {
-      lname = safe_strdup (c);
-      Unlock_Clientrecord (u);
-      c = NONULL((const char *)lname);
-    }
-    else				/* cannot recognize target Lname */
-    {
-      lname = NULL;
-      c = "";
-      uf = 0;
-    }
-    b = NULL;
-    while ((b = Check_Bindtable (BT_Upload, c, uf, U_ANYCH, b)))
-      if (b->name)
-	RunBinding (b, NULL, lname, dcc->l.iface->name, NULL, -1, dcc->filename);
-      else
-	b->func (dcc->uh, dcc->filename);
-    /* %L - Lname, %N - nick@net, %@ - user@host, %I - socket, %* - filename */
-    sr = strchr (dcc->uh, '!') - dcc->uh;
-    printl (buff, MAXBLOCKSIZE, format_dcc_sentfile, 0, dcc->l.iface->name,
-	    &dcc->uh[sr+1], lname, NULL, dcc->socket + 1, 0, 0, dcc->filename);
-    Unset_Iface();
-    FREE (&lname);
-    LOG_CONN ("%s", buff);
-    if (ptr > dcc->size)
-      Add_Request(I_LOG, "*", F_CONN | F_WARN,
-		  "File %s has grown from %lu to %lu bytes while sent.",
-		  dcc->filename,(unsigned long int)dcc->size,
-		  (unsigned long int)ptr);
+    dcc->socket = -1;			/* it will be closed by cleanup */
+    dcc->l.iface->ift |= I_FINWAIT; /* all rest will be done by _dcc_sig_2() */
   }
-  else
-    ERROR ("DCC SEND %s failed: sent %lu out of %lu bytes.", dcc->filename,
-	   (unsigned long int)ptr, (unsigned long int)dcc->size);
-  Set_Iface (NULL);
-done:
-  dcc->socket = -1;			/* it will be closed by cleanup */
-  dcc->l.iface->ift |= I_FINWAIT; /* all rest will be done by _dcc_sig_2() */
   Unset_Iface();
-  pthread_cleanup_pop(1);
+  pthread_cleanup_pop(dx != NULL);
 }
 
 #define dcc ((dcc_priv_t *) input_data)
@@ -691,22 +1045,109 @@ static void _dcc_chat_handler (int res, void *input_data)
     -> packet
     <- bytes got
     -> packet... */
+/* opens partial file on first data, if resuming then existing file is
+   moved there first so we need no copying, returns FALSE on error */
+static bool _dcc_get_open (struct dcc_xfer *dx, uint32_t startptr,
+			   uint32_t size)
+{
+  if (startptr > 0 && rename (dx->filename, dx->partname) < 0)
+    return FALSE;
+  dx->fd = open (dx->partname, O_WRONLY | O_CREAT, 0666);
+  if (dx->fd < 0)
+  {
+    if (startptr > 0)
+      rename (dx->partname, dx->filename);
+    return FALSE;
+  }
+  if (ftruncate (dx->fd, startptr) < 0)	/* drop anything after resume point */
+    return FALSE;
+  dx->bufoff = startptr;
+  if (size > startptr)			/* it's only a hint so ignore errors */
+#if defined(HAVE_FALLOCATE) && defined(FALLOC_FL_KEEP_SIZE)
+    fallocate (dx->fd, FALLOC_FL_KEEP_SIZE, startptr, size - startptr);
+#elif defined(HAVE_POSIX_FALLOCATE)
+    posix_fallocate (dx->fd, startptr, size - startptr);
+#else
+    ;
+#endif
+  return TRUE;
+}
+
+/* writes sz bytes from buffer to partial file, returns FALSE on error */
+static bool _dcc_get_flush (struct dcc_xfer *dx, size_t sz)
+{
+  size_t done = 0;
+  ssize_t sw;
+
+  while (done < sz)
+  {
+    sw = pwrite (dx->fd, &dx->buf[done], sz - done, dx->bufoff + done);
+    if (sw < 0 && errno == EINTR)
+      continue;
+    if (sw <= 0)
+      return FALSE;
+    done += sw;
+  }
+  dx->inbuf -= sz;
+  memmove (dx->buf, &dx->buf[sz], dx->inbuf);
+  dx->bufoff += sz;
+  return TRUE;
+}
+
+/* writes the rest, cuts off preallocated space, and renames partial file */
+static void _dcc_get_finish (struct dcc_xfer *dx)
+{
+  int cancelstate;
+
+  if (dx->fd < 0)
+    return;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+  if (dx->inbuf && !_dcc_get_flush (dx, dx->inbuf))
+    ERROR ("DCC GET: error on saving file %s.", dx->filename);
+  if (ftruncate (dx->fd, dx->bufoff) < 0)
+    ERROR ("DCC GET: error on saving file %s.", dx->filename);
+  close (dx->fd);
+  dx->fd = -1;
+  if (rename (dx->partname, dx->filename) < 0)
+    ERROR ("DCC GET: cannot rename %s to %s.", dx->partname, dx->filename);
+  pthread_setcancelstate(cancelstate, NULL);
+}
+
+static void _dcc_get_cleanup (void *ptr)
+{
+  _dcc_get_finish (ptr);
+  _dcc_xfer_cleanup (ptr);
+}
+
+/* sends network-ordered ptr, returns FALSE if socket died */
+static bool _dcc_get_ack (struct dcc_xfer *dx, uint32_t ptr)
+{
+  uint32_t nptr = htonl (ptr);
+  size_t bp = 0, sz = sizeof(nptr);
+
+  while (sz)
+    if (WriteSocket (dx->socket, (char *)&nptr, &bp, &sz) < 0)
+      return FALSE;
+  return TRUE;
+}
+
 	/* we will get file anyway but if we got ACCEPT then reset startptr */
 	/* on send we will ignore RESUME after first packet already sent */
+	/* data are collected and written to disk in aligned DCC_WRITEBLOCK
+	   chunks, all data got at once are acknowledged by single ack */
 static void _dcc_send_handler (int res, void *input_data)
 {
   int ahead;			/* current ahead size */
-  uint32_t ptr, nptr, ip;	/* current ptr in chunk, network-ordered, IP */
-  //uint32_t aptr, toget;		/* ahead ptr, toget */
+  uint32_t ptr, nptr, ip;	/* current ptr in chunk, temp var, IP */
   uint32_t aptr;		/* ahead ptr */
-  ssize_t bs, sbs, sw, sw2;	/* gotten block size, temp var */
+  ssize_t sbs, sw, sw2;		/* gotten block size, temp var */
+  size_t bs;
+  off_t end;
   time_t t, t2, start;
   size_t statistics[16];	/* to calculate average speed */
-  FILE *f, *rf;			/* opened file */
-  void *buff;
+  char buff[HUGE_STRING];
   char *uh, *sfn;
-  struct send_cleanup *scd;
-  bool wait_accept;
+  struct dcc_xfer *dx;
 
   dprint (5, "dcc:_dcc_send_handler: %d", res);
   if (res != 0)					/* some error catched */
@@ -717,7 +1158,6 @@ static void _dcc_send_handler (int res, void *input_data)
     return;
   }
   pthread_mutex_lock (&dcc->mutex);		/* prepare to work */
-  wait_accept = dcc->wait_accept;
   dcc->ptr = 0;
   ip = dcc->rate;
   dcc->rate = 0;
@@ -727,43 +1167,40 @@ static void _dcc_send_handler (int res, void *input_data)
   Send_Signal (I_MODULE, "ui", S_FLUSH); /* notify the UI on transfer */
   Unset_Iface();
   aptr = ptr = 0;
-  bs = sbs = sw2 = 0;
+  sbs = sw2 = 0;
   ahead = 0;
   start = time (&t);
-  scd = safe_calloc(1, sizeof(struct send_cleanup));
-  scd->socket = dcc->socket;
-  pthread_cleanup_push(&_send_handler_cleanup, scd);
+  dx = _dcc_xfer_new (dcc->socket);
+  pthread_cleanup_push(&_dcc_get_cleanup, dx);
   memset (statistics, 0, sizeof(statistics));
-  if (wait_accept)		/* if waiting for ACCEPT then open temp file */
-    scd->f = f = tmpfile();
-  else if ((f = fopen (dcc->filename, "a")))	/* else open real file */
-  {
-    scd->f = f;
-    fseek (f, (off_t)dcc->startptr, SEEK_SET);
-  }
-  if (f == NULL)
+  sfn = strrchr (dcc->filename, '/');		/* get short filename */
+  if (sfn)
+    sfn++;
+  else
+    sfn = dcc->filename;
+  /* get data into hidden file .name.part until done */
+  snprintf (buff, sizeof(buff), "%.*s.%s.part", (int)(sfn - dcc->filename),
+	    dcc->filename, sfn);
+  dx->partname = safe_strdup (buff);
+  dx->filename = dcc->filename;
+  if (dcc->size == 0 && !_dcc_get_open (dx, 0, 0)) /* there will be no data */
   {
     ERROR ("DCC GET: cannot open local file to download there.");
     goto done;
   }
-  scd->buff = buff = safe_malloc (MAXBLOCKSIZE);
+  dx->buf = safe_malloc (2 * DCC_WRITEBLOCK);
   uh = safe_strchr (dcc->uh, '!');	/* split nick and user@host in buf */
   if (uh)
     uh++;
-  sfn = strrchr (dcc->filename, '/');		/* get short filename */
-  if (sfn)
-    sfn++;
-  else
-    sfn = dcc->filename;
   Set_Iface (NULL);
   /* %L - lname, %@ - uh, %N - nick@net, %I - IP, %* - filename(unquoted) */
-  printl (buff, MAXBLOCKSIZE, format_dcc_startget, 0, dcc->l.iface->name, uh,
+  printl (buff, sizeof(buff), format_dcc_startget, 0, dcc->l.iface->name, uh,
 	  dcc->lname, NULL, ip, 0, 0, sfn);
   Unset_Iface();
-  LOG_CONN ("%s", (char *)buff);		/* do logging */
+  LOG_CONN ("%s", buff);			/* do logging */
+  AssociateSocket (dx->socket, &_dcc_xfer_wakeup, dx);
   FOREVER					/* cycle to get file */
   {
-    //toget = 0;
     time (&t2);
     pthread_mutex_lock (&dcc->mutex);
     dcc->ptr = ptr;
@@ -778,109 +1215,92 @@ static void _dcc_send_handler (int res, void *input_data)
       while (t < t2)
 	statistics[(++t)%16] = 0;
     }
-//    if (dcc->size > dcc->startptr)
-//      toget = dcc->size - dcc->startptr;	/* to get: for use below */
     pthread_mutex_unlock (&dcc->mutex);
-//    if (ptr >= toget)
-    if (ptr >= dcc->size)
-      break;					/* and we got it all */
-    sw = ReadSocket (buff, dcc->socket, MAXBLOCKSIZE); /* next block */
+    sw = 0;
+    if (ptr < dcc->size)			/* next block */
+    {
+      bs = 2 * DCC_WRITEBLOCK - dx->inbuf;
+      if (bs > MAXBLOCKSIZE)
+	bs = MAXBLOCKSIZE;
+      sw = ReadSocket (&dx->buf[dx->inbuf], dx->socket, bs);
+    }
     if (sw > 0)
-      bs = fwrite (buff, 1, sw, f);
-    else if (!sw || sw == E_AGAIN)		/* try again */
     {
-      if (sbs && ahead < dcc->ahead)		/* sending request */
+      if (dx->fd < 0)				/* transfer started */
       {
-	nptr = aptr + sbs;
-//	if (nptr >= toget)			/* nowhere to ahead */
-	if (nptr >= dcc->size)
-	  continue;
-	ahead++;
-	aptr = nptr;
-	DBG ("DCC GET %s:ack ptr %#x ahead bs %d.", dcc->filename, (int)aptr, (int)sbs);
-	nptr = htonl (aptr);			/* next block for ahead */
-	bs = 0;
-	sw = sizeof(nptr);
-	while (sw)				/* send network-ordered ptr */
-	  if (WriteSocket (dcc->socket, (char *)&nptr, &bs, &sw) < 0)
-	    break;
-	if (sw)
-	  break;				/* if socket died */
+	pthread_mutex_lock (&dcc->mutex);
+	dcc->wait_accept = FALSE;	/* it's too late to get ACCEPT now */
+	aptr = ptr = dcc->startptr; /* FIXME: irssi sends file ptr, is it right? */
+	pthread_mutex_unlock (&dcc->mutex);
+	if (!_dcc_get_open (dx, ptr, dcc->size))
+	{
+	  ERROR ("DCC GET: cannot open local file to download there.");
+	  break;
+	}
       }
-      continue;
+      dx->inbuf += sw;
+      ptr += sw;
+      statistics[t%16] += sw;
+      DBG ("DCC GET %s:got %zd bytes.", dcc->filename, sw);
+      if (!sbs && sw == sw2)		/* two cons. blocks of the same size */
+	sbs = sw;				/* assume it's block size */
+      sw2 = sw;					/* keep it for next cycle */
+      if (ahead && sw == sbs)			/* we got full next block */
+	ahead--;
+      if (dx->inbuf >= DCC_WRITEBLOCK)		/* write aligned part */
+      {
+	end = dx->bufoff + dx->inbuf;
+	if (!_dcc_get_flush (dx, end - end % DCC_WRITEBLOCK - dx->bufoff))
+	{
+	  ERROR ("DCC GET: error on saving file %s.", dcc->filename);
+	  break;
+	}
+      }
+      if (ptr < aptr + DCC_WRITEBLOCK)		/* try to get more first */
+	continue;
     }
-    else if (sw < 0)				/* error happened */
-      break;
-    if (sw != bs)				/* file writing error */
+    else if (sw < 0 && sw != E_AGAIN)		/* error happened */
       break;
-    if (!sbs && sw == sw2)		/* two cons. blocks of the same size */
-      sbs = sw;					/* assume it's block size */
-    if (ptr == 0) {				/* transfer started */
-      pthread_mutex_lock (&dcc->mutex);
-      dcc->wait_accept = FALSE;		/* it's too late to get ACCEPT now */
-      aptr = ptr = dcc->startptr; /* FIXME: irssi sends file ptr, is it right? */
-      pthread_mutex_unlock (&dcc->mutex);
-    }
-    ptr += bs;
-    statistics[t%16] += bs;
-    sw2 = sw;					/* keep it for next cycle */
-    DBG ("DCC GET %s:got %zd bytes.", dcc->filename, sw);
-    if (ahead && bs == sbs)			/* we got full next block */
-      ahead--;
-    if (ptr < aptr)				/* we sent ptr ahead */
+    if (ptr > aptr)				/* ack everything we got */
+    {
+      ahead = 0;				/* we are at ptr! */
+      aptr = ptr;
+      DBG ("DCC GET %s:ack ptr %#x.", dcc->filename, (int)aptr);
+      if (!_dcc_get_ack (dx, aptr))
+	break;					/* if socket died */
       continue;
-    ahead = 0;					/* we are at ptr! */
-    aptr = ptr;
-    DBG ("DCC GET %s:ack ptr %#x.", dcc->filename, (int)aptr);
-    nptr = htonl (aptr);
-    bs = 0;
-    sw = sizeof(nptr);
-    while (sw)					/* send network-ordered ptr */
-      if (WriteSocket (dcc->socket, (char *)&nptr, &bs, &sw) < 0)
+    }
+    if (ptr >= dcc->size)
+      break;					/* and we got it all */
+    if (sbs && ahead < dcc->ahead && aptr + sbs < dcc->size)
+    {						/* sending request */
+      ahead++;
+      aptr += sbs;
+      DBG ("DCC GET %s:ack ptr %#x ahead bs %d.", dcc->filename, (int)aptr, (int)sbs);
+      if (!_dcc_get_ack (dx, aptr))		/* next block for ahead */
 	break;					/* if socket died */
-    if (sw)					/* we got all we can */
-      break;
-  }
-  pthread_mutex_lock (&dcc->mutex);
-  if (wait_accept && dcc->startptr)
-  {
-    /* if want_resume and got startptr then move file chunk to real file */
-    aptr = dcc->startptr;
-//    dcc->wait_accept = FALSE;		/* it's too late to get ACCEPT now */
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &ahead);
-    pthread_mutex_unlock (&dcc->mutex);
-    if (!(rf = fopen (dcc->filename, "a")))
-      ERROR ("DCC GET: cannot append to local file after resume.");
-    else
-    {
-      fseek (rf, aptr, SEEK_SET);
-      fseek (f, 0L, SEEK_SET);
-      while ((sw = fread (buff, 1, MAXBLOCKSIZE, f)) > 0 &&
-	(sw2 = fwrite (buff, 1, sw, rf)) == sw);
-      fclose (rf);
-      if (sw < 0 || sw2 != sw)			/* got an error on save */
-	ERROR ("DCC GET: error on saving file %s.", dcc->filename);
+      continue;
     }
-    pthread_setcancelstate(ahead, NULL);
-  } else
-    pthread_mutex_unlock (&dcc->mutex);
+    _dcc_xfer_wait (dx, DCC_ACK_WAIT);		/* wait for more data */
+  }
+  _dcc_get_finish (dx);
   if (dcc->size == 0 || ptr == dcc->size)	/* getting is complete */
   {
     /* %L - lname, %@ - uh, %N - nick@net, %I - IP, %* - filename(unquoted) */
     Set_Iface (NULL);
-    printl (buff, MAXBLOCKSIZE, format_dcc_gotfile, 0, dcc->l.iface->name, uh,
+    printl (buff, sizeof(buff), format_dcc_gotfile, 0, dcc->l.iface->name, uh,
 	    dcc->lname, NULL, ip, 0, 0, sfn);
     Unset_Iface();
   }
   else if (ptr > dcc->size)			/* file is bigger than offered */
-    snprintf (buff, MAXBLOCKSIZE,
+    snprintf (buff, sizeof(buff),
 	      _("Got file \"%s\" from %s: %lu bytes instead of %lu."), sfn,
 	      dcc->l.iface->name, (unsigned long)ptr, (unsigned long)dcc->size);
   else						/* incomplete file! */
-    snprintf (buff, MAXBLOCKSIZE,
+    snprintf (buff, sizeof(buff),
 	      _("Got incomplete file \"%s\" from %s: %lu/%lu bytes."), sfn,
 	      dcc->l.iface->name, (unsigned long)ptr, (unsigned long)dcc->size);
-  LOG_CONN ("%s", (char *)buff);		/* do logging */
+  LOG_CONN ("%s", buff);			/* do logging */
   if (ptr == dcc->size)				/* successfully downloaded */
   {
     struct binding_t *bind = NULL;
@@ -893,7 +1313,7 @@ static void _dcc_send_handler (int res, void *input_data)
       path = ".";
     else					/* calculate relative path */
     {
-      path = expand_path (buff, ircdcc_dnload_dir, MAXBLOCKSIZE);
+      path = expand_path (buff, ircdcc_dnload_dir, sizeof(buff));
       if (!strncmp (dcc->filename, path, strlen(path)))
 	path = &dcc->filename[strlen(path)+1];	/* it contains defpath */
       else
@@ -1902,6 +2322,8 @@ static void _irc_ctcp_register (void)
   RegisterInteger ("dcc-resume-min", &ircdcc_resume_min);
   RegisterInteger ("dcc-get-maxsize", &ircdcc_get_maxsize);
   RegisterInteger ("dcc-blocksize", &ircdcc_blocksize);
+  RegisterInteger ("dcc-send-rate", &ircdcc_send_rate);
+  RegisterInteger ("dcc-total-rate", &ircdcc_total_rate);
   RegisterBoolean ("dcc-allow-ctcp-chat", &ircdcc_allow_dcc_chat);
   RegisterBoolean ("dcc-resume", &ircdcc_do_resume_send);
   RegisterBoolean ("dcc-get", &ircdcc_accept_send);
@@ -1976,6 +2398,8 @@ static iftype_t irc_ctcp_mod_sig (INTERFACE *iface, ifsig_t sig)
       UnregisterVariable ("dcc-resume-min");
       UnregisterVariable ("dcc-get-maxsize");
       UnregisterVariable ("dcc-blocksize");
+      UnregisterVariable ("dcc-send-rate");
+      UnregisterVariable ("dcc-total-rate");
       UnregisterVariable ("dcc-allow-ctcp-chat");
       UnregisterVariable ("dcc-resume");
       UnregisterVariable ("dcc-get");
@@ -1999,6 +2423,7 @@ static iftype_t irc_ctcp_mod_sig (INTERFACE *iface, ifsig_t sig)
 	  register iftype_t rc = ifa->IFSignal (ifa, sig);
 	  ifa->ift |= rc;
 	}
+      _dcc_senders_stop();
       Delete_Help ("irc-ctcp");
       _forget_(dcc_priv_t);
       iface->ift |= I_DIED;
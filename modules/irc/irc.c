@@ -42,12 +42,39 @@
 #include "sheduler.h"
 #include "conversion.h"
 
+/* output classes in order of priority */
+enum {
+  IRCQ_CONTROL = 0,			/* PING, PONG, NICK, JOIN, etc. */
+  IRCQ_CHANNEL,				/* MODE, KICK, TOPIC, INVITE */
+  IRCQ_RELAY,				/* messages and notices */
+  IRCQ_BULK,				/* CTCPs, queries, everything else */
+  IRCQ_CLASSES
+};
+
+#define IRCQ_MAX	64		/* max lines queued in each class */
+
+typedef struct irc_qline {
+  struct irc_qline *next;
+  time_t since;
+  char line[1];				/* WARNING: variable size! */
+} irc_qline;
+
+typedef struct irc_queue {
+  irc_qline *head, *tail;
+  int depth;
+  int credit;				/* for weighted dequeueing */
+  unsigned long int sent, dropped;
+  unsigned long int waited;		/* total of waiting time */
+  time_t maxwait;
+} irc_queue;
+
 typedef struct irc_server {
   struct irc_server *next;
   struct irc_server *prev;
   struct irc_await *await;
   time_t last_output;
   int penalty;				/* in messages*2, applied to sendq */
+  irc_queue q[IRCQ_CLASSES];		/* output queued for sendq */
   tid_t timer;
   char **servlist;
   char *mynick;
@@ -72,6 +99,7 @@ typedef struct irc_await {
 /* must be locked by dispatcher lock so don't access it from threads! */
 static irc_await *IrcAwaits = NULL;
 static irc_server *IrcServers = NULL;
+static int IrcTerminating = 0;		/* module is waiting for QUITs */
 
 static long int irc_timeout = 180;	/* 3 minutes by default */
 static long int irc_connect_timeout = 300;
@@ -80,6 +108,7 @@ static long int irc_retry_server = 60;	/* in minutes */
 static long int defaultport = 6667;
 static long int maxpenalty = 10;	/* in seconds, see ircd sources */
 static long int irc_pmsg_keep = 30;
+static long int irc_bulk_expire = 60;
 static char irc_default_nick[NICKLEN+1] = "";
 static char irc_default_ident[10] = "";
 static char irc_default_realname[REALNAMELEN+1] = "";
@@ -369,6 +398,97 @@ static iftype_t _irc_privmsgout_sig (INTERFACE *iface, ifsig_t sig)
 #define _irc_connected(serv) _irc_run_conn_bind (serv, BT_IrcConn)
 #define _irc_disconnected(serv) _irc_run_conn_bind (serv, BT_IrcDisc)
 
+/* relative weights of classes IRCQ_CHANNEL..IRCQ_BULK, control has none */
+static const int IrcQWeight[IRCQ_CLASSES] = { 0, 4, 2, 1 };
+
+static const char *IrcQName[IRCQ_CLASSES] = {
+  "control", "channel", "relay", "bulk"
+};
+
+/* returns 1 if line is CTCP request or reply except ACTION */
+static int _irc_line_is_ctcp (const char *line)
+{
+  const char *c;
+  size_t s;
+
+  for (s = 0; line[s] && line[s] != ' '; s++);
+  if ((s != 7 || strncasecmp (line, "PRIVMSG", 7)) &&
+      (s != 6 || strncasecmp (line, "NOTICE", 6)))
+    return 0;
+  return ((c = strstr (line, " :")) && c[2] == '\001' &&
+	  strncmp (&c[3], "ACTION ", 7));
+}
+
+static int _irc_queue_class (const char *line, flag_t flag)
+{
+  static const char *control[] = { "PING", "PONG", "QUIT", "NICK", "PASS",
+				   "USER", "JOIN", "PART", "AWAY", NULL };
+  static const char *channel[] = { "MODE", "KICK", "TOPIC", "INVITE", NULL };
+  size_t s;
+  int i;
+
+  if (flag & F_QUICK)
+    return IRCQ_CONTROL;
+  for (s = 0; line[s] && line[s] != ' '; s++);
+  for (i = 0; control[i]; i++)
+    if (strlen (control[i]) == s && !strncasecmp (line, control[i], s))
+      return IRCQ_CONTROL;
+  for (i = 0; channel[i]; i++)
+    if (strlen (channel[i]) == s && !strncasecmp (line, channel[i], s))
+      return IRCQ_CHANNEL;
+  if (_irc_line_is_ctcp (line))
+    return IRCQ_BULK;			/* CTCP or its reply */
+  if ((s == 7 && !strncasecmp (line, "PRIVMSG", 7)) ||
+      (s == 6 && !strncasecmp (line, "NOTICE", 6)))
+    return IRCQ_RELAY;
+  return IRCQ_BULK;
+}
+
+/* returns 1 if request was queued or 0 if its queue is full */
+static int _irc_queue_add (irc_server *serv, REQUEST *req)
+{
+  irc_queue *q = &serv->q[_irc_queue_class (req->string, req->flag)];
+  irc_qline *ql;
+  size_t s;
+
+  if (q->depth >= IRCQ_MAX)
+    return 0;
+  s = strlen (req->string);
+  ql = safe_malloc (sizeof(irc_qline) + s);
+  ql->next = NULL;
+  ql->since = Time;
+  memcpy (ql->line, req->string, s + 1);
+  if (q->tail)
+    q->tail->next = ql;
+  else
+    q->head = ql;
+  q->tail = ql;
+  q->depth++;
+  return 1;
+}
+
+static void _irc_queue_pop (irc_queue *q)
+{
+  irc_qline *ql = q->head;
+
+  if (!(q->head = ql->next))
+    q->tail = NULL;
+  q->depth--;
+  FREE (&ql);
+}
+
+static void _irc_queue_clear (irc_server *serv)
+{
+  int i;
+
+  for (i = 0; i < IRCQ_CLASSES; i++)
+  {
+    while (serv->q[i].head)
+      _irc_queue_pop (&serv->q[i]);
+    serv->q[i].credit = 0;
+  }
+}
+
 /*
  * do first try (serv->servlist is NULL) or retry if autoreconnect is on
  * creates new connection thread and irc_await for it
@@ -400,6 +520,7 @@ static int _irc_try_server (irc_server *serv, const char *tohost, int banned,
   }
   /* some cleanup... */
   serv->penalty = 0;
+  _irc_queue_clear (serv);
   serv->p.last_input = Time;
   /* check if we will try connection/reconnect */
   uf = Get_Clientflags (serv->p.iface->name, "");	/* all flags */
@@ -585,6 +706,98 @@ static int _irc_send (irc_server *serv, char *line)
   return 1;
 }
 
+/* pick a class to send next line from: control ones go first, others are
+   dequeued by weight while have credit, credit is refilled when every
+   nonempty class have spent it */
+static irc_queue *_irc_queue_next (irc_server *serv)
+{
+  int i, refill = 0;
+
+  if (serv->q[IRCQ_CONTROL].head)
+    return &serv->q[IRCQ_CONTROL];
+  FOREVER
+  {
+    for (i = IRCQ_CONTROL + 1; i < IRCQ_CLASSES; i++)
+      if (serv->q[i].head)
+      {
+	if (serv->q[i].credit > 0)
+	  return &serv->q[i];
+	refill = 1;
+      }
+    if (!refill)
+      return NULL;			/* all empty */
+    for (i = IRCQ_CONTROL + 1; i < IRCQ_CLASSES; i++)
+      serv->q[i].credit = IrcQWeight[i];
+    refill = 0;
+  }
+}
+
+/* send queued lines while penalty allows
+   returns: -1 on error, 0 if something left, 1 if everything is sent */
+static int _irc_queue_flush (irc_server *serv)
+{
+  irc_queue *q = &serv->q[IRCQ_BULK];
+  irc_qline *ql, **ptr;
+  int r;
+
+  /* drop stale CTCPs but keep queries since modules wait for replies */
+  if (irc_bulk_expire > 0 && q->head &&
+      Time - q->head->since > irc_bulk_expire)
+  {
+    q->tail = NULL;
+    for (ptr = &q->head; (ql = *ptr); )
+      if (Time - ql->since > irc_bulk_expire && _irc_line_is_ctcp (ql->line))
+      {
+	dprint (4, "irc: dropping stale output to %s: %s", serv->p.iface->name,
+		ql->line);
+	*ptr = ql->next;
+	q->depth--;
+	q->dropped++;
+	FREE (&ql);
+      }
+      else
+      {
+	q->tail = ql;
+	ptr = &ql->next;
+      }
+  }
+  while ((q = _irc_queue_next (serv)))
+  {
+    if ((r = _irc_send (serv, q->head->line)) <= 0)
+      return r;
+    q->sent++;
+    q->waited += (Time - q->head->since);
+    if (Time - q->head->since > q->maxwait)
+      q->maxwait = Time - q->head->since;
+    q->credit--;
+    _irc_queue_pop (q);
+  }
+  return 1;
+}
+
+static void _irc_queue_report (irc_server *serv, char *buf, size_t s)
+{
+  irc_queue *q;
+  size_t ptr;
+  int i;
+
+  ptr = strfcpy (buf, "  output queues:", s);
+  for (i = 0; i < IRCQ_CLASSES && ptr < s; i++)
+  {
+    q = &serv->q[i];
+    ptr += snprintf (&buf[ptr], s - ptr,
+		     " %s %d (sent %lu, avg %lus, max %lus", IrcQName[i],
+		     q->depth, q->sent, q->sent ? q->waited / q->sent : 0UL,
+		     (unsigned long int)q->maxwait);
+    if (ptr >= s)
+      break;
+    if (q->dropped)
+      ptr += snprintf (&buf[ptr], s - ptr, ", dropped %lu)", q->dropped);
+    else
+      ptr += strfcpy (&buf[ptr], ")", s - ptr);
+  }
+}
+
 /* since Find_Clientrecord is case-insensitive now, we don't need lower case */
 static char *_irc_get_lname (char *nuh, userflag *uf, char *net)
 {
@@ -714,6 +927,11 @@ static iftype_t _irc_signal (INTERFACE *iface, ifsig_t sig)
 	      0, reason);
       tmp = Set_Iface (iface);
       New_Request (tmp, F_REPORT, "%s", report);
+      if (serv->p.state == P_TALK || serv->p.state == P_IDLE)
+      {
+	_irc_queue_report (serv, report, sizeof(report));
+	New_Request (tmp, F_REPORT, "%s", report);
+      }
       Unset_Iface();
     case S_TIMEOUT:
       DBG("irc: got S_TIMEOUT, drop timer %d", serv->timer);
@@ -890,7 +1108,20 @@ static int _irc_request_main (INTERFACE *iface, REQUEST *req)
       if (serv->p.state != P_QUIT)
 	break;
       if (req)				/* we still have message to send */
-        _irc_send (serv, req->string);	/* ignoring result... */
+      {
+	/* lines queued before QUIT should go out first but time is frozen
+	   while module is terminating so drop the rest then */
+	if (_irc_queue_flush (serv) == 0)
+	{
+	  if (!IrcTerminating)
+	    return 1;			/* wait for penalty */
+	  dprint (4, "irc: dropping output queue to %s on terminate",
+		  serv->p.iface->name);
+	  _irc_queue_clear (serv);
+	  serv->penalty = 0;		/* QUIT is the last one anyway */
+	}
+	_irc_send (serv, req->string);	/* ignoring result... */
+      }
       serv->p.state = P_LASTWAIT;
       if (serv->timer >= 0)
 	KillTimer (serv->timer);
@@ -922,6 +1153,7 @@ static int _irc_request_main (INTERFACE *iface, REQUEST *req)
 	  FREE (&serv->servlist[i]);
       FREE (&serv->servlist);
       FREE (&serv->mynick);
+      _irc_queue_clear (serv);
       iface->ift |= I_DIED;
       /* shedule retry of autoconnects (in 1 hour by default) */
       NewTimer (I_MODULE, "irc", S_FLUSH, 0, irc_retry_server, 0, 0);
@@ -942,9 +1174,11 @@ static int _irc_request_main (INTERFACE *iface, REQUEST *req)
     register int ec;
     int count = 0;
 
-    /* connection established, we may send data */
-    if ((sw = _irc_send (serv, req ? req->string : NULL)) == 1)
-      reject = 0; /* nice, we sent it */
+    /* connection established, queue request and send what we can */
+    if (req)
+      reject = !_irc_queue_add (serv, req);
+    if (_irc_queue_flush (serv) == 1 && !req)
+      reject = 0; /* nice, all is sent */
     /* check for input (sw includes '\0') */
 _retry_input:
     sw = Peer_Get ((&serv->p), inbuf, sizeof(inbuf));
@@ -1082,9 +1316,22 @@ _retry_input:
 
 static int _irc_request (INTERFACE *iface, REQUEST *req)
 {
+  irc_server *serv = (irc_server *)iface->data;
+  int i;
+
   if (_irc_request_main (iface, req) != 2 && req != NULL &&
-      ((irc_server *)iface->data)->p.socket >= 0)
+      serv->p.socket >= 0)
+    return REQ_REJECTED;
+  if (serv->p.socket < 0 || (serv->p.state != P_TALK && serv->p.state != P_IDLE))
+    return REQ_OK;
+  for (i = 0; i < IRCQ_CLASSES; i++)
+    if (serv->q[i].depth)
+      break;
+  if (i == IRCQ_CLASSES)		/* nothing left in queues */
+    return REQ_OK;
+  if (req == NULL)			/* we'll wait for penalty to go down */
     return REQ_REJECTED;
+  Mark_Iface (iface);			/* come back for queued lines */
   return REQ_OK;
 }
 
@@ -1795,6 +2042,7 @@ static void module_irc_regall (void)
   RegisterInteger ("irc-default-port", &defaultport);
   RegisterInteger ("irc-max-penalty", &maxpenalty);
   RegisterInteger ("irc-privmsg-keep", &irc_pmsg_keep);
+  RegisterInteger ("irc-bulk-expire", &irc_bulk_expire);
   RegisterString ("irc-default-nick", irc_default_nick, sizeof(irc_default_nick), 0);
   RegisterString ("irc-default-ident", irc_default_ident, sizeof(irc_default_ident), 0);
   RegisterString ("irc-default-realname", irc_default_realname, sizeof(irc_default_realname), 0);
@@ -1827,6 +2075,7 @@ static iftype_t module_irc_signal (INTERFACE *iface, ifsig_t sig)
       UnregisterVariable ("irc-default-port");
       UnregisterVariable ("irc-max-penalty");
       UnregisterVariable ("irc-privmsg-keep");
+      UnregisterVariable ("irc-bulk-expire");
       UnregisterVariable ("irc-default-nick");
       UnregisterVariable ("irc-default-ident");
       UnregisterVariable ("irc-default-realname");
@@ -1868,6 +2117,7 @@ static iftype_t module_irc_signal (INTERFACE *iface, ifsig_t sig)
 	New_Request (tmp, F_QUICK, _("Waiting for IRC servers for terminating connection..."));
 	Unset_Iface();
 	Get_Request();		/* send it now */
+	IrcTerminating = 1;
 	for (serv = IrcServers; serv; serv = serv->next)
 	  _irc_signal (serv->p.iface, S_TERMINATE);
 	/* kill all server connections */
@@ -1880,6 +2130,7 @@ static iftype_t module_irc_signal (INTERFACE *iface, ifsig_t sig)
 	    Get_Request();	/* in this state it may only send data */
 	    Unset_Iface();
 	  }
+	IrcTerminating = 0;
       }
       irc_privmsgunreg();	/* do it after all privmsg ifaces gone */
       iface->ift |= I_DIED;
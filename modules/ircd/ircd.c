@@ -29,6 +29,7 @@
 #include "conversion.h"
 #include "socket.h"
 
+#include <ctype.h>
 #include <wchar.h>
 #include <signal.h>
 
@@ -991,6 +992,49 @@ static inline int _ircd_is_server_name (const char *lcc)
   return 1;
 }
 
+/* counters and latency of executed messages by command */
+typedef struct
+{
+  int id;				/* counter metric id */
+  int latency;				/* latency metric id */
+  char cmd[1];				/* uppercase */
+} ircd_msg_metric;
+
+static NODE *IrcdMsgMetrics = NULL;
+
+static void _ircd_count_message (const char *cmd, long long t)
+{
+  ircd_msg_metric *mm;
+  char buf[SHORT_STRING];
+  register size_t l;
+
+  if (match ("[0-9][0-9][0-9]", cmd) >= 0)
+    cmd = "numeric";			/* don't make metric per numeric */
+  for (l = 0; cmd[l] && l < sizeof(buf) - 1; l++)
+    buf[l] = toupper (((uchar *)cmd)[l]);
+  buf[l] = '\0';
+  if ((mm = Find_Key (IrcdMsgMetrics, buf)) == NULL)
+  {
+    mm = safe_malloc (sizeof(ircd_msg_metric) + l);
+    memcpy (mm->cmd, buf, l + 1);
+    snprintf (buf, sizeof(buf), "command=\"%s\"", mm->cmd);
+    mm->id = Metric_Register ("foxeye_ircd_messages_total", buf,
+			      "Messages executed by ircd", METRIC_COUNTER,
+			      NULL, 0);
+    mm->latency = Metric_Register ("foxeye_ircd_command_latency_us", buf,
+				   "Time of messages execution by ircd",
+				   METRIC_LATENCY, NULL, 0);
+    if (Insert_Key (&IrcdMsgMetrics, mm->cmd, mm, 1) < 0)
+    {
+      ERROR ("ircd:_ircd_count_message: tree error on %s", mm->cmd);
+      FREE (&mm);
+      return;
+    }
+  }
+  Metric_Add (mm->id, 1);
+  Metric_Observe (mm->latency, t);
+}
+
 /* executes message from server */
 static inline int _ircd_do_command (peer_priv *peer, int argc, const char **argv)
 {
@@ -1610,6 +1654,7 @@ static int _ircd_client_request (INTERFACE *cli, REQUEST *req)
   size_t sw;
   ssize_t sr;
   int argc, i, p, p0;
+  long long t;
   char buff[MB_LEN_MAX*IRCMSGLEN+1];
 #if IRCD_USES_ICONV
   char sbuff[MB_LEN_MAX*IRCMSGLEN+1];
@@ -1862,6 +1907,7 @@ _sendq_exceeded:
     i = 0;
     p0 = p = 1;
     argv[argc] = NULL;
+    t = Metric_Clock ();
     if (!*argv[1]);			/* got malformed line */
     else if (!Ircd->iface);		/* internal error! */
     else if (peer->p.state == P_QUIT)	/* killed by processing */
@@ -1924,6 +1970,10 @@ _sendq_exceeded:
 				cl->host, cl->vhost, cl->umode, argc - 2, &argv[2]);
     }
     cl = peer->link->cl;		/* binding might change it! */
+    t = Metric_Clock () - t;
+    Metric_Slow (t, argv[1], peer->p.dname);
+    if (i > 0)
+      _ircd_count_message (argv[1], t);
     if (i == 0)				/* protocol failed */
     {
       if (peer->p.state == P_QUIT) ;	/* no reply to a killed client */
@@ -5199,6 +5249,7 @@ static iftype_t _ircd_signal (INTERFACE *iface, ifsig_t sig)
 	free_CLASS (cl);
       }
       Destroy_Tree (&Ircd->clients, &_ircd_catch_undeleted_cl);
+      Destroy_Tree (&IrcdMsgMetrics, safe_pfree);
       if (Ircd->sub)
       {
 	Ircd->sub->ift |= I_DIED;
@@ -0,0 +1,13 @@
+dnl Compression of rotated logs, doesn't depend on ziplink module
+if test "x$with_zlib" != xno; then
+  AC_CHECK_HEADER([zlib.h],
+    [AC_CHECK_LIB([z], [gzwrite],
+      [AC_DEFINE([HAVE_LIBZ], [1], [Define if logs module can compress rotated logs with zlib.])
+      if test "$fe_cv_static" = yes; then
+        STATICLIBS="-lz ${STATICLIBS}"
+      else
+        MODLIBS="MODLIBS_logs=\"-lz\" ${MODLIBS}"
+      fi
+      fe_logs_gzip=yes])])
+fi
+AC_MSG_CACHE_ADD([Logs compression], [${fe_logs_gzip:-no}])
@@ -23,13 +23,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <ctype.h>
+#ifdef HAVE_LIBZ
+# include <sched.h>
+# include <zlib.h>
+#endif
 
 #include "modules.h"
 #include "init.h"
 #include "sheduler.h"
 
 #define	MAXLOGQUEUE	5000	/* max queue size before logging is aborted */
+#define	LOGBUFSIZE	(4 * HUGE_STRING) /* size of single chunk of log buffer */
+#define	LOGBUFSPARE	32	/* max number of free chunks kept for reuse */
+#define	LOGZBUFSIZE	65536	/* size of read buffer of log compressor */
+
+typedef struct logbuf_t
+{
+  struct logbuf_t *next;
+  size_t used;
+  char buf[LOGBUFSIZE];
+} logbuf_t;
+
+/* renders text into buffer of given size, returns length without '\0' */
+typedef size_t (*logrender_t) (char *, const char *, size_t, flag_t);
 
 typedef struct logfile_t
 {
@@ -42,19 +60,32 @@ typedef struct logfile_t
   time_t timestamp;
   time_t lastmsg;
   time_t rotatetime;
+  time_t lastsync;
   int rmode;
   int reccount;
   int colormode;	/* <0 normal, 0 nocolor, >0 html */
   INTERFACE *iface;
-  ssize_t (*add_buf) (struct logfile_t *, char *, size_t, size_t, int);
-  size_t inbuf;
+  ssize_t (*add_buf) (struct logfile_t *, const char *, size_t, size_t,
+		      logrender_t, flag_t);
+  logrender_t render;	/* NULL if text is written as is */
+  logbuf_t *head;	/* records added but not taken by writer yet */
+  logbuf_t *tail;
+  logbuf_t *wq;		/* records being written, owned by writer */
+  size_t inbuf;		/* bytes in head...tail chain */
+  size_t inwq;		/* bytes in wq chain */
+  size_t wqoff;		/* bytes of wq head already written */
+  int error;		/* fatal error from writer, 0 if none */
+  bool busy;		/* writer is doing file operations now */
   bool wantprefix;
-  char buf[HUGE_STRING];
+  bool compress;	/* gzip file after rotation */
 } logfile_t;
 
 static logfile_t *Logfiles = NULL;
 
 static long int logfile_locks = 16;	/* "logfile-lock-attempts" */
+static long int logfile_bufsize = 1024;	/* "logfile-buffer-size" */
+static char logfile_fsync[10] = "never";/* "logfile-fsync" */
+static long int logfile_fsync_int = 300;/* "logfile-fsync-interval" */
 static char logs_pattern[128] = "%$~";	/* "logrotate-path" */
 static char logrotate_time[5] = "0000";	/* "logrotate-time" */
 static char log_prefix[16] = "-|- ";	/* "logfile-notice-prefix" */
@@ -66,96 +97,387 @@ static char logrotate_min[3] = "";
 static char logrotate_hr[3] = "";
 static time_t lastrotated = 0;
 
-static int flush_log (logfile_t *log, int force, int needsync)
+/*
+ * Log writer thread: dispatcher only puts records into buffer chains of
+ * logfile_t and writer thread sends them to files. LogsLock protects list
+ * Logfiles, buffer chains, fd and busy fields of each logfile_t, and pool
+ * of free chunks. When writer does file operations it releases the lock and
+ * sets busy on the log so anyone who wants to close fd should wait for it.
+ */
+static pthread_mutex_t LogsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t LogsCond = PTHREAD_COND_INITIALIZER; /* wake writer */
+static pthread_cond_t LogsIdle = PTHREAD_COND_INITIALIZER; /* busy cleared */
+static pthread_t LogsWriter;
+static bool LogsWriterRun = FALSE;
+
+static logbuf_t *LogbufFree = NULL;
+static unsigned int LogbufFreeNum = 0;
+static unsigned int LogbufNum = 0;	/* allocated chunks, for report */
+static int _mt_flush_bytes = 0, _mt_flush_time = 0; /* metric ids */
+
+#define LOG_SYNC_NEVER		0
+#define LOG_SYNC_INTERVAL	1
+#define LOG_SYNC_ROTATE		2
+
+static int _logs_sync_mode (void)
+{
+  if (!strcasecmp (logfile_fsync, "interval"))
+    return LOG_SYNC_INTERVAL;
+  if (!strcasecmp (logfile_fsync, "rotate"))
+    return LOG_SYNC_ROTATE;
+  return LOG_SYNC_NEVER;
+}
+
+/* all _logbuf_* and _log_* functions should be called with LogsLock held */
+static logbuf_t *_logbuf_get (void)
+{
+  logbuf_t *b;
+
+  if ((b = LogbufFree) != NULL)
+  {
+    LogbufFree = b->next;
+    LogbufFreeNum--;
+  }
+  else
+  {
+    b = safe_malloc (sizeof(logbuf_t));
+    LogbufNum++;
+  }
+  b->next = NULL;
+  b->used = 0;
+  return b;
+}
+
+static void _logbuf_free_chain (logbuf_t *b)
+{
+  logbuf_t *next;
+
+  for (; b; b = next)
+  {
+    next = b->next;
+    if (LogbufFreeNum < LOGBUFSPARE)
+    {
+      b->next = LogbufFree;
+      LogbufFree = b;
+      LogbufFreeNum++;
+    }
+    else
+    {
+      FREE (&b);
+      LogbufNum--;
+    }
+  }
+}
+
+/* returns pointer where sz bytes can be put or NULL if buffer is full */
+static char *_log_reserve (logfile_t *log, size_t sz)
+{
+  if (log->inbuf + log->inwq + sz > (size_t)logfile_bufsize * 1024 &&
+      log->inbuf + log->inwq != 0)
+    return NULL;
+  if (log->tail == NULL)
+    log->head = log->tail = _logbuf_get();
+  else if (log->tail->used + sz > sizeof(log->tail->buf))
+    log->tail = log->tail->next = _logbuf_get();
+  return &log->tail->buf[log->tail->used];
+}
+
+static void _log_wait_idle (logfile_t *log)
 {
+  while (log->busy)
+    pthread_cond_wait (&LogsIdle, &LogsLock);
+}
+
+static void _log_free_buffers (logfile_t *log)
+{
+  _log_wait_idle (log);
+  _logbuf_free_chain (log->wq);
+  _logbuf_free_chain (log->head);
+  log->wq = log->head = log->tail = NULL;
+  log->inbuf = log->inwq = log->wqoff = 0;
+}
+
+static void _log_write_html_header (int fd)
+{
+  char buf[HUGE_STRING];
   ssize_t x;
+
+  x = snprintf (buf, sizeof(buf), "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" \"http://www.w3.org/TR/html4/loose.dtd\">"
+		"<HTML>\n<HEAD>\n"
+		"<meta http-equiv=\"Content-Type\" content=\"text/html;charset=%s\" />\n"
+		"<meta http-equiv=\"Content-Style-Type\" content=\"text/css\" />\n"
+		"<STYLE TYPE=\"text/css\"><!--\n"
+		".time { color: %s }\n"
+		".info { color: %s }\n"
+		".action { color: %s }\n"
+		".f0 { color: white }\n"
+		".f1 { color: black }\n"
+		".f2 { color: navy }\n"
+		".f3 { color: green }\n"
+		".f4 { color: red }\n"
+		".f5 { color: maroon }\n"
+		".f6 { color: purple }\n"
+		".f7 { color: olive }\n"
+		".f8 { color: yellow }\n"
+		".f9 { color: lime }\n"
+		".f10 { color: teal }\n"
+		".f11 { color: aqua }\n"
+		".f12 { color: blue }\n"
+		".f13 { color: fuchsia }\n"
+		".f14 { color: gray }\n"
+		".f15 { color: silver }\n"
+		".b0 { background-color: white }\n"
+		".b1 { background-color: black }\n"
+		".b2 { background-color: navy }\n"
+		".b3 { background-color: green }\n"
+		".b4 { background-color: red }\n"
+		".b5 { background-color: maroon }\n"
+		".b6 { background-color: purple }\n"
+		".b7 { background-color: olive }\n"
+		".b8 { background-color: yellow }\n"
+		".b9 { background-color: lime }\n"
+		".b10 { background-color: teal }\n"
+		".b11 { background-color: aqua }\n"
+		".b12 { background-color: blue }\n"
+		".b13 { background-color: fuchsia }\n"
+		".b14 { background-color: gray }\n"
+		".b15 { background-color: silver }\n"
+		"--></STYLE>\n</HEAD>\n<BODY>\n", Charset, log_html_time,
+		log_html_info, log_html_action);
+  if ((size_t)x >= sizeof(buf))
+    x = sizeof(buf) - 1;
+  if (write (fd, buf, x) < 0)
+    return;			/* error will be caught on next write */
+}
+
+/*
+ * Writes all unsaved data of the log into file in as few writev() calls as
+ * possible. LogsLock should be held by caller and will be released while
+ * doing file operations. Returns 0 on success or error code.
+ */
+static int _log_flush_locked (logfile_t *log, int needsync)
+{
+  struct iovec iov[64];
   struct flock lck;
-  int es;
+  logbuf_t *b;
+  ssize_t x;
+  size_t off;
+  int i, fd, es = 0;
+  long long t;
 
-  if (log->inbuf == 0)
+  _log_wait_idle (log);
+  if (log->head)			/* append pending to writing queue */
+  {
+    if (log->wq)
+    {
+      for (b = log->wq; b->next; b = b->next);
+      b->next = log->head;
+    }
+    else
+      log->wq = log->head;
+    log->inwq += log->inbuf;
+    log->head = log->tail = NULL;
+    log->inbuf = 0;
+  }
+  if (log->wq == NULL)
     return 0;
-  if (log->fd < 0)
+  if ((fd = log->fd) < 0)
     return EBADF;
-  if (!force && Time - log->timestamp < cache_time)
-    return 0;
-  dprint (5, "logs/logs:flush_log: logfile %s: %zd bytes after %d seconds",
-	  log->path, log->inbuf, (int)(Time - log->timestamp));
+  log->busy = TRUE;
+  pthread_mutex_unlock (&LogsLock);
+  t = Metric_Clock ();
   memset (&lck, 0, sizeof (struct flock));
   lck.l_type = F_WRLCK;
   lck.l_whence = SEEK_END;
-  if (fcntl (log->fd, F_SETLK, &lck) < 0)
-    return errno;		/* cannot lock the file */
-  x = 0;
-  if (log->colormode > 0 && lseek (log->fd, 0, SEEK_END) == 0)
+  /* wq is not touched by anyone else while busy so walk it unlocked */
+  b = log->wq;
+  off = log->wqoff;
+  if (fcntl (fd, F_SETLK, &lck) < 0)
+    es = errno;			/* cannot lock the file */
+  else
+  {
+    if (log->colormode > 0 && lseek (fd, 0, SEEK_END) == 0)
+      _log_write_html_header (fd);
+    while (b)
+    {
+      logbuf_t *bb = b;
+      size_t o = off;
+
+      for (i = 0; bb && i < (int)(sizeof(iov)/sizeof(*iov)); bb = bb->next, i++)
+      {
+	iov[i].iov_base = &bb->buf[o];
+	iov[i].iov_len = bb->used - o;
+	o = 0;
+      }
+      x = writev (fd, iov, i);
+      if (x < 0 && errno == EINTR)
+	continue;
+      if (x <= 0)
+      {
+	es = x ? errno : ENOSPC;
+	break;
+      }
+      METRIC_COUNT (_mt_flush_bytes, "foxeye_log_flush_bytes_total", NULL,
+		    "Bytes written into log files", x);
+      /* skip written data, writev() may do partial write */
+      while (b && (size_t)x >= b->used - off)
+      {
+	x -= (b->used - off);
+	b = b->next;
+	off = 0;
+      }
+      off += x;
+    }
+    lck.l_type = F_UNLCK;
+    fcntl (fd, F_SETLK, &lck);
+    if (es == 0 && needsync)
+      fsync (fd);		/* don't check for error here */
+  }
+  t = Metric_Clock () - t;
+  METRIC_TIME (_mt_flush_time, "foxeye_log_flush_latency_us", NULL,
+	       "Time of log files writing", t);
+  Metric_Slow (t, "log flush", log->path);
+  pthread_mutex_lock (&LogsLock);
+  if (es == 0)
   {
-    char buf[HUGE_STRING];
-    /* add start of html here */
-    x = snprintf (buf, sizeof(buf), "<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\" \"http://www.w3.org/TR/html4/loose.dtd\">"
-		  "<HTML>\n<HEAD>\n"
-		  "<meta http-equiv=\"Content-Type\" content=\"text/html;charset=%s\" />\n"
-		  "<meta http-equiv=\"Content-Style-Type\" content=\"text/css\" />\n"
-		  "<STYLE TYPE=\"text/css\"><!--\n"
-		  ".time { color: %s }\n"
-		  ".info { color: %s }\n"
-		  ".action { color: %s }\n"
-		  ".f0 { color: white }\n"
-		  ".f1 { color: black }\n"
-		  ".f2 { color: navy }\n"
-		  ".f3 { color: green }\n"
-		  ".f4 { color: red }\n"
-		  ".f5 { color: maroon }\n"
-		  ".f6 { color: purple }\n"
-		  ".f7 { color: olive }\n"
-		  ".f8 { color: yellow }\n"
-		  ".f9 { color: lime }\n"
-		  ".f10 { color: teal }\n"
-		  ".f11 { color: aqua }\n"
-		  ".f12 { color: blue }\n"
-		  ".f13 { color: fuchsia }\n"
-		  ".f14 { color: gray }\n"
-		  ".f15 { color: silver }\n"
-		  ".b0 { background-color: white }\n"
-		  ".b1 { background-color: black }\n"
-		  ".b2 { background-color: navy }\n"
-		  ".b3 { background-color: green }\n"
-		  ".b4 { background-color: red }\n"
-		  ".b5 { background-color: maroon }\n"
-		  ".b6 { background-color: purple }\n"
-		  ".b7 { background-color: olive }\n"
-		  ".b8 { background-color: yellow }\n"
-		  ".b9 { background-color: lime }\n"
-		  ".b10 { background-color: teal }\n"
-		  ".b11 { background-color: aqua }\n"
-		  ".b12 { background-color: blue }\n"
-		  ".b13 { background-color: fuchsia }\n"
-		  ".b14 { background-color: gray }\n"
-		  ".b15 { background-color: silver }\n"
-		  "--></STYLE>\n</HEAD>\n<BODY>\n", Charset, log_html_time,
-		  log_html_info, log_html_action);
-    if ((size_t)x >= sizeof(buf))
-      x = sizeof(buf) - 1;
-    x = write (log->fd, buf, x);
+    _logbuf_free_chain (log->wq);
+    log->wq = NULL;
+    log->inwq = log->wqoff = 0;
+    if (needsync)
+      log->lastsync = Time;
   }
-  if (x >= 0)
-    x = write (log->fd, log->buf, log->inbuf);
-  es = errno;
-  lck.l_type = F_UNLCK;
-  fcntl (log->fd, F_SETLK, &lck);
-  if (x < 0)
-    return es;			/* fatal error on write! */
-  if (needsync)
-    fsync (log->fd);		/* don't check for error here */
-  log->inbuf = 0;
-  return 0;
+  else if (es != EACCES && es != EAGAIN)
+  {
+    /* written part is lost from buffers */
+    while (log->wq && log->wq != b)
+    {
+      logbuf_t *next = log->wq->next;
+
+      log->inwq -= (log->wq->used - log->wqoff);
+      log->wq->next = NULL;
+      _logbuf_free_chain (log->wq);
+      log->wq = next;
+      log->wqoff = 0;
+    }
+    if (b)
+    {
+      log->inwq -= (off - log->wqoff);
+      log->wqoff = off;
+    }
+  }
+  log->busy = FALSE;
+  pthread_cond_broadcast (&LogsIdle);
+  return es;
+}
+
+static int flush_log (logfile_t *log, int force, int needsync)
+{
+  int x;
+
+  pthread_mutex_lock (&LogsLock);
+  if (log->inbuf == 0 && log->inwq == 0)
+    x = 0;
+  else if (!force && Time - log->timestamp < cache_time)
+    x = 0;
+  else
+  {
+    dprint (5, "logs/logs:flush_log: logfile %s: %zu bytes after %d seconds",
+	    log->path, log->inbuf + log->inwq, (int)(Time - log->timestamp));
+    x = _log_flush_locked (log, needsync);
+  }
+  pthread_mutex_unlock (&LogsLock);
+  return x;
+}
+
+/* detaches fd from the log so writer will not use it anymore */
+static int _log_detach_fd (logfile_t *log)
+{
+  int fd;
+
+  pthread_mutex_lock (&LogsLock);
+  _log_wait_idle (log);
+  fd = log->fd;
+  log->fd = -1;
+  pthread_mutex_unlock (&LogsLock);
+  return fd;
+}
+
+static void _log_attach_fd (logfile_t *log, int fd)
+{
+  pthread_mutex_lock (&LogsLock);
+  log->fd = fd;
+  pthread_mutex_unlock (&LogsLock);
+}
+
+static void *_logs_writer (void *unused)
+{
+  logfile_t *log;
+  struct timespec ts;
+  int x, sync_mode;
+
+  pthread_mutex_lock (&LogsLock);
+  while (LogsWriterRun)
+  {
+    sync_mode = _logs_sync_mode();
+    for (log = Logfiles; log; log = log->next)
+    {
+      if (log->error || log->fd < 0 || log->busy)
+	continue;
+      /* write if there is at least one full chunk or cache-time passed */
+      if (log->inwq == 0 && (log->inbuf == 0 ||
+	  (log->inbuf < LOGBUFSIZE && Time - log->timestamp < cache_time)))
+	continue;
+      x = _log_flush_locked (log, sync_mode == LOG_SYNC_INTERVAL &&
+				  Time - log->lastsync >= logfile_fsync_int);
+      if (x && x != EACCES && x != EAGAIN)
+	log->error = x;		/* dispatcher will report it and close */
+      /* log cannot be freed while we were busy so log->next is valid */
+    }
+    clock_gettime (CLOCK_REALTIME, &ts);
+    ts.tv_sec++;
+    pthread_cond_timedwait (&LogsCond, &LogsLock, &ts);
+  }
+  pthread_mutex_unlock (&LogsLock);
+  return NULL;
+}
+
+static void _logs_report_error (logfile_t *log, int x, int quiet)
+{
+  char buf[STRING];
+
+  if (quiet)				/* ts < 0 means quiet */
+    return;
+#if _GNU_SOURCE
+  register const char *str = strerror_r (x, buf, sizeof(buf));
+  ERROR ("Couldn't sync logfile %s (%s), abort logging to it.",
+	 log->path, str);
+#else
+  if (strerror_r(x, buf, sizeof(buf)) != 0)
+    snprintf(buf, sizeof(buf), "(failed to decode err=%d)", x);
+  ERROR ("Couldn't sync logfile %s (%s), abort logging to it.",
+	 log->path, buf);
+#endif
 }
 
+/*
+ * Adds a record "[timestamp][prefix]line\n" into the log buffer. If render
+ * is not NULL then it's called to make line from text directly in the log
+ * buffer, otherwise text of size sz is copied as is.
+ */
 static ssize_t textlog_add_buf (logfile_t *log, const char *text, size_t sz,
-				size_t sp, int ts, int ishtml)
+				size_t sp, int ts, int ishtml,
+				logrender_t render, flag_t flag)
 {
   char tss[36];	/* we need 32 actually */
-  size_t tsz, tsw, sw, psw;
+  size_t tsz;
+  char *c;
   int x;
 
+  if ((x = log->error) != 0)		/* fatal error from writer */
+  {
+    _logs_report_error (log, x, (ts < 0));
+    return -1;
+  }
   if (ts)
   {
     if (ishtml)
@@ -163,97 +485,114 @@ static ssize_t textlog_add_buf (logfile_t *log, const char *text, size_t sz,
 		      TimeString);
     else
       tsz = snprintf (tss, sizeof(tss), "[%.5s] ", TimeString);
-    if (log->inbuf > sizeof(log->buf) - tsz)
-      tsw = sizeof(log->buf) - log->inbuf;
-    else
-      tsw = tsz;
-    memcpy (&log->buf[log->inbuf], tss, tsw);
   }
   else
-    tsz = tsw = 0;
-  if (log->inbuf + tsz + sp + sz + 1 >= sizeof(log->buf))
-						/* [timestamp][prefix]line\n */
+    tsz = 0;
+  if (render)				/* max size of rendered line */
+    sz = HUGE_STRING - 1;
+  if (tsz + sp + sz + 1 > LOGBUFSIZE)	/* [timestamp][prefix]line\n */
+    sz = LOGBUFSIZE - (tsz + sp + 1);	/* truncate it */
+  pthread_mutex_lock (&LogsLock);
+  c = _log_reserve (log, tsz + sp + sz + 1);
+  if (c == NULL)			/* buffer is full, file locked? */
   {
-    if (log->inbuf + tsz >= sizeof(log->buf))
-      sw = psw = 0;
-    else if (log->inbuf + tsz + sp >= sizeof(log->buf))
-    {
-      psw = sizeof(log->buf) - log->inbuf - tsz;
-      memcpy (&log->buf[log->inbuf+tsw], log_prefix, psw);
-      sw = 0;
-    }
-    else
-    {
-      psw = sp;
-      memcpy (&log->buf[log->inbuf+tsw], log_prefix, psw);
-      if ((log->inbuf + tsz + sp + sz) > sizeof(log->buf)) /* sz > sw */
-	sw = sizeof(log->buf) - log->inbuf - sp - tsz;
-      else
-	sw = sz;
-      memcpy (&log->buf[log->inbuf+tsw+psw], text, sw);
-    }
-    log->inbuf += (tsw + psw + sw);
-    x = flush_log (log, 1, 0);
-    if (x == EACCES || x == EAGAIN)	/* file locked */
+    pthread_cond_signal (&LogsCond);
+    pthread_mutex_unlock (&LogsLock);
+    /* check if file is locked too far ago */
+    if (log->iface->qsize > MAXLOGQUEUE)
     {
-      log->inbuf -= (tsw + psw + sw);
-      /* check if file is locked too far ago */
-      if (log->iface->qsize > MAXLOGQUEUE)
-      {
-	if (ts >= 0)
-	  ERROR ("Logfile %s is locked but queue grew to %d, abort logging to it",
-		 log->path, log->iface->qsize);
-	return -1;
-      }
-      return 0;
-    }
-    else if (x)				/* fatal error! */
-    {
-      if (ts >= 0)			/* ts < 0 means quiet */
-      {
-#if _GNU_SOURCE
-	register const char *str = strerror_r (x, log->buf, sizeof(log->buf));
-	ERROR ("Couldn't sync logfile %s (%s), abort logging to it.",
-	       log->path, str);
-#else
-	if (strerror_r(x, log->buf, sizeof(log->buf)) != 0)
-	  snprintf(log->buf, sizeof(log->buf), "(failed to decode err=%d)", x);
-	ERROR ("Couldn't sync logfile %s (%s), abort logging to it.",
-	       log->path, log->buf);
-#endif
-      }
+      if (ts >= 0)
+	ERROR ("Logfile %s is locked but queue grew to %d, abort logging to it",
+	       log->path, log->iface->qsize);
       return -1;
     }
-    if (ts && tsw < tsz)
-      memcpy (log->buf, &tss[tsw], tsz - tsw);
-    tsw = tsz - tsw;
-    sp -= psw;
-    sz -= sw;
+    return 0;
   }
-  else
-    sw = psw = 0;
-  if (log->inbuf + tsw + sp + sz + 1 > sizeof(log->buf)) /* truncate it */
-    sz = sizeof(log->buf) - (log->inbuf + tsw + sp + 1);
+  if (tsz)
+    memcpy (c, tss, tsz);
   if (sp)
-    memcpy (&log->buf[log->inbuf+tsw], &log_prefix[psw], sp);
-  if (sz)
-    memcpy (&log->buf[log->inbuf+tsw+sp], &text[sw], sz);
-  if (log->inbuf == 0)		/* timestamp for cache-time */
+    memcpy (&c[tsz], log_prefix, sp);
+  if (render)				/* it puts '\0' so sz+1 is required */
+    sz = render (&c[tsz+sp], text, sz + 1, flag);
+  else if (sz)
+    memcpy (&c[tsz+sp], text, sz);
+  c[tsz+sp+sz] = '\n';
+  log->tail->used += (tsz + sp + sz + 1);
+  if (log->inbuf == 0 && log->inwq == 0) /* timestamp for cache-time */
     log->timestamp = Time;
   log->lastmsg = Time;
-  log->inbuf += (tsw + sp + sz);
-  log->buf[log->inbuf++] = '\n';
-  return sz + sw;
+  log->inbuf += (tsz + sp + sz + 1);
+  if (log->head != log->tail)		/* at least one chunk is full */
+    pthread_cond_signal (&LogsCond);
+  pthread_mutex_unlock (&LogsLock);
+  return (tsz + sp + sz + 1);
 }
 
-static ssize_t textlog_add_buf_ts (logfile_t *log, char *text, size_t sz, size_t sp, int x)
+static ssize_t textlog_add_buf_ts (logfile_t *log, const char *text, size_t sz,
+				   size_t sp, logrender_t render, flag_t fl)
 {
-  return textlog_add_buf (log, text, sz, sp, 1, x);
+  return textlog_add_buf (log, text, sz, sp, 1, (log->colormode > 0),
+			  render, fl);
 }
 
-static ssize_t textlog_add_buf_nots (logfile_t *log, char *text, size_t sz, size_t sp, int x)
+static ssize_t textlog_add_buf_nots (logfile_t *log, const char *text, size_t sz,
+				     size_t sp, logrender_t render, flag_t fl)
+{
+  return textlog_add_buf (log, text, sz, sp, 0, (log->colormode > 0),
+			  render, fl);
+}
+
+/*
+ * Character classes for renderers. Everything which is not LCH_TEXT stops
+ * copying of text run and is handled by the renderer.
+ */
+#define LCH_TEXT	0
+#define LCH_EOL		1	/* '\0' */
+#define LCH_SKIP	2	/* ^G and blink ^F are ignored */
+#define LCH_BOLD	3	/* ^B */
+#define LCH_UNDER	4	/* understrike ^_ */
+#define LCH_REV		5	/* reverse ^V */
+#define LCH_PLAIN	6	/* ^O resets all attributes */
+#define LCH_COLOR	7	/* mirc colors ^C */
+#define LCH_LT		8	/* characters which should be escaped in html */
+#define LCH_GT		9
+#define LCH_AMP		10
+#define LCH_HTTP	11	/* check for http:// */
+#define LCH_SPACE	12	/* ACTION nick hilighting */
+
+#define LCH_CONTROLS \
+  [0] = LCH_EOL, ['\002'] = LCH_BOLD, ['\003'] = LCH_COLOR, \
+  ['\006'] = LCH_SKIP, ['\007'] = LCH_SKIP, ['\017'] = LCH_PLAIN, \
+  ['\026'] = LCH_REV, ['\037'] = LCH_UNDER
+#define LCH_HTMLCHARS \
+  ['<'] = LCH_LT, ['>'] = LCH_GT, ['&'] = LCH_AMP, ['h'] = LCH_HTTP
+
+static const unsigned char _lch_html[256] = { LCH_CONTROLS, LCH_HTMLCHARS };
+static const unsigned char _lch_html_sp[256] = { LCH_CONTROLS, LCH_HTMLCHARS,
+						 [' '] = LCH_SPACE };
+
+typedef unsigned long __attribute__((__may_alias__)) lch_word_t;
+
+/*
+ * Returns pointer to first byte below 0x20 in text (it may be terminating
+ * '\0' as well). Scans a word per step which is safe since aligned word
+ * never crosses a page boundary.
+ */
+static inline const char *_log_scan_ctrl (const char *text)
 {
-  return textlog_add_buf (log, text, sz, sp, 0, x);
+  const lch_word_t ones = (lch_word_t)-1 / 0xff;	/* 0x0101...01 */
+  const lch_word_t *w;
+
+  while ((unsigned long)text & (sizeof(lch_word_t) - 1))
+  {
+    if (*(const unsigned char *)text < 0x20)
+      return text;
+    text++;
+  }
+  for (w = (const lch_word_t *)text;
+       !((*w - ones * 0x20) & ~*w & (ones << 7)); w++);
+  for (text = (const char *)w; *(const unsigned char *)text >= 0x20; text++);
+  return text;
 }
 
 static inline int _getmirccolor (const char **p)
@@ -275,266 +614,244 @@ static inline int _getmirccolor (const char **p)
   return n;
 }
 
-static size_t textlog_rmcolor (char *buff, const char *text, size_t sz)
+/* skips color spec after ^C, comma is eaten only if background follows */
+static inline void _skipmirccolor (const char **p, int *fg, int *bg)
 {
-  register char ch;
-  size_t i;
+  *fg = _getmirccolor (p);
+  *bg = -1;
+  if (*fg >= 0 && (*p)[0] == ',' && (*p)[1] >= '0' && (*p)[1] <= '9')
+  {
+    (*p)++;
+    *bg = _getmirccolor (p);
+  }
+}
+
+static size_t textlog_rmcolor (char *buff, const char *text, size_t sz,
+			       flag_t flag)
+{
+  const char *t;
+  size_t i, n;
+  int fg, bg;
 
   i = 0;
-  while (i < sz)			/* reserved for 1 char */
+  sz--;					/* reserved for '\0' */
+  while (i < sz)
   {
-    if ((ch = *text++) == '\0')		/* EOL */
+    t = _log_scan_ctrl (text);		/* plain line goes by one memcpy() */
+    n = t - text;
+    if (i + n > sz)
+      n = sz - i;
+    memcpy (&buff[i], text, n);
+    i += n;
+    text += n;
+    if (text != t)			/* truncated */
       break;
-    switch (ch)
+    switch (_lch_html[*(const unsigned char *)text++])
     {
-      case '\002':			/* bold ^B */
-      case '\007':			/* ignoring ^G */
-      case '\037':			/* understrike ^_ */
-      case '\026':			/* reverse ^V */
-      case '\006':			/* blink ^F */
-	break;
-      case '\003':			/* mirc colors */
-	if (text[0] == '1' && text[1] >= '0' && text[1] <= '5')
-	  text += 2;
-	else if (*text >= '0' && *text <= '9')
-	  text++;
-	else
-	  break;
-	if (*text == ',')
-	{
-	  if (text[0] == '1' && text[1] >= '0' && text[1] <= '5')
-	    text += 3;
-	  else if (*text >= '0' && *text <= '9')
-	    text += 2;
-	  else
-	    buff[i] = *text++;
-	}
+      case LCH_EOL:
+	buff[i] = '\0';
+	return (i);
+      case LCH_COLOR:
+	_skipmirccolor (&text, &fg, &bg);
+      case LCH_SKIP:
+      case LCH_BOLD:
+      case LCH_UNDER:
+      case LCH_REV:
+      case LCH_PLAIN:
 	break;
-      default:
-	buff[i++] = ch;
+      default:				/* other control chars are kept */
+	buff[i++] = text[-1];
     }
   }
+  buff[i] = '\0';
   return (i);
 }
 
+/* puts string into buff if it fits before reserved space r */
+#define HTML_PUT(s,l) \
+  if (i + r + (l) > sz) \
+    goto done; \
+  memcpy (&buff[i], s, l), i += (l)
+
+/* closes attribute which has (l) bytes reserved for closing tag */
+#define HTML_CLOSE(s,l) \
+  memcpy (&buff[i], s, l), i += (l), r -= (l)
+
 static size_t textlog2html (char *buff, const char *text, size_t sz, flag_t flag)
 {
   int us = 0;		/* flags */
   int bold = 0;
   int rev = 0;
-  int blink = 0;
   int color = 0;
-  int url = 0;
-  const char *p = NULL;	/* URL ptr, NULL to make compiler happy */
-  register unsigned char ch;
-  size_t i, sw, r;	/* counters */
+  const unsigned char *lch;
+  const char *t;
+  size_t i, r, n;	/* counters, r is reserved for closing tags */
+  int fg, bg;
 
   if ((flag & F_T_MASK) == F_T_ACTION)
   {
     i = strfcpy (buff, "<span class=action>", sz);
     color = -2;				/* colorize "* nick" */
     r = 12;		/* </span><br>\0 */
+    lch = _lch_html_sp;
   }
   else if (flag & F_PREFIXED)
   {
     i = strfcpy (buff, "<span class=info>", sz);
     r = 12;		/* </span><br>\0 */
+    lch = _lch_html;
   }
   else
+  {
     i = 0, r = 5;	/* <br>\0 */
+    lch = _lch_html;
+  }
   while (i + r < sz)			/* reserved for 1 char */
   {
-    ch = *(unsigned char *)text++;
-    if (ch == '\0')			/* EOL */
+    for (t = text; lch[*(const unsigned char *)t] == LCH_TEXT; t++);
+    n = t - text;
+    if (i + r + n > sz)
+      n = sz - r - i;
+    memcpy (&buff[i], text, n);		/* copy run of plain text */
+    i += n;
+    text += n;
+    if (text != t)			/* truncated */
       break;
-    if (url && ch <= ' ')		/* URL ends? */
+    switch (lch[*(const unsigned char *)text++])
     {
-      sw = snprintf (&buff[i], r, "\">%.*s</A>", url, p);
-      r -= sw;
-      i += sw;
-      url = 0;
-    }
-    if (url) {				/* URL continues */
-      url++;
-      r++;
-      buff[i++] = ch;	/* this char */
-    } else switch (ch) {
-      case ' ':
-	if (color < 0)			/* ACTION nick hilighting */
+      case LCH_EOL:
+	goto done;
+      case LCH_SPACE:
+	if (++color == 0)
 	{
-	  if (++color == 0)
-	  {
-	    i += strfcpy (&buff[i], "</span>", r);
-	    r -= 7;
-	  }
+	  HTML_CLOSE ("</span>", 7);
+	  lch = _lch_html;
 	}
-	buff[i++] = ch;
+	buff[i++] = ' ';
 	break;
-      case '\002':			/* bold ^B */
+      case LCH_BOLD:
 	if (bold)
 	{
-	  i += strfcpy (&buff[i], "</B>", r);
-	  r -= 4;
+	  HTML_CLOSE ("</B>", 4);
 	  bold = 0;
 	}
-	else if (i + r + 7 > sz) /* <b></b> */
+	else if (i + r + 7 <= sz) /* <b></b> */
 	{
-	  r = sz - i;
-	  break;
-	}
-	else
-	{
-	  i += strfcpy (&buff[i], "<B>", sz - i);
+	  memcpy (&buff[i], "<B>", 3);
+	  i += 3;
 	  r += 4; /* </b> */
 	  bold = 1;
 	}
 	break;
-      case '\007':			/* ignoring ^G */
-	break;
-      case '\037':			/* understrike ^_ */
+      case LCH_UNDER:
 	if (us)
 	{
-	  i += strfcpy (&buff[i], "</U>", r);
-	  r -= 4;
+	  HTML_CLOSE ("</U>", 4);
 	  us = 0;
 	}
-	else if (i + r + 7 > sz) /* <u></u> */
-	  break;
-	else
+	else if (i + r + 7 <= sz) /* <u></u> */
 	{
-	  i += strfcpy (&buff[i], "<U>", sz - i);
+	  memcpy (&buff[i], "<U>", 3);
+	  i += 3;
 	  r += 4; /* </u> */
 	  us = 1;
 	}
 	break;
-      case '\026':			/* reverse ^V */
+      case LCH_REV:
 	if (rev)
 	{
-	  i += strfcpy (&buff[i], "</I>", r);
-	  r -= 4;
+	  HTML_CLOSE ("</I>", 4);
 	  rev = 0;
 	}
-	else if (i + r + 7 > sz) /* <i></i> */
-	  break;
-	else
+	else if (i + r + 7 <= sz) /* <i></i> */
 	{
-	  i += strfcpy (&buff[i], "<I>", sz - i);
+	  memcpy (&buff[i], "<I>", 3);
+	  i += 3;
 	  r += 4; /* </i> */
 	  rev = 1;
 	}
 	break;
-      case '\006':			/* blink ^F */
-	if (blink)
-	{
-//	  strfcpy (&buff[i], "</F>", r);
-//	  r -= 4;
-//	  i += 4;
-	  blink = 0;
-	}
-//	else if (i + r + 7 > sz) /* <f></f> */
-//	  break;
-	else
+      case LCH_PLAIN:
+	if (color > 0)
 	{
-//	  strfcpy (&buff[i], "<F>", sz - i);
-//	  r += 4;
-//	  i += 3;
-	  blink = 1;
+	  HTML_CLOSE ("</span>", 7);
+	  color = 0;
 	}
+	if (us)
+	  HTML_CLOSE ("</U>", 4);
+	if (rev)
+	  HTML_CLOSE ("</I>", 4);
+	if (bold)
+	  HTML_CLOSE ("</B>", 4);
+	us = rev = bold = 0;
 	break;
-      case '\003':			/* mirc colors */
+      case LCH_COLOR:
 	if (*text >= '0' && *text <= '9')
 	{
-	  register int fg = _getmirccolor (&text);
-	  register int bg = 0;
-
-	  if (*text == ',')
-	  {
-	    text++;
-	    bg = _getmirccolor (&text);
-	  }
+	  _skipmirccolor (&text, &fg, &bg);
 	  if (color)
 	  {
-	    i += strfcpy (&buff[i], "</span>", r);
-	    r -= 7;
+	    HTML_CLOSE ("</span>", 7);
 	    color = 0;
+	    lch = _lch_html;
 	  }
-	  sw = 23;			/* <span class=AXX></span> */
-	  if (bg)
-	    sw += 6;			/* " bYY" */
-	  if (i + sw + r > sz)		/* insufficient space? */
+	  n = (bg >= 0) ? 29 : 23;	/* <span class="fXX bYY"></span> */
+	  if (i + n + r > sz)		/* insufficient space? */
 	    break;			/* ignore color directive */
 	  color = 1;
-	  if (bg)
-	    sw = snprintf (&buff[i], sz - i,
-			   "<span class=\"f%d b%d\">", fg, bg);
+	  if (bg >= 0)
+	    i += snprintf (&buff[i], sz - i, "<span class=\"f%d b%d\">", fg, bg);
 	  else
-	    sw = snprintf (&buff[i], sz - i, "<span class=f%d>", fg);
-	  i += sw;
+	    i += snprintf (&buff[i], sz - i, "<span class=f%d>", fg);
 	  r += 7; /* </span> */
 	}
 	else if (color > 0)
 	{
-	  i += strfcpy (&buff[i], "</span>", r);
-	  r -= 7;
+	  HTML_CLOSE ("</span>", 7);
 	  color = 0;
 	}
 	break;
-      case '<':				/* should be escaped */
-	if (i + r + 4 > sz)
-	{
-	  r = sz - r;
-	  break;
-	}
-	i += strfcpy (&buff[i], "&lt;", 5);
+      case LCH_LT:
+	HTML_PUT ("&lt;", 4);
 	break;
-      case '>':
-	if (i + r + 4 > sz)
-	{
-	  r = sz - r;
-	  break;
-	}
-	i += strfcpy (&buff[i], "&gt;", 5);
+      case LCH_GT:
+	HTML_PUT ("&gt;", 4);
 	break;
-      case '&':
-	if (i + r + 5 > sz)
-	{
-	  r = sz - r;
-	  break;
-	}
-	i += strfcpy (&buff[i], "&amp;", 6);
+      case LCH_AMP:
+	HTML_PUT ("&amp;", 5);
 	break;
-      case 'h':				/* check for http:// */
-	if (color >= 0 && !url && !strncmp (text, "ttp://", 6))
+      case LCH_HTTP:
+	if (color >= 0 && !strncmp (text, "ttp://", 6))
 	{
-	  if (i + r + 29 > sz) /* <a href="http://">http://</a> */
+	  /* URL ends on any space or control char */
+	  for (t = &text[6]; *(const unsigned char *)t > ' '; t++);
+	  n = t - &text[-1];
+	  /* <A HREF="url">url</A> */
+	  if (i + r + 2 * n + 15 <= sz)
 	  {
-	    r = sz - r;
+	    i += snprintf (&buff[i], sz - i, "<A HREF=\"%.*s\">%.*s</A>",
+			   (int)n, &text[-1], (int)n, &text[-1]);
+	    text = t;
 	    break;
 	  }
-	  p = &text[-1];
-	  url = 7; /* http:// */
-	  text = &p[url];
-	  i += strfcpy (&buff[i], "<A HREF=\"http://", sz - i);
-	  r += 13; /* ">http://</a> */
-	  break;
 	}
-      default:
-	buff[i++] = ch;
+	buff[i++] = 'h';
+	break;
+      default: ;			/* LCH_SKIP */
     }
   }
-  if (url)
-    sw = snprintf (&buff[i], sz - i, "\">%.*s</A>%s%s%s%s%s<BR>", url, p,
-		   color ? "</span>" : "", us ? "</U>" : "", rev ? "</I>" : "",
-		   bold ? "</B>" : "", (flag & F_PREFIXED) ? "</span>" : "");
-  else
-    sw = snprintf (&buff[i], sz - i, "%s%s%s%s%s<BR>", color ? "</span>" : "",
-		   us ? "</U>" : "", rev ? "</I>" : "", bold ? "</B>" : "",
-		   (flag & F_PREFIXED) ? "</span>" : "");
-  if (i + sw >= sz)
+done:
+  n = snprintf (&buff[i], sz - i, "%s%s%s%s%s<BR>", color ? "</span>" : "",
+		us ? "</U>" : "", rev ? "</I>" : "", bold ? "</B>" : "",
+		(flag & F_PREFIXED) ? "</span>" : "");
+  if (i + n >= sz)
     return (sz - 1);
-  return (i + sw);
+  return (i + n);
 }
 
+#undef HTML_PUT
+#undef HTML_CLOSE
+
 #define open_log_file(path) open (path, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP)
 
 static iftype_t logfile_signal (INTERFACE *iface, ifsig_t sig)
@@ -546,7 +863,7 @@ static iftype_t logfile_signal (INTERFACE *iface, ifsig_t sig)
   switch (sig)
   {
     case S_TIMEOUT:
-      flush_log (log, 0, 0);
+      pthread_cond_signal (&LogsCond);	/* writer will decide itself */
       break;
     case S_TERMINATE:
       Set_Iface (iface);	/* get all queue now if possible */
@@ -555,13 +872,16 @@ static iftype_t logfile_signal (INTERFACE *iface, ifsig_t sig)
       FREE (&log->rpath);	/* these are allocated */
     case S_SHUTDOWN:
       if (ShutdownR && *ShutdownR && (log->level & (F_BOOT | F_ERROR | F_WARN)))
-	textlog_add_buf (log, ShutdownR, strlen(ShutdownR), strlen(log_prefix), -1, 0);
+	textlog_add_buf (log, ShutdownR, strlen(ShutdownR), strlen(log_prefix),
+			 -1, 0, NULL, 0);
+      pthread_mutex_lock (&LogsLock);
       if (log->prev)
 	log->prev->next = log->next;
       else
 	Logfiles = log->next;
       if (log->next)
 	log->next->prev = log->prev;
+      pthread_mutex_unlock (&LogsLock);
       iface->ift |= I_DIED;
       lockcount = 0;
       while ((x = flush_log (log, 1, 1)) != 0)
@@ -569,13 +889,16 @@ static iftype_t logfile_signal (INTERFACE *iface, ifsig_t sig)
 	  break;		/* try to flush log up to 16 times */
       if (sig == S_SHUTDOWN)
 	break;
-      close (log->fd);
+      close (_log_detach_fd (log));
+      pthread_mutex_lock (&LogsLock);
+      _log_free_buffers (log);
+      pthread_mutex_unlock (&LogsLock);
       FREE (&log->path);
       break;
     case S_FLUSH:
       flush_log (log, 1, 0);
-      close (log->fd);
-      log->fd = open_log_file (log->path);
+      close (_log_detach_fd (log));
+      _log_attach_fd (log, open_log_file (log->path));
     default: ;
   }
   return 0;
@@ -585,25 +908,36 @@ static int add_to_log (INTERFACE *iface, REQUEST *req)
 {
   ssize_t x;
   logfile_t *log;
-  char *line;
-  char buff[HUGE_STRING];
+  const char *line, *t;
+  logrender_t render;
 
   log = (logfile_t *)iface->data;
   if (!req || !(req->flag & log->level))
     return REQ_OK;
   //TODO: if current date differs of log->lastmsg then add date message
-  if (log->colormode > 0)		/* html mode */
-    x = textlog2html ((line = buff), req->string, sizeof(buff), req->flag);
-  else if (log->colormode < 0)		/* nocolor mode */
-    x = textlog_rmcolor ((line = buff), req->string, sizeof(buff));
+  line = req->string;
+  render = log->render;
+  if (render == &textlog_rmcolor)	/* nocolor mode */
+  {
+    t = _log_scan_ctrl (line);
+    if (*t == '\0')			/* no control codes, copy it as is */
+    {
+      render = NULL;
+      x = t - line;
+    }
+    else
+      x = 1;
+  }
+  else if (render)			/* html mode */
+    x = (*line != '\0');
   else
-    x = strlen ((line = req->string));
+    x = strlen (line);
   if (x == 0)
     Add_Request(I_LOG, "*", F_WARN, "logs:add_to_log: message size=%zd", x++);
   else if (log->wantprefix != FALSE && (req->flag & F_PREFIXED))
-    x = log->add_buf (log, line, x, strlen(log_prefix), (log->colormode > 0));
+    x = log->add_buf (log, line, x, strlen(log_prefix), render, req->flag);
   else
-    x = log->add_buf (log, line, x, 0, (log->colormode > 0));
+    x = log->add_buf (log, line, x, 0, render, req->flag);
   if (x <= 0)
   {
     if (x < 0)
@@ -624,6 +958,7 @@ static int add_to_log (INTERFACE *iface, REQUEST *req)
 #define L_NOTS 32
 #define L_NOCL 64
 #define L_HTML 128
+#define L_GZIP 256
 
 
 static time_t get_rotatetime (time_t mtime, int mode)
@@ -667,16 +1002,229 @@ static inline size_t __strftime (char *l, size_t s, char *f, struct tm *t)
 #pragma GCC diagnostic error "-Wformat-nonliteral"
 #endif
 
+#ifdef HAVE_LIBZ
+/*
+ * Log compressor thread: rotated files are queued by do_rotate() and then
+ * compressed one by one into "file.gz" with idle priority so it never takes
+ * CPU from dispatcher or writer. Memory used is fixed: one read buffer and
+ * zlib state. LogzLock protects the queue and progress data below.
+ */
+typedef struct logzjob_t
+{
+  struct logzjob_t *next;
+  char *path;
+} logzjob_t;
+
+static pthread_mutex_t LogzLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t LogzCond = PTHREAD_COND_INITIALIZER;
+static pthread_t LogzThread;
+static bool LogzRun = FALSE;
+
+static logzjob_t *LogzQueue = NULL;
+static logzjob_t *LogzQueueLast = NULL;
+static unsigned int LogzQueueNum = 0;
+static logzjob_t *LogzJob = NULL;	/* in progress */
+static off_t LogzDone, LogzTotal;
+static time_t LogzStart;
+static unsigned int LogzFiles = 0;	/* statistics, for report */
+static unsigned int LogzFailed = 0;
+static off_t LogzLastIn, LogzLastOut;
+static int LogzLastTime;
+
+/* returns 0 on success or errno, never leaves partial "file.gz" */
+static int _log_compress_file (const char *path, char *buf, off_t *outsize)
+{
+  char gzpath[PATH_MAX+1];
+  struct stat st;
+  gzFile gz;
+  ssize_t s;
+  int fd, gzfd, x = 0;
+
+  if (snprintf (gzpath, sizeof(gzpath), "%s.gz", path) >= (int)sizeof(gzpath))
+    return ENAMETOOLONG;
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return errno;
+  if (fstat (fd, &st) < 0 ||
+      (gzfd = open (gzpath, O_WRONLY | O_CREAT | O_TRUNC,
+		    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) < 0)
+  {
+    x = errno;
+    close (fd);
+    return x;
+  }
+  pthread_mutex_lock (&LogzLock);
+  LogzTotal = st.st_size;
+  pthread_mutex_unlock (&LogzLock);
+  if ((gz = gzdopen (gzfd, "wb")) == NULL)
+  {
+    close (gzfd);
+    x = ENOMEM;
+  }
+  else while ((s = read (fd, buf, LOGZBUFSIZE)) != 0)
+  {
+    if (s < 0)
+      x = errno;
+    else if (gzwrite (gz, buf, (unsigned int)s) != (int)s)
+      x = EIO;
+    if (x)
+      break;
+    pthread_mutex_lock (&LogzLock);
+    LogzDone += s;
+    if (!LogzRun)			/* module is unloading, abort it */
+      x = EINTR;
+    pthread_mutex_unlock (&LogzLock);
+    if (x)
+      break;
+    sched_yield();
+  }
+  close (fd);
+  if (gz && gzclose (gz) != Z_OK && x == 0)
+    x = EIO;
+  if (x == 0 && stat (gzpath, &st) == 0)
+  {
+    *outsize = st.st_size;
+    unlink (path);			/* done, remove uncompressed file */
+  }
+  else
+    unlink (gzpath);
+  return x;
+}
+
+static void *_logs_compressor (void *unused)
+{
+  logzjob_t *job;
+  char *buf;
+  off_t outsize = 0;
+  int x;
+#ifdef SCHED_IDLE
+  struct sched_param sp;
+
+  sp.sched_priority = 0;
+  pthread_setschedparam (pthread_self(), SCHED_IDLE, &sp);
+#endif
+  buf = safe_malloc (LOGZBUFSIZE);
+  pthread_mutex_lock (&LogzLock);
+  while (LogzRun)
+  {
+    if ((job = LogzQueue) == NULL)
+    {
+      pthread_cond_wait (&LogzCond, &LogzLock);
+      continue;
+    }
+    if ((LogzQueue = job->next) == NULL)
+      LogzQueueLast = NULL;
+    LogzQueueNum--;
+    LogzJob = job;
+    LogzDone = LogzTotal = 0;
+    LogzStart = time (NULL);
+    pthread_mutex_unlock (&LogzLock);
+    dprint (3, "logs:_logs_compressor: compressing %s", job->path);
+    x = _log_compress_file (job->path, buf, &outsize);
+    pthread_mutex_lock (&LogzLock);
+    LogzJob = NULL;
+    if (x == 0)
+    {
+      LogzFiles++;
+      LogzLastIn = LogzTotal;
+      LogzLastOut = outsize;
+      LogzLastTime = (int)(time (NULL) - LogzStart);
+      dprint (3, "logs:_logs_compressor: %s done in %d seconds", job->path,
+	      LogzLastTime);
+    }
+    else if (x != EINTR)
+    {
+      LogzFailed++;
+#if _GNU_SOURCE
+      ERROR ("logs: couldn't compress rotated log %s: %s", job->path,
+	     strerror_r (x, buf, LOGZBUFSIZE));
+#else
+      if (strerror_r (x, buf, LOGZBUFSIZE) != 0)
+	snprintf (buf, LOGZBUFSIZE, "(failed to decode err=%d)", x);
+      ERROR ("logs: couldn't compress rotated log %s: %s", job->path, buf);
+#endif
+    }
+    FREE (&job->path);
+    FREE (&job);
+  }
+  pthread_mutex_unlock (&LogzLock);
+  FREE (&buf);
+  return NULL;
+}
+
+/* queues file for compression, starts compressor if it isn't running yet */
+static void _log_compress_later (const char *path)
+{
+  logzjob_t *job;
+
+  pthread_mutex_lock (&LogzLock);
+  if (!LogzRun)
+  {
+    LogzRun = TRUE;
+    if (pthread_create (&LogzThread, NULL, &_logs_compressor, NULL))
+    {
+      LogzRun = FALSE;
+      pthread_mutex_unlock (&LogzLock);
+      ERROR ("logs: cannot create compressor thread, %s left uncompressed.",
+	     path);
+      return;
+    }
+  }
+  job = safe_malloc (sizeof(logzjob_t));
+  job->next = NULL;
+  job->path = safe_strdup (path);
+  if (LogzQueueLast)
+    LogzQueueLast->next = job;
+  else
+    LogzQueue = job;
+  LogzQueueLast = job;
+  LogzQueueNum++;
+  pthread_cond_signal (&LogzCond);
+  pthread_mutex_unlock (&LogzLock);
+}
+
+/* stops compressor, aborting current job, files in queue are left as is */
+static void _log_compress_stop (void)
+{
+  logzjob_t *job;
+
+  pthread_mutex_lock (&LogzLock);
+  if (!LogzRun)
+  {
+    pthread_mutex_unlock (&LogzLock);
+    return;
+  }
+  LogzRun = FALSE;
+  pthread_cond_signal (&LogzCond);
+  pthread_mutex_unlock (&LogzLock);
+  pthread_join (LogzThread, NULL);
+  while ((job = LogzQueue) != NULL)
+  {
+    LogzQueue = job->next;
+    WARNING ("logs: rotated log %s left uncompressed.", job->path);
+    FREE (&job->path);
+    FREE (&job);
+  }
+  LogzQueueLast = NULL;
+  LogzQueueNum = 0;
+}
+#endif
+
 static void do_rotate (logfile_t *log)
 {
   char path[PATH_MAX+1];
   char *c, *c2, *rpath;
   ssize_t s = 0;
   register int x;
+  int fd;
+  off_t size;
   struct tm tm;
 
-  x = flush_log (log, 1, 0);
   dprint (5, "logs/logs.c:do_rotate: start for %s", log->path);
+  /* writer doesn't touch fd while we hold the lock and log isn't busy */
+  pthread_mutex_lock (&LogsLock);
+  x = _log_flush_locked (log, (_logs_sync_mode() == LOG_SYNC_ROTATE));
+  size = (log->fd < 0) ? -1 : lseek (log->fd, 0, SEEK_END);
+  pthread_mutex_unlock (&LogsLock);
   if (x)
   {
 #if _GNU_SOURCE
@@ -689,7 +1237,7 @@ static void do_rotate (logfile_t *log)
 #endif
     return;
   }
-  if (lseek (log->fd, 0, SEEK_END) == 0) /* we will not rotate empty file */
+  if (size == 0)			/* we will not rotate empty file */
   {
     dprint (3, "logs/logs.c:do_rotate: nothing to do on %s", log->path);
     log->rotatetime = get_rotatetime (Time, log->rmode);
@@ -698,12 +1246,17 @@ static void do_rotate (logfile_t *log)
   localtime_r (&log->lastmsg, &tm);
   /* end html here, ignoring any errors */
   if (log->colormode > 0)
-  {
-    textlog_add_buf (log, "</BODY>\n</HTML>", 15, 0, 0, 0);
-    flush_log (log, 1, 0);
-  }
-  close (log->fd);
-  log->fd = -1;			/* if we get any error let's don't fall */
+    textlog_add_buf (log, "</BODY>\n</HTML>", 15, 0, 0, 0, NULL, 0);
+  /* write the rest and detach fd at once so writer can't get between,
+     anything logged after that will go into new file */
+  pthread_mutex_lock (&LogsLock);
+  _log_flush_locked (log, 0);
+  fd = log->fd;
+  log->fd = -1;
+  pthread_mutex_unlock (&LogsLock);
+  /* if we get any error let's don't fall */
+  if (fd >= 0)
+    close (fd);
   /* make rotate path */
   if ((rpath = log->rpath) == NULL)
     rpath = logs_pattern;
@@ -802,13 +1355,17 @@ static void do_rotate (logfile_t *log)
         strfcpy(buffer, "(failed to decode error)", sizeof(buffer));
       ERROR ("Couldn't rotate %s to %s: %s", log->path, path, buffer);
 #endif
-      log->fd = open_log_file (log->path);
+      _log_attach_fd (log, open_log_file (log->path));
       return;				/* reopen log, don't update time */
     }
   }
   dprint (3, "logs/logs.c:do_rotate: finished on %s", log->path);
   log->rotatetime = get_rotatetime (Time, log->rmode);
-  log->fd = open_log_file (log->path);
+  _log_attach_fd (log, open_log_file (log->path));
+#ifdef HAVE_LIBZ
+  if (log->compress)
+    _log_compress_later (path);
+#endif
 }
 
 static char Flags[] = FLAG_T;
@@ -851,11 +1408,18 @@ static inline void _logfile_set_rmode(logfile_t *log, int rmode)
   else
     log->add_buf = &textlog_add_buf_ts;
   log->colormode = (rmode & (L_HTML | L_NOCL)) - L_NOCL;
-  log->rmode = (rmode & ~(L_NOTS | L_HTML | L_NOCL));
+  if (log->colormode > 0)		/* html mode */
+    log->render = &textlog2html;
+  else if (log->colormode < 0)		/* nocolor mode */
+    log->render = &textlog_rmcolor;
+  else
+    log->render = NULL;
+  log->compress = (rmode & L_GZIP) ? TRUE : FALSE;
+  log->rmode = (rmode & ~(L_NOTS | L_HTML | L_NOCL | L_GZIP));
 }
 
 /*
- * logfile [-n[ots]] [-h[tml]|-s[tripcolor]] [-y|-m|-w] [-r[path] rpath] filename level [service]
+ * logfile [-n[ots]] [-h[tml]|-s[tripcolor]] [-y|-m|-w] [-g[zip]] [-r[path] rpath] filename level [service]
  * logfile -c[lose] filename
  */
 static ScriptFunction (cfg_logfile)
@@ -886,17 +1450,23 @@ static ScriptFunction (cfg_logfile)
     if (!strncmp (path, "nots", ss))
       rmode |= L_NOTS;
     else if (!strncmp (path, "yearly", ss))
-      rmode = (rmode & (L_NOTS|L_DELE)) + L_YEAR;
+      rmode = (rmode & (L_NOTS|L_DELE|L_GZIP)) + L_YEAR;
     else if (!strncmp (path, "monthly", ss))
-      rmode = (rmode & (L_NOTS|L_DELE)) + L_MONT;
+      rmode = (rmode & (L_NOTS|L_DELE|L_GZIP)) + L_MONT;
     else if (!strncmp (path, "weekly", ss))
-      rmode = (rmode & (L_NOTS|L_DELE)) + L_WEEK;
+      rmode = (rmode & (L_NOTS|L_DELE|L_GZIP)) + L_WEEK;
     else if (!strncmp (path, "close", ss))
       rmode |= L_DELE;
     else if (!strncmp (path, "html", ss))
       rmode |= L_HTML;
     else if (!strncmp (path, "stripcolor", ss))
       rmode |= L_NOCL;
+    else if (!strncmp (path, "gzip", ss))
+#ifdef HAVE_LIBZ
+      rmode |= L_GZIP;
+#else
+      WARNING ("logfile: compression isn't supported, -gzip ignored.");
+#endif
     else if (!strncmp (path, "rpath", ss))
     {
       args = NextWord_Unquoted (mask, (char *)args, sizeof(mask)); /* still */
@@ -957,18 +1527,14 @@ static ScriptFunction (cfg_logfile)
   fd = open_log_file (tpath);
   if (fd < 0)
     return 0;
-  log = safe_malloc (sizeof(logfile_t));
-  log->next = Logfiles;
+  log = safe_calloc (1, sizeof(logfile_t));
   log->prev = NULL;
   log->level = level;
-  if (Logfiles)
-    Logfiles->prev = log;
-  Logfiles = log;
   log->path = safe_strdup (tpath);
   log->rpath = rpath;
   log->fd = fd;
-  log->inbuf = 0;
   log->reccount = 0;
+  log->lastsync = Time;
   if ((level & F_PREFIXED) == level) /* only prefixed */
     log->wantprefix = FALSE;
   else
@@ -980,6 +1546,12 @@ static ScriptFunction (cfg_logfile)
     strcpy (mask, "*");
   log->iface = Add_Iface (I_LOG | I_FILE, mask, &logfile_signal, &add_to_log,
 			  log);
+  pthread_mutex_lock (&LogsLock);	/* writer may see it from now */
+  log->next = Logfiles;
+  if (Logfiles)
+    Logfiles->prev = log;
+  Logfiles = log;
+  pthread_mutex_unlock (&LogsLock);
   fstat (fd, &st);	/* is it impossible to get an error here? */
   log->lastmsg = st.st_mtime;
   log->rotatetime = get_rotatetime (st.st_mtime, log->rmode);
@@ -997,6 +1569,9 @@ static void module_log_regall (void)
   Add_Request (I_INIT, "*", F_REPORT, "module logs");
   /* register all variables */
   RegisterInteger ("logfile-lock-attempts", &logfile_locks);
+  RegisterInteger ("logfile-buffer-size", &logfile_bufsize);
+  RegisterString ("logfile-fsync", logfile_fsync, sizeof(logfile_fsync), 0);
+  RegisterInteger ("logfile-fsync-interval", &logfile_fsync_int);
   RegisterString ("logrotate-path", logs_pattern, sizeof(logs_pattern), 0);
   RegisterString ("logrotate-time", logrotate_time, sizeof(logrotate_time), 0);
   RegisterString ("logfile-notice-prefix", log_prefix, sizeof(log_prefix), 0);
@@ -1005,12 +1580,13 @@ static void module_log_regall (void)
   RegisterString ("log-html-color-action", log_html_action, sizeof(log_html_action), 0);
   /* register logfiles - only when all variables are set */
   for (log = Logfiles; log; log = log->next)
-    Add_Request (I_INIT, "*", F_REPORT, "logfile%s%s%s%s%s %s %s %s",
+    Add_Request (I_INIT, "*", F_REPORT, "logfile%s%s%s%s%s%s %s %s %s",
 		 (log->add_buf == &textlog_add_buf_nots) ? " -n" : "",
 		 log->rmode ? ((log->rmode < 2) ? " -w" : (log->rmode == 2) ? " -m" : " -y") : "",
+		 log->compress ? " -g" : "",
 		 log->rpath ? " -rpath \"" : "", NONULL(log->rpath), log->rpath ? "\"" : "",
 		 log->path, logfile_printlevel (log->level), log->iface->name);
-  RegisterFunction ("logfile", &cfg_logfile, "[-n] [-y|-m|-w] filename level [service]");
+  RegisterFunction ("logfile", &cfg_logfile, "[-n] [-y|-m|-w] [-g] filename level [service]");
 }
 
 static void logrotate_reset (void)
@@ -1080,15 +1656,32 @@ static iftype_t module_log_signal (INTERFACE *iface, ifsig_t sig)
       tmp = Set_Iface (iface);
       New_Request (tmp, F_REPORT, "Module logs: %s", Logfiles ? "opened logs:" :
 		   "no opened logs found");
+      pthread_mutex_lock (&LogsLock);
       for (log = Logfiles; log; log = log->next)
       {
-	if (log->inbuf)
-	  New_Request (tmp, F_REPORT, "   file %s, last flushed %d seconds ago",
-		       log->path, (int)(Time - log->timestamp));
+	if (log->inbuf || log->inwq)
+	  New_Request (tmp, F_REPORT, "   file %s, %zu bytes unsaved, last flushed %d seconds ago",
+		       log->path, log->inbuf + log->inwq,
+		       (int)(Time - log->timestamp));
 	else
 	  New_Request (tmp, F_REPORT, "   file %s, no updates to save",
 		       log->path);
       }
+      New_Request (tmp, F_REPORT, "   buffers: %u allocated, %u of them free",
+		   LogbufNum, LogbufFreeNum);
+      pthread_mutex_unlock (&LogsLock);
+#ifdef HAVE_LIBZ
+      pthread_mutex_lock (&LogzLock);
+      if (LogzJob)
+	New_Request (tmp, F_REPORT, "   compressing %s: %lld of %lld bytes done in %d seconds, %u more in queue",
+		     LogzJob->path, (long long)LogzDone, (long long)LogzTotal,
+		     (int)(time (NULL) - LogzStart), LogzQueueNum);
+      if (LogzFiles || LogzFailed)
+	New_Request (tmp, F_REPORT, "   compressed %u rotated logs (%u failed), last one %lld to %lld bytes in %d seconds",
+		     LogzFiles, LogzFailed, (long long)LogzLastIn,
+		     (long long)LogzLastOut, LogzLastTime);
+      pthread_mutex_unlock (&LogzLock);
+#endif
       Unset_Iface();
       break;
     case S_TIMEOUT:
@@ -1101,10 +1694,32 @@ static iftype_t module_log_signal (INTERFACE *iface, ifsig_t sig)
       /* stop rotation first, then terminate all logfiles and unregister all */
       if (*logrotate_hr && *logrotate_min)
 	KillShedule (I_MODULE, "logs", S_TIMEOUT, "*", "*", "*", "*", "*");
-      for (log = Logfiles; log; log = log->next)
-	logfile_signal (log->iface, S_TERMINATE);
+      while (Logfiles)
+	logfile_signal (Logfiles->iface, S_TERMINATE);
+#ifdef HAVE_LIBZ
+      _log_compress_stop();
+#endif
+      /* all logs are closed now so stop the writer */
+      pthread_mutex_lock (&LogsLock);
+      LogsWriterRun = FALSE;
+      pthread_cond_signal (&LogsCond);
+      pthread_mutex_unlock (&LogsLock);
+      pthread_join (LogsWriter, NULL);
+      pthread_mutex_lock (&LogsLock);
+      while (LogbufFree)			/* ensure we leave no garbage */
+      {
+	logbuf_t *b = LogbufFree;
+
+	LogbufFree = b->next;
+	FREE (&b);
+      }
+      LogbufNum = LogbufFreeNum = 0;
+      pthread_mutex_unlock (&LogsLock);
       Delete_Binding("time-shift", (Function)&ts_logs, NULL);
       UnregisterVariable ("logfile-lock-attempts");
+      UnregisterVariable ("logfile-buffer-size");
+      UnregisterVariable ("logfile-fsync");
+      UnregisterVariable ("logfile-fsync-interval");
       UnregisterVariable ("logrotate-path");
       UnregisterVariable ("logrotate-time");
       UnregisterVariable ("logfile-notice-prefix");
@@ -1138,6 +1753,13 @@ SigFunction ModuleInit (char *args)
   struct tm tm;
 
   CheckVersion;
+  LogsWriterRun = TRUE;
+  if (pthread_create (&LogsWriter, NULL, &_logs_writer, NULL))
+  {
+    LogsWriterRun = FALSE;
+    ERROR ("logs: cannot create writer thread!");
+    return (NULL);
+  }
   Add_Help ("logs");
   module_log_regall();			/* variables and function */
   Add_Binding("time-shift", "*", 0, 0, (Function)&ts_logs, NULL);
@@ -54,6 +54,10 @@
 static lua_State *Lua = NULL;
 
 static long int _lua_max_timer = 172800;
+static long int _lua_call_budget = 0;
+
+/* how many VM instructions between call time budget checks */
+#define LUA_BUDGET_COUNT 1000
 
 #define _lua_getfoxeye(l) lua_getglobal(l, "foxeye"); /* T */ \
 			  if (!lua_istable(l, -1)) return 0
@@ -139,11 +143,103 @@ static inline int _lua_getbinding (lua_State *L, int n, const char *name) /* ->
   return 1;
 }
 
+/*
+ * Cache of functions bound to FoxEye: binding name -> registry reference,
+ *  so binding_lua() does not walk foxeye.__binds on every call.
+ */
+typedef struct lua_bindref
+{
+  int ref;				/* function in LUA_REGISTRYINDEX */
+  unsigned long int calls;
+  unsigned long int spent;		/* total time, in microseconds */
+  unsigned long int maxspent;
+  unsigned long int overruns;		/* times it was out of budget */
+  char name[1];				/* binding name, tree key */
+} lua_bindref;
+
+static NODE *lua_bindrefs = NULL;
+
+static lua_bindref *_lua_bindref_set (lua_State *L, const char *name) /* f -> */
+{
+  lua_bindref *br = Find_Key (lua_bindrefs, name);
+
+  if (br)				/* keep statistics on rebind */
+    luaL_unref (L, LUA_REGISTRYINDEX, br->ref);
+  else
+  {
+    br = safe_malloc (sizeof(lua_bindref) + strlen (name));
+    strcpy (br->name, name);
+    br->calls = br->spent = br->maxspent = br->overruns = 0;
+    if (Insert_Key (&lua_bindrefs, br->name, br, 1))
+      ERROR ("Lua: cannot cache binding %s.", name);
+  }
+  br->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+  return br;
+}
+
+static void _lua_bindref_drop (lua_State *L, const char *name)
+{
+  lua_bindref *br = Find_Key (lua_bindrefs, name);
+
+  if (!br)
+    return;
+  luaL_unref (L, LUA_REGISTRYINDEX, br->ref);
+  Delete_Key (lua_bindrefs, br->name, br);
+  FREE (&br);
+}
+
+/*
+ * Runs function with optional time budget. Calls may be nested (a binding
+ *  can trigger another one) so budget is counted from outermost call.
+ */
+static struct timespec _lua_call_start;
+static int _lua_call_depth = 0;
+
+static unsigned long int _lua_call_time (void) /* microseconds */
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - _lua_call_start.tv_sec) * 1000000L +
+	 (now.tv_nsec - _lua_call_start.tv_nsec) / 1000;
+}
+
+static void _lua_budget_hook (lua_State *L, lua_Debug *ar)
+{
+  if (_lua_call_budget > 0 &&
+      _lua_call_time() >= (unsigned long int)_lua_call_budget * 1000)
+    luaL_error (L, "call time budget of %d ms exceeded", (int)_lua_call_budget);
+}
+
+static int _lua_pcall (lua_State *L, int nargs, int nres,
+		       unsigned long int *spent)
+{
+  unsigned long int outer;
+  int i;
+
+  outer = 0;
+  if (_lua_call_depth++ == 0)
+  {
+    clock_gettime (CLOCK_MONOTONIC, &_lua_call_start);
+    if (_lua_call_budget > 0)
+      lua_sethook (L, &_lua_budget_hook, LUA_MASKCOUNT, LUA_BUDGET_COUNT);
+  }
+  else
+    outer = _lua_call_time();
+  i = lua_pcall (L, nargs, nres, 0);
+  *spent = _lua_call_time() - outer;
+  if (--_lua_call_depth == 0)
+    lua_sethook (L, NULL, 0, 0);
+  return i;
+}
+
 /*
  * Calls from FoxEye to Lua (bindings)
  */
 static int binding_lua (char *name, int argc, const char *argv[])
 {
+  lua_bindref *br;
+  unsigned long int spent;
   int i = 0;
 
   dprint (5, "lua:binding_lua call for %s.", name);
@@ -158,18 +254,36 @@ static int binding_lua (char *name, int argc, const char *argv[])
     ERROR ("Lua:binding_lua: stack isn't empty, %d elements in it.", i);
     lua_settop (Lua, 0);			/* reset stack */
   }
-  if (!_lua_getbindlist (Lua, "*") || /* B */
-      !_lua_getbinding (Lua, 1, name))		/* push function onto stack */
+  if ((br = Find_Key (lua_bindrefs, name)))
+    lua_rawgeti (Lua, LUA_REGISTRYINDEX, br->ref); /* f */
+  else if (!_lua_getbindlist (Lua, "*") || /* B */
+	   !_lua_getbinding (Lua, 1, name))	/* push function onto stack */
   {
     ERROR ("Lua:binding_lua: binding %s not found.", name);
     lua_settop (Lua, 0);
     return 0;
   }
-  lua_remove (Lua, 1); /* n f */
-  lua_remove (Lua, 1); /* f */
+  else
+  {
+    lua_remove (Lua, 1); /* n f */
+    lua_remove (Lua, 1); /* f */
+    lua_pushvalue (Lua, 1); /* f f */
+    _lua_bindref_set (Lua, name); /* f */
+  }
+  luaL_checkstack (Lua, argc, "too many binding parameters");
   while (i < argc)
     lua_pushstring (Lua, argv[i++]);		/* push parameters onto stack */
-  i = lua_pcall (Lua, argc, 1, 0);		/* run Lua binding */
+  i = _lua_pcall (Lua, argc, 1, &spent);	/* run Lua binding */
+  if ((br = Find_Key (lua_bindrefs, name)))	/* it might unbind itself */
+  {
+    br->calls++;
+    br->spent += spent;
+    if (spent > br->maxspent)
+      br->maxspent = spent;
+    if (_lua_call_budget > 0 &&
+	spent >= (unsigned long int)_lua_call_budget * 1000)
+      br->overruns++;
+  }
   if (i == 0)					/* no errors */
   {
     BindResult = (char *)lua_tostring (Lua, 1);	/* get a value */
@@ -333,6 +447,8 @@ static int _lua_bind (lua_State *L) /* foxeye.bind(table,mask,uflags,func) */
   if (Insert_Key (&lua_bindtables, table, (void *)table, 1))
     safe_free ((void *)table); /* it's not added (already in list) so free memory */
   lua_insert (L, 5); /* t m u B n f */
+  lua_pushvalue (L, 6); /* t m u B n f f */
+  _lua_bindref_set (L, lua_tostring (L, 5)); /* t m u B n f */
   lua_settable (L, 4); /* t m u B */
   /* and now it's added into individual list too */
   return 0;
@@ -367,6 +483,7 @@ static int _lua_unbind (lua_State *L) /* foxeye.unbind(table[,func]) */
     {
       _lua_getbindlist (L, "*"); /* t B f n A */
       lua_replace (L, 2); /* t A f n */
+      _lua_bindref_drop (L, lua_tostring (L, 4));
       lua_pushnil (L); /* t A f n nil */
       lua_rawset (L, 2); /* t A f */
       /* and now cleared from common table too */
@@ -390,6 +507,7 @@ static int _lua_unbind (lua_State *L) /* foxeye.unbind(table[,func]) */
       lua_pushstring (L, dbg.name); /* t B A k n */
       if (_lua_scanbindlists (L, 5) == 1) /* clear it from common list */
       {
+	_lua_bindref_drop (L, dbg.name);
 	lua_pushnil (L); /* t B A k n nil */
 	lua_settable (L, 3); /* t B A k */
 	dprint (3, "lua:_lua_unbind: deleted from common list.");
@@ -595,6 +713,7 @@ typedef struct lua_timer
 {
   tid_t tid;
   time_t when;
+  int ref;				/* function in LUA_REGISTRYINDEX */
   char *cmd;
   struct lua_timer *prev;
 } lua_timer;
@@ -614,14 +733,14 @@ static int _lua_timer (lua_State *L) /* tid = SetTimer(time,func) */
   luaL_argcheck (L, lua_isnumber (L, 1), 1, NULL);
   luaL_argcheck (L, lua_isfunction (L, 2), 2, NULL);
   n = lua_tonumber (L, 1);
-  lua_getinfo (L, ">n", &dbg); /* t */
-  if (!dbg.name)
-    return luaL_error (L, "cannot get function name for SetTimer");
   if (n < 0 || n > _lua_max_timer)
     return luaL_error (L, "invalid parameters for SetTimer");
+  lua_pushvalue (L, 2); /* t f f */
+  lua_getinfo (L, ">n", &dbg); /* t f */
   tt = alloc_lua_timer();
   tt->tid = NewTimer (I_MODULE, "lua", S_LOCAL, (unsigned int)n, 0, 0, 0);
-  tt->cmd = safe_strdup (dbg.name);
+  tt->ref = luaL_ref (L, LUA_REGISTRYINDEX); /* t */
+  tt->cmd = safe_strdup (dbg.name ? dbg.name : "function");
   tt->when = Time + n;
   tt->prev = Lua_Last_Timer;
   Lua_Last_Timer = tt;
@@ -646,6 +765,7 @@ static int _lua_untimer (lua_State *L) /* ResetTimer(tid) */
     return luaL_error (L, "this timer-id is not active");
   *ptt = tt->prev;
   KillTimer (tt->tid);
+  luaL_unref (L, LUA_REGISTRYINDEX, tt->ref);
   FREE (&tt->cmd);
   /* do we need some garbage gathering for lua here? */
   dprint (3, "lua:_lua_untimer:removed timer for %lu", (unsigned long int)tt->when);
@@ -1157,7 +1277,8 @@ static iftype_t lua_module_signal (INTERFACE *iface, ifsig_t sig)
   LEAF *l;
   const char *c;
   INTERFACE *tmp;
-  lua_timer *tt, **ptt;
+  lua_timer *tt, **ptt, *expired;
+  lua_bindref *br;
 
   switch (sig)
   {
@@ -1169,17 +1290,21 @@ static iftype_t lua_module_signal (INTERFACE *iface, ifsig_t sig)
       Delete_Binding ("unfunction", &lua_unregister_function, NULL);
       Delete_Binding ("dcc", &dc_lua, NULL);
       UnregisterVariable ("lua-max-timer");
+      UnregisterVariable ("lua-call-budget");
       l = NULL;
       while ((l = Next_Leaf (lua_bindtables, l, &c)))
 	Delete_Binding (c, &binding_lua, NULL);	/* delete all bindings there */
       Destroy_Tree (&lua_bindtables, safe_pfree);
+      Destroy_Tree (&lua_bindrefs, safe_pfree); /* refs die with interpreter */
       lua_close (Lua);
+      _forget_(lua_timer);
       Delete_Help ("lua");
       iface->ift |= I_DIED;
       break;
     case S_REG:
       Add_Request (I_INIT, "*", F_REPORT, "module lua");
       RegisterInteger ("lua-max-timer", &_lua_max_timer);
+      RegisterInteger ("lua-call-budget", &_lua_call_budget);
       break;
     case S_REPORT:
       tmp = Set_Iface (iface);
@@ -1187,44 +1312,66 @@ static iftype_t lua_module_signal (INTERFACE *iface, ifsig_t sig)
 		   LT_max);
       New_Request (tmp, F_REPORT, "            interpreter using %d kB memory.",
 		   lua_gc (Lua, LUA_GCCOUNT, 0));
+      l = NULL;
+      while ((l = Next_Leaf (lua_bindrefs, l, NULL)))
+      {
+	br = l->s.data;
+	if (br->calls == 0)
+	  continue;
+	New_Request (tmp, F_REPORT,
+		     "            binding %s: %lu calls, %lu.%03lu ms total, %lu.%03lu ms max, %lu over budget.",
+		     br->name, br->calls, br->spent / 1000, br->spent % 1000,
+		     br->maxspent / 1000, br->maxspent % 1000, br->overruns);
+      }
       Unset_Iface();
       break;
     case S_LOCAL:
+      /* take all expired timers out first since calls may change the list */
+      expired = NULL;
       for (ptt = &Lua_Last_Timer; (tt = *ptt); )
       {
 	if (tt->when <= Time)
 	{
-	  lua_pushstring (Lua, tt->cmd); /* n */
-	  lua_gettable (Lua, -1); /* f */
-	  if (!lua_isfunction (Lua, -1))
-	    ERROR ("Lua: timer: %s isn't function name.", tt->cmd);
-	  else
-	  {
-	    register int i = lua_pcall (Lua, 0, 0, 0); /* run Lua binding */
-	    if (i != 0)				/* no errors */
-	    {
-	      if (i == LUA_ERRRUN)
-		ERROR ("Lua: timer: runtime error on call \"%s\": %s.", tt->cmd,
-		       lua_tostring (Lua, 1));
-	      else if (i == LUA_ERRMEM)
-		ERROR ("Lua: timer: memory error on call \"%s\": %s.", tt->cmd,
-		       lua_tostring (Lua, 1));
-	      else
-		ERROR ("Lua: timer: unknown error %d on call \"%s\": %s.", i,
-		       tt->cmd, lua_tostring (Lua, 1));
-	      lua_pop (Lua, 1);
-	    }
-	  }
 	  *ptt = tt->prev;
-	  KillTimer (tt->tid);
-	  FREE (&tt->cmd);
-	  /* do we need some garbage gathering for lua here? */
-	  dprint (3, "lua: timer:removed timer for %lu", (unsigned long int)tt->when);
-	  free_lua_timer (tt);
+	  tt->prev = expired;
+	  expired = tt;
 	}
 	else
 	  ptt = &tt->prev;
       }
+      while ((tt = expired))
+      {
+	expired = tt->prev;
+	lua_rawgeti (Lua, LUA_REGISTRYINDEX, tt->ref); /* f */
+	luaL_unref (Lua, LUA_REGISTRYINDEX, tt->ref);
+	if (!lua_isfunction (Lua, -1))
+	{
+	  ERROR ("Lua: timer: %s isn't function.", tt->cmd);
+	  lua_pop (Lua, 1);
+	}
+	else
+	{
+	  unsigned long int spent;
+	  register int i = _lua_pcall (Lua, 0, 0, &spent); /* run Lua binding */
+	  if (i != 0)				/* no errors */
+	  {
+	    if (i == LUA_ERRRUN)
+	      ERROR ("Lua: timer: runtime error on call \"%s\": %s.", tt->cmd,
+		     lua_tostring (Lua, 1));
+	    else if (i == LUA_ERRMEM)
+	      ERROR ("Lua: timer: memory error on call \"%s\": %s.", tt->cmd,
+		     lua_tostring (Lua, 1));
+	    else
+	      ERROR ("Lua: timer: unknown error %d on call \"%s\": %s.", i,
+		     tt->cmd, lua_tostring (Lua, 1));
+	    lua_pop (Lua, 1);
+	  }
+	}
+	KillTimer (tt->tid);
+	FREE (&tt->cmd);
+	dprint (3, "lua: timer:removed timer for %lu", (unsigned long int)tt->when);
+	free_lua_timer (tt);
+      }
       break;
     default: ;
   }
@@ -1280,6 +1427,7 @@ SigFunction ModuleInit (char *args)
   Add_Binding ("unfunction", NULL, 0, 0, &lua_unregister_function, NULL);
   Add_Binding ("dcc", "lua", U_OWNER, U_NONE, &dc_lua, NULL);
   RegisterInteger ("lua-max-timer", &_lua_max_timer);
+  RegisterInteger ("lua-call-budget", &_lua_call_budget);
   Send_Signal (I_MODULE | I_INIT, "*", S_REG);
   Add_Help ("lua");
   return (&lua_module_signal);
@@ -45,9 +45,14 @@
 #include <openssl/err.h>
 #include <openssl/engine.h>
 #include <openssl/conf.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 
 struct sslbuff {
-  BIO *bio;
   size_t bufptr, inbuf;
   char buf[2*MBMESSAGEMAX];
 };
@@ -56,8 +61,17 @@ struct connchain_buffer {
   struct peer_t *peer;
   struct connchain_i *saved_chain;
   struct connchain_buffer *next;
+  struct connchain_buffer *prev;
   ssize_t error;
   SSL *ssl;
+  struct connchain_i **bio_ch;	/* next link while BIO works directly */
+  idx_t bio_id;
+  char *target;			/* "host/port" for client side session reuse */
+  struct connchain_buffer *hs_next;	/* in handshake queue */
+  struct timespec hs_start;	/* when handshake was started */
+  int hs_state;			/* who owns ssl and bio now, see below */
+  bool hs_input;		/* new data for handshake since last step */
+  bool hs_wantwrite;		/* last handshake step had no room to write */
   struct sslbuff in, out;
   bool check_done;
 };
@@ -65,29 +79,617 @@ struct connchain_buffer {
 /* global list of buffers, need it in case of module termination */
 static struct connchain_buffer *sslbuflist = NULL;
 
+/* free buffers kept for reuse, linked by ->next */
+#define SSL_BUF_SPARE	8
+
+static struct connchain_buffer *SslBufFree = NULL;
+static unsigned int SslBufFreeNum = 0;
+
+static BIO_METHOD *SslBioMethod = NULL;
+
+/* handshake states, ssl and BIOs may be touched by owner of buffer only in
+   state SSL_HS_NONE, otherwise they are owned by handshake worker */
+#define SSL_HS_NONE	0
+#define SSL_HS_QUEUED	1
+#define SSL_HS_RUNNING	2
+
 static SSL_CTX *ctx = NULL;
 static bool _initialized = FALSE;
 
 static char ssl_certificate_file[PATH_MAX+1] = "";
 static char ssl_key_file[PATH_MAX+1] = "";
 static bool ssl_enable_bypass = FALSE;
+static long int ssl_session_cache_size = 1024;
+static long int ssl_session_timeout = 3600;
+static bool ssl_session_tickets = TRUE;
+static long int ssl_ticket_key_lifetime = 43200;
+static long int ssl_handshake_workers = 2;
+
+/*
+ * Client side sessions cache: one last session per connection target so
+ * reconnect to the same host and port may skip full handshake. It's short
+ * list with most recently used entries at head.
+ */
+#define SSL_CLIENT_SESSIONS	32
+
+typedef struct ssl_client_session {
+  struct ssl_client_session *next;
+  SSL_SESSION *sess;
+  char target[1];		/* allocated together */
+} ssl_client_session;
+
+static pthread_mutex_t SslSessLock = PTHREAD_MUTEX_INITIALIZER;
+static ssl_client_session *SslClientSessions = NULL;
+static unsigned int SslClientSessionsNum = 0;
+static unsigned long SslClientHits = 0, SslClientMiss = 0;
+
+/*
+ * Session tickets keys: current one encrypts new tickets and previous one is
+ * still accepted (and such ticket is renewed) so rotation doesn't drop all
+ * sessions at once. Keys are rotated when a ticket is issued and current key
+ * is older than ssl-ticket-key-lifetime.
+ */
+typedef struct {
+  unsigned char name[16];
+  unsigned char hmac[32];
+  unsigned char aes[32];
+  time_t created;
+} ssl_ticket_key;
+
+static ssl_ticket_key SslTicketKeys[2];	/* current and previous */
+static pthread_mutex_t SslTicketLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Handshake workers: asymmetric crypto of handshakes is done by pool of
+ * threads so dispatcher isn't stalled by it. Owner of buffer puts received
+ * data into BIO and queues the buffer, worker runs SSL_do_handshake() on it
+ * and wakes up the interface of the peer so owner can send data from BIO.
+ * Once handshake is finished data are processed by owner as usual.
+ * SslHsLock protects the queue, hs_state fields, and statistics.
+ */
+#define SSL_HS_MAXWORKERS	16
+#define SSL_HS_BUCKETS		16	/* latency histogram, 1ms...32s */
+
+static pthread_mutex_t SslHsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SslHsCond = PTHREAD_COND_INITIALIZER; /* wake worker */
+static pthread_cond_t SslHsIdle = PTHREAD_COND_INITIALIZER; /* step done */
+static pthread_t SslHsThreads[SSL_HS_MAXWORKERS];
+static unsigned int SslHsWorkers = 0;
+static bool SslHsRun = FALSE;
+static struct connchain_buffer *SslHsQueue = NULL, *SslHsQueueLast = NULL;
+static unsigned int SslHsQueued = 0, SslHsQueuedMax = 0;
+static unsigned long SslHsHist[SSL_HS_BUCKETS];
+static unsigned long SslHsDone = 0, SslHsSteps = 0;
 
 static void _freesslbuff(struct connchain_buffer **buf)
 {
-  struct connchain_buffer **sb;
+  register struct connchain_buffer *sb = *buf;
+
+  if (sb->prev != NULL)
+    sb->prev->next = sb->next;
+  else if (sslbuflist == sb)
+    sslbuflist = sb->next;
+  else
+    ERROR("ssl: cannot find buffer %p in list to free it!", sb);
+  if (sb->next != NULL)
+    sb->next->prev = sb->prev;
+  DBG("ssl: freeing buffer %p", sb);
+  SSL_free(sb->ssl);			/* it frees BIO too */
+  FREE(&sb->target);
+  if (SslBufFreeNum < SSL_BUF_SPARE) {
+    sb->next = SslBufFree;
+    SslBufFree = sb;
+    SslBufFreeNum++;
+    *buf = NULL;
+  } else
+    FREE(buf);
+}
+
+/*
+ * BIO of the link: SSL reads records from buf->in and writes them into
+ * buf->out. While bio_ch is set (i.e. it's called by owner of the link) it
+ * reads directly from the next link in chain if buf->in is empty and writes
+ * directly into next link if buf->out is empty, so the buffers are used
+ * only for data that next link couldn't take or SSL didn't need yet. Any
+ * handshake worker has no access to the chain so works with buffers only.
+ */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define BIO_get_data(b) ((b)->ptr)
+#define BIO_set_data(b,p) ((b)->ptr = (p))
+#define BIO_set_init(b,v) ((b)->init = (v))
+#endif
+
+static int _ssl_bio_write(BIO *b, const char *data, int len)
+{
+  struct connchain_buffer *buf = BIO_get_data(b);
+  size_t so;
+  ssize_t i;
+  int done = 0;
+
+  BIO_clear_retry_flags(b);
+  if (len <= 0)
+    return (0);
+  if (buf->bio_ch != NULL && buf->out.inbuf == 0) { /* try to send it now */
+    so = len;
+    i = Connchain_Put(buf->bio_ch, buf->bio_id, data, &so);
+    if (i < 0) {
+      buf->error = i;
+      return (-1);
+    }
+    done = len - (int)so;
+    if (done > 0)
+      dprint(6, "ssl: sent encrypted data, size=%d", done);
+  }
+  if (done < len) {			/* keep the rest in buffer */
+    if (buf->out.bufptr > 0 &&
+	buf->out.inbuf + (len - done) > sizeof(buf->out.buf)) {
+      memmove(buf->out.buf, &buf->out.buf[buf->out.bufptr],
+	      buf->out.inbuf - buf->out.bufptr);
+      buf->out.inbuf -= buf->out.bufptr;
+      buf->out.bufptr = 0;
+    }
+    so = sizeof(buf->out.buf) - buf->out.inbuf;
+    if (so > (size_t)(len - done))
+      so = len - done;
+    memcpy(&buf->out.buf[buf->out.inbuf], &data[done], so);
+    buf->out.inbuf += so;
+    done += so;
+  }
+  if (done == 0) {			/* no room at all */
+    BIO_set_retry_write(b);
+    return (-1);
+  }
+  return (done);
+}
+
+static int _ssl_bio_read(BIO *b, char *out, int len)
+{
+  struct connchain_buffer *buf = BIO_get_data(b);
+  ssize_t i;
+
+  BIO_clear_retry_flags(b);
+  if (len <= 0)
+    return (0);
+  i = buf->in.inbuf - buf->in.bufptr;
+  if (i > 0) {				/* take buffered data first */
+    if (i > len)
+      i = len;
+    memcpy(out, &buf->in.buf[buf->in.bufptr], i);
+    if (buf->in.bufptr + i == buf->in.inbuf)
+      buf->in.bufptr = buf->in.inbuf = 0;
+    else
+      buf->in.bufptr += i;
+    return ((int)i);
+  }
+  if (buf->bio_ch != NULL && buf->error == 0) {
+    i = Connchain_Get(buf->bio_ch, buf->bio_id, out, len);
+    if (i > 0) {
+      dprint(6, "ssl: got encrypted data from socket, size=%zd", i);
+      return ((int)i);
+    }
+    if (i < 0) {			/* connection is closed */
+      buf->error = i;
+      return (0);
+    }
+  }
+  BIO_set_retry_read(b);
+  return (-1);
+}
+
+static long _ssl_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+  struct connchain_buffer *buf = BIO_get_data(b);
+
+  switch (cmd) {
+  case BIO_CTRL_FLUSH:
+    return (1);
+  case BIO_CTRL_PENDING:
+    return (buf ? (long)(buf->in.inbuf - buf->in.bufptr) : 0);
+  case BIO_CTRL_WPENDING:
+    return (buf ? (long)(buf->out.inbuf - buf->out.bufptr) : 0);
+  case BIO_CTRL_EOF:
+    return (buf ? (buf->error != 0) : 1);
+  default:
+    return (0);
+  }
+}
+
+static int _ssl_bio_create(BIO *b)
+{
+  BIO_set_init(b, 1);
+  return (1);
+}
+
+static int _ssl_bio_destroy(BIO *b)
+{
+  return (b != NULL);			/* buffer isn't owned by BIO */
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static BIO_METHOD _ssl_bio_method = {
+  BIO_TYPE_SOURCE_SINK, "foxeye connchain",
+  &_ssl_bio_write, &_ssl_bio_read, NULL, NULL, &_ssl_bio_ctrl,
+  &_ssl_bio_create, &_ssl_bio_destroy, NULL
+};
+#endif
+
+static BIO_METHOD *_ssl_bio_method_new(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  return (&_ssl_bio_method);
+#else
+  BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+			       "foxeye connchain");
+
+  if (m == NULL)
+    return (NULL);
+  BIO_meth_set_write(m, &_ssl_bio_write);
+  BIO_meth_set_read(m, &_ssl_bio_read);
+  BIO_meth_set_ctrl(m, &_ssl_bio_ctrl);
+  BIO_meth_set_create(m, &_ssl_bio_create);
+  BIO_meth_set_destroy(m, &_ssl_bio_destroy);
+  return (m);
+#endif
+}
+
+/* lets BIO work with the chain directly, only owner of the link may do it
+   and not while old chain still has some data to pass */
+static inline void _ssl_bio_attach(struct connchain_buffer *buf,
+				   struct connchain_i **ch, idx_t id)
+{
+  if (buf->saved_chain == NULL) {
+    buf->bio_ch = ch;
+    buf->bio_id = id;
+  }
+}
+
+#define _ssl_bio_detach(buf) (buf)->bio_ch = NULL
+
+/* returns saved session for target or NULL, reference isn't taken */
+static SSL_SESSION *_ssl_client_session_get(const char *target)
+{
+  ssl_client_session *cs, **ptr;
+
+  for (ptr = &SslClientSessions; (cs = *ptr); ptr = &cs->next)
+    if (!strcmp(cs->target, target))
+      break;
+  if (cs == NULL) {
+    SslClientMiss++;
+    return (NULL);
+  }
+  if (SSL_SESSION_get_time(cs->sess) + SSL_SESSION_get_timeout(cs->sess) <= time(NULL)) {
+    *ptr = cs->next;		/* expired, forget it */
+    SslClientSessionsNum--;
+    SSL_SESSION_free(cs->sess);
+    FREE(&cs);
+    SslClientMiss++;
+    return (NULL);
+  }
+  *ptr = cs->next;		/* move it to head */
+  cs->next = SslClientSessions;
+  SslClientSessions = cs;
+  SslClientHits++;
+  return (cs->sess);
+}
+
+/* sets saved session for target on ssl if there is one */
+static void _ssl_client_session_set(SSL *ssl, const char *target)
+{
+  SSL_SESSION *sess;
+
+  pthread_mutex_lock(&SslSessLock);
+  if ((sess = _ssl_client_session_get(target)) != NULL) {
+    SSL_set_session(ssl, sess);		/* it takes own reference */
+    DBG("ssl: trying to resume session for %s", target);
+  }
+  pthread_mutex_unlock(&SslSessLock);
+}
+
+/* callback on new session on client side, takes reference on success */
+static int _ssl_client_session_new(SSL *ssl, SSL_SESSION *sess)
+{
+  struct connchain_buffer *buf = SSL_get_app_data(ssl);
+  ssl_client_session *cs, **ptr;
+  size_t sz;
+
+  if (buf == NULL || buf->target == NULL)
+    return (0);
+  pthread_mutex_lock(&SslSessLock);	/* may be called by worker */
+  for (ptr = &SslClientSessions; (cs = *ptr); ptr = &cs->next)
+    if (!strcmp(cs->target, buf->target))
+      break;
+  if (cs != NULL) {		/* replace old session */
+    *ptr = cs->next;
+    SSL_SESSION_free(cs->sess);
+  } else {
+    if (SslClientSessionsNum >= SSL_CLIENT_SESSIONS) { /* drop last one */
+      for (ptr = &SslClientSessions; (*ptr)->next; ptr = &(*ptr)->next);
+      SSL_SESSION_free((*ptr)->sess);
+      FREE(ptr);
+    } else
+      SslClientSessionsNum++;
+    sz = strlen(buf->target);
+    cs = safe_malloc(sizeof(ssl_client_session) + sz);
+    memcpy(cs->target, buf->target, sz + 1);
+  }
+  cs->sess = sess;
+  cs->next = SslClientSessions;
+  SslClientSessions = cs;
+  pthread_mutex_unlock(&SslSessLock);
+  DBG("ssl: saved session for %s", buf->target);
+  return (1);
+}
+
+static void _ssl_client_sessions_free(void)
+{
+  ssl_client_session *cs;
+
+  pthread_mutex_lock(&SslSessLock);
+  while ((cs = SslClientSessions)) {
+    SslClientSessions = cs->next;
+    SSL_SESSION_free(cs->sess);
+    FREE(&cs);
+  }
+  SslClientSessionsNum = 0;
+  pthread_mutex_unlock(&SslSessLock);
+}
+
+static int _ssl_ticket_key_new(ssl_ticket_key *key)
+{
+  if (RAND_bytes(key->name, sizeof(key->name)) <= 0 ||
+      RAND_bytes(key->hmac, sizeof(key->hmac)) <= 0 ||
+      RAND_bytes(key->aes, sizeof(key->aes)) <= 0)
+    return (0);
+  key->created = time(NULL);
+  return (1);
+}
+
+/* returns: -1 on error, 0 - key not found, 1 - key is current, 2 - renew */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int _ssl_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			      EVP_CIPHER_CTX *ectx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int _ssl_ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+			      EVP_CIPHER_CTX *ectx, HMAC_CTX *hctx, int enc)
+#endif
+{
+  ssl_ticket_key key;
+  int i, ret;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  OSSL_PARAM params[3];
+#endif
+
+  pthread_mutex_lock(&SslTicketLock);
+  if (enc) {			/* issuing new ticket */
+    if (SslTicketKeys[0].created + ssl_ticket_key_lifetime <= time(NULL)) {
+      memcpy(&key, &SslTicketKeys[0], sizeof(key));
+      if (_ssl_ticket_key_new(&SslTicketKeys[0])) {
+	memcpy(&SslTicketKeys[1], &key, sizeof(key));
+	dprint(3, "ssl: session ticket key rotated");
+      } else
+	ERROR("ssl: could not generate new session ticket key");
+    }
+    i = 0;
+    ret = 1;
+  } else {			/* find the key by name */
+    for (i = 0; i < 2; i++)
+      if (SslTicketKeys[i].created != 0 &&
+	  !memcmp(name, SslTicketKeys[i].name, sizeof(SslTicketKeys[i].name)))
+	break;
+    ret = i + 1;		/* 1 for current, 2 for previous, 3 - none */
+  }
+  if (ret < 3)
+    memcpy(&key, &SslTicketKeys[i], sizeof(key));
+  pthread_mutex_unlock(&SslTicketLock);
+  if (ret == 3)			/* unknown key, do full handshake */
+    return (0);
+  if (enc) {
+    if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) <= 0)
+      return (-1);
+    memcpy(name, key.name, sizeof(key.name));
+    if (!EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv))
+      return (-1);
+  } else if (!EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes, iv))
+    return (-1);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac,
+						sizeof(key.hmac));
+  params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+					       (char *)"sha256", 0);
+  params[2] = OSSL_PARAM_construct_end();
+  if (!EVP_MAC_CTX_set_params(hctx, params))
+    return (-1);
+#else
+  if (!HMAC_Init_ex(hctx, key.hmac, sizeof(key.hmac), EVP_sha256(), NULL))
+    return (-1);
+#endif
+  return (ret);
+}
+
+/* applies session cache and tickets settings to ctx */
+static void _ssl_setup_sessions(void)
+{
+  if (ssl_session_cache_size < 0)
+    ssl_session_cache_size = 0;
+  if (ssl_session_timeout < 1)
+    ssl_session_timeout = 1;
+  if (ssl_ticket_key_lifetime < 60)
+    ssl_ticket_key_lifetime = 60;
+  /* client sessions are kept by us, 0 for OpenSSL means unlimited cache */
+  SSL_CTX_set_session_cache_mode(ctx, ssl_session_cache_size ?
+				 SSL_SESS_CACHE_BOTH :
+				 (SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE));
+  SSL_CTX_sess_set_cache_size(ctx, ssl_session_cache_size);
+  SSL_CTX_set_timeout(ctx, ssl_session_timeout);
+  if (ssl_session_tickets)
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+  else
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+}
+
+/* adds finished handshake into statistics, SslHsLock should be locked */
+static void _ssl_hs_account(struct connchain_buffer *buf)
+{
+  struct timespec ts;
+  long ms;
+  int i;
 
-  for (sb = &sslbuflist; *sb; sb = &(*sb)->next)
-    if (*sb == *buf)
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ms = (ts.tv_sec - buf->hs_start.tv_sec) * 1000 +
+       (ts.tv_nsec - buf->hs_start.tv_nsec) / 1000000;
+  for (i = 0; i < SSL_HS_BUCKETS - 1 && ms >= (1L << i); i++);
+  SslHsHist[i]++;
+  SslHsDone++;
+}
+
+static void *_ssl_hs_worker(void *unused)
+{
+  struct connchain_buffer *buf;
+  INTERFACE *iface;
+
+  pthread_mutex_lock(&SslHsLock);
+  while (SslHsRun) {
+    if ((buf = SslHsQueue) == NULL) {
+      pthread_cond_wait(&SslHsCond, &SslHsLock);
+      continue;
+    }
+    if ((SslHsQueue = buf->hs_next) == NULL)
+      SslHsQueueLast = NULL;
+    SslHsQueued--;
+    buf->hs_state = SSL_HS_RUNNING;
+    pthread_mutex_unlock(&SslHsLock);
+    SSL_do_handshake(buf->ssl);
+    buf->hs_wantwrite = SSL_want_write(buf->ssl);
+    pthread_mutex_lock(&SslHsLock);
+    SslHsSteps++;
+    if (SSL_is_init_finished(buf->ssl))
+      _ssl_hs_account(buf);
+    /* owner waits for SSL_HS_NONE before freeing peer so wake it while
+       we still own the buffer, Mark_Iface() doesn't take any lock */
+    if ((iface = buf->peer->iface))
+      Mark_Iface(iface);		/* owner has data to send now */
+    buf->hs_state = SSL_HS_NONE;
+    pthread_cond_broadcast(&SslHsIdle);
+  }
+  pthread_mutex_unlock(&SslHsLock);
+  return (NULL);
+}
+
+static void _ssl_hs_start_workers(void)
+{
+  if (ssl_handshake_workers < 0)
+    ssl_handshake_workers = 0;
+  else if (ssl_handshake_workers > SSL_HS_MAXWORKERS)
+    ssl_handshake_workers = SSL_HS_MAXWORKERS;
+  SslHsRun = TRUE;
+  for (SslHsWorkers = 0; SslHsWorkers < ssl_handshake_workers; SslHsWorkers++)
+    if (pthread_create(&SslHsThreads[SslHsWorkers], NULL, &_ssl_hs_worker, NULL)) {
+      ERROR("ssl: cannot create handshake worker thread!");
       break;
-  if (*sb != NULL)
-    *sb = (*buf)->next;
+    }
+  dprint(3, "ssl: started %u handshake workers", SslHsWorkers);
+}
+
+static void _ssl_hs_stop_workers(void)
+{
+  pthread_mutex_lock(&SslHsLock);
+  SslHsRun = FALSE;
+  pthread_cond_broadcast(&SslHsCond);
+  pthread_mutex_unlock(&SslHsLock);
+  while (SslHsWorkers)
+    pthread_join(SslHsThreads[--SslHsWorkers], NULL);
+}
+
+/* returns TRUE if buffer is owned by worker now */
+static bool _ssl_hs_busy(struct connchain_buffer *buf)
+{
+  bool busy;
+
+  if (SslHsWorkers == 0)
+    return (FALSE);
+  pthread_mutex_lock(&SslHsLock);
+  busy = (buf->hs_state != SSL_HS_NONE);
+  pthread_mutex_unlock(&SslHsLock);
+  return (busy);
+}
+
+/* takes buffer back from workers, to be called before freeing it */
+static void _ssl_hs_cancel(struct connchain_buffer *buf)
+{
+  struct connchain_buffer **ptr;
+
+  pthread_mutex_lock(&SslHsLock);
+  if (buf->hs_state == SSL_HS_QUEUED) {
+    for (ptr = &SslHsQueue; *ptr; ptr = &(*ptr)->hs_next)
+      if (*ptr == buf) {
+	*ptr = buf->hs_next;
+	if (SslHsQueueLast == buf)
+	  SslHsQueueLast = NULL;
+	break;
+      }
+    for (ptr = &SslHsQueue; *ptr; ptr = &(*ptr)->hs_next)
+      SslHsQueueLast = *ptr;
+    SslHsQueued--;
+    buf->hs_state = SSL_HS_NONE;
+  }
+  while (buf->hs_state != SSL_HS_NONE)
+    pthread_cond_wait(&SslHsIdle, &SslHsLock);
+  pthread_mutex_unlock(&SslHsLock);
+}
+
+/* does a handshake step either in place or by worker
+   returns TRUE if buffer was queued to worker */
+static bool _ssl_handshake(struct connchain_i **ch, idx_t id,
+			   struct connchain_buffer *buf)
+{
+  if (buf->hs_start.tv_sec == 0) {	/* first step */
+    clock_gettime(CLOCK_MONOTONIC, &buf->hs_start);
+    buf->hs_input = TRUE;
+  }
+  if (SslHsWorkers == 0) {
+    _ssl_bio_attach(buf, ch, id);
+    SSL_do_handshake(buf->ssl);
+    _ssl_bio_detach(buf);
+    pthread_mutex_lock(&SslHsLock);
+    SslHsSteps++;
+    if (SSL_is_init_finished(buf->ssl))
+      _ssl_hs_account(buf);
+    pthread_mutex_unlock(&SslHsLock);
+    return (FALSE);
+  }
+  if (!buf->hs_input &&			/* SSL still waits for data */
+      !(buf->hs_wantwrite && buf->out.inbuf == 0)) /* or for room */
+    return (FALSE);
+  buf->hs_input = buf->hs_wantwrite = FALSE;
+  pthread_mutex_lock(&SslHsLock);
+  buf->hs_state = SSL_HS_QUEUED;
+  buf->hs_next = NULL;
+  if (SslHsQueueLast)
+    SslHsQueueLast->hs_next = buf;
   else
-    ERROR("ssl: cannot find buffer %p in list to free it!", *buf);
-  DBG("ssl: freeing buffer %p", *buf);
-//  BIO_free((*buf)->in.bio);
-//  BIO_free((*buf)->out.bio);
-  SSL_free((*buf)->ssl);
-  FREE(buf);
+    SslHsQueue = buf;
+  SslHsQueueLast = buf;
+  if (++SslHsQueued > SslHsQueuedMax)
+    SslHsQueuedMax = SslHsQueued;
+  pthread_cond_signal(&SslHsCond);
+  pthread_mutex_unlock(&SslHsLock);
+  return (TRUE);
+}
+
+/* returns upper bound of latency in ms for given percent of handshakes */
+static long _ssl_hs_percentile(int percent)
+{
+  unsigned long n = 0, total = 0;
+  int i;
+
+  for (i = 0; i < SSL_HS_BUCKETS; i++)
+    total += SslHsHist[i];
+  if (total == 0)
+    return (0);
+  for (i = 0; i < SSL_HS_BUCKETS - 1; i++)
+    if ((n += SslHsHist[i]) * 100 >= total * percent)
+      break;
+  return (1L << i);
 }
 
 static void _s_check_saved_buffer(idx_t id, struct connchain_buffer *buf)
@@ -113,21 +715,13 @@ static void _s_check_saved_buffer(idx_t id, struct connchain_buffer *buf)
   DBG("ssl: cleared old chain");
 }
 
-/* does buffer part of _ccfilter_S_send() job */
+/* does buffer part of _ccfilter_S_send() job, sends what BIO left */
 static ssize_t _ssl_try_send_buffers(struct connchain_i **ch, idx_t id,
-				     struct connchain_buffer *buf, bool check_bio)
+				     struct connchain_buffer *buf)
 {
   size_t so;
   ssize_t i;
 
-  if (check_bio) {
-    i = BIO_read(buf->out.bio, &buf->out.buf[buf->out.inbuf],
-		 sizeof(buf->out.buf) - buf->out.inbuf);
-    if (i > 0)
-      buf->out.inbuf += i;
-    /* else
-      DBG("ssl: BIO_read error code %zd", i); */
-  }
   so = buf->out.inbuf - buf->out.bufptr;
   i = Connchain_Put(ch, id, &buf->out.buf[buf->out.bufptr], &so);
   /* DBG("ssl: tried to send data, size=%zu sent=%zd", so, i); */
@@ -173,30 +767,31 @@ static bool _ssl_check_input_from_chain(struct connchain_i **ch, idx_t id,
 	  return (FALSE);
       }
       i = 0;
-    } else if (buf->in.inbuf < sizeof(buf->in.buf)) {
-      if ((i = Connchain_Get(ch, id, &buf->in.buf[buf->in.bufptr],
-			     (sizeof(buf->in.buf) - buf->in.inbuf))) < 0)
+    } else if (SslHsWorkers == 0) {
+      i = 0;			/* BIO will read it directly */
+    } else {
+      if (buf->in.bufptr > 0 && buf->in.inbuf == sizeof(buf->in.buf)) {
+	memmove(buf->in.buf, &buf->in.buf[buf->in.bufptr],
+		buf->in.inbuf - buf->in.bufptr);
+	buf->in.inbuf -= buf->in.bufptr;
+	buf->in.bufptr = 0;
+      }
+      if (buf->in.inbuf == sizeof(buf->in.buf))
+	i = 0;
+      else if ((i = Connchain_Get(ch, id, &buf->in.buf[buf->in.inbuf],
+				  (sizeof(buf->in.buf) - buf->in.inbuf))) < 0)
 	(*b)->error = i;
-    } else
-      i = 0;
+    }
     if (i > 0) {
       buf->in.inbuf += i;
+      buf->hs_input = TRUE;
       dprint(6, "ssl: got encrypted data from socket, size=%zd", i);
     }
-  } else			/* not ready yet, try to pull saved buffers */
+  } else {			/* not ready yet, try to pull saved buffers */
+    i = buf->in.inbuf;
     _s_check_saved_buffer(id, buf);
-  /* now process buffered data */
-  i = buf->in.inbuf - buf->in.bufptr;
-  if (i > 0) {
-    i = BIO_write(buf->in.bio, &buf->in.buf[buf->in.bufptr], i);
-    if (i <= 0) {		/* some error in BIO_write */
-      DBG("ssl: BIO_write error code %zd", i);
-    } else {			/* some data pushed into BIO */
-      if (buf->in.inbuf == buf->in.bufptr + i) /* all input consumed */
-	buf->in.bufptr = buf->in.inbuf = 0;
-      else
-	buf->in.bufptr += i;
-    }
+    if (buf->in.inbuf != (size_t)i)
+      buf->hs_input = TRUE;
   }
   return (TRUE);
 }
@@ -207,7 +802,6 @@ static ssize_t _ccfilter_S_send(struct connchain_i **ch, idx_t id, const char *s
 				size_t *sz, struct connchain_buffer **b)
 {
   struct connchain_buffer *buf = *b;
-  size_t so;
   ssize_t i;
 
   if (buf == NULL)		/* terminated */
@@ -224,7 +818,9 @@ static ssize_t _ccfilter_S_send(struct connchain_i **ch, idx_t id, const char *s
     return Connchain_Put (ch, id, str, sz); /* ask next link to flush then */
   }
 retry:
-  i = _ssl_try_send_buffers(ch, id, buf, TRUE); /* try to push buffers now */
+  if (_ssl_hs_busy(buf))	/* worker does handshake now */
+    return (0);
+  i = _ssl_try_send_buffers(ch, id, buf); /* try to push buffers now */
   if (i < 0)
     return (i);
   if (buf->out.inbuf >= (sizeof(buf->out.buf) - 16)) /* reserve 16 bytes */
@@ -234,19 +830,28 @@ retry:
       return (0);
     return Connchain_Put (ch, id, str, sz); /* bounce test to next link */
   } else if (!SSL_is_init_finished(buf->ssl)) {
-    SSL_do_handshake(buf->ssl);
     if (!_ssl_check_input_from_chain(ch, id, b)) /* SSL may wait for data */
       return Connchain_Put (ch, id, str, sz); /* if not SSL then bypass data */
     DBG("ssl: handshake is in progress");
     if ((*b)->error < 0)
       return ((*b)->error);	/* there might be an error from connchain */
+    if (!buf->check_done)
+      return (0);
+    if (_ssl_handshake(ch, id, buf))
+      return (0);		/* queued to worker */
+    if ((*b)->error < 0)
+      return ((*b)->error);
     if (i > 0)
       goto retry;		/* we have send something to socket so retry */
-    if (!buf->check_done)
+    if (!SSL_is_init_finished(buf->ssl))
       return (0);
   }
   /* ready to process input data */
+  _ssl_bio_attach(buf, ch, id);
   i = SSL_write(buf->ssl, str, *sz);
+  _ssl_bio_detach(buf);
+  if (buf->error < 0)		/* next link failed */
+    return (buf->error);
   if (i > 0) {			/* some data were processed */
     *sz -= i;
     dprint(6, "ssl: pushed data: [%-*.*s]", (int)i, (int)i, str);
@@ -254,12 +859,7 @@ retry:
     DBG("ssl: SSL_write error code %d", SSL_get_error(buf->ssl, (int)i));
     i = 0;
   }
-  so = i;
-  /* trying to push buffer again */
-  i = _ssl_try_send_buffers(ch, id, buf, TRUE);
-  if (i < 0)
-    return (i);
-  return (so);
+  return (i);
 }
 
 /* termination includes saved chain if in early state */
@@ -268,6 +868,7 @@ static ssize_t _ccfilter_S_recv(struct connchain_i **ch, idx_t id, char *str,
 {
   struct connchain_buffer *buf = *b;
   ssize_t i;
+  bool busy;
 
   if (buf == NULL)		/* terminated */
     return E_NOSOCKET;
@@ -276,6 +877,8 @@ static ssize_t _ccfilter_S_recv(struct connchain_i **ch, idx_t id, char *str,
   if (sz == 0)			/* wrong call */
     return (0);
   if (id < 0) {			/* raw pull request */
+    if (_ssl_hs_busy(buf))	/* buffer is used by worker now */
+      return (0);
     if (buf->saved_chain != NULL)
       _s_check_saved_buffer(id, buf);
     if (buf->in.inbuf == 0)
@@ -291,37 +894,48 @@ static ssize_t _ccfilter_S_recv(struct connchain_i **ch, idx_t id, char *str,
     return (i);
   }
 retry:
-  if (!_ssl_check_input_from_chain(ch, id, b)) { /* not a SSL data */
-    i = (buf->in.inbuf - buf->in.bufptr);
-    if (i > (ssize_t)sz)
-      i = sz;
-    memcpy(str, &buf->in.buf[buf->in.bufptr], i);
-    if (buf->in.bufptr + i == buf->in.inbuf)
-      Connchain_Shrink (buf->peer, *ch);
-    else
-      buf->in.bufptr += i;
-    return (i);
+  busy = _ssl_hs_busy(buf);	/* worker may do handshake now */
+  if (!busy && !SSL_is_init_finished(buf->ssl)) { /* check for handshake */
+    if (!_ssl_check_input_from_chain(ch, id, b)) { /* not a SSL data */
+      i = (buf->in.inbuf - buf->in.bufptr);
+      if (i > (ssize_t)sz)
+	i = sz;
+      memcpy(str, &buf->in.buf[buf->in.bufptr], i);
+      if (buf->in.bufptr + i == buf->in.inbuf)
+	Connchain_Shrink (buf->peer, *ch);
+      else
+	buf->in.bufptr += i;
+      return (i);
+    }
+    if (buf->check_done && (*b)->error == 0)
+      busy = _ssl_handshake(ch, id, buf);
   }
-  if (!SSL_is_init_finished(buf->ssl)) { /* check for handshake */
-    SSL_do_handshake(buf->ssl);
-    i = _ssl_try_send_buffers(ch, id, buf, TRUE); /* SSL may have data to send */
+  if (!busy && buf->out.inbuf > 0) { /* SSL may have data to send */
+    i = _ssl_try_send_buffers(ch, id, buf);
     if (i < 0)
       return (i);
-    if (i > 0)
+    if (i > 0 && !SSL_is_init_finished(buf->ssl))
       goto retry;		/* we have send something to socket so retry */
   }
-  i = SSL_read(buf->ssl, str, sz);
-  if (i <= 0) {			/* some error in SSL_read */
-    /* DBG("ssl: SSL_read error code %d", SSL_get_error(buf->ssl, (int)i)); */
-    i = (*b)->error;		/* there might be error from connchain */
-  } else			/* got some data */
-    dprint(6, "ssl: decrypted data: [%-*.*s]", (int)i, (int)i, str);
+  if (busy || !SSL_is_init_finished(buf->ssl))
+    i = (*b)->error;		/* wait for handshake */
+  else {
+    _ssl_bio_attach(buf, ch, id);
+    i = SSL_read(buf->ssl, str, sz);
+    _ssl_bio_detach(buf);
+    if (i <= 0) {		/* some error in SSL_read */
+      /* DBG("ssl: SSL_read error code %d", SSL_get_error(buf->ssl, (int)i)); */
+      i = (*b)->error;		/* there might be error from connchain */
+    } else			/* got some data */
+      dprint(6, "ssl: decrypted data: [%-*.*s]", (int)i, (int)i, str);
+  }
   if (i >= 0)
     return (i);
   ERROR("ssl: got %zd from connection chain, terminating", i);
 finish_filter:
   if (buf->saved_chain != NULL && Connchain_Get(&buf->saved_chain, -1, NULL, 0))
     buf->saved_chain = NULL;
+  _ssl_hs_cancel(buf);		/* worker should leave it first */
   i = (*b)->error;
   if (i == 0)
     i = E_NOSOCKET;
@@ -335,14 +949,22 @@ static struct connchain_buffer *_make_buffer(struct peer_t *peer,
 	ssize_t (**send) (struct connchain_i **, idx_t, const char *, size_t *, struct connchain_buffer **))
 {
   struct connchain_buffer *buf;
+  BIO *bio;
 
-  buf = safe_malloc (sizeof(struct connchain_buffer));
+  if ((buf = SslBufFree) != NULL) {	/* reuse a free one */
+    SslBufFree = buf->next;
+    SslBufFreeNum--;
+  } else
+    buf = safe_malloc (sizeof(struct connchain_buffer));
   DBG("ssl: allocated buffer %p", buf);
   *recv = &_ccfilter_S_recv;		/* init the structure */
   *send = &_ccfilter_S_send;
   buf->in.inbuf = buf->in.bufptr = buf->out.inbuf = buf->out.bufptr = 0;
   buf->peer = peer;
+  buf->prev = NULL;
   buf->next = sslbuflist;		/* add it in list */
+  if (sslbuflist)
+    sslbuflist->prev = buf;
   sslbuflist = buf;
   buf->saved_chain = peer->connchain;	/* save existing connchain */
   peer->connchain = NULL;		/* reset connchain */
@@ -352,17 +974,19 @@ static struct connchain_buffer *_make_buffer(struct peer_t *peer,
   if (buf->ssl == NULL) {
     // ... error
   }
-  buf->in.bio = BIO_new(BIO_s_mem());
-  if (buf->in.bio == NULL) {
-    // ... error
-  }
-  BIO_set_mem_eof_return(buf->in.bio, -1); /* see: https://www.openssl.org/docs/crypto/BIO_s_mem.html */
-  buf->out.bio = BIO_new(BIO_s_mem());
-  if (buf->out.bio == NULL) {
+  SSL_set_app_data(buf->ssl, buf);
+  buf->target = NULL;
+  buf->hs_state = SSL_HS_NONE;
+  buf->hs_start.tv_sec = 0;
+  buf->hs_start.tv_nsec = 0;
+  buf->hs_input = buf->hs_wantwrite = FALSE;
+  buf->bio_ch = NULL;
+  bio = BIO_new(SslBioMethod);
+  if (bio == NULL) {
     // ... error
   }
-  BIO_set_mem_eof_return(buf->out.bio, -1);
-  SSL_set_bio(buf->ssl, buf->in.bio, buf->out.bio);
+  BIO_set_data(bio, buf);
+  SSL_set_bio(buf->ssl, bio, bio);	/* the same BIO for both ways */
   buf->error = 0;
   /* from now on all data should go through SSL */
   return (buf);
@@ -392,10 +1016,20 @@ static int _ccfilter_s_init (struct peer_t *peer,
 	struct connchain_buffer **b)
 {
   register struct connchain_buffer *buf;
+  const char *domain;
+  unsigned short port;
+  char target[STRING];
 
   if (b == NULL)			/* this is a test */
     return (1);
   *b = buf = _make_buffer(peer, recv, send);
+  /* try to resume last session to the same target */
+  domain = SocketDomain(peer->socket, &port);
+  if (*domain) {
+    snprintf(target, sizeof(target), "%s/%hu", domain, port);
+    buf->target = safe_strdup(target);
+    _ssl_client_session_set(buf->ssl, target);
+  }
   /* start handshake as client side */
   SSL_set_connect_state(buf->ssl);
   buf->check_done = TRUE; /* no check is possible on client side */
@@ -421,6 +1055,11 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
     UnregisterVariable("ssl-certificate-file");
     UnregisterVariable("ssl-key-file");
     UnregisterVariable("ssl-enable-server-bypass");
+    UnregisterVariable("ssl-session-cache-size");
+    UnregisterVariable("ssl-session-timeout");
+    UnregisterVariable("ssl-session-tickets");
+    UnregisterVariable("ssl-ticket-key-lifetime");
+    UnregisterVariable("ssl-handshake-workers");
     Delete_Binding("connchain-grow", &_ccfilter_S_init, NULL);
     Delete_Binding("connchain-grow", &_ccfilter_s_init, NULL);
     if (ShutdownR == NULL)
@@ -442,9 +1081,22 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
     Delete_Help("ssl");
     if (ShutdownR == termreason)
       ShutdownR = NULL;
+    _ssl_hs_stop_workers();		/* no links left so queue is empty */
+    _ssl_client_sessions_free();
+    while (SslBufFree) {		/* no one uses them anymore */
+      buf = SslBufFree;
+      SslBufFree = buf->next;
+      FREE(&buf);
+    }
+    SslBufFreeNum = 0;
+    memset(SslTicketKeys, 0, sizeof(SslTicketKeys));
     /* free ctx */
     SSL_CTX_free(ctx);
     ctx = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    BIO_meth_free(SslBioMethod);
+#endif
+    SslBioMethod = NULL;
     /* deinit library */
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
     ERR_remove_state(0);
@@ -461,7 +1113,10 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
   case S_REPORT:
     tmp = Set_Iface(iface);
     if ((buf = sslbuflist)) do {
-	if (buf->peer->dname && *buf->peer->dname)
+	if (_ssl_hs_busy(buf))
+	  New_Request(tmp, F_REPORT, _("SSL link: handshake on peer (%hd) is in progress."),
+		      buf->peer->socket);
+	else if (buf->peer->dname && *buf->peer->dname)
 	  New_Request(tmp, F_REPORT, _("SSL link: used on peer %s as %s."),
 		      buf->peer->dname, SSL_CIPHER_get_version(SSL_get_current_cipher(buf->ssl)));
 	else
@@ -471,6 +1126,18 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
       } while (buf);
     else
       New_Request(tmp, F_REPORT, _("Module ssl: not used."));
+    pthread_mutex_lock(&SslSessLock);
+    New_Request(tmp, F_REPORT, _("SSL sessions: %ld cached, %ld hits, %ld misses, %ld timeouts; client cache: %u targets, %lu hits, %lu misses."),
+		SSL_CTX_sess_number(ctx), SSL_CTX_sess_hits(ctx),
+		SSL_CTX_sess_misses(ctx), SSL_CTX_sess_timeouts(ctx),
+		SslClientSessionsNum, SslClientHits, SslClientMiss);
+    pthread_mutex_unlock(&SslSessLock);
+    pthread_mutex_lock(&SslHsLock);
+    New_Request(tmp, F_REPORT, _("SSL handshakes: %lu done in %lu steps by %u workers, queue %u (max %u), latency 50%% <%ldms 90%% <%ldms 99%% <%ldms."),
+		SslHsDone, SslHsSteps, SslHsWorkers, SslHsQueued,
+		SslHsQueuedMax, _ssl_hs_percentile(50),
+		_ssl_hs_percentile(90), _ssl_hs_percentile(99));
+    pthread_mutex_unlock(&SslHsLock);
     Unset_Iface();
     break;
   case S_REG:
@@ -479,6 +1146,15 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
 		   sizeof(ssl_certificate_file), 0);
     RegisterString("ssl-key-file", ssl_key_file, sizeof(ssl_key_file), 0);
     RegisterBoolean("ssl-enable-server-bypass", &ssl_enable_bypass);
+    RegisterInteger("ssl-session-cache-size", &ssl_session_cache_size);
+    RegisterInteger("ssl-session-timeout", &ssl_session_timeout);
+    RegisterBoolean("ssl-session-tickets", &ssl_session_tickets);
+    RegisterInteger("ssl-ticket-key-lifetime", &ssl_ticket_key_lifetime);
+    RegisterInteger("ssl-handshake-workers", &ssl_handshake_workers);
+    break;
+  case S_FLUSH:
+    if (_initialized)
+      _ssl_setup_sessions();
     break;
   case S_TIMEOUT:
     /* delayed init */
@@ -487,6 +1163,8 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
       break;				/* ignore it */
     }
     _initialized = TRUE;
+    _ssl_setup_sessions();
+    _ssl_hs_start_workers();
     // SSL_CTX_set_cipher_list(ctx, "ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH");
     // SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, &_no_verify);
     // SSL_CTX_set_tlsext_use_srtp(ctx, "SRTP_AES128_CM_SHA1_80");
@@ -539,12 +1217,40 @@ SigFunction ModuleInit (char *args)
     ERROR("OpenSSL init failed: CTX_new: %s", ERR_error_string(ERR_get_error(), NULL));
     return (NULL);
   }
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+  SslBioMethod = _ssl_bio_method_new();
+  if (SslBioMethod == NULL) {
+    ERROR("OpenSSL init failed: could not create BIO method");
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return (NULL);
+  }
+  /* init sessions cache and tickets */
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"foxeye", 6);
+  SSL_CTX_sess_set_new_cb(ctx, &_ssl_client_session_new);
+  if (!_ssl_ticket_key_new(&SslTicketKeys[0])) {
+    ERROR("OpenSSL init failed: could not generate session ticket key");
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return (NULL);
+  }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &_ssl_ticket_key_cb);
+#else
+  SSL_CTX_set_tlsext_ticket_key_cb(ctx, &_ssl_ticket_key_cb);
+#endif
   _initialized = FALSE;
   Add_Help("ssl");
   RegisterString("ssl-certificate-file", ssl_certificate_file,
 		 sizeof(ssl_certificate_file), 0);
   RegisterString("ssl-key-file", ssl_key_file, sizeof(ssl_key_file), 0);
   RegisterBoolean("ssl-enable-server-bypass", &ssl_enable_bypass);
+  RegisterInteger("ssl-session-cache-size", &ssl_session_cache_size);
+  RegisterInteger("ssl-session-timeout", &ssl_session_timeout);
+  RegisterBoolean("ssl-session-tickets", &ssl_session_tickets);
+  RegisterInteger("ssl-ticket-key-lifetime", &ssl_ticket_key_lifetime);
+  RegisterInteger("ssl-handshake-workers", &ssl_handshake_workers);
   Add_Binding("connchain-grow", "S", 0, 0, &_ccfilter_S_init, NULL);
   Add_Binding("connchain-grow", "s", 0, 0, &_ccfilter_s_init, NULL);
   /* schedule init */
@@ -29,6 +29,7 @@
 #include "direct.h"
 #include "conversion.h"
 #include "list.h"
+#include "tree.h"
 #include "sheduler.h"
 
 typedef struct {
@@ -165,6 +166,90 @@ static inline int ArgInteger (Tcl_Interp *tcl, Tcl_Obj *obj)
 
 static int _tcl_interface (char *, int, const char **);
 
+#ifdef HAVE_TCL_EVALOBJV
+/*
+ * Cache of Tcl objects for bindings: procedure name objects keep resolved
+ *  command in their internal representation, so keep them between calls.
+ */
+typedef struct tcl_bindname
+{
+  Tcl_Obj *obj;
+  char name[1];				/* tree key */
+} tcl_bindname;
+
+static NODE *tcl_bindnames = NULL;
+
+/* argument objects, reused while nobody else holds them; each call holds
+   own references so nested calls and unbinding from script are safe */
+static Tcl_Obj *tcl_args[8];
+
+static Tcl_Obj *_tcl_get_bindname (const char *fname)
+{
+  tcl_bindname *bn = Find_Key (tcl_bindnames, fname);
+
+  if (bn)
+    return bn->obj;
+  bn = safe_malloc (sizeof(tcl_bindname) + strlen (fname));
+  strcpy (bn->name, fname);
+  bn->obj = Tcl_NewStringObj (fname, -1); /* assume it's ascii */
+  Tcl_IncrRefCount (bn->obj);
+  if (Insert_Key (&tcl_bindnames, bn->name, bn, 1))
+  {
+    Tcl_DecrRefCount (bn->obj);		/* should never happen */
+    FREE (&bn);
+    return Tcl_NewStringObj (fname, -1);
+  }
+  return bn->obj;
+}
+
+static void _tcl_free_bindname (void *data)
+{
+  Tcl_DecrRefCount (((tcl_bindname *)data)->obj);
+  safe_free (&data);
+}
+
+static void _tcl_forget_bindname (const char *fname)
+{
+  tcl_bindname *bn = Find_Key (tcl_bindnames, fname);
+
+  if (bn && !Delete_Key (tcl_bindnames, bn->name, bn))
+    _tcl_free_bindname (bn);
+}
+
+static Tcl_Obj *_tcl_set_arg (int i, const char *arg)
+{
+#ifdef HAVE_TCL_SETSYSTEMENCODING
+  char buf[LONG_STRING];
+#endif
+  char *ptr;
+  size_t psize;
+
+  psize = safe_strlen (arg);
+#ifdef HAVE_TCL_SETSYSTEMENCODING
+  if (_Tcl_Conversion)
+  {
+    ptr = buf;
+    psize = Undo_Conversion(_Tcl_Conversion, &ptr, sizeof(buf), arg, &psize);
+  }
+  else
+#endif
+    ptr = (char *)arg;
+  if (tcl_args[i] && Tcl_IsShared (tcl_args[i])) /* script kept it */
+  {
+    Tcl_DecrRefCount (tcl_args[i]);
+    tcl_args[i] = NULL;
+  }
+  if (tcl_args[i])
+    Tcl_SetStringObj (tcl_args[i], ptr, psize);
+  else
+  {
+    tcl_args[i] = Tcl_NewStringObj (ptr, psize);
+    Tcl_IncrRefCount (tcl_args[i]);
+  }
+  return tcl_args[i];
+}
+#endif
+
 /* ---------------------------------------------------------------------------
  * Calls from TCL to anywhere.
  */
@@ -355,6 +440,9 @@ static int _tcl_unbind (ClientData cd, Tcl_Interp *tcl, int argc, TCLARGS argv[]
   /* we ignore attr(s) and mask due to difference with eggdrop, sorry */
   c = ArgString (argv[4], &s);		/* it's command name now */
   Delete_Binding (tbt->name, &_tcl_interface, c);
+#ifdef HAVE_TCL_EVALOBJV
+  _tcl_forget_bindname (c);
+#endif
   return TCL_OK;
 }
 
@@ -467,20 +555,35 @@ typedef struct tcl_timer
 {
   tid_t tid;
   time_t when;
+#ifdef HAVE_TCL8X
+  Tcl_Obj *cmd;				/* keeps compiled script */
+#else
   char *cmd;
-  struct tcl_timer *prev;
+#endif
+  struct tcl_timer *next;
 } tcl_timer;
 
-ALLOCATABLE_TYPE (tcl_timer, TT_, prev)
+ALLOCATABLE_TYPE (tcl_timer, TT_, next)
 
-static tcl_timer *Tcl_Last_Timer = NULL;
+/* sorted by time so first to fire is always on top */
+static tcl_timer *Tcl_Timers = NULL;
+
+static void _tcl_free_timer (tcl_timer *tt)
+{
+#ifdef HAVE_TCL8X
+  Tcl_DecrRefCount (tt->cmd);
+#else
+  FREE (&tt->cmd);
+#endif
+  free_tcl_timer (tt);
+}
 
 			/* utimer <time> <cmd> */
 static int _tcl_utimer (ClientData cd, Tcl_Interp *tcl, int argc, TCLARGS argv[])
 {
   char *c;
   int n, s;
-  tcl_timer *tt;
+  tcl_timer *tt, **ptt;
 
   if (argc != 3)			/* check for number of params */
     return _tcl_errret (tcl, "bad number of parameters.");
@@ -490,10 +593,16 @@ static int _tcl_utimer (ClientData cd, Tcl_Interp *tcl, int argc, TCLARGS argv[]
     return _tcl_errret (tcl, "invalid parameters for utimer");
   tt = alloc_tcl_timer();
   tt->tid = NewTimer (I_MODULE, "tcl", S_LOCAL, (unsigned int)n, 0, 0, 0);
+#ifdef HAVE_TCL8X
+  tt->cmd = argv[2];			/* share it, script may be compiled */
+  Tcl_IncrRefCount (tt->cmd);
+#else
   tt->cmd = safe_strdup (c);
+#endif
   tt->when = Time + n;
-  tt->prev = Tcl_Last_Timer;
-  Tcl_Last_Timer = tt;
+  for (ptt = &Tcl_Timers; *ptt && (*ptt)->when <= tt->when; ptt = &(*ptt)->next);
+  tt->next = *ptt;
+  *ptt = tt;
   dprint (3, "tcl:_tcl_utimer:added timer for %lu", (unsigned long int)tt->when);
   ResultInteger (tcl, (int)tt->tid);
   return TCL_OK;
@@ -508,16 +617,15 @@ static int _tcl_killutimer (ClientData cd, Tcl_Interp *tcl, int argc, TCLARGS ar
   if (argc != 2)			/* check for number of params */
     return _tcl_errret (tcl, "bad number of parameters.");
   n = ArgInteger (tcl, argv[1]);		/* tid */
-  for (ptt = &Tcl_Last_Timer; (tt = *ptt); ptt = &tt->prev)
+  for (ptt = &Tcl_Timers; (tt = *ptt); ptt = &tt->next)
     if ((int)tt->tid == n)
       break;
   if (!tt)
     return _tcl_errret (tcl, "this timer-id is not active.");
-  *ptt = tt->prev;
+  *ptt = tt->next;
   KillTimer (tt->tid);
-  FREE (&tt->cmd);
   dprint (3, "tcl:_tcl_killutimer:removed timer for %lu", (unsigned long int)tt->when);
-  free_tcl_timer (tt);
+  _tcl_free_timer (tt);
   return TCL_OK;
 }
 
@@ -969,17 +1077,17 @@ static int dc_tcl (struct peer_t *from, char *args)
 static int _tcl_interface (char *fname, int argc, const char *argv[])
 {
   int i;
-#ifdef HAVE_TCLEVALOBJV
-  Tcl_Obj *objv[10];			/* I hope it's enough */
+#ifdef HAVE_TCL_EVALOBJV
+  Tcl_Obj *objv[9];
 #else
   char cmd[40];				/* the same */
   char vn[8];
-#endif
 #ifdef HAVE_TCL_SETSYSTEMENCODING
   char buf[LONG_STRING];
 #endif
   char *ptr;
   size_t psize;
+#endif
 
   if (!fname || !*fname)		/* nothing to do */
     return 0;
@@ -996,21 +1104,15 @@ static int _tcl_interface (char *fname, int argc, const char *argv[])
   /* now it's time to call TCL */
   if (argc > 8)
     argc = 8;
-#ifdef HAVE_TCLEVALOBJV
-  objv[0] = Tcl_NewStringObj (fname, safe_strlen (fname)); /* assume it's ascii */
-  for (i = 0; i < argc; i++) {
-    psize = safe_strlen (argv[i]);
-#ifdef HAVE_TCL_SETSYSTEMENCODING
-    ptr = buf;
-    psize = Undo_Conversion(_Tcl_Conversion, &ptr, sizeof(buf), argv[i], &psize);
-    if (ptr == buf)
-      buf[psize] = '\0';
-#else
-    ptr = argv[i];
-#endif
-    objv[i + 1] = Tcl_NewStringObj (ptr, psize);
-  }
-  i = Tcl_EvalObjv (Interp, argc + 1, objv, TCL_GLOBAL_ONLY);
+#ifdef HAVE_TCL_EVALOBJV
+  objv[0] = _tcl_get_bindname (fname);
+  for (i = 0; i < argc; i++)
+    objv[i + 1] = _tcl_set_arg (i, argv[i]);
+  for (i = 0; i <= argc; i++)
+    Tcl_IncrRefCount (objv[i]);
+  i = Tcl_EvalObjv (Interp, argc + 1, objv, TCL_EVAL_GLOBAL);
+  for (; argc >= 0; argc--)
+    Tcl_DecrRefCount (objv[argc]);
 #else
   cmd[0] = 0;
   for (i = 0; i < argc; i++)
@@ -1044,7 +1146,8 @@ static int _tcl_interface (char *fname, int argc, const char *argv[])
 # ifdef HAVE_TCL_SETSYSTEMENCODING
     s = safe_strlen(BindResult);
     s = Do_Conversion(_Tcl_Conversion, &ptr, sizeof(buf), BindResult, &s);
-    BindResult = Tcl_GetString(Tcl_NewStringObj(ptr, s));
+    Tcl_SetObjResult (Interp, Tcl_NewStringObj (ptr, s)); /* interp owns it */
+    BindResult = Tcl_GetStringResult (Interp);
 # endif
 #else
     BindResult = Interp->result;
@@ -1072,7 +1175,7 @@ static int _tcl_interface (char *fname, int argc, const char *argv[])
 static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
 {
   tcl_bindtable *tbt;
-  tcl_timer *tt, **ptt;
+  tcl_timer *tt;
   int i;
   INTERFACE *tmp;
 
@@ -1088,13 +1191,21 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
       Delete_Binding ("unregister", &tcl_unregister_var, NULL);
       Delete_Binding ("unfunction", &tcl_unregister_func, NULL);
       Delete_Binding ("dcc", &dc_tcl, NULL);
-      while ((tt = Tcl_Last_Timer))	/* remove all timers */
+      while ((tt = Tcl_Timers))		/* remove all timers */
       {
-	Tcl_Last_Timer = tt->prev;
+	Tcl_Timers = tt->next;
 	KillTimer (tt->tid);
-	FREE (&tt->cmd);
-	free_tcl_timer (tt);
+	_tcl_free_timer (tt);
       }
+#ifdef HAVE_TCL_EVALOBJV
+      Destroy_Tree (&tcl_bindnames, &_tcl_free_bindname);
+      for (i = 0; i < (int)(sizeof(tcl_args)/sizeof(tcl_args[0])); i++)
+	if (tcl_args[i])
+	{
+	  Tcl_DecrRefCount (tcl_args[i]);
+	  tcl_args[i] = NULL;
+	}
+#endif
       Tcl_DeleteInterp (Interp);	/* stop interpreter */
       if (!Tcl_InterpDeleted(Interp))
 	WARNING("Tcl_InterpDeleted returned 0 after Tcl_DeleteInterp!");
@@ -1117,29 +1228,25 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
       RegisterInteger ("tcl-max-timer", &tcl_max_timer);
       break;
     case S_LOCAL:
-      for (ptt = &Tcl_Last_Timer; (tt = *ptt); ptt = &tt->prev)
-	if (tt->when <= Time)		/* finds first matched */
-	  break;
-	else
-	  DBG ("tcl:timer:skipping timer %lu.", (unsigned long int)tt->when);
-      if (!tt)
+      if (!(tt = Tcl_Timers) || tt->when > Time) /* first is earliest */
       {
 	ERROR ("tcl:timer:not found timer for %lu.", (unsigned long int)Time);
 	break;
       }
-      dprint (5, "tcl:timer:found scheduled (%lu->%lu) cmd: %s",
-	      (unsigned long int)tt->when, (unsigned long int)Time, tt->cmd);
-      if (Tcl_Eval (Interp, tt->cmd) != TCL_OK)
-      {
+      Tcl_Timers = tt->next;		/* script may change the list */
 #ifdef HAVE_TCL8X
+      dprint (5, "tcl:timer:found scheduled (%lu->%lu) cmd: %s",
+	      (unsigned long int)tt->when, (unsigned long int)Time,
+	      Tcl_GetString (tt->cmd));
+      if (Tcl_EvalObjEx (Interp, tt->cmd, TCL_EVAL_GLOBAL) != TCL_OK)
 	ERROR ("TCL timer: execution failed: %s", Tcl_GetStringResult (Interp));
 #else
+      dprint (5, "tcl:timer:found scheduled (%lu->%lu) cmd: %s",
+	      (unsigned long int)tt->when, (unsigned long int)Time, tt->cmd);
+      if (Tcl_Eval (Interp, tt->cmd) != TCL_OK)
 	ERROR ("TCL timer: execution failed: %s", Interp->result);
 #endif
-      }
-      FREE (&tt->cmd);
-      *ptt = tt->prev;
-      free_tcl_timer (tt);
+      _tcl_free_timer (tt);
       break;
     case S_REPORT:
       for (i = 0, tbt = &tcl_bindtables[0]; tbt->intcl; tbt++)
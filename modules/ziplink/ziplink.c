@@ -39,12 +39,67 @@ struct connchain_buffer {
   struct connchain_i *saved_chain;
   struct connchain_buffer *next;
   ssize_t error;
+  size_t unflushed;		/* bytes given to deflate but not flushed */
+  time_t pending;		/* when first of unflushed bytes came */
+  bool tested;			/* there was test call after last data */
+  char dict;			/* ZD_* state of preset dictionary use */
+  uLong sent, sentraw, got, gotraw; /* totals of finished streams */
   struct zipbuff in, out;
 };
 
+#define ZD_CHECK	0	/* checking incoming stream for the offer */
+#define ZD_PLAIN	1	/* peer didn't offer, plain deflate only */
+#define ZD_OFFER	2	/* peer offered, restart our stream with it */
+#define ZD_USED		3	/* our stream is primed with dictionary */
+
 /* global list of buffers, need it in case of module termination */
 struct connchain_buffer *zipbuflist = NULL;
 
+static long int ziplink_level = ZIPLINK_COMPRESSION_LEVEL; /* "ziplink-level" */
+static long int ziplink_memlevel = ZIPLINK_MEMLEVEL; /* "ziplink-memlevel" */
+
+/*
+ * Preset dictionary of commonly used server-to-server tokens, the most
+ * frequent ones are at the end as zlib recommends. It's negotiated per
+ * link: each side starts its stream with two empty stored blocks (which
+ * any inflate just skips) as an offer, and if the offer came from the peer
+ * then we finish our plain stream and start new one primed with the
+ * dictionary. Receiving side detects it by dictionary id in the header.
+ */
+static const char ZipDict[] =
+  " SQUIT  SERVICE  SERVER  SERVLIST  SQUERY  KILL  WALLOPS  TOPIC "
+  " INVITE  KICK  AWAY :  PART  QUIT :Ping timeout  QUIT :"
+  " NJOIN  JOIN  MODE  +o  +v  +b  -o  +l  +k  NOTICE  NICK "
+  " PING :PONG :\r\n:irc. PRIVMSG #";
+static uLong ZipDictId;
+
+/* the offer: empty blocks of Z_SYNC_FLUSH and Z_FULL_FLUSH after header */
+static const unsigned char ZipOffer[] = { 0, 0, 0, 0xff, 0xff,
+					  0, 0, 0, 0xff, 0xff };
+
+/*
+ * Pooled allocator for zlib: each stream allocates few blocks of the same
+ * few sizes so we keep freed blocks in per-size lists instead of returning
+ * them to libc. Blocks of sizes that don't fit into classes aren't pooled.
+ */
+#define ZPOOLCLASSES	8
+#define ZPOOLKEEP	16	/* max free blocks kept in each class */
+
+typedef union zpoolblock {
+  union zpoolblock *next;
+  size_t size;
+  long double align;
+} zpoolblock;
+
+static struct {
+  size_t size;
+  zpoolblock *free;
+  unsigned int num;
+} ZPool[ZPOOLCLASSES];
+
+static pthread_mutex_t ZPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long ZPoolHits = 0, ZPoolMiss = 0;
+
 static void _freezipbuff(struct connchain_buffer **buf)
 {
   struct connchain_buffer **zb;
@@ -62,12 +117,65 @@ static void _freezipbuff(struct connchain_buffer **buf)
 
 static voidpf _z_alloc(voidpf opaque, uInt items, uInt size)
 {
-  return safe_calloc(items, size); /* FIXME: isn't malloc better here? */
+  size_t sz = (size_t)items * size;
+  zpoolblock *b = NULL;
+  int i;
+
+  pthread_mutex_lock(&ZPoolLock);
+  for (i = 0; i < ZPOOLCLASSES && ZPool[i].size != 0; i++)
+    if (ZPool[i].size == sz)
+      break;
+  if (i < ZPOOLCLASSES && ZPool[i].size == 0)
+    ZPool[i].size = sz;		/* new class */
+  if (i < ZPOOLCLASSES && (b = ZPool[i].free) != NULL) {
+    ZPool[i].free = b->next;
+    ZPool[i].num--;
+    ZPoolHits++;
+  } else
+    ZPoolMiss++;
+  pthread_mutex_unlock(&ZPoolLock);
+  if (b == NULL)		/* zlib doesn't need zeroed memory */
+    b = safe_malloc(sizeof(zpoolblock) + sz);
+  b->size = sz;
+  return (&b[1]);
 }
 
 static void _z_free(voidpf opaque, voidpf address)
 {
-  safe_free(&address);
+  zpoolblock *b = &((zpoolblock *)address)[-1];
+  int i;
+
+  pthread_mutex_lock(&ZPoolLock);
+  for (i = 0; i < ZPOOLCLASSES && ZPool[i].size != 0; i++)
+    if (ZPool[i].size == b->size) {
+      if (ZPool[i].num >= ZPOOLKEEP)
+	break;
+      b->next = ZPool[i].free;
+      ZPool[i].free = b;
+      ZPool[i].num++;
+      b = NULL;
+      break;
+    }
+  pthread_mutex_unlock(&ZPoolLock);
+  if (b != NULL)
+    safe_free((void **)&b);
+}
+
+static void _z_pool_purge(void)
+{
+  zpoolblock *b;
+  int i;
+
+  pthread_mutex_lock(&ZPoolLock);
+  for (i = 0; i < ZPOOLCLASSES; i++) {
+    while ((b = ZPool[i].free) != NULL) {
+      ZPool[i].free = b->next;
+      FREE(&b);
+    }
+    ZPool[i].num = 0;
+    ZPool[i].size = 0;
+  }
+  pthread_mutex_unlock(&ZPoolLock);
 }
 
 static void _z_check_saved_buffer(idx_t id, struct connchain_buffer *buf)
@@ -93,14 +201,109 @@ static void _z_check_saved_buffer(idx_t id, struct connchain_buffer *buf)
     buf->saved_chain = NULL;
 }
 
+/* try to push compressed data into next link, returns error or 0 */
+static ssize_t _z_push(struct connchain_i **ch, idx_t id,
+		       struct connchain_buffer *buf)
+{
+  size_t so;
+  ssize_t i;
+
+  if (buf->out.inbuf == 0)
+    return (0);
+  so = buf->out.inbuf - buf->out.bufptr;
+  i = Connchain_Put (ch, id, &buf->out.buf[buf->out.bufptr], &so);
+  if (i < 0)
+    return i;
+  if (i > 0)
+    dprint(6, "ziplink: sent compressed data, size=%zd", i);
+  if (so == 0)			/* done */
+    buf->out.bufptr = buf->out.inbuf = 0;
+  else
+    buf->out.bufptr += i;
+  return (0);
+}
+
+/* finish deflate block for everything collected so far */
+static int _z_flush(struct connchain_buffer *buf)
+{
+  int i;
+
+  if (buf->out.inbuf >= (sizeof(buf->out.buf) - 16))
+    return (Z_OK);		/* no room, try later */
+  buf->out.z.next_out = &buf->out.buf[buf->out.inbuf];
+  buf->out.z.avail_out = sizeof(buf->out.buf) - buf->out.inbuf;
+  buf->out.z.next_in = NULL;
+  buf->out.z.avail_in = 0;
+  i = deflate(&buf->out.z, Z_PARTIAL_FLUSH);
+  if (i == Z_BUF_ERROR)		/* nothing to do */
+    i = Z_OK;
+  if (i == Z_OK) {
+    buf->out.inbuf = sizeof(buf->out.buf) - buf->out.z.avail_out;
+    if (buf->out.z.avail_out != 0) /* else there is more to flush */
+      buf->unflushed = 0;
+    dprint(6, "ziplink: flushed compressed block, buffer size=%zu",
+	   buf->out.inbuf);
+  }
+  return i;
+}
+
+/* finish plain stream and start new one primed with the dictionary */
+static int _z_restart(struct connchain_buffer *buf)
+{
+  int i;
+
+  if (buf->out.inbuf >= (sizeof(buf->out.buf) - 64))
+    return (Z_OK);		/* no room, try later */
+  buf->out.z.next_out = &buf->out.buf[buf->out.inbuf];
+  buf->out.z.avail_out = sizeof(buf->out.buf) - buf->out.inbuf;
+  buf->out.z.next_in = NULL;
+  buf->out.z.avail_in = 0;
+  i = deflate(&buf->out.z, Z_FINISH);
+  buf->out.inbuf = sizeof(buf->out.buf) - buf->out.z.avail_out;
+  if (i != Z_STREAM_END)	/* Z_OK means there is more to finish */
+    return i;
+  buf->sent += buf->out.z.total_out;
+  buf->sentraw += buf->out.z.total_in;
+  if ((i = deflateReset(&buf->out.z)) == Z_OK &&
+      (i = deflateSetDictionary(&buf->out.z, (const Bytef *)ZipDict,
+				sizeof(ZipDict) - 1)) == Z_OK) {
+    buf->dict = ZD_USED;
+    buf->unflushed = 0;
+    dprint(3, "ziplink: switched to preset dictionary on socket %hd",
+	   buf->peer->socket);
+  }
+  return i;
+}
+
+/* check if peer's stream starts with the offer, it's right after header */
+static void _z_check_offer(struct connchain_buffer *buf)
+{
+  size_t p = buf->in.bufptr;
+  uLong pos = buf->in.z.total_in;
+
+  for (; p < buf->in.inbuf && pos < 2 + sizeof(ZipOffer); p++, pos++)
+    if (pos >= 2 && (unsigned char)buf->in.buf[p] != ZipOffer[pos - 2]) {
+      buf->dict = ZD_PLAIN;	/* old version or other software */
+      return;
+    }
+  if (pos == 2 + sizeof(ZipOffer))
+    buf->dict = ZD_OFFER;
+}
+
 /* send into saved_chain while in early state and reject data
-   kill saved chain as soon it's done */
+   kill saved chain as soon it's done
+
+   lines are collected into the same deflate block while there are more
+   lines to send, the block is flushed when we get a test call and there
+   was no data since previous test call (i.e. sending queue is empty now),
+   on flush request, if batch is large enough, or if it's too old */
 static ssize_t _ccfilter_Z_send(struct connchain_i **ch, idx_t id, const char *str,
 				size_t *sz, struct connchain_buffer **b)
 {
   struct connchain_buffer *buf = *b;
-  size_t so, sp;
+  size_t so;
   ssize_t i;
+  int flush;
 
   if (buf == NULL)		/* terminated */
     return (E_NOSOCKET);
@@ -109,54 +312,67 @@ static ssize_t _ccfilter_Z_send(struct connchain_i **ch, idx_t id, const char *s
     if (buf->saved_chain != NULL)
       return (0);
   }
-  if (buf->out.inbuf != 0) {	/* trying to push buffer now */
-    so = buf->out.inbuf - buf->out.bufptr;
-    i = Connchain_Put (ch, id, &buf->out.buf[buf->out.bufptr], &so);
-    if (i < 0)
+  if ((i = _z_push(ch, id, buf)) < 0) /* trying to push buffer now */
+    return i;
+  if (buf->dict == ZD_OFFER) {	/* peer can use dictionary */
+    if (_z_restart(buf) != Z_OK)
+      return (E_NOSOCKET);	/* compression error */
+    if ((i = _z_push(ch, id, buf)) < 0)
       return i;
-    if (i > 0)
-      dprint(6, "ziplink: sent compressed data, size=%zd", i);
-    if (so == 0)		/* done */
-      buf->out.bufptr = buf->out.inbuf = 0;
-    else
-      buf->out.bufptr += i;
+    if (buf->dict == ZD_OFFER)	/* old stream isn't finished yet */
+      return (0);
   }
-  if (str == NULL) {		/* asked to flush, we not call deflate here! */
-    if (buf->out.inbuf)
+  if (buf->unflushed != 0 &&
+      (str == NULL || (*sz == 0 && (buf->tested || Time != buf->pending)))) {
+    if (_z_flush(buf) != Z_OK)
+      return (E_NOSOCKET);	/* compression error */
+    if ((i = _z_push(ch, id, buf)) < 0)
+      return i;
+  }
+  if (str == NULL) {		/* asked to flush */
+    if (buf->out.inbuf || buf->unflushed)
       return (0);
     return Connchain_Put (ch, id, str, sz); /* ask next link to flush then */
   }
   if (*sz == 0)			{ /* a test */
+    if (buf->unflushed != 0 && !buf->tested) {
+      buf->tested = TRUE;	/* flush on next test unless data come */
+      if (buf->peer->iface)
+	Mark_Iface(buf->peer->iface);
+    }
     if (buf->out.inbuf >= (sizeof(buf->out.buf) - 64)) /* reserve 64 bytes */
       return (0);
     return Connchain_Put (ch, id, str, sz); /* bounce test to next link */
   }
   if (buf->out.inbuf >= (sizeof(buf->out.buf) - 16))
     return (0);			/* not ready now */
+  if (buf->unflushed == 0)
+    buf->pending = Time;
+  buf->tested = FALSE;
+  if (buf->unflushed + *sz >= ZIPLINK_BATCHSIZE)
+    flush = Z_PARTIAL_FLUSH;
+  else
+    flush = Z_NO_FLUSH;
   buf->out.z.next_out = &buf->out.buf[buf->out.inbuf];
   buf->out.z.avail_out = sizeof(buf->out.buf) - buf->out.inbuf;
   buf->out.z.next_in = (char *)str;
   buf->out.z.avail_in = *sz;
-  i = deflate(&buf->out.z, Z_PARTIAL_FLUSH); /* compress input into buffer */
+  i = deflate(&buf->out.z, flush); /* compress input into buffer */
   if (i == Z_OK) {
     buf->out.inbuf = sizeof(buf->out.buf) - buf->out.z.avail_out;
     so = *sz - buf->out.z.avail_in;
     *sz = buf->out.z.avail_in;
+    if (flush == Z_NO_FLUSH || buf->out.z.avail_out == 0)
+      buf->unflushed += so;
+    else
+      buf->unflushed = 0;
     dprint(6, "ziplink: compression success on [%-*.*s]", (int)so, (int)so, str);
   } else
     so = E_NOSOCKET;		/* compression error */
-  if (buf->out.inbuf != 0) {	/* trying to push buffer again */
-    sp = buf->out.inbuf - buf->out.bufptr;
-    i = Connchain_Put (ch, id, &buf->out.buf[buf->out.bufptr], &sp);
-    if (i < 0)
-      return i;
-    if (i > 0)
-      dprint(6, "ziplink: sent compressed data, size=%zd", i);
-    if (sp == 0)		/* done */
-      buf->out.bufptr = buf->out.inbuf = 0;
-    else
-      buf->out.bufptr += i;
-  }
+  if ((i = _z_push(ch, id, buf)) < 0) /* trying to push buffer again */
+    return i;
+  if (buf->unflushed != 0 && buf->peer->iface) /* get a test call soon */
+    Mark_Iface(buf->peer->iface);
   return (so);
 }
 
@@ -206,11 +422,30 @@ static ssize_t _ccfilter_Z_recv(struct connchain_i **ch, idx_t id, char *str,
       flush = Z_SYNC_FLUSH;
   } else			/* not ready yet, try to pull saved buffers */
     _z_check_saved_buffer(id, buf);
+  if (buf->dict == ZD_CHECK && buf->in.inbuf > buf->in.bufptr) {
+    _z_check_offer(buf);
+    if (buf->dict == ZD_OFFER && buf->peer->iface)
+      Mark_Iface(buf->peer->iface); /* get a send call to restart stream */
+  }
   buf->in.z.next_in = &buf->in.buf[buf->in.bufptr];
   buf->in.z.avail_in = buf->in.inbuf - buf->in.bufptr;
   buf->in.z.next_out = str;
   buf->in.z.avail_out = sz;
   i = inflate(&buf->in.z, flush); /* decompress buf->in.buf into str */
+  if (i == Z_STREAM_END) {	/* peer restarted stream with dictionary */
+    buf->got += buf->in.z.total_in;
+    buf->gotraw += buf->in.z.total_out;
+    if ((i = inflateReset(&buf->in.z)) == Z_OK)
+      i = inflate(&buf->in.z, flush);
+  }
+  if (i == Z_NEED_DICT) {	/* peer uses preset dictionary */
+    if (buf->in.z.adler == ZipDictId &&
+	inflateSetDictionary(&buf->in.z, (const Bytef *)ZipDict,
+			     sizeof(ZipDict) - 1) == Z_OK)
+      i = inflate(&buf->in.z, flush);
+    else
+      ERROR("ziplink: peer uses unknown preset dictionary.");
+  }
   if (i == Z_OK ||		/* some decompression was done */
       i == Z_BUF_ERROR) {	/* but might be insuffitient space to out */
     if (buf->in.z.avail_in == 0) /* all input consumed */
@@ -260,6 +495,10 @@ static int _ccfilter_Z_init (struct peer_t *peer,
   *b = buf = safe_malloc (sizeof(struct connchain_buffer));
   DBG("ziplink: allocated buffer %p", buf);
   buf->in.inbuf = buf->in.bufptr = buf->out.inbuf = buf->out.bufptr = 0;
+  buf->unflushed = 0;
+  buf->tested = FALSE;
+  buf->dict = ZD_CHECK;
+  buf->sent = buf->sentraw = buf->got = buf->gotraw = 0;
   buf->peer = peer;
   buf->next = zipbuflist;		/* add it in list */
   zipbuflist = buf;
@@ -278,8 +517,21 @@ static int _ccfilter_Z_init (struct peer_t *peer,
   buf->in.z.avail_in = 0;
   buf->in.z.total_in = 0;
   buf->in.z.total_out = 0;
-  if ((i = deflateInit(&buf->out.z, ZIPLINK_COMPRESSION_LEVEL)) == Z_OK &&
-      (i = inflateInit(&buf->in.z)) != Z_OK) {
+  if (ziplink_level < 1 || ziplink_level > 9) /* fix illegal values */
+    ziplink_level = ZIPLINK_COMPRESSION_LEVEL;
+  if (ziplink_memlevel < 1 || ziplink_memlevel > MAX_MEM_LEVEL)
+    ziplink_memlevel = ZIPLINK_MEMLEVEL;
+  buf->out.z.next_out = buf->out.buf;
+  buf->out.z.avail_out = sizeof(buf->out.buf);
+  buf->out.z.next_in = NULL;
+  buf->out.z.avail_in = 0;
+  if ((i = deflateInit2(&buf->out.z, (int)ziplink_level, Z_DEFLATED, MAX_WBITS,
+			(int)ziplink_memlevel, Z_DEFAULT_STRATEGY)) == Z_OK &&
+      ((i = deflate(&buf->out.z, Z_SYNC_FLUSH)) != Z_OK || /* the offer */
+       (i = deflate(&buf->out.z, Z_FULL_FLUSH)) != Z_OK)) {
+    err = buf->out.z.msg;
+    deflateEnd(&buf->out.z);
+  } else if (i == Z_OK && (i = inflateInit(&buf->in.z)) != Z_OK) {
     deflateEnd(&buf->out.z);
     err = buf->in.z.msg;
   } else
@@ -289,11 +541,19 @@ static int _ccfilter_Z_init (struct peer_t *peer,
     _freezipbuff(b);
     return (-1);
   }
+  buf->out.inbuf = sizeof(buf->out.buf) - buf->out.z.avail_out;
   buf->error = 0;
   /* from now on all data should be compressed */
   return (1);
 }
 
+static void _z_register(void)
+{
+  Add_Request (I_INIT, "*", F_REPORT, "module ziplink");
+  RegisterInteger("ziplink-level", &ziplink_level);
+  RegisterInteger("ziplink-memlevel", &ziplink_memlevel);
+}
+
 /*
  * this function must receive signals:
  *  S_TERMINATE - unload module,
@@ -310,6 +570,8 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
   switch (sig) {
   case S_TERMINATE:
     Delete_Binding("connchain-grow", &_ccfilter_Z_init, NULL);
+    UnregisterVariable("ziplink-level");
+    UnregisterVariable("ziplink-memlevel");
     if (ShutdownR == NULL)
       ShutdownR = termreason;
     while (zipbuflist) {	/* kill every ziplink in progress */
@@ -326,6 +588,7 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
       while (Get_Request());
       Unset_Iface();
     }
+    _z_pool_purge();
     Delete_Help("ziplink");
     if (ShutdownR == termreason)
       ShutdownR = NULL;
@@ -334,8 +597,13 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
     tmp = Set_Iface(iface);
     if ((buf = zipbuflist)) do {
 	if (buf->peer->dname && *buf->peer->dname)
-	  New_Request(tmp, F_REPORT, "Zip link: used on peer %s.",
-		      buf->peer->dname);
+	  New_Request(tmp, F_REPORT, "Zip link: used on peer %s%s, sent %lu/%lu,"
+		      " received %lu/%lu bytes.", buf->peer->dname,
+		      (buf->dict == ZD_USED) ? " with dictionary" : "",
+		      buf->sent + buf->out.z.total_out,
+		      buf->sentraw + buf->out.z.total_in,
+		      buf->got + buf->in.z.total_in,
+		      buf->gotraw + buf->in.z.total_out);
 	else
 	  New_Request(tmp, F_REPORT, "Zip link: used on nonamed peer (%hd).",
 		      buf->peer->socket);
@@ -343,10 +611,12 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
       } while (buf);
     else
       New_Request(tmp, F_REPORT, "Module ziplink: not used.");
+    New_Request(tmp, F_REPORT, "Zip link: zlib memory pool hits %lu, misses %lu.",
+		ZPoolHits, ZPoolMiss);
     Unset_Iface();
     break;
   case S_REG:
-    Add_Request (I_INIT, "*", F_REPORT, "module ziplink");
+    _z_register();
     break;
   default: ;
   }
@@ -361,7 +631,10 @@ static iftype_t module_signal (INTERFACE *iface, ifsig_t sig)
 SigFunction ModuleInit (char *args)
 {
   CheckVersion;
+  ZipDictId = adler32(adler32(0L, Z_NULL, 0), (const Bytef *)ZipDict,
+		      sizeof(ZipDict) - 1);
   Add_Help("ziplink");
+  _z_register();
   Add_Binding("connchain-grow", "Z", 0, 0, &_ccfilter_Z_init, NULL);
   return (&module_signal);
 }
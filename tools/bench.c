@@ -0,0 +1,890 @@
+/*
+ * Copyright (C) 2026  Andrej N. Gritsenko <andrej@rep.kiev.ua>
+ *
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License along
+ *     with this program; if not, write to the Free Software Foundation, Inc.,
+ *     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * This file is part of FoxEye's source: microbenchmarks of core library.
+ *
+ * Each benchmark runs some core function on generated data many times and
+ * reports time, CPU cycles, and memory allocations per single call. Output
+ * is one tab separated line per benchmark so it can be saved and given back
+ * later with -b option to compare against, in that case every benchmark
+ * which became slower than allowed is reported and exit status is 2.
+ */
+
+#include "foxeye.h"
+
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <locale.h>
+
+#include "tree.h"
+#include "list.h"
+#include "wtmp.h"
+#include "conversion.h"
+#include "init.h"
+
+#define BENCH_KEYS	100000		/* keys in the tree */
+#define BENCH_RECORDS	20000		/* records in the listfile */
+#define BENCH_MASKS	1000		/* masks in the ban list */
+#define BENCH_HOSTS	1024		/* uhosts to check against masks */
+#define BENCH_BINDS	500		/* bindings in the bindtable */
+#define BENCH_LINES	64		/* lines of text to convert */
+#define BENCH_BATCH	64		/* requests queued before delivery */
+#define BENCH_EVENTS	20000		/* events in the wtmp file */
+#define BENCH_MAX	32		/* max number of benchmarks */
+
+typedef struct
+{
+  const char *name;
+  int (*setup) (void);			/* returns -1 if cannot be run */
+  void (*run) (unsigned long);		/* runs given number of calls */
+} bench_t;
+
+typedef struct
+{
+  char name[32];
+  double ns, cycles, allocs, bytes;
+} bench_result;
+
+/* options */
+static double MinTime = 0.2;		/* seconds for each run */
+static int Repeats = 3;			/* best of */
+static double Threshold = 10.0;		/* percents */
+static unsigned long long Seed = 1;
+
+/* allocations counter, see below */
+static unsigned long long AllocCount = 0, AllocBytes = 0;
+
+/* state of current measure: paused parts are not counted */
+static long long MeasureNs;
+static unsigned long long MeasureCycles, MeasureAllocs, MeasureBytes;
+static long long _t0;
+static unsigned long long _c0, _a0, _b0;
+
+static char WorkDir[] = "/tmp/fe-bench.XXXXXX";
+
+/* ----------------------------------------------------------------------------
+ * Allocations accounting: glibc allows to catch calls from the library
+ * since it exports internal allocator, elsewhere counts will be zero
+ */
+#ifdef __GLIBC__
+extern void *__libc_malloc (size_t);
+extern void *__libc_calloc (size_t, size_t);
+extern void *__libc_realloc (void *, size_t);
+extern void __libc_free (void *);
+
+void *malloc (size_t size)
+{
+  AllocCount++;
+  AllocBytes += size;
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t nmemb, size_t size)
+{
+  AllocCount++;
+  AllocBytes += nmemb * size;
+  return __libc_calloc (nmemb, size);
+}
+
+void *realloc (void *ptr, size_t size)
+{
+  AllocCount++;
+  AllocBytes += size;
+  return __libc_realloc (ptr, size);
+}
+
+void free (void *ptr)
+{
+  __libc_free (ptr);
+}
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Time and cycles measurement
+ */
+static long long _bench_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* note: on x86 it counts reference cycles which don't follow CPU frequency */
+static unsigned long long _bench_cycles (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int lo, hi;
+
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((unsigned long long)hi << 32) | lo;
+#else
+  return 0;
+#endif
+}
+
+static void bench_resume (void)
+{
+  _a0 = AllocCount;
+  _b0 = AllocBytes;
+  _c0 = _bench_cycles();
+  _t0 = _bench_clock();
+}
+
+static void bench_pause (void)
+{
+  long long t = _bench_clock();
+  unsigned long long c = _bench_cycles();
+
+  MeasureNs += t - _t0;
+  MeasureCycles += c - _c0;
+  MeasureAllocs += AllocCount - _a0;
+  MeasureBytes += AllocBytes - _b0;
+}
+
+/* xorshift64* generator, the same seed gives the same data */
+static unsigned long long _bench_random (void)
+{
+  Seed ^= Seed >> 12;
+  Seed ^= Seed << 25;
+  Seed ^= Seed >> 27;
+  return Seed * 2685821657736338717ULL;
+}
+
+static unsigned int _bench_rand (unsigned int n)
+{
+  return (unsigned int)(_bench_random() % n);
+}
+
+/* ----------------------------------------------------------------------------
+ * Tree: insert, find, and delete on 100k keys
+ */
+static NODE *BTree = NULL;
+static char (*BKeys)[16] = NULL;
+static unsigned int BTreeNum = 0;	/* keys inserted in BTree */
+static unsigned long BTreeIdx = 0;
+
+static int _bench_tree_setup (void)
+{
+  register unsigned int i;
+
+  if (BKeys == NULL)
+  {
+    BKeys = safe_malloc (BENCH_KEYS * sizeof(*BKeys));
+    for (i = 0; i < BENCH_KEYS; i++)	/* unique and in random order */
+      snprintf (BKeys[i], sizeof(*BKeys), "%06x%05u",
+		_bench_rand (0x1000000), i);
+  }
+  return 0;
+}
+
+static void _bench_tree_fill (void)
+{
+  for ( ; BTreeNum < BENCH_KEYS; BTreeNum++)
+    if (Insert_Key (&BTree, BKeys[BTreeNum], BKeys[BTreeNum], 1))
+      break;
+}
+
+static void _bench_tree_insert (unsigned long n)
+{
+  while (n--)
+  {
+    if (BTreeNum == BENCH_KEYS)
+    {
+      bench_pause();
+      Destroy_Tree (&BTree, NULL);
+      BTreeNum = 0;
+      bench_resume();
+    }
+    if (Insert_Key (&BTree, BKeys[BTreeNum], BKeys[BTreeNum], 1))
+      break;
+    BTreeNum++;
+  }
+}
+
+static void _bench_tree_find (unsigned long n)
+{
+  register unsigned long i = BTreeIdx;
+
+  bench_pause();
+  _bench_tree_fill();
+  bench_resume();
+  while (n--)
+  {
+    /* step by prime to not hit the same path again */
+    i = (i + 7919) % BENCH_KEYS;
+    if (Find_Key (BTree, BKeys[i]) != BKeys[i])
+      break;
+  }
+  BTreeIdx = i;
+}
+
+static void _bench_tree_miss (unsigned long n)
+{
+  char key[16];
+  register unsigned long i = BTreeIdx;
+
+  bench_pause();
+  _bench_tree_fill();
+  bench_resume();
+  while (n--)
+  {
+    i = (i + 7919) % BENCH_KEYS;
+    memcpy (key, BKeys[i], sizeof(key));
+    key[6] = 'x';			/* never inserted */
+    if (Find_Key (BTree, key) != NULL)
+      break;
+  }
+  BTreeIdx = i;
+}
+
+static void _bench_tree_delete (unsigned long n)
+{
+  while (n--)
+  {
+    if (BTreeNum == 0)
+    {
+      bench_pause();
+      _bench_tree_fill();
+      bench_resume();
+    }
+    BTreeNum--;
+    if (Delete_Key (BTree, BKeys[BTreeNum], BKeys[BTreeNum]))
+      break;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Masks: ban list of 1k masks against client uhosts
+ */
+static char (*BMasks)[64] = NULL;
+static char (*BHosts)[64] = NULL;
+static unsigned long BMaskIdx = 0;
+
+static int _bench_match_setup (void)
+{
+  register unsigned int i;
+
+  if (BMasks)
+    return 0;
+  BMasks = safe_malloc (BENCH_MASKS * sizeof(*BMasks));
+  BHosts = safe_malloc (BENCH_HOSTS * sizeof(*BHosts));
+  for (i = 0; i < BENCH_MASKS; i++)
+    switch (i % 4)
+    {
+      case 0:
+	snprintf (BMasks[i], sizeof(*BMasks), "*!*@*.host%u.example.net",
+		  _bench_rand (5000));
+	break;
+      case 1:
+	snprintf (BMasks[i], sizeof(*BMasks), "nick%u*!*@*", _bench_rand (5000));
+	break;
+      case 2:
+	snprintf (BMasks[i], sizeof(*BMasks), "*!~ident%u@10.%u.*",
+		  _bench_rand (5000), _bench_rand (256));
+	break;
+      default:
+	snprintf (BMasks[i], sizeof(*BMasks), "*!*@192.168.%u.%u",
+		  _bench_rand (256), _bench_rand (256));
+    }
+  for (i = 0; i < BENCH_HOSTS; i++)
+    if (i % 2)
+      snprintf (BHosts[i], sizeof(*BHosts), "Nick%u!~ident%u@10.%u.%u.%u",
+		_bench_rand (5000), _bench_rand (5000), _bench_rand (256),
+		_bench_rand (256), _bench_rand (256));
+    else
+      snprintf (BHosts[i], sizeof(*BHosts),
+		"nick%u!user@dialup-%u.host%u.example.net", _bench_rand (5000),
+		_bench_rand (100000), _bench_rand (5000));
+  return 0;
+}
+
+/* one call is one mask checked, whole list is checked for each uhost */
+static void _bench_match (unsigned long n)
+{
+  register unsigned long i = BMaskIdx;
+  int r = 0;
+
+  while (n--)
+  {
+    r += match (BMasks[i % BENCH_MASKS], BHosts[(i / BENCH_MASKS) % BENCH_HOSTS]);
+    i++;
+  }
+  BMaskIdx = i + (r & 0);
+}
+
+static void _bench_simple_match (unsigned long n)
+{
+  register unsigned long i = BMaskIdx;
+  int r = 0;
+
+  while (n--)
+  {
+    r += simple_match (BMasks[i % BENCH_MASKS],
+		       BHosts[(i / BENCH_MASKS) % BENCH_HOSTS]);
+    i++;
+  }
+  BMaskIdx = i + (r & 0);
+}
+
+/* ----------------------------------------------------------------------------
+ * Conversion: IRC lines in 8-bit charsets to UTF-8
+ */
+static struct conversion_t *BConv[3];
+static const char *BCharsets[3] = { "KOI8-R", "CP1251", "ISO-8859-1" };
+static char (*BLines)[400] = NULL;
+static unsigned long BLineIdx = 0;
+
+static int _bench_conv_setup (int i)
+{
+  register unsigned int l, k;
+  register char *c;
+
+  if (BLines == NULL)
+  {
+    BLines = safe_malloc (BENCH_LINES * sizeof(*BLines));
+    /* words of 8-bit letters mixed with ascii words */
+    for (l = 0; l < BENCH_LINES; l++)
+    {
+      c = BLines[l];
+      while (c < &BLines[l][sizeof(*BLines) - 16])
+      {
+	k = 2 + _bench_rand (9);
+	if (_bench_rand (4) == 0)
+	  while (k--)
+	    *c++ = 'a' + _bench_rand (26);
+	else
+	  while (k--)
+	    *c++ = 0xc0 + _bench_rand (64);
+	*c++ = ' ';
+      }
+      *c = '\0';
+    }
+  }
+  if (BConv[i] == NULL)
+    BConv[i] = Get_Conversion (BCharsets[i]);
+  if (BConv[i] == NULL ||
+      strcasecmp (Conversion_Charset (BConv[i]), BCharsets[i]))
+    return -1;				/* charset is not supported */
+  return 0;
+}
+
+static int _bench_koi8_setup (void)
+{
+  return _bench_conv_setup (0);
+}
+
+static int _bench_cp1251_setup (void)
+{
+  return _bench_conv_setup (1);
+}
+
+static int _bench_latin1_setup (void)
+{
+  return _bench_conv_setup (2);
+}
+
+static void _bench_conv (struct conversion_t *conv, unsigned long n)
+{
+  char buf[HUGE_STRING];
+  char *out;
+  size_t sz;
+
+  while (n--)
+  {
+    const char *line = BLines[BLineIdx++ % BENCH_LINES];
+
+    sz = strlen (line);
+    out = buf;
+    if (Do_Conversion (conv, &out, sizeof(buf), line, &sz) == 0)
+      break;
+  }
+}
+
+static void _bench_koi8 (unsigned long n)
+{
+  _bench_conv (BConv[0], n);
+}
+
+static void _bench_cp1251 (unsigned long n)
+{
+  _bench_conv (BConv[1], n);
+}
+
+static void _bench_latin1 (unsigned long n)
+{
+  _bench_conv (BConv[2], n);
+}
+
+/* ----------------------------------------------------------------------------
+ * Bindtables: dcc command lookup and pubm-like masks scan
+ */
+static struct bindtable_t *BT_Key = NULL, *BT_Mask = NULL;
+static char (*BCmds)[32] = NULL;
+static unsigned long BCmdIdx = 0;
+
+/* never called, bindings are only checked */
+static int _bench_binding ()
+{
+  return 1;
+}
+
+static int _bench_bind_setup (void)
+{
+  char mask[64];
+  register unsigned int i;
+
+  if (BT_Key)
+    return 0;
+  BT_Key = Add_Bindtable ("bench-key", B_KEYWORD);
+  BT_Mask = Add_Bindtable ("bench-mask", B_MASK);
+  BCmds = safe_malloc (BENCH_BINDS * sizeof(*BCmds));
+  for (i = 0; i < BENCH_BINDS; i++)
+  {
+    snprintf (BCmds[i], sizeof(*BCmds), "cmd%c%c%u", 'a' + _bench_rand (26),
+	      'a' + _bench_rand (26), i);
+    Add_Binding ("bench-key", BCmds[i], U_ACCESS, U_NONE, &_bench_binding, NULL);
+    snprintf (mask, sizeof(mask), "#chan%u *word%u*", _bench_rand (20),
+	      _bench_rand (1000));
+    Add_Binding ("bench-mask", mask, U_NONE, U_NONE, &_bench_binding, NULL);
+  }
+  return 0;
+}
+
+static void _bench_bind_key (unsigned long n)
+{
+  char line[64];
+  register unsigned long i = BCmdIdx;
+
+  while (n--)
+  {
+    i = (i + 37) % BENCH_BINDS;
+    snprintf (line, sizeof(line), "%s some args", BCmds[i]);
+    if (Check_Bindtable (BT_Key, line, U_OWNER, U_NONE, NULL) == NULL)
+      break;
+  }
+  BCmdIdx = i;
+}
+
+/* one call is a full scan for all matched bindings */
+static void _bench_bind_mask (unsigned long n)
+{
+  char line[128];
+  struct binding_t *b;
+
+  while (n--)
+  {
+    snprintf (line, sizeof(line), "#chan%lu some text with word%lu in it",
+	      BCmdIdx % 20, BCmdIdx % 1000);
+    BCmdIdx++;
+    for (b = NULL; (b = Check_Bindtable (BT_Mask, line, U_OWNER, U_NONE, b)); );
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Formatting: typical log line formats
+ */
+static const char *BFormats[] = {
+  "%N (%@) has joined %#",
+  "[%t] %y%N%n %-: %*",
+  "%^%N%^ (%@) left %# (%*)",
+  "%* %N %@ %L %# %I %P %-"
+};
+
+static void _bench_printl (unsigned long n)
+{
+  char buf[MESSAGEMAX];
+  register unsigned long i = 0;
+
+  while (n--)
+  {
+    printl (buf, sizeof(buf), BFormats[i % 4], 0, "SomeNick", "user@host.example.net",
+	    "lname", "#channel", 0x7f000001, 6667, 120,
+	    "some text of the message which is long enough to be realistic");
+    i++;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Listfile: 20k records with two masks each
+ */
+static int BRecords = 0;
+static unsigned long BRecIdx = 0;
+
+static int _bench_list_setup (void)
+{
+  char name[32], mask[64];
+  struct clrec_t *u;
+  int i;
+
+  if (BRecords)
+    return 0;
+  for (i = 0; i < BENCH_RECORDS; i++)
+  {
+    snprintf (name, sizeof(name), "user%05d", i);
+    snprintf (mask, sizeof(mask), "*!*user%05d@*.isp%u.example.com", i,
+	      _bench_rand (100));
+    if (Add_Clientrecord (name, (uchar *)mask, U_FRIEND) != 1)
+      break;
+    snprintf (mask, sizeof(mask), "*!~u%05d@10.%u.%u.*", i, _bench_rand (256),
+	      _bench_rand (256));
+    if ((u = Lock_Clientrecord (name)))
+    {
+      if (Add_Mask (u, (uchar *)mask) < 0)
+	i = BENCH_RECORDS;
+      Unlock_Clientrecord (u);
+    }
+  }
+  BRecords = i;
+  return (BRecords == BENCH_RECORDS) ? 0 : -1;
+}
+
+static void _bench_find_client (unsigned long n)
+{
+  char uhost[128];
+  const char *lname;
+  userflag uf;
+  struct clrec_t *u;
+
+  while (n--)
+  {
+    BRecIdx = (BRecIdx + 7919) % BENCH_RECORDS;
+    snprintf (uhost, sizeof(uhost), "nick!user%05lu@host-%lu.isp.example.com",
+	      BRecIdx, BRecIdx);
+    u = Find_Clientrecord ((uchar *)uhost, &lname, &uf, NULL);
+    if (u)
+      Unlock_Clientrecord (u);
+  }
+}
+
+static void _bench_find_miss (unsigned long n)
+{
+  char uhost[128];
+  const char *lname;
+  userflag uf;
+  struct clrec_t *u;
+
+  while (n--)
+  {
+    BRecIdx = (BRecIdx + 7919) % BENCH_RECORDS;
+    snprintf (uhost, sizeof(uhost), "nick!nobody%05lu@host-%lu.example.org",
+	      BRecIdx, BRecIdx);
+    u = Find_Clientrecord ((uchar *)uhost, &lname, &uf, NULL);
+    if (u)
+      Unlock_Clientrecord (u);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Dispatcher: requests queued and delivered to an interface
+ */
+static INTERFACE *BIface = NULL, *BFrom = NULL;
+static unsigned long BDelivered = 0;
+
+static int _bench_request_req (INTERFACE *iface, REQUEST *req)
+{
+  if (req)
+    BDelivered++;
+  return REQ_OK;
+}
+
+static int _bench_request_setup (void)
+{
+#ifndef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+  return -1;				/* LockIface is not usable yet */
+#endif
+  if (BIface == NULL)
+  {
+    BFrom = Add_Iface (I_TEMP, "bench-from", NULL, NULL, NULL);
+    BIface = Add_Iface (I_TEMP, "bench", NULL, &_bench_request_req, NULL);
+  }
+  return (BIface == NULL || BFrom == NULL) ? -1 : 0;
+}
+
+static void _bench_request (unsigned long n)
+{
+  register unsigned long i, b;
+
+  while (n)
+  {
+    b = (n > BENCH_BATCH) ? BENCH_BATCH : n;
+    Set_Iface (BFrom);			/* requests need a sender */
+    for (i = 0; i < b; i++)
+      Add_Request (I_TEMP, "bench", F_T_MESSAGE, "request %lu to deliver", i);
+    Unset_Iface();
+    i = BDelivered + b;
+    Set_Iface (BIface);			/* as interface thread does */
+    while (BDelivered < i && Get_Request());
+    Unset_Iface();
+    n -= b;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+ * Wtmp: new events and search in 20k events file
+ */
+static int _bench_wtmp_setup (void)
+{
+  char path[LONG_STRING];
+  struct wtmp_t w;
+  int fd, i;
+
+  if (_bench_list_setup() < 0)
+    return -1;
+  snprintf (path, sizeof(path), "%s/Wtmp", WorkDir);
+  if (!strcmp (Wtmp, path))
+    return 0;
+  strfcpy (Wtmp, path, sizeof(Wtmp));
+  fd = open (Wtmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return -1;
+  w.fuid = ID_ME;
+  w.count = 0;
+  w.time = (uint32_t)time (NULL) - BENCH_EVENTS;
+  for (i = 0; i < BENCH_EVENTS; i++, w.time++)
+  {
+    w.uid = FindLID ("user00000") + _bench_rand (BENCH_RECORDS);
+    w.event = (i % 2) ? W_END : W_START;
+    if (write (fd, &w, sizeof(w)) != sizeof(w))
+      break;
+  }
+  close (fd);
+  return (i == BENCH_EVENTS) ? 0 : -1;
+}
+
+static void _bench_new_event (unsigned long n)
+{
+  while (n--)
+    NewEvent (W_END, ID_ME, FindLID ("user00001"), 0);
+}
+
+static void _bench_find_events (unsigned long n)
+{
+  struct wtmp_t w[8];
+  char name[32];
+  time_t now = time (NULL);
+
+  while (n--)
+  {
+    BRecIdx = (BRecIdx + 7919) % BENCH_RECORDS;
+    snprintf (name, sizeof(name), "user%05lu", BRecIdx);
+    if (FindEvents (w, 8, name, W_ANY, ID_ANY, now) < 0)
+      break;
+  }
+}
+
+static bench_t Benchmarks[] = {
+  { "tree-insert", &_bench_tree_setup, &_bench_tree_insert },
+  { "tree-find", &_bench_tree_setup, &_bench_tree_find },
+  { "tree-find-miss", &_bench_tree_setup, &_bench_tree_miss },
+  { "tree-delete", &_bench_tree_setup, &_bench_tree_delete },
+  { "match", &_bench_match_setup, &_bench_match },
+  { "simple-match", &_bench_match_setup, &_bench_simple_match },
+  { "conversion-koi8-r", &_bench_koi8_setup, &_bench_koi8 },
+  { "conversion-cp1251", &_bench_cp1251_setup, &_bench_cp1251 },
+  { "conversion-latin1", &_bench_latin1_setup, &_bench_latin1 },
+  { "bindtable-keyword", &_bench_bind_setup, &_bench_bind_key },
+  { "bindtable-mask", &_bench_bind_setup, &_bench_bind_mask },
+  { "printl", NULL, &_bench_printl },
+  { "find-client", &_bench_list_setup, &_bench_find_client },
+  { "find-client-miss", &_bench_list_setup, &_bench_find_miss },
+  { "request", &_bench_request_setup, &_bench_request },
+  { "new-event", &_bench_wtmp_setup, &_bench_new_event },
+  { "find-events", &_bench_wtmp_setup, &_bench_find_events },
+  { NULL, NULL, NULL }
+};
+
+/* ----------------------------------------------------------------------------
+ * Runner
+ */
+static void _bench_measure (bench_t *b, unsigned long n)
+{
+  MeasureNs = 0;
+  MeasureCycles = MeasureAllocs = MeasureBytes = 0;
+  bench_resume();
+  b->run (n);
+  bench_pause();
+}
+
+static void _bench_run (bench_t *b, bench_result *r)
+{
+  unsigned long n = 1;
+  int i;
+  double ns;
+
+  /* find number of calls to run at least MinTime */
+  while (1)
+  {
+    _bench_measure (b, n);
+    if (MeasureNs >= MinTime * 1e9 || n >= ULONG_MAX / 16)
+      break;
+    if (MeasureNs < MinTime * 1e7)
+      n *= 10;
+    else
+      n = (unsigned long)(n * MinTime * 1.2e9 / MeasureNs) + 1;
+  }
+  strfcpy (r->name, b->name, sizeof(r->name));
+  r->ns = -1;
+  for (i = 0; i < Repeats; i++)
+  {
+    if (i)
+      _bench_measure (b, n);
+    ns = (double)MeasureNs / n;
+    if (r->ns < 0 || ns < r->ns)	/* take the best run */
+    {
+      r->ns = ns;
+      r->cycles = (double)MeasureCycles / n;
+      r->allocs = (double)MeasureAllocs / n;
+      r->bytes = (double)MeasureBytes / n;
+    }
+  }
+}
+
+static int _bench_load (const char *file, bench_result *res)
+{
+  FILE *fp;
+  char line[256];
+  int n = 0;
+
+  if ((fp = fopen (file, "r")) == NULL)
+  {
+    perror (file);
+    exit (1);
+  }
+  while (n < BENCH_MAX && fgets (line, sizeof(line), fp))
+  {
+    if (line[0] == '#')
+      continue;
+    if (sscanf (line, "%31s %lf %lf %lf %lf", res[n].name, &res[n].ns,
+		&res[n].cycles, &res[n].allocs, &res[n].bytes) == 5)
+      n++;
+  }
+  fclose (fp);
+  return n;
+}
+
+static void _bench_cleanup (void)
+{
+  DIR *dir;
+  struct dirent *de;
+  char path[LONG_STRING];
+
+  if ((dir = opendir (WorkDir)) == NULL)
+    return;
+  while ((de = readdir (dir)))
+  {
+    if (de->d_name[0] == '.')
+      continue;
+    snprintf (path, sizeof(path), "%s/%s", WorkDir, de->d_name);
+    unlink (path);
+  }
+  closedir (dir);
+  rmdir (WorkDir);
+}
+
+static void _bench_usage (const char *prog)
+{
+  fprintf (stderr, "Usage: %s [options] [mask ...]\n"
+    "  -t seconds  minimal time of each run (default %.1f)\n"
+    "  -r number   number of runs, best one is reported (default %d)\n"
+    "  -s seed     seed of random generator (default %llu)\n"
+    "  -b file     compare with baseline file made by previous run\n"
+    "  -T percent  allowed slowdown against baseline (default %.0f)\n"
+    "  -l          list benchmarks and exit\n"
+    "Only benchmarks matching any of masks are ran if masks given.\n",
+    prog, MinTime, Repeats, Seed, Threshold);
+  exit (1);
+}
+
+int main (int argc, char **argv)
+{
+  bench_result base[BENCH_MAX], r;
+  int nbase = 0, i, j, opt, failed = 0;
+  const char *basefile = NULL;
+  bench_t *b;
+
+  while ((opt = getopt (argc, argv, "t:r:s:b:T:l")) != -1)
+    switch (opt)
+    {
+      case 't': MinTime = atof (optarg); break;
+      case 'r': Repeats = atoi (optarg); break;
+      case 's': Seed = strtoull (optarg, NULL, 10); break;
+      case 'b': basefile = optarg; break;
+      case 'T': Threshold = atof (optarg); break;
+      case 'l':
+	for (b = Benchmarks; b->name; b++)
+	  printf ("%s\n", b->name);
+	return 0;
+      default: _bench_usage (argv[0]);
+    }
+  if (MinTime <= 0 || Repeats < 1 || Threshold < 0)
+    _bench_usage (argv[0]);
+  if (Seed == 0)
+    Seed = 1;
+  if (basefile)
+    nbase = _bench_load (basefile, base);
+  /* prepare the core: we need only listfile and UTF-8 as internal charset */
+  setlocale (LC_ALL, "C.UTF-8");
+  strfcpy (Charset, "UTF-8", sizeof(Charset));
+  if (mkdtemp (WorkDir) == NULL)
+  {
+    perror ("mkdtemp");
+    return 1;
+  }
+  atexit (&_bench_cleanup);
+  snprintf (Listfile, sizeof(Listfile), "%s/listfile", WorkDir);
+  O_MAKEFILES = TRUE;			/* don't load any listfile */
+  IFInit_Users();
+  O_MAKEFILES = FALSE;
+  printf ("# benchmark\tns/op\tcycles/op\tallocs/op\tbytes/op%s\n",
+	  nbase ? "\tbaseline\tchange" : "");
+  for (b = Benchmarks; b->name; b++)
+  {
+    for (i = optind; i < argc; i++)
+      if (match (argv[i], b->name) >= 0)
+	break;
+    if (i > optind && i == argc)
+      continue;
+    if (b->setup && b->setup() < 0)
+    {
+      fprintf (stderr, "%s: cannot be ran, skipped\n", b->name);
+      continue;
+    }
+    _bench_run (b, &r);
+    printf ("%s\t%.2f\t%.1f\t%.3f\t%.1f", r.name, r.ns, r.cycles, r.allocs,
+	    r.bytes);
+    for (j = 0; j < nbase; j++)
+      if (!strcmp (base[j].name, r.name))
+	break;
+    if (j < nbase)
+    {
+      double change = (r.ns - base[j].ns) * 100.0 / base[j].ns;
+
+      printf ("\t%.2f\t%+.1f%%", base[j].ns, change);
+      /* allocations are exact so any growth of them is regression */
+      if (change > Threshold || r.allocs > base[j].allocs + 0.01)
+      {
+	printf ("\tREGRESSION");
+	failed++;
+      }
+    }
+    printf ("\n");
+    fflush (stdout);
+  }
+  return failed ? 2 : 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2026  Andrej N. Gritsenko <andrej@rep.kiev.ua>
+ *
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License along
+ *     with this program; if not, write to the Free Software Foundation, Inc.,
+ *     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * This file is part of FoxEye's source: loopback identd for testing.
+ *
+ * Listens on 127.0.0.1 and answers RFC 1413 queries the way given by
+ * options: with user id, with an ERROR, partially, late, or not at all.
+ * Every query and answer is printed on stdout so ident lookup of incoming
+ * connections may be checked against "ident: ..." debug lines of the bot.
+ * Since the bot always asks port 113, run it with enough privileges.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+typedef enum
+{
+  ID_USERID = 0,			/* normal answer */
+  ID_ERROR,				/* ERROR : NO-USER */
+  ID_SILENT,				/* read query and never answer */
+  ID_CLOSE,				/* close without answer */
+  ID_SPLIT				/* answer in two parts */
+} id_mode;
+
+static unsigned short Port = 113;
+static id_mode Mode = ID_USERID;
+static const char *User = "tester";
+static const char *OpSys = "UNIX";
+static int Delay = 0;			/* milliseconds */
+static int Count = 0;			/* 0 is forever */
+
+/* reads query line, returns its length or -1 */
+static int _id_read_query (int fd, char *buf, size_t bs)
+{
+  struct pollfd p;
+  size_t l = 0;
+  ssize_t sr;
+  char *c;
+
+  p.fd = fd;
+  p.events = POLLIN;
+  while (l < bs - 1)
+  {
+    if (poll (&p, 1, 30000) <= 0)
+      return -1;
+    sr = read (fd, &buf[l], bs - l - 1);
+    if (sr < 0 && errno == EINTR)
+      continue;
+    if (sr <= 0)
+      return -1;
+    l += sr;
+    buf[l] = '\0';
+    if ((c = strpbrk (buf, "\r\n")))
+    {
+      *c = '\0';
+      return (int)(c - buf);
+    }
+  }
+  return -1;
+}
+
+static void _id_write (int fd, const char *s, size_t l)
+{
+  ssize_t sw;
+
+  while (l)
+  {
+    sw = write (fd, s, l);
+    if (sw < 0 && errno == EINTR)
+      continue;
+    if (sw <= 0)
+      return;
+    s += sw;
+    l -= sw;
+  }
+}
+
+static void _id_serve (int fd, const struct sockaddr_in *from)
+{
+  char query[128], answer[256];
+  unsigned int lp, rp;
+  size_t l;
+
+  if (_id_read_query (fd, query, sizeof(query)) < 0)
+  {
+    printf ("%s: no query\n", inet_ntoa (from->sin_addr));
+    return;
+  }
+  printf ("%s: query \"%s\"\n", inet_ntoa (from->sin_addr), query);
+  if (sscanf (query, "%u , %u", &lp, &rp) != 2 || lp > 65535 || rp > 65535)
+    snprintf (answer, sizeof(answer), "%s : ERROR : INVALID-PORT\r\n", query);
+  else if (Mode == ID_ERROR)
+    snprintf (answer, sizeof(answer), "%u , %u : ERROR : NO-USER\r\n", lp, rp);
+  else
+    snprintf (answer, sizeof(answer), "%u , %u : USERID : %s : %s\r\n", lp, rp,
+	      OpSys, User);
+  if (Delay)
+    poll (NULL, 0, Delay);
+  switch (Mode)
+  {
+    case ID_SILENT:
+      printf ("  not answering\n");
+      poll (NULL, 0, 3600000);		/* until bot gives up */
+      return;
+    case ID_CLOSE:
+      printf ("  closing\n");
+      return;
+    case ID_SPLIT:
+      l = strlen (answer) / 2;
+      _id_write (fd, answer, l);
+      poll (NULL, 0, 100);
+      _id_write (fd, &answer[l], strlen (&answer[l]));
+      break;
+    default:
+      _id_write (fd, answer, strlen (answer));
+  }
+  answer[strlen (answer) - 2] = '\0';
+  printf ("  answer \"%s\"\n", answer);
+}
+
+static void _id_usage (const char *prog)
+{
+  fprintf (stderr, "Usage: %s [options]\n"
+    "  -p port     port to listen on 127.0.0.1 (default %hu)\n"
+    "  -u user     user id to answer (default %s)\n"
+    "  -o opsys    operating system field, OTHER gives raw id (default %s)\n"
+    "  -m mode     userid, error, silent, close, or split (default userid)\n"
+    "  -d msec     delay before answer (default %d)\n"
+    "  -c number   exit after that number of connections\n",
+    prog, Port, User, OpSys, Delay);
+  exit (1);
+}
+
+int main (int argc, char **argv)
+{
+  static const char *modes[] = { "userid", "error", "silent", "close", "split" };
+  struct sockaddr_in sa;
+  socklen_t sl;
+  int opt, ls, fd, i, n = 0;
+
+  while ((opt = getopt (argc, argv, "p:u:o:m:d:c:")) != -1)
+    switch (opt)
+    {
+      case 'p': Port = (unsigned short)atoi (optarg); break;
+      case 'u': User = optarg; break;
+      case 'o': OpSys = optarg; break;
+      case 'm':
+	for (i = 0; i < (int)(sizeof(modes) / sizeof(*modes)); i++)
+	  if (!strcmp (optarg, modes[i]))
+	    break;
+	if (i == (int)(sizeof(modes) / sizeof(*modes)))
+	  _id_usage (argv[0]);
+	Mode = (id_mode)i;
+	break;
+      case 'd': Delay = atoi (optarg); break;
+      case 'c': Count = atoi (optarg); break;
+      default: _id_usage (argv[0]);
+    }
+  if (optind < argc || Port == 0)
+    _id_usage (argv[0]);
+  signal (SIGPIPE, SIG_IGN);
+  if ((ls = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+  {
+    perror ("socket");
+    return 1;
+  }
+  i = 1;
+  setsockopt (ls, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+  memset (&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sa.sin_port = htons (Port);
+  if (bind (ls, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen (ls, 16) < 0)
+  {
+    fprintf (stderr, "cannot listen on 127.0.0.1:%hu: %s\n", Port,
+	     strerror (errno));
+    return 1;
+  }
+  setvbuf (stdout, NULL, _IOLBF, 0);
+  printf ("listening on 127.0.0.1:%hu, mode %s\n", Port, modes[Mode]);
+  while (Count == 0 || n < Count)
+  {
+    sl = sizeof(sa);
+    if ((fd = accept (ls, (struct sockaddr *)&sa, &sl)) < 0)
+    {
+      if (errno == EINTR)
+	continue;
+      perror ("accept");
+      break;
+    }
+    _id_serve (fd, &sa);
+    close (fd);
+    n++;
+  }
+  close (ls);
+  return 0;
+}
@@ -0,0 +1,809 @@
+/*
+ * Copyright (C) 2026  Andrej N. Gritsenko <andrej@rep.kiev.ua>
+ *
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License along
+ *     with this program; if not, write to the Free Software Foundation, Inc.,
+ *     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * This file is part of FoxEye's source: load generator for ircd module.
+ *
+ * Opens many client connections to ircd listener on loopback, registers
+ * them, joins channels and then sends a mix of PRIVMSG, JOIN, PART, and
+ * NICK messages with given rate. Each PRIVMSG carries time when it was
+ * sent so every copy delivered back to any of our clients gives sample of
+ * end-to-end latency. Optionally also connects as a server and sends a
+ * synthetic netburst, in that case server with given name and password
+ * should be known by ircd. All random choices are made by own generator
+ * from given seed so the same options make the same sequence of messages.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define IOBUF 4096		/* input and output buffers of connection */
+#define NICKMAX 10		/* 9 chars is RFC 2812 limit */
+
+#define LAT_SUB 4		/* the same buckets as core metrics use */
+#define LAT_BUCKETS (LAT_SUB * 27)
+
+typedef enum
+{
+  LG_CONNECTING = 0,
+  LG_REGISTERING,
+  LG_READY,
+  LG_DEAD
+} lg_state;
+
+typedef struct
+{
+  int fd;
+  lg_state state;
+  unsigned int id;
+  unsigned int gen;		/* nick generation */
+  unsigned int njoined;
+  unsigned char *joined;	/* flag per channel */
+  char nick[NICKMAX];
+  size_t inlen, outlen;
+  char in[IOBUF];
+  char out[IOBUF];
+} lg_conn;
+
+/* options */
+static struct in_addr Host;
+static unsigned short Port = 6667;
+static unsigned int Clients = 100;
+static unsigned int Channels = 10;
+static unsigned int PerClient = 3;	/* channels to join at start */
+static unsigned int Duration = 30;	/* seconds */
+static unsigned int Rate = 1000;	/* messages per second */
+static unsigned int ConnRate = 200;	/* connections per second */
+static unsigned int Mix[4] = { 80, 5, 5, 10 }; /* privmsg join part nick */
+static unsigned long long Seed = 1;
+static const char *Password = NULL;	/* client password */
+static const char *LinkName = NULL;	/* server to simulate */
+static const char *LinkPass = NULL;
+static unsigned int BurstUsers = 1000;
+static int Verbose = 0;
+
+/* state */
+static lg_conn *Conns;
+static struct pollfd *Pfd;
+static lg_conn Link;
+static unsigned int Connected = 0, Registered = 0, Failed = 0;
+static unsigned long long Sent[4], Received = 0, Samples = 0, SeqNum = 0;
+static unsigned long long Lat[LAT_BUCKETS];
+static long long LatMin = -1, LatMax = 0, LatSum = 0;
+static long long BurstStart = 0, BurstSent = 0, BurstDone = 0;
+static unsigned long long BurstLines = 0;
+static volatile sig_atomic_t Stop = 0;
+
+static const char *MixNames[4] = { "privmsg", "join", "part", "nick" };
+
+/* xorshift64* generator, the same seed gives the same sequence */
+static unsigned long long _lg_random (void)
+{
+  Seed ^= Seed >> 12;
+  Seed ^= Seed << 25;
+  Seed ^= Seed >> 27;
+  return Seed * 2685821657736338717ULL;
+}
+
+static unsigned int _lg_rand (unsigned int n)
+{
+  return (n > 1) ? (unsigned int)(_lg_random () % n) : 0;
+}
+
+static long long _lg_clock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int _lat_bucket (long long v)
+{
+  register unsigned int e = 0;
+
+  if (v < LAT_SUB)
+    return (v < 0) ? 0 : (unsigned int)v;
+  while ((v >> e) >= 2 * LAT_SUB)
+    e++;
+  e = LAT_SUB * (e + 1) + (unsigned int)(v >> e) - LAT_SUB;
+  return (e < LAT_BUCKETS) ? e : LAT_BUCKETS - 1;
+}
+
+static long long _lat_value (unsigned int i)
+{
+  if (i < LAT_SUB)
+    return i;
+  return ((long long)(i % LAT_SUB + LAT_SUB + 1) << (i / LAT_SUB - 1)) - 1;
+}
+
+static long long _lat_percentile (int q)
+{
+  register unsigned int i;
+  unsigned long long rank, c = 0;
+
+  if (Samples == 0)
+    return 0;
+  rank = (Samples * q + 999) / 1000;
+  for (i = 0; i < LAT_BUCKETS - 1; i++)
+    if ((c += Lat[i]) >= rank)
+      break;
+  return _lat_value (i);
+}
+
+static void _lat_add (long long v)
+{
+  Lat[_lat_bucket (v)]++;
+  Samples++;
+  LatSum += v;
+  if (LatMin < 0 || v < LatMin)
+    LatMin = v;
+  if (v > LatMax)
+    LatMax = v;
+}
+
+/* makes nick from id and generation, fits into 9 chars */
+static void _lg_make_nick (lg_conn *c, char *nick)
+{
+  static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  unsigned int i, v;
+  char *p = nick;
+
+  *p++ = 'l';
+  for (i = 0, v = c->id; i < 4; i++, v /= 36)
+    *p++ = digits[v % 36];
+  for (v = c->gen; v && p < &nick[NICKMAX - 1]; v /= 36)
+    *p++ = digits[v % 36];
+  *p = '\0';
+}
+
+static void _lg_close (lg_conn *c)
+{
+  if (c->fd >= 0)
+    close (c->fd);
+  c->fd = -1;
+  if (c->state == LG_READY && c != &Link)
+    Registered--;
+  if (c->state != LG_CONNECTING && c != &Link)
+    Connected--;
+  c->state = LG_DEAD;
+}
+
+/* tries to send buffered output, returns -1 if connection died */
+static int _lg_flush (lg_conn *c)
+{
+  ssize_t sw;
+
+  while (c->outlen)
+  {
+    sw = write (c->fd, c->out, c->outlen);
+    if (sw < 0 && errno == EINTR)
+      continue;
+    if (sw < 0 && errno == EAGAIN)
+      return 0;
+    if (sw <= 0)
+    {
+      _lg_close (c);
+      return -1;
+    }
+    c->outlen -= sw;
+    memmove (c->out, &c->out[sw], c->outlen);
+  }
+  return 0;
+}
+
+static void _lg_send (lg_conn *c, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void _lg_send (lg_conn *c, const char *fmt, ...)
+{
+  va_list ap;
+  int l;
+
+  if (c->state == LG_DEAD)
+    return;
+  va_start (ap, fmt);
+  l = vsnprintf (&c->out[c->outlen], sizeof(c->out) - c->outlen - 2, fmt, ap);
+  va_end (ap);
+  if (l < 0 || (size_t)l >= sizeof(c->out) - c->outlen - 2)
+  {
+    /* output is stuck, server doesn't read us anymore */
+    if (Verbose)
+      fprintf (stderr, "connection %s: output buffer overflow\n", c->nick);
+    _lg_close (c);
+    return;
+  }
+  c->outlen += l;
+  c->out[c->outlen++] = '\r';
+  c->out[c->outlen++] = '\n';
+  _lg_flush (c);
+}
+
+static int _lg_connect (lg_conn *c)
+{
+  struct sockaddr_in sa;
+  int i = 1;
+
+  if ((c->fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+    return -1;
+  fcntl (c->fd, F_SETFL, O_NONBLOCK);
+  setsockopt (c->fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof(i));
+  memset (&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr = Host;
+  sa.sin_port = htons (Port);
+  if (connect (c->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 &&
+      errno != EINPROGRESS)
+  {
+    close (c->fd);
+    c->fd = -1;
+    return -1;
+  }
+  c->state = LG_CONNECTING;
+  c->inlen = c->outlen = 0;
+  return 0;
+}
+
+/* connection is established, start registration */
+static void _lg_register (lg_conn *c)
+{
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt (c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err)
+  {
+    if (Verbose)
+      fprintf (stderr, "connection %u failed: %s\n", c->id, strerror (err));
+    Failed++;
+    close (c->fd);
+    c->fd = -1;
+    c->state = LG_DEAD;
+    return;
+  }
+  c->state = LG_REGISTERING;
+  if (c == &Link)
+  {
+    BurstStart = _lg_clock ();
+    _lg_send (c, "PASS %s 0210 IRC|", LinkPass);
+    _lg_send (c, "SERVER %s 1 1 :load generator peer", LinkName);
+    return;
+  }
+  Connected++;
+  if (Password)
+    _lg_send (c, "PASS %s", Password);
+  _lg_send (c, "NICK %s", c->nick);
+  _lg_send (c, "USER lg 0 * :load generator client %u", c->id);
+}
+
+/* sends synthetic netburst: users and channels with them */
+static void _lg_burst (void)
+{
+  unsigned int i, j, n;
+  char buf[IOBUF / 2];
+  size_t l;
+
+  for (i = 0; i < BurstUsers && Link.state != LG_DEAD; i++)
+  {
+    _lg_send (&Link, "NICK b%07u 1 lgb%u 127.0.0.1 1 +i :burst user", i, i);
+    _lg_flush (&Link);
+    if (Link.outlen > sizeof(Link.out) / 2)
+    {
+      /* wait until server reads it, burst is sent as fast as possible */
+      struct pollfd p = { Link.fd, POLLOUT, 0 };
+
+      poll (&p, 1, 1000);
+      _lg_flush (&Link);
+    }
+  }
+  /* each burst user is on PerClient random channels */
+  for (j = 0; j < Channels && Link.state != LG_DEAD; j++)
+  {
+    l = snprintf (buf, sizeof(buf), "NJOIN #lg%u :", j);
+    for (i = 0, n = 0; i < BurstUsers; i++)
+    {
+      if (_lg_rand (Channels) >= PerClient)
+	continue;
+      if (l + 12 >= sizeof(buf) - 1)	/* flush the line */
+      {
+	buf[l - 1] = '\0';
+	_lg_send (&Link, "%s", buf);
+	l = snprintf (buf, sizeof(buf), "NJOIN #lg%u :", j);
+	n = 0;
+      }
+      l += snprintf (&buf[l], sizeof(buf) - l, "%sb%07u,", n ? "" : "@", i);
+      n++;
+    }
+    if (n)
+    {
+      buf[l - 1] = '\0';
+      _lg_send (&Link, "%s", buf);
+    }
+    if (Link.outlen > sizeof(Link.out) / 2)
+    {
+      struct pollfd p = { Link.fd, POLLOUT, 0 };
+
+      poll (&p, 1, 1000);
+      _lg_flush (&Link);
+    }
+  }
+  BurstSent = _lg_clock ();
+  /* server answers PONG after it processed everything sent before */
+  _lg_send (&Link, "PING %s :loadgen-burst", LinkName);
+}
+
+/* returns first word after prefix and command, sets pointers */
+static char *_lg_parse (char *line, char **prefix, char **cmd)
+{
+  char *c = line;
+
+  *prefix = NULL;
+  if (*c == ':')
+  {
+    *prefix = ++c;
+    while (*c && *c != ' ')
+      c++;
+    if (*c)
+      *c++ = '\0';
+    if ((line = strchr (*prefix, '!')))
+      *line = '\0';			/* leave only nick */
+  }
+  while (*c == ' ')
+    c++;
+  *cmd = c;
+  while (*c && *c != ' ')
+    c++;
+  if (*c)
+    *c++ = '\0';
+  while (*c == ' ')
+    c++;
+  return c;
+}
+
+static unsigned int _lg_channel (const char *ch)
+{
+  if (ch[0] == ':')
+    ch++;
+  if (strncmp (ch, "#lg", 3))
+    return Channels;			/* not ours */
+  return (unsigned int)atoi (&ch[3]);
+}
+
+static void _lg_line (lg_conn *c, char *line, long long now)
+{
+  char *prefix, *cmd, *args, *t;
+  unsigned int i;
+
+  args = _lg_parse (line, &prefix, &cmd);
+  if (c == &Link)
+  {
+    BurstLines++;
+    if (!strcmp (cmd, "PING"))
+      _lg_send (c, "PONG %s %s", LinkName, args);
+    else if (!strcmp (cmd, "PONG") && strstr (args, "loadgen-burst"))
+      BurstDone = now;
+    else if (!strcmp (cmd, "ERROR"))
+    {
+      fprintf (stderr, "server link closed: %s\n", args);
+      _lg_close (c);
+    }
+    return;
+  }
+  Received++;
+  if (!strcmp (cmd, "PRIVMSG"))
+  {
+    /* PRIVMSG target :LG <usec> <seq> */
+    if ((t = strstr (args, " :LG ")))
+      _lat_add (now - strtoll (&t[5], NULL, 10));
+  }
+  else if (!strcmp (cmd, "PING"))
+    _lg_send (c, "PONG %s", args);
+  else if (!strcmp (cmd, "001"))
+  {
+    if (c->state == LG_REGISTERING)
+      Registered++;
+    c->state = LG_READY;
+    if ((t = strchr (args, ' ')))	/* server may change our nick */
+      *t = '\0';
+    snprintf (c->nick, sizeof(c->nick), "%s", args);
+    for (i = 0; i < PerClient; i++)
+      _lg_send (c, "JOIN #lg%u", _lg_rand (Channels));
+  }
+  else if (!strcmp (cmd, "433") && c->state == LG_REGISTERING)
+  {
+    c->gen++;				/* nick is in use, try another */
+    _lg_make_nick (c, c->nick);
+    _lg_send (c, "NICK %s", c->nick);
+  }
+  else if (prefix == NULL || strcmp (prefix, c->nick))
+    ;					/* below are only ours */
+  else if (!strcmp (cmd, "JOIN"))
+  {
+    if ((i = _lg_channel (args)) < Channels && !c->joined[i])
+    {
+      c->joined[i] = 1;
+      c->njoined++;
+    }
+  }
+  else if (!strcmp (cmd, "PART"))
+  {
+    if ((t = strchr (args, ' ')))
+      *t = '\0';
+    if ((i = _lg_channel (args)) < Channels && c->joined[i])
+    {
+      c->joined[i] = 0;
+      c->njoined--;
+    }
+  }
+  else if (!strcmp (cmd, "NICK"))
+    snprintf (c->nick, sizeof(c->nick), "%s", (args[0] == ':') ? &args[1] : args);
+  else if (!strcmp (cmd, "ERROR"))
+    _lg_close (c);
+}
+
+static void _lg_read (lg_conn *c, long long now)
+{
+  ssize_t sr;
+  char *line, *end;
+
+  sr = read (c->fd, &c->in[c->inlen], sizeof(c->in) - c->inlen - 1);
+  if (sr < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (sr <= 0)
+  {
+    if (Verbose)
+      fprintf (stderr, "connection %s closed by server\n", c->nick);
+    _lg_close (c);
+    return;
+  }
+  c->inlen += sr;
+  c->in[c->inlen] = '\0';
+  line = c->in;
+  while ((end = strchr (line, '\n')) != NULL)
+  {
+    *end = '\0';
+    if (end > line && end[-1] == '\r')
+      end[-1] = '\0';
+    if (*line)
+      _lg_line (c, line, now);
+    if (c->state == LG_DEAD)
+      return;
+    line = end + 1;
+  }
+  c->inlen -= (line - c->in);
+  if (c->inlen == sizeof(c->in) - 1)	/* too long line, drop it */
+    c->inlen = 0;
+  memmove (c->in, line, c->inlen);
+}
+
+/* picks random registered client */
+static lg_conn *_lg_pick (void)
+{
+  unsigned int i, n;
+
+  if (Registered == 0)
+    return NULL;
+  for (n = 0; n < 16; n++)
+  {
+    i = _lg_rand (Clients);
+    if (Conns[i].state == LG_READY)
+      return &Conns[i];
+  }
+  for (n = 0; n < Clients; n++, i = (i + 1) % Clients)
+    if (Conns[i].state == LG_READY)
+      return &Conns[i];
+  return NULL;
+}
+
+/* returns random channel which is (or is not) joined by client */
+static unsigned int _lg_pick_channel (lg_conn *c, int joined)
+{
+  unsigned int i, n;
+
+  i = _lg_rand (Channels);
+  for (n = 0; n < Channels; n++, i = (i + 1) % Channels)
+    if ((c->joined[i] != 0) == joined)
+      return i;
+  return Channels;
+}
+
+static void _lg_action (long long now)
+{
+  lg_conn *c, *c2;
+  unsigned int a, r, ch;
+
+  if ((c = _lg_pick ()) == NULL)
+    return;
+  r = _lg_rand (Mix[0] + Mix[1] + Mix[2] + Mix[3]);
+  for (a = 0; a < 3 && r >= Mix[a]; a++)
+    r -= Mix[a];
+  switch (a)
+  {
+    case 0:				/* PRIVMSG to channel or to client */
+      if (c->njoined && (ch = _lg_pick_channel (c, 1)) < Channels)
+	_lg_send (c, "PRIVMSG #lg%u :LG %lld %llu", ch, now, SeqNum++);
+      else if ((c2 = _lg_pick ()) != NULL)
+	_lg_send (c, "PRIVMSG %s :LG %lld %llu", c2->nick, now, SeqNum++);
+      break;
+    case 1:
+      if ((ch = _lg_pick_channel (c, 0)) < Channels)
+	_lg_send (c, "JOIN #lg%u", ch);
+      break;
+    case 2:
+      if ((ch = _lg_pick_channel (c, 1)) < Channels)
+	_lg_send (c, "PART #lg%u :load generator", ch);
+      break;
+    default:
+      {
+	char nick[NICKMAX];
+
+	c->gen++;
+	_lg_make_nick (c, nick);	/* c->nick is updated on server reply */
+	_lg_send (c, "NICK %s", nick);
+      }
+  }
+  Sent[a]++;
+}
+
+static void _lg_usage (const char *prog)
+{
+  fprintf (stderr, "Usage: %s [options]\n"
+    "  -p port     ircd listener port on 127.0.0.1 (default %hu)\n"
+    "  -c number   number of clients (default %u)\n"
+    "  -C number   number of channels (default %u)\n"
+    "  -j number   channels to join by each client at start (default %u)\n"
+    "  -r rate     messages per second (default %u)\n"
+    "  -d seconds  duration of the test (default %u)\n"
+    "  -w rate     new connections per second (default %u)\n"
+    "  -m P,J,L,N  weights of PRIVMSG, JOIN, PART, and NICK (default %u,%u,%u,%u)\n"
+    "  -s seed     seed of random generator (default %llu)\n"
+    "  -k pass     password for clients\n"
+    "  -L name:pass  also link as server with that name and send netburst\n"
+    "  -b number   number of users in netburst (default %u)\n"
+    "  -v          verbose output, report each second\n",
+    prog, Port, Clients, Channels, PerClient, Rate, Duration, ConnRate,
+    Mix[0], Mix[1], Mix[2], Mix[3], Seed, BurstUsers);
+  exit (1);
+}
+
+static void _lg_signal (int sig)
+{
+  Stop = sig;
+}
+
+static void _lg_report (double secs)
+{
+  unsigned long long total = Sent[0] + Sent[1] + Sent[2] + Sent[3];
+  unsigned int i;
+
+  printf ("clients: %u connected, %u registered, %u failed\n", Connected,
+	  Registered, Failed);
+  printf ("sent: %llu messages in %.2f s, %.1f msg/s (", total, secs,
+	  secs > 0 ? total / secs : 0.0);
+  for (i = 0; i < 4; i++)
+    printf ("%s%s %llu", i ? ", " : "", MixNames[i], Sent[i]);
+  printf (")\n");
+  printf ("received: %llu lines, %.1f lines/s, %llu latency samples\n",
+	  Received, secs > 0 ? Received / secs : 0.0, Samples);
+  printf ("latency us: min %lld avg %lld p50 %lld p90 %lld p99 %lld p99.9 %lld max %lld\n",
+	  LatMin < 0 ? 0 : LatMin, Samples ? LatSum / (long long)Samples : 0,
+	  _lat_percentile (500), _lat_percentile (900), _lat_percentile (990),
+	  _lat_percentile (999), LatMax);
+  if (LinkName)
+  {
+    if (BurstDone)
+      printf ("netburst: %u users in %u channels, sent in %.3f s, processed in %.3f s, %llu lines received\n",
+	      BurstUsers, Channels, (BurstSent - BurstStart) / 1e6,
+	      (BurstDone - BurstStart) / 1e6, BurstLines);
+    else
+      printf ("netburst: not completed, %llu lines received\n", BurstLines);
+  }
+}
+
+int main (int argc, char **argv)
+{
+  struct rlimit rl;
+  long long start, now, tstart = 0, tend = 0, last;
+  unsigned long long actions = 0, want;
+  unsigned int i, n, next = 0;
+  int opt, timeout;
+  char *c;
+
+  inet_aton ("127.0.0.1", &Host);
+  while ((opt = getopt (argc, argv, "p:c:C:j:r:d:w:m:s:k:L:b:v")) != -1)
+    switch (opt)
+    {
+      case 'p': Port = (unsigned short)atoi (optarg); break;
+      case 'c': Clients = (unsigned int)atoi (optarg); break;
+      case 'C': Channels = (unsigned int)atoi (optarg); break;
+      case 'j': PerClient = (unsigned int)atoi (optarg); break;
+      case 'r': Rate = (unsigned int)atoi (optarg); break;
+      case 'd': Duration = (unsigned int)atoi (optarg); break;
+      case 'w': ConnRate = (unsigned int)atoi (optarg); break;
+      case 'm':
+	if (sscanf (optarg, "%u,%u,%u,%u", &Mix[0], &Mix[1], &Mix[2],
+		    &Mix[3]) != 4)
+	  _lg_usage (argv[0]);
+	break;
+      case 's': Seed = strtoull (optarg, NULL, 10); break;
+      case 'k': Password = optarg; break;
+      case 'L':
+	if (!(c = strchr (optarg, ':')))
+	  _lg_usage (argv[0]);
+	*c = '\0';
+	LinkName = optarg;
+	LinkPass = &c[1];
+	break;
+      case 'b': BurstUsers = (unsigned int)atoi (optarg); break;
+      case 'v': Verbose = 1; break;
+      default: _lg_usage (argv[0]);
+    }
+  if (optind < argc || Channels == 0 || Port == 0 || ConnRate == 0 ||
+      Clients > 36 * 36 * 36 * 36 || Mix[0] + Mix[1] + Mix[2] + Mix[3] == 0)
+    _lg_usage (argv[0]);
+  if (Seed == 0)
+    Seed = 1;				/* xorshift cannot work with 0 */
+  if (PerClient > Channels)
+    PerClient = Channels;
+  /* each connection needs a descriptor */
+  if (getrlimit (RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < Clients + 16)
+  {
+    rl.rlim_cur = (rl.rlim_max < Clients + 16) ? rl.rlim_max : Clients + 16;
+    setrlimit (RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < Clients + 16)
+      fprintf (stderr, "warning: only %lu descriptors available\n",
+	       (unsigned long)rl.rlim_cur);
+  }
+  signal (SIGPIPE, SIG_IGN);
+  signal (SIGINT, &_lg_signal);
+  signal (SIGTERM, &_lg_signal);
+  Conns = calloc (Clients, sizeof(lg_conn));
+  Pfd = calloc (Clients + 1, sizeof(struct pollfd));
+  if (!Conns || !Pfd)
+  {
+    fprintf (stderr, "out of memory\n");
+    return 1;
+  }
+  for (i = 0; i < Clients; i++)
+  {
+    Conns[i].fd = -1;
+    Conns[i].state = LG_DEAD;
+    Conns[i].id = i;
+    Conns[i].joined = calloc (Channels, 1);
+    _lg_make_nick (&Conns[i], Conns[i].nick);
+  }
+  Link.fd = -1;
+  Link.state = LG_DEAD;
+  snprintf (Link.nick, sizeof(Link.nick), "link");
+  start = last = _lg_clock ();
+  if (LinkName)
+  {
+    if (_lg_connect (&Link) < 0)
+    {
+      fprintf (stderr, "cannot connect to 127.0.0.1:%hu: %s\n", Port,
+	       strerror (errno));
+      return 1;
+    }
+  }
+  while (!Stop)
+  {
+    now = _lg_clock ();
+    /* open new connections with given rate */
+    want = (now - start) * ConnRate / 1000000 + 1;
+    while (next < Clients && next < want)
+    {
+      if (_lg_connect (&Conns[next]) < 0)
+      {
+	Failed++;
+	if (Verbose)
+	  fprintf (stderr, "connection %u: %s\n", next, strerror (errno));
+      }
+      next++;
+    }
+    /* start traffic when everyone registered or 30 seconds passed */
+    if (!tstart && next == Clients &&
+	((Registered + Failed >= Clients &&
+	  (!LinkName || BurstDone || Link.state == LG_DEAD)) ||
+	 now - start > 30000000))
+    {
+      tstart = now;
+      tend = now + (long long)Duration * 1000000;
+      if (Verbose)
+	fprintf (stderr, "%u clients registered in %.2f s, starting traffic\n",
+		 Registered, (now - start) / 1e6);
+    }
+    if (tstart && now < tend)
+    {
+      want = (unsigned long long)(now - tstart) * Rate / 1000000;
+      for (n = 0; actions < want && n < Rate / 10 + 1; n++, actions++)
+	_lg_action (now);
+    }
+    else if (tstart && now > tend + 2000000)
+      break;				/* 2 seconds to get the rest */
+    if (Verbose && now - last >= 1000000)
+    {
+      fprintf (stderr, "%.0f s: registered %u, sent %llu, received %llu, p50 %lld us, p99 %lld us\n",
+	       (now - start) / 1e6, Registered, actions, Received,
+	       _lat_percentile (500), _lat_percentile (990));
+      last = now;
+    }
+    /* poll everyone */
+    for (i = 0; i < Clients; i++)
+    {
+      Pfd[i].fd = Conns[i].fd;
+      Pfd[i].events = POLLIN;
+      if (Conns[i].state == LG_CONNECTING || Conns[i].outlen)
+	Pfd[i].events |= POLLOUT;
+      Pfd[i].revents = 0;
+    }
+    Pfd[Clients].fd = Link.fd;
+    Pfd[Clients].events = POLLIN;
+    if (Link.state == LG_CONNECTING || Link.outlen)
+      Pfd[Clients].events |= POLLOUT;
+    Pfd[Clients].revents = 0;
+    timeout = (next < Clients || tstart) ? 1 : 100;
+    if (poll (Pfd, Clients + 1, timeout) < 0 && errno != EINTR)
+    {
+      perror ("poll");
+      break;
+    }
+    now = _lg_clock ();
+    for (i = 0; i <= Clients; i++)
+    {
+      lg_conn *cc = (i < Clients) ? &Conns[i] : &Link;
+
+      if (Pfd[i].fd < 0 || !Pfd[i].revents)
+	continue;
+      if (cc->state == LG_CONNECTING)
+      {
+	_lg_register (cc);
+	if (cc == &Link && cc->state == LG_REGISTERING)
+	  _lg_burst ();
+	continue;
+      }
+      if (Pfd[i].revents & POLLOUT)
+	_lg_flush (cc);
+      if (cc->state != LG_DEAD && (Pfd[i].revents & (POLLIN | POLLHUP | POLLERR)))
+	_lg_read (cc, now);
+    }
+  }
+  now = _lg_clock ();
+  for (i = 0; i < Clients; i++)
+    if (Conns[i].state != LG_DEAD)
+    {
+      _lg_send (&Conns[i], "QUIT :load generator done");
+      close (Conns[i].fd);
+    }
+  if (Link.state != LG_DEAD)
+  {
+    _lg_send (&Link, "SQUIT %s :load generator done", LinkName);
+    close (Link.fd);
+  }
+  _lg_report (tstart ? ((tend < now ? tend : now) - tstart) / 1e6 : 0.0);
+  return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2026  Andrej N. Gritsenko <andrej@rep.kiev.ua>
+ *
+ *     This program is free software; you can redistribute it and/or modify
+ *     it under the terms of the GNU General Public License as published by
+ *     the Free Software Foundation; either version 2 of the License, or
+ *     (at your option) any later version.
+ *
+ *     This program is distributed in the hope that it will be useful,
+ *     but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *     MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *     GNU General Public License for more details.
+ *
+ *     You should have received a copy of the GNU General Public License along
+ *     with this program; if not, write to the Free Software Foundation, Inc.,
+ *     51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * This file is part of FoxEye's source: resolver cache checks.
+ *
+ * Replaces resolver functions of the core with SetResolverBackend() by ones
+ * which know only names from a file in /etc/hosts format, so no DNS is used
+ * at all. Then connects through the sockets library to a loopback listener
+ * and checks how many lookups reached the backend: cached names, failed
+ * names, concurrent lookups of the same name, and dropping the cache. Each
+ * check is printed as one line, exit status is 2 if any of them failed.
+ */
+
+#include "foxeye.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "socket.h"
+#include "init.h"
+
+#define RT_MAXHOSTS	64		/* records in the fixture */
+#define RT_THREADS	8		/* concurrent lookups */
+
+#ifdef STRICT_BACKRESOLV
+# define RT_BACKCHECK	1		/* reverse lookup resolves name back */
+#else
+# define RT_BACKCHECK	0
+#endif
+
+typedef struct
+{
+  struct in_addr addr;
+  char name[NI_MAXHOST+1];
+  int canonical;			/* first name on the line */
+} rt_host;
+
+static rt_host Hosts[RT_MAXHOSTS];
+static int Nhosts = 0;
+
+/* options */
+static const char *Fixture = RESOLVTEST_HOSTS;
+static int Delay = 200;			/* msec, to make lookups overlap */
+
+static pthread_mutex_t CountLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int GaiCalls = 0, GniCalls = 0;
+static int Failed = 0;
+static unsigned short Port;		/* of the listening socket */
+
+/* ----------------------------------------------------------------------------
+ * Backend: the fixture file only
+ */
+
+static int _rt_load (const char *file)
+{
+  FILE *fp;
+  char line[HUGE_STRING], *c, *name;
+  struct in_addr addr;
+  int first;
+
+  if ((fp = fopen (file, "r")) == NULL)
+  {
+    perror (file);
+    return -1;
+  }
+  while (fgets (line, sizeof(line), fp))
+  {
+    if ((c = strchr (line, '#')))
+      *c = '\0';
+    if ((c = strtok (line, " \t\r\n")) == NULL)
+      continue;
+    if (inet_pton (AF_INET, c, &addr) != 1)
+      continue;				/* only IPv4 records are used */
+    for (first = 1; (name = strtok (NULL, " \t\r\n")); first = 0)
+    {
+      if (Nhosts == RT_MAXHOSTS)
+	break;
+      Hosts[Nhosts].addr = addr;
+      strfcpy (Hosts[Nhosts].name, name, sizeof(Hosts[Nhosts].name));
+      Hosts[Nhosts].canonical = first;
+      Nhosts++;
+    }
+  }
+  fclose (fp);
+  return Nhosts;
+}
+
+static void _rt_delay (void)
+{
+  struct timespec ts;
+
+  ts.tv_sec = Delay / 1000;
+  ts.tv_nsec = (Delay % 1000) * 1000000L;
+  nanosleep (&ts, NULL);
+}
+
+static int _rt_gai (const char *node, const char *service,
+		    const struct addrinfo *hints, struct addrinfo **res)
+{
+  struct addrinfo *ai;
+  struct sockaddr_in *sin;
+  int i;
+
+  pthread_mutex_lock (&CountLock);
+  GaiCalls++;
+  pthread_mutex_unlock (&CountLock);
+  _rt_delay();
+  if (node == NULL || service != NULL)
+    return EAI_SERVICE;
+  if (hints && hints->ai_family != AF_UNSPEC && hints->ai_family != AF_INET)
+    return EAI_FAMILY;
+  for (i = 0; i < Nhosts; i++)
+    if (!strcasecmp (Hosts[i].name, node))
+      break;
+  if (i == Nhosts)
+    return EAI_NONAME;
+  /* one block to be freed by _rt_fai() */
+  ai = safe_calloc (1, sizeof(struct addrinfo) + sizeof(struct sockaddr_in));
+  sin = (struct sockaddr_in *)&ai[1];
+  sin->sin_family = AF_INET;
+  sin->sin_addr = Hosts[i].addr;
+  ai->ai_family = AF_INET;
+  ai->ai_socktype = SOCK_STREAM;
+  ai->ai_addrlen = sizeof(struct sockaddr_in);
+  ai->ai_addr = (struct sockaddr *)sin;
+  *res = ai;
+  return 0;
+}
+
+static void _rt_fai (struct addrinfo *ai)
+{
+  FREE (&ai);
+}
+
+static int _rt_gni (const struct sockaddr *sa, socklen_t salen, char *host,
+		    socklen_t hostlen, char *serv, socklen_t servlen, int flags)
+{
+  const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+  int i;
+
+  pthread_mutex_lock (&CountLock);
+  GniCalls++;
+  pthread_mutex_unlock (&CountLock);
+  _rt_delay();
+  if (sa->sa_family != AF_INET || salen < sizeof(struct sockaddr_in) ||
+      serv != NULL || servlen != 0 || (flags & NI_NUMERICHOST))
+    return EAI_FAMILY;
+  for (i = 0; i < Nhosts; i++)
+    if (Hosts[i].canonical && Hosts[i].addr.s_addr == sin->sin_addr.s_addr)
+      break;
+  if (i == Nhosts)
+    return EAI_NONAME;
+  strfcpy (host, Hosts[i].name, hostlen);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ * Checks
+ */
+
+static void _rt_counts (unsigned int *gai, unsigned int *gni)
+{
+  pthread_mutex_lock (&CountLock);
+  *gai = GaiCalls;
+  *gni = GniCalls;
+  pthread_mutex_unlock (&CountLock);
+}
+
+static void _rt_result (const char *check, int ok, const char *fmt, ...)
+{
+  va_list ap;
+
+  printf ("%s\t%s\t", ok ? "ok" : "FAIL", check);
+  va_start (ap, fmt);
+  vprintf (fmt, ap);
+  va_end (ap);
+  printf ("\n");
+  fflush (stdout);
+  if (!ok)
+    Failed++;
+}
+
+/* connects to the listening socket by name and puts its domain into buf,
+   returns 0 on success or socket error code */
+static int _rt_connect (const char *name, char *buf, size_t bs)
+{
+  idx_t idx;
+  int i;
+
+  if ((idx = GetSocket (M_RAW)) < 0)
+    return idx;
+  if ((i = SetupSocket (idx, name, NULL, Port, NULL, NULL)) == 0 && buf)
+    strfcpy (buf, SocketDomain (idx, NULL), bs);
+  KillSocket (&idx);
+  return i;
+}
+
+/* accepts and closes connections so they never fill the backlog */
+static void *_rt_acceptor (void *data)
+{
+  int ls = *(int *)data, fd;
+
+  while ((fd = accept (ls, NULL, NULL)) >= 0 || errno == EINTR)
+    if (fd >= 0)
+      close (fd);
+  return NULL;
+}
+
+static void *_rt_thread (void *data)
+{
+  *(int *)data = _rt_connect ("fixture.test", NULL, 0);
+  return NULL;
+}
+
+static void _rt_usage (const char *prog)
+{
+  fprintf (stderr, "Usage: %s [options]\n"
+    "  -f file     hosts file to resolve from (default %s)\n"
+    "  -d msec     delay of each lookup in backend (default %d)\n",
+    prog, Fixture, Delay);
+  exit (1);
+}
+
+int main (int argc, char **argv)
+{
+  pthread_t th[RT_THREADS];
+  int res[RT_THREADS];
+  unsigned int gai0, gni0, gai, gni;
+  char domain[NI_MAXHOST+1], err[SHORT_STRING];
+  struct sockaddr_in sa;
+  socklen_t sl;
+  pthread_t ath;
+  int opt, ls, i, n;
+
+  while ((opt = getopt (argc, argv, "f:d:")) != -1)
+    switch (opt)
+    {
+      case 'f': Fixture = optarg; break;
+      case 'd': Delay = atoi (optarg); break;
+      default: _rt_usage (argv[0]);
+    }
+  if (optind < argc || Delay < 0)
+    _rt_usage (argv[0]);
+  if (_rt_load (Fixture) <= 0)
+  {
+    fprintf (stderr, "no IPv4 records in %s\n", Fixture);
+    return 1;
+  }
+  Time = time (NULL);			/* there is no scheduler here */
+  if (_fe_init_sockets() < 0)
+  {
+    fprintf (stderr, "cannot init sockets library\n");
+    return 1;
+  }
+  SetResolverBackend (&_rt_gai, &_rt_fai, &_rt_gni);
+  /* plain listening socket, the library one has too short backlog */
+  memset (&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  sl = sizeof(sa);
+  if ((ls = socket (AF_INET, SOCK_STREAM, 0)) < 0 ||
+      bind (ls, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+      listen (ls, 64) < 0 || getsockname (ls, (struct sockaddr *)&sa, &sl) < 0 ||
+      pthread_create (&ath, NULL, &_rt_acceptor, &ls) != 0)
+  {
+    perror ("cannot listen on 127.0.0.1");
+    return 1;
+  }
+  Port = ntohs (sa.sin_port);
+
+  /* first connection: forward and reverse lookups */
+  _rt_counts (&gai0, &gni0);
+  i = _rt_connect ("alias.test", domain, sizeof(domain));
+  _rt_counts (&gai, &gni);
+  _rt_result ("connect", i == 0 && !strcmp (domain, "fixture.test") &&
+	      gai == gai0 + 1 + RT_BACKCHECK && gni == gni0 + 1,
+	      "alias.test -> %s, %u forward, %u reverse",
+	      i ? SocketError (i, err, sizeof(err)) : domain,
+	      gai - gai0, gni - gni0);
+
+  /* the same again should be answered from the cache */
+  _rt_counts (&gai0, &gni0);
+  i = _rt_connect ("alias.test", domain, sizeof(domain));
+  _rt_counts (&gai, &gni);
+  _rt_result ("cached", i == 0 && !strcmp (domain, "fixture.test") &&
+	      gai == gai0 && gni == gni0,
+	      "alias.test -> %s, %u forward, %u reverse",
+	      i ? SocketError (i, err, sizeof(err)) : domain,
+	      gai - gai0, gni - gni0);
+
+  /* unknown name fails and failure is cached too */
+  _rt_counts (&gai0, &gni0);
+  i = _rt_connect ("missing.test", NULL, 0);
+  n = _rt_connect ("missing.test", NULL, 0);
+  _rt_counts (&gai, &gni);
+  _rt_result ("negative", i == E_NOSUCHDOMAIN && n == E_NOSUCHDOMAIN &&
+	      gai == gai0 + 1, "missing.test -> %s, %u forward",
+	      SocketError (n, err, sizeof(err)), gai - gai0);
+
+  /* backend reset drops the cache, then concurrent lookups of the same
+     name should share one backend call */
+  SetResolverBackend (&_rt_gai, &_rt_fai, &_rt_gni);
+  _rt_counts (&gai0, &gni0);
+  for (n = 0; n < RT_THREADS; n++)
+    if (pthread_create (&th[n], NULL, &_rt_thread, &res[n]) != 0)
+      break;
+  for (i = 0; i < n; i++)
+    pthread_join (th[i], NULL);
+  _rt_counts (&gai, &gni);
+  for (i = 0; i < n; i++)
+    if (res[i] != 0)
+      break;
+  _rt_result ("shared", n == RT_THREADS && i == n &&
+	      gai == gai0 + 1 + RT_BACKCHECK && gni == gni0 + 1,
+	      "%d of %d connected, %u forward, %u reverse",
+	      i, RT_THREADS, gai - gai0, gni - gni0);
+
+  /* default backend is back and our one isn't called anymore */
+  SetResolverBackend (NULL, NULL, NULL);
+  _rt_counts (&gai0, &gni0);
+  i = _rt_connect ("127.0.0.1", NULL, 0);
+  _rt_counts (&gai, &gni);
+  _rt_result ("default", i == 0 && gai == gai0 && gni == gni0,
+	      "127.0.0.1 -> %s, %u forward, %u reverse",
+	      i ? SocketError (i, err, sizeof(err)) : "connected",
+	      gai - gai0, gni - gni0);
+
+  return Failed ? 2 : 0;
+}
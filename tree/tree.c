@@ -22,7 +22,15 @@
 #include <string.h>
 #include <stdlib.h>
 
-#define safe_calloc calloc
+void (*Tree_Account) (long int) = NULL;
+
+static void *safe_calloc (size_t n, size_t s)
+{
+  if (Tree_Account)
+    Tree_Account ((long int)(n * s));
+  return calloc (n, s);
+}
+
 #define uchar unsigned char
 
 /* prefix unprefixed leaf node by two chars */
@@ -412,6 +420,8 @@ void Destroy_Tree (NODE **node, void (*destroy) (void *))
       destroy ((*node)->l[i].s.data);
   }
   free (*node);
+  if (Tree_Account)
+    Tree_Account (-(long int)sizeof(NODE));
   *node = NULL;
 }
 
@@ -60,4 +60,7 @@ LEAF *Next_Leaf (NODE *, LEAF *, const char **);
 const char *Leaf_Key (LEAF *);
 void Destroy_Tree (NODE **, void (*) (void *));
 
+/* application may set it to count memory used by nodes */
+extern void (*Tree_Account) (long int);
+
 #endif /* _TREE_H_ */